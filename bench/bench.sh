@@ -0,0 +1,54 @@
+#!/bin/sh
+# Benchmarks the tardiff tools on a generated workload, and prints one line of
+# JSON per operation to standard output (see benchrun.c for the fields).
+#
+# Environment variables:
+#   BENCH_DIR       scratch directory (default: a new directory in /tmp)
+#   BENCH_GENFLAGS  options passed to benchgen (default: -s 256)
+#   BENCH_CHAIN     number of differences files merged (default: 4)
+
+set -e
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+TARDIFF="$BENCH/../tardiff"
+RUN="$BENCH/benchrun"
+CHAIN=${BENCH_CHAIN:-4}
+DIR=${BENCH_DIR:-$(mktemp -d "${TMPDIR:-/tmp}/tardiff-bench.XXXXXX")}
+
+mkdir -p "$DIR"
+cd "$DIR"
+rm -f v*.tar d* out*
+"$BENCH/benchgen" ${BENCH_GENFLAGS:--s 256} -n $((CHAIN + 1)) v
+
+size() { wc -c < "$1" | tr -d ' '; }
+S0=$(size v0.tar)
+S1=$(size v1.tar)
+
+# Each operation's throughput is relative to the size of the tar files read
+"$RUN" diff $((S0 + S1)) "$TARDIFF" v0.tar v1.tar d1
+"$RUN" diff-tar $((S0 + S1)) "$TARDIFF" -t v0.tar v1.tar dt1
+"$RUN" patch-forward "$S1" "$TARDIFF" -p v0.tar d1 out-forward
+"$RUN" patch-backward "$S1" \
+    sh -c "cat v0.tar | '$TARDIFF' -p - d1 out-backward"
+cmp out-forward v1.tar
+cmp out-backward v1.tar
+rm -f out-*
+
+# Merge a chain of differences files, and patch with the chain directly
+i=2
+while [ $i -le "$CHAIN" ]
+do
+    "$TARDIFF" v$((i - 1)).tar v$i.tar d$i
+    i=$((i + 1))
+done
+DIFFS=$(i=1; while [ $i -le "$CHAIN" ]; do printf 'd%d ' $i; i=$((i + 1)); done)
+SD=$(cat $DIFFS | wc -c | tr -d ' ')
+SN=$(size v$CHAIN.tar)
+"$RUN" merge "$SD" "$TARDIFF" -m $DIFFS dm
+"$RUN" patch-chain "$SN" "$TARDIFF" -p v0.tar $DIFFS out-chain
+cmp out-chain v$CHAIN.tar
+rm -f out-*
+
+"$RUN" info $((S0 + SD)) sh -c "'$TARDIFF' -i v0.tar $DIFFS > /dev/null"
+
+if [ -z "$BENCH_DIR" ]; then rm -rf "$DIR"; fi
@@ -0,0 +1,333 @@
+/* Generates a sequence of tar archives for benchmarking, each of which is
+   derived from the previous one by modifying, reordering, inserting and
+   deleting members. The output is fully determined by the options given, so
+   results of different runs can be compared. */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BS 512
+#define SEGMENT_BLOCKS 64       /* granularity of zero runs (in blocks) */
+#define BUF_BLOCKS 128          /* blocks copied at a time */
+
+typedef struct Member
+{
+    unsigned id;                /* used to generate a unique name */
+    uint64_t size;              /* size of member data in bytes */
+    off_t    offset;            /* offset of member data in previous file */
+    uint64_t seed;              /* seed of the member's original content */
+    unsigned mtime;             /* modification time stored in header */
+} Member;
+
+static uint64_t rng_state;
+static uint64_t total_size  = 64 << 20;     /* size of first archive */
+static double   change      = 0.05;         /* fraction of members changed */
+static double   reorder     = 0.02;         /* fraction of members moved */
+static double   duplicate   = 0.05;         /* fraction of members duplicated */
+static double   zeroes      = 0.05;         /* fraction of zero segments */
+static int      versions    = 2;            /* number of archives generated */
+
+static Member   *members;
+static size_t   nmember, capacity;
+static unsigned next_id;
+
+/* xorshift64* pseudo-random number generator */
+static uint64_t rng()
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state*2685821657736338717ull;
+}
+
+/* Returns a uniformly distributed real number in range [0:1). */
+static double rng_real()
+{
+    return (rng() >> 11)*(1.0/9007199254740992.0);
+}
+
+static void fill_random(char *buf, size_t len)
+{
+    uint64_t r;
+    size_t i;
+
+    for (i = 0; i + 8 <= len; i += 8)
+    {
+        r = rng();
+        memcpy(buf + i, &r, 8);
+    }
+    for ( ; i < len; ++i) buf[i] = (char)rng();
+}
+
+static void write_data(FILE *fp, const void *buf, size_t len)
+{
+    if (fwrite(buf, 1, len, fp) != len)
+    {
+        fprintf(stderr, "Write failed!\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static Member *add_member()
+{
+    if (nmember == capacity)
+    {
+        capacity = capacity ? 2*capacity : 1024;
+        members = realloc(members, capacity*sizeof(Member));
+        assert(members != NULL);
+    }
+    return &members[nmember++];
+}
+
+/* Returns a member size between 1 byte and 1 MB, distributed so that most
+   members are small, but most data is in large members (as is typical). */
+static uint64_t random_size()
+{
+    return 1 + rng()%(1u << (rng()%21));
+}
+
+static void write_header(FILE *fp, const Member *m)
+{
+    char hdr[BS];
+    unsigned sum = 0;
+    size_t i;
+
+    memset(hdr, 0, BS);
+    snprintf(hdr, 100, "dir%03u/file%08u.dat", m->id%1000, m->id);
+    snprintf(hdr + 100, 8, "%07o", 0644);
+    snprintf(hdr + 108, 8, "%07o", 1000);
+    snprintf(hdr + 116, 8, "%07o", 1000);
+    snprintf(hdr + 124, 12, "%011llo", (unsigned long long)m->size);
+    snprintf(hdr + 136, 12, "%011o", m->mtime);
+    hdr[156] = '0';
+    memcpy(hdr + 257, "ustar\0" "00", 8);
+    memset(hdr + 148, ' ', 8);
+    for (i = 0; i < BS; ++i) sum += (unsigned char)hdr[i];
+    snprintf(hdr + 148, 8, "%06o", sum);
+    write_data(fp, hdr, BS);
+}
+
+/* Writes new member data, consisting of random data and runs of zeroes,
+   which is determined by `seed' only. */
+static void write_new_data(FILE *fp, uint64_t size, uint64_t seed)
+{
+    char buf[SEGMENT_BLOCKS*BS];
+    uint64_t len = size + (BS - size%BS)%BS, n, saved_state = rng_state;
+
+    rng_state = seed | 1;
+    while (len > 0)
+    {
+        n = (len < sizeof(buf)) ? len : sizeof(buf);
+        if (rng_real() < zeroes) memset(buf, 0, n); else fill_random(buf, n);
+        if (n > size) memset(buf + size, 0, n - size);   /* padding */
+        write_data(fp, buf, n);
+        len  -= n;
+        size -= (n < size) ? n : size;
+    }
+    rng_state = saved_state;
+}
+
+/* Copies member data from the previous archive, modifying some blocks if
+   `modify' is true (half of them completely, half of them in a few bytes). */
+static void write_old_data(FILE *fp, FILE *prev, const Member *m, bool modify)
+{
+    char buf[BUF_BLOCKS*BS];
+    uint64_t blocks = m->size/BS + (m->size%BS != 0), n, i;
+    double p = modify ? 0.1 : 0.0;
+
+    if (fseeko(prev, m->offset, SEEK_SET) != 0)
+    {
+        fprintf(stderr, "Seek failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    for ( ; blocks > 0; blocks -= n)
+    {
+        n = (blocks < BUF_BLOCKS) ? blocks : BUF_BLOCKS;
+        if (fread(buf, BS, n, prev) != n)
+        {
+            fprintf(stderr, "Read failed!\n");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < n; ++i)
+        {
+            if (rng_real() < p)
+            {
+                if (rng() & 1) fill_random(buf + i*BS, BS);
+                else fill_random(buf + i*BS + rng()%(BS - 8), 1 + rng()%8);
+            }
+        }
+        write_data(fp, buf, n*BS);
+    }
+}
+
+static void write_end(FILE *fp)
+{
+    char buf[2*BS];
+
+    memset(buf, 0, sizeof(buf));
+    write_data(fp, buf, sizeof(buf));
+}
+
+/* Generates the first archive. */
+static void generate_first(FILE *fp)
+{
+    uint64_t total = 0;
+    Member *m;
+    size_t i;
+
+    while (total < total_size)
+    {
+        m = add_member();
+        m->id    = next_id++;
+        m->mtime = 1000000000u + rng()%100000000u;
+        if (nmember > 1 && rng_real() < duplicate)
+        {
+            /* Duplicate content of an earlier member */
+            i = rng()%(nmember - 1);
+            m->size = members[i].size;
+            m->seed = members[i].seed;
+        }
+        else
+        {
+            m->size = random_size();
+            m->seed = rng();
+        }
+        write_header(fp, m);
+        write_new_data(fp, m->size, m->seed);
+        m->offset = ftello(fp) - (off_t)(m->size + (BS - m->size%BS)%BS);
+        total += BS + m->size;
+    }
+    write_end(fp);
+}
+
+/* Generates the next archive from the previous one. */
+static void generate_next(FILE *fp, FILE *prev)
+{
+    Member *old, tmp, *m;
+    size_t nold, i, j;
+
+    /* Move members */
+    for (i = 0; i < nmember; ++i)
+    {
+        if (rng_real() < reorder)
+        {
+            j = rng()%nmember;
+            tmp = members[i], members[i] = members[j], members[j] = tmp;
+        }
+    }
+
+    old = members;
+    nold = nmember;
+    members = NULL;
+    nmember = capacity = 0;
+    for (i = 0; i < nold; ++i)
+    {
+        /* Delete members */
+        if (rng_real() < change/4) continue;
+
+        m = add_member();
+        *m = old[i];
+        if (rng_real() < change)
+        {
+            m->mtime += 1 + rng()%86400;
+            write_header(fp, m);
+            write_old_data(fp, prev, &old[i], true);
+        }
+        else
+        {
+            write_header(fp, m);
+            write_old_data(fp, prev, &old[i], false);
+        }
+        m->offset = ftello(fp) - (off_t)(m->size + (BS - m->size%BS)%BS);
+
+        /* Insert members */
+        if (rng_real() < change/4)
+        {
+            m = add_member();
+            m->id    = next_id++;
+            m->mtime = 1000000000u + rng()%100000000u;
+            m->size  = random_size();
+            write_header(fp, m);
+            m->seed  = rng();
+            write_new_data(fp, m->size, m->seed);
+            m->offset = ftello(fp) - (off_t)(m->size + (BS - m->size%BS)%BS);
+        }
+    }
+    free(old);
+    write_end(fp);
+}
+
+static void usage()
+{
+    printf("Usage:\n"
+           "\tbenchgen [-s <MB>] [-c <change>] [-r <reorder>] "
+           "[-d <duplicate>] [-z <zeroes>]\n"
+           "\t\t[-n <versions>] [-S <seed>] <prefix>\n\n"
+           "Writes <prefix>0.tar through <prefix><versions-1>.tar, each derived "
+           "from the\nprevious one. Fractions are given as real numbers "
+           "between 0 and 1.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    char path[4096];
+    FILE *fp, *prev = NULL;
+    int opt, n;
+
+    rng_state = 88172645463325252ull;
+    while ((opt = getopt(argc, argv, "s:c:r:d:z:n:S:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's': total_size = strtoull(optarg, NULL, 10) << 20; break;
+        case 'c': change     = atof(optarg); break;
+        case 'r': reorder    = atof(optarg); break;
+        case 'd': duplicate  = atof(optarg); break;
+        case 'z': zeroes     = atof(optarg); break;
+        case 'n': versions   = atoi(optarg); break;
+        case 'S': rng_state ^= strtoull(optarg, NULL, 10); break;
+        default:  usage(); return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1 || versions < 1)
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+    if (rng_state == 0) rng_state = 1;
+
+    for (n = 0; n < versions; ++n)
+    {
+        snprintf(path, sizeof(path), "%s%d.tar", argv[optind], n);
+        fp = fopen(path, "wb");
+        if (fp == NULL)
+        {
+            fprintf(stderr, "Cannot open '%s' for writing!\n", path);
+            return EXIT_FAILURE;
+        }
+        if (n == 0) generate_first(fp); else generate_next(fp, prev);
+        if (prev != NULL) fclose(prev);
+        if (fflush(fp) != 0)
+        {
+            fprintf(stderr, "Write failed!\n");
+            return EXIT_FAILURE;
+        }
+        fclose(fp);
+        prev = fopen(path, "rb");
+        if (prev == NULL)
+        {
+            fprintf(stderr, "Cannot open '%s' for reading!\n", path);
+            return EXIT_FAILURE;
+        }
+    }
+    fclose(prev);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,109 @@
+/* Runs a command and reports the resources it used as a single line of JSON:
+   wall clock time, user and system CPU time, peak resident set size, and the
+   peak amount of space used on the file system containing the temporary
+   directory. The latter is sampled, since temporary files are unlinked as
+   soon as they are created, and includes output files written to the same
+   file system. */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/statvfs.h>
+#include <sys/wait.h>
+
+#define SAMPLE_INTERVAL_NS 10000000     /* 10 ms */
+
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + 1e-9*(now.tv_nsec - start->tv_nsec);
+}
+
+static double seconds(const struct timeval *tv)
+{
+    return tv->tv_sec + 1e-6*tv->tv_usec;
+}
+
+/* Returns the number of bytes available in the file system at `path'. */
+static unsigned long long free_space(const char *path)
+{
+    struct statvfs st;
+
+    if (statvfs(path, &st) != 0) return 0;
+    return (unsigned long long)st.f_bavail*st.f_frsize;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *tmpdir = getenv("TMPDIR");
+    struct timespec start, interval = { 0, SAMPLE_INTERVAL_NS };
+    struct rusage ru;
+    unsigned long long bytes, avail, min_avail, initial;
+    double wall, cpu;
+    pid_t pid;
+    int status;
+
+    if (argc < 4)
+    {
+        printf("Usage:\n"
+               "\tbenchrun <name> <bytes> <command> [<args>..]\n\n"
+               "Runs a command that processes the given number of bytes, and "
+               "prints its\nresource usage as JSON.\n");
+        return EXIT_FAILURE;
+    }
+    bytes = strtoull(argv[2], NULL, 10);
+    if (tmpdir == NULL) tmpdir = P_tmpdir;
+    initial = min_avail = free_space(tmpdir);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        return EXIT_FAILURE;
+    }
+    if (pid == 0)
+    {
+        execvp(argv[3], argv + 3);
+        perror(argv[3]);
+        _exit(127);
+    }
+
+    /* Sample free space while waiting for the command to finish */
+    for (;;)
+    {
+        pid_t res = wait4(pid, &status, WNOHANG, &ru);
+        if (res == pid) break;
+        if (res < 0 && errno != EINTR)
+        {
+            perror("wait4");
+            return EXIT_FAILURE;
+        }
+        avail = free_space(tmpdir);
+        if (avail < min_avail) min_avail = avail;
+        nanosleep(&interval, NULL);
+    }
+    wall = elapsed(&start);
+    cpu  = seconds(&ru.ru_utime) + seconds(&ru.ru_stime);
+
+    printf("{\"op\": \"%s\", \"bytes\": %llu, \"wall_s\": %.3f, "
+           "\"user_s\": %.3f, \"sys_s\": %.3f, \"cpu_s\": %.3f, "
+           "\"mb_per_s\": %.2f, \"max_rss_kb\": %ld, \"tmp_peak_kb\": %llu, "
+           "\"status\": %d}\n",
+           argv[1], bytes, wall, seconds(&ru.ru_utime), seconds(&ru.ru_stime),
+           cpu, (wall > 0) ? bytes/wall/1e6 : 0.0, ru.ru_maxrss,
+           (initial - min_avail)/1024,
+           WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    fflush(stdout);
+
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? EXIT_SUCCESS
+                                                           : EXIT_FAILURE;
+}
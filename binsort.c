@@ -1,5 +1,6 @@
 #include "common.h"
 #include "binsort.h"
+#include "stats.h"
 #include <sys/mman.h>
 
 /* Defines how many files to merge at the same time. */
@@ -107,7 +108,8 @@ static void merge_files(BinSort *bs, int k)
     /* Store merged file: */
     files[0] = dst;
     for (i = 1; i < k; ++i) sizes[0] += sizes[i];
-    bs->nfiles -= NWAY_MERGE - 1;
+    bs->nfiles -= k - 1;
+    if (active_stats != NULL) ++active_stats->sort_merges;
 }
 
 /* Flushes all currently cached blocks to a new file on disk.
@@ -127,6 +129,7 @@ static void flush_cache(BinSort *bs)
     assert(fp != NULL);
     nwritten = fwrite(bs->cache, bs->block_size, bs->ncached, fp);
     assert(nwritten == bs->ncached);
+    release_cache(fp);
 
     assert(bs->nfiles < NFILES);
     bs->files[bs->nfiles] = fp;
@@ -134,6 +137,7 @@ static void flush_cache(BinSort *bs)
 
     bs->ncached = 0;
     bs->nfiles += 1;
+    if (active_stats != NULL) ++active_stats->sort_runs;
 
     /* Merge equal-length files: */
     while ( bs->nfiles >= NWAY_MERGE &&
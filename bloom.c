@@ -0,0 +1,88 @@
+#include "bloom.h"
+
+#define BLOOM_BITS_PER_KEY  10      /* about 1% false positives */
+#define BLOOM_PROBES        7       /* bits set per digest */
+#define LINE_WORDS          8       /* 64-bit words per cache line */
+
+struct BloomFilter
+{
+    uint64_t nlines;                /* number of cache lines */
+    uint64_t (*lines)[LINE_WORDS];
+};
+
+static uint64_t digest_word(const uint8_t *p)
+{
+    uint64_t w = 0;
+    int n;
+
+    for (n = 0; n < 8; ++n) w = (w << 8) | p[n];
+    return w;
+}
+
+/* Returns the cache line for `digest', and stores the bit positions within
+   the line in the second half of the digest in `bits'. */
+static const uint64_t *line_of( const BloomFilter *bf, const uint8_t *digest,
+                                uint64_t *bits )
+{
+    *bits = digest_word(digest + 8);
+    return bf->lines[(digest_word(digest) >> 32)*bf->nlines >> 32];
+}
+
+BloomFilter *BloomFilter_create(uint64_t count)
+{
+    BloomFilter *bf;
+
+    bf = malloc(sizeof(BloomFilter));
+    if (bf == NULL) return NULL;
+    bf->nlines = (count*BLOOM_BITS_PER_KEY + 511)/512;
+    if (bf->nlines == 0) bf->nlines = 1;
+    if (bf->nlines > 0xffffffffu) bf->nlines = 0xffffffffu;
+    bf->lines = calloc(bf->nlines, sizeof(*bf->lines));
+    if (bf->lines == NULL)
+    {
+        free(bf);
+        return NULL;
+    }
+    return bf;
+}
+
+void BloomFilter_add(BloomFilter *bf, const uint8_t digest[DS])
+{
+    uint64_t *line, bits;
+    int n;
+
+    line = (uint64_t*)line_of(bf, digest, &bits);
+    for (n = 0; n < BLOOM_PROBES; ++n, bits >>= 9)
+    {
+        line[(bits >> 6)&7] |= (uint64_t)1 << (bits&63);
+    }
+}
+
+bool BloomFilter_test(const BloomFilter *bf, const uint8_t digest[DS])
+{
+    const uint64_t *line;
+    uint64_t bits;
+    int n;
+
+    line = line_of(bf, digest, &bits);
+    for (n = 0; n < BLOOM_PROBES; ++n, bits >>= 9)
+    {
+        if ((line[(bits >> 6)&7] & ((uint64_t)1 << (bits&63))) == 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t BloomFilter_memory(const BloomFilter *bf)
+{
+    return bf->nlines*sizeof(*bf->lines);
+}
+
+void BloomFilter_destroy(BloomFilter *bf)
+{
+    if (bf == NULL) return;
+    free(bf->lines);
+    free(bf);
+}
@@ -0,0 +1,28 @@
+#ifndef BLOOM_H_INCLUDED
+#define BLOOM_H_INCLUDED
+
+#include "common.h"
+
+/* A blocked Bloom filter over block digests. Each digest sets BLOOM_PROBES
+   bits in a single 64-byte cache line, so a test touches one cache line. Since
+   the digests are MD5 hashes, their bits are used as hash values directly. */
+typedef struct BloomFilter BloomFilter;
+
+/* Creates a filter for (about) `count' digests. The data structure returned
+   must be freed with BloomFilter_destroy, and is NULL if out of memory. */
+BloomFilter *BloomFilter_create(uint64_t count);
+
+/* Adds a digest to the filter. */
+void BloomFilter_add(BloomFilter *bf, const uint8_t digest[DS]);
+
+/* Returns false if the digest was definitely not added to the filter, or true
+   if it probably was. */
+bool BloomFilter_test(const BloomFilter *bf, const uint8_t digest[DS]);
+
+/* Returns the number of bytes of memory used by the filter. */
+size_t BloomFilter_memory(const BloomFilter *bf);
+
+/* Destroys the filter and releases its memory. */
+void BloomFilter_destroy(BloomFilter *bf);
+
+#endif /* ndef BLOOM_H_INCLUDED */
@@ -0,0 +1,421 @@
+#include "common.h"
+#include "identify.h"
+#include "merge.h"
+#include "progress.h"
+#include "stats.h"
+#include <dirent.h>
+#include <sys/stat.h>
+
+/* Manages a directory containing one or more data files and differences files
+   that (directly or indirectly) apply to them. Each version is restored
+   through the cheapest chain of differences files, and its restore cost is
+   estimated as the number of blocks read (all differences files of the chain,
+   plus at most one block of the data file for each output block) and the
+   number of seeks (one for each run of blocks copied by a differences file).
+
+   When a budget is given for the number of blocks read from differences files
+   (the part of the cost that grows with the length of a chain), chains that
+   exceed it are shortened by merging all their differences files into a
+   single checkpoint file, which is added to the directory. The original files
+   are kept, so every version remains available; later versions are then
+   restored through the checkpoint, until their chains exceed the budget
+   again. */
+
+#define NO_VERSION (-1)
+
+/* A distinct file version (identified by its digest) */
+typedef struct Version
+{
+    uint8_t     digest[DS];
+    uint64_t    nblocks;    /* size of the version in blocks */
+    struct File *file;      /* data file, or last diff of the cheapest chain */
+    int         prev;       /* version `file' applies to, or NO_VERSION */
+    int         depth;      /* number of differences files in the chain */
+    uint64_t    diff_blocks;    /* blocks read from differences files */
+    uint64_t    seeks;      /* runs copied by the differences files */
+    bool        reached;    /* can the version be restored? */
+    bool        done;       /* is the cheapest chain known? */
+    bool        merged;     /* has a checkpoint been made for this version? */
+} Version;
+
+typedef struct Chain
+{
+    const char  *dir;
+    struct File *files;
+    Version     *versions;
+    int         count;
+    int         capacity;
+    int         *order;     /* reachable versions by increasing cost */
+    int         nreached;
+} Chain;
+
+/* Returns the size of the file at `path' in blocks, or 0 if it is unknown. */
+static uint64_t file_blocks(const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) != 0) return 0;
+    return (uint64_t)st.st_size/BS + (st.st_size%BS != 0);
+}
+
+/* Returns the total number of blocks read to restore version `v'. */
+static uint64_t restore_blocks(const Version *v)
+{
+    return v->diff_blocks + v->nblocks;
+}
+
+static int compar_names(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Returns the index of the version with the given digest, adding it to the
+   chain if it does not exist yet. */
+static int get_version(Chain *ch, const uint8_t digest[DS])
+{
+    Version *v;
+    int i;
+
+    for (i = 0; i < ch->count; ++i)
+    {
+        if (memcmp(ch->versions[i].digest, digest, DS) == 0) return i;
+    }
+    if (ch->count == ch->capacity)
+    {
+        ch->capacity = ch->capacity > 0 ? 2*ch->capacity : 16;
+        ch->versions = realloc(ch->versions,
+                               ch->capacity*sizeof(Version));
+        ch->order    = realloc(ch->order, ch->capacity*sizeof(int));
+        assert(ch->versions != NULL && ch->order != NULL);
+    }
+    v = &ch->versions[ch->count];
+    memset(v, 0, sizeof(Version));
+    memcpy(v->digest, digest, DS);
+    v->prev = NO_VERSION;
+    return ch->count++;
+}
+
+/* Adds the versions of the files in `files' to the chain. */
+static void add_versions(Chain *ch, struct File *files)
+{
+    struct File *file;
+    Version *v;
+    size_t n;
+    int i;
+
+    /* Note that get_version() may move the versions array */
+    for (file = files; file != NULL; file = file->next)
+    {
+        if (file->type == FILE_DATA)
+        {
+            i = get_version(ch, file->data.digest);
+            v = &ch->versions[i];
+            v->nblocks = file_blocks(file->path);
+        }
+        else
+        if (file->type == FILE_DIFF)
+        {
+            i = get_version(ch, file->diff.digest1);
+            v = &ch->versions[i];
+            if (file->diff.bases != NULL)
+            {
+                /* The concatenation of the base files */
+                v->nblocks = 0;
+                for (n = 0; n < file->diff.bases->count; ++n)
+                {
+                    v->nblocks += file->diff.bases->nblocks[n];
+                }
+            }
+            i = get_version(ch, file->diff.digest2);
+            v = &ch->versions[i];
+            v->nblocks = file->diff.copied + file->diff.added;
+        }
+    }
+}
+
+/* Identifies the files in the directory and adds them to the chain. Invalid
+   files and files whose name starts with a dot are ignored. */
+static void load_dir(Chain *ch)
+{
+    struct dirent *de;
+    struct stat st;
+    struct File *file;
+    char **paths = NULL;
+    int npath = 0, capacity = 0, n;
+    size_t len;
+    DIR *d;
+
+    d = opendir(ch->dir);
+    if (d == NULL) fail("Cannot open directory '%s'!", ch->dir);
+    while ((de = readdir(d)) != NULL)
+    {
+        if (de->d_name[0] == '.') continue;
+        if (npath == capacity)
+        {
+            capacity = capacity > 0 ? 2*capacity : 16;
+            paths = realloc(paths, capacity*sizeof(char*));
+            assert(paths != NULL);
+        }
+        len = strlen(ch->dir) + strlen(de->d_name) + 2;
+        paths[npath] = malloc(len);
+        assert(paths[npath] != NULL);
+        snprintf(paths[npath], len, "%s/%s", ch->dir, de->d_name);
+        if (stat(paths[npath], &st) == 0 && S_ISREG(st.st_mode)) ++npath;
+        else free(paths[npath]);
+    }
+    closedir(d);
+    qsort(paths, npath, sizeof(char*), &compar_names);
+
+    stats_phase("identify");
+    identify_files((const char**)paths, npath, NULL, &ch->files);
+    stats_phase_end();
+    for (file = ch->files; file != NULL; file = file->next)
+    {
+        if (file->type == FILE_INVALID)
+        {
+            fprintf(stderr, "%s: %s (ignored)\n", file->path,
+                            file->invalid.error);
+        }
+    }
+    add_versions(ch, ch->files);
+
+    for (n = 0; n < npath; ++n) free(paths[n]);
+    free(paths);
+}
+
+/* Determines the cheapest chain of each version (by the number of blocks read
+   from differences files, then by the number of seeks), and orders the
+   reachable versions by increasing cost. */
+static void find_chains(Chain *ch)
+{
+    struct File *file;
+    Version *v, *w;
+    uint64_t blocks, seeks;
+    int i, j;
+
+    for (i = 0; i < ch->count; ++i)
+    {
+        v = &ch->versions[i];
+        v->reached = v->done = false;
+        v->file  = NULL;
+        v->prev  = NO_VERSION;
+        v->depth = 0;
+        v->diff_blocks = v->seeks = 0;
+    }
+    for (file = ch->files; file != NULL; file = file->next)
+    {
+        if (file->type != FILE_DATA) continue;
+        v = &ch->versions[get_version(ch, file->data.digest)];
+        if (!v->reached)
+        {
+            v->reached = true;
+            v->file    = file;
+        }
+    }
+    for (file = ch->files; file != NULL; file = file->next)
+    {
+        /* Diffs with multiple base files apply to their concatenation, which
+           is reached (without a file) if all base files are present */
+        if (!bases_present(ch->files, file)) continue;
+        v = &ch->versions[get_version(ch, file->diff.digest1)];
+        v->reached = true;
+    }
+
+    ch->nreached = 0;
+    for (;;)
+    {
+        /* Select the cheapest version not done yet */
+        i = NO_VERSION;
+        for (j = 0; j < ch->count; ++j)
+        {
+            w = &ch->versions[j];
+            if (!w->reached || w->done) continue;
+            if (i == NO_VERSION ||
+                w->diff_blocks < ch->versions[i].diff_blocks ||
+                (w->diff_blocks == ch->versions[i].diff_blocks &&
+                 w->seeks < ch->versions[i].seeks))
+            {
+                i = j;
+            }
+        }
+        if (i == NO_VERSION) break;
+        v = &ch->versions[i];
+        v->done = true;
+        ch->order[ch->nreached++] = i;
+
+        /* Extend its chain with each differences file that applies to it */
+        for (file = ch->files; file != NULL; file = file->next)
+        {
+            if (file->type != FILE_DIFF ||
+                memcmp(file->diff.digest1, v->digest, DS) != 0) continue;
+
+            w = &ch->versions[get_version(ch, file->diff.digest2)];
+            blocks = v->diff_blocks + file_blocks(file->path);
+            seeks  = v->seeks + file->diff.runs;
+            if (w->done || (w->reached && (blocks > w->diff_blocks ||
+                (blocks == w->diff_blocks && seeks >= w->seeks)))) continue;
+
+            w->reached     = true;
+            w->file        = file;
+            w->prev        = i;
+            w->depth       = v->depth + 1;
+            w->diff_blocks = blocks;
+            w->seeks       = seeks;
+        }
+    }
+}
+
+/* Merges the chain of differences files of version `i' into a new checkpoint
+   file, and adds it to the chain. Returns false if merging failed. */
+static bool make_checkpoint(Chain *ch, int i)
+{
+    Version *v = &ch->versions[i];
+    char digest_str[2*DS + 1], path[4096], **paths;
+    const char *new_path = path;
+    struct File *file, **last;
+    MergeContext *mc;
+    OutputStream *os;
+    bool ok;
+    int n, j;
+
+    paths = malloc(v->depth*sizeof(char*));
+    assert(paths != NULL);
+    for (n = v->depth, j = i; n > 0; j = ch->versions[j].prev)
+    {
+        paths[--n] = ch->versions[j].file->path;
+    }
+    hexstring(digest_str, v->digest, DS);
+    snprintf(path, sizeof(path), "%s/checkpoint-%.16s", ch->dir, digest_str);
+
+    mc = merge_create();
+    ok = merge_diffs(mc, paths, v->depth, false);
+    if (ok)
+    {
+        os = stats_output_stream(OpenFileOutputStream(open_output(path)),
+                                 "diff");
+        assert(os != NULL);
+        stats_phase("output");
+        progress_phase("output", 0);
+        merge_output(mc, os);
+        stats_phase_end();
+        os->close(os);
+    }
+    merge_cleanup(mc);
+    free(paths);
+    if (!ok) return false;
+
+    /* Identify the new file, and append it to the file list */
+    for (last = &ch->files; *last != NULL; last = &(*last)->next) { }
+    stats_phase("identify");
+    ok = identify_files(&new_path, 1, NULL, &file);
+    stats_phase_end();
+    *last = file;
+    if (!ok || file->type != FILE_DIFF)
+    {
+        fprintf(stderr, "%s: could not be read back!\n", path);
+        return false;
+    }
+    printf("%s: merged %d differences files\n", path, v->depth);
+    return true;
+}
+
+/* Prints the restore cost of each version. Returns false if some differences
+   files cannot be applied to any data file in the directory. */
+static bool report(Chain *ch)
+{
+    struct File *file;
+    Version *v;
+    bool res = true;
+    int n;
+
+    for (n = 0; n < ch->nreached; ++n)
+    {
+        v = &ch->versions[ch->order[n]];
+        if (v->file == NULL) continue;
+        printf("%s: %d diffs, %llu blocks read (%llu from diffs), "
+               "%llu seeks\n", v->file->path, v->depth,
+               (unsigned long long)restore_blocks(v),
+               (unsigned long long)v->diff_blocks,
+               (unsigned long long)v->seeks);
+    }
+    for (file = ch->files; file != NULL; file = file->next)
+    {
+        if (bases_present(ch->files, file))
+        {
+            write_bases(ch->files, file, stdout);
+        }
+    }
+    fflush(stdout);
+    for (file = ch->files; file != NULL; file = file->next)
+    {
+        if (file->type == FILE_DIFF &&
+            !ch->versions[get_version(ch, file->diff.digest1)].reached)
+        {
+            fprintf(stderr, "UNUSABLE FILE: %s\n", file->path);
+            res = false;
+        }
+    }
+    return res;
+}
+
+int tardiffchain(int argc, char *argv[], char *flags)
+{
+    const char *budget_str = get_option("budget");
+    uint64_t budget = 0;
+    Chain chain = { NULL, NULL, NULL, 0, 0, NULL, 0 };
+    Version *v;
+    char *end;
+    bool ok;
+    int n;
+
+    (void)argc;
+    (void)flags;
+
+    if (budget_str != NULL)
+    {
+        budget = strtoull(budget_str, &end, 10);
+        if (*end != '\0' || end == budget_str || budget == 0)
+        {
+            fprintf(stderr, "Invalid restore budget: %s\n", budget_str);
+            return EXIT_FAILURE;
+        }
+    }
+
+    chain.dir = argv[0];
+    load_dir(&chain);
+    find_chains(&chain);
+
+    /* Add checkpoints for the cheapest version exceeding the budget, until no
+       chain can be shortened any further */
+    while (budget_str != NULL)
+    {
+        for (n = 0; n < chain.nreached; ++n)
+        {
+            v = &chain.versions[chain.order[n]];
+            if (v->diff_blocks > budget && v->depth > 1 && !v->merged)
+            {
+                break;
+            }
+        }
+        if (n == chain.nreached) break;
+        chain.versions[chain.order[n]].merged = true;
+        if (!make_checkpoint(&chain, chain.order[n])) break;
+        find_chains(&chain);
+    }
+
+    ok = report(&chain);
+    for (n = 0; n < chain.nreached; ++n)
+    {
+        v = &chain.versions[chain.order[n]];
+        if (budget_str != NULL && v->diff_blocks > budget)
+        {
+            fprintf(stderr, "%s: exceeds the restore budget\n",
+                            v->file->path);
+        }
+    }
+    free_files(chain.files);
+    free(chain.versions);
+    free(chain.order);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
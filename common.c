@@ -1,12 +1,68 @@
+#define _GNU_SOURCE             /* for O_DIRECT */
 #include "common.h"
+#include "decompress.h"
+#include <fcntl.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <zlib.h>
 
+#define DROP_INTERVAL   (8 << 20)   /* bytes read between cache drops */
+#define DIRECT_ALIGN    4096        /* alignment of direct I/O */
+#define DIRECT_BUFFER   (1 << 20)   /* size of a direct I/O read */
+#define DIRECT_MIN_SIZE (64 << 20)  /* minimum size of a file read directly */
+
 typedef struct FileStream
 {
     InputStream is;
     gzFile file;
+    off_t size;
+    int fd;                     /* underlying file descriptor */
+    off_t dropped;              /* end of data dropped from the page cache */
+    bool random;                /* has the stream been seeked? */
 } FileStream;
 
+/* Uncompressed file read with direct I/O (bypassing the page cache) while it
+   is read sequentially */
+typedef struct DirectStream
+{
+    InputStream is;
+    int fd;
+    off_t size;
+    off_t pos;                  /* current position in the file */
+    char *buf;                  /* aligned buffer */
+    off_t buf_pos;              /* file offset of the buffered data */
+    size_t buf_len;             /* number of bytes buffered */
+    bool random;                /* has the stream been seeked? */
+} DirectStream;
+
+typedef struct ConcatStream
+{
+    InputStream is;
+    InputStream **parts;
+    int nparts;
+    int cur;                    /* index of the part being read */
+    off_t pos;                  /* position in the current part */
+} ConcatStream;
+
+typedef struct FileOutputStream
+{
+    OutputStream os;
+    FILE *fp;
+} FileOutputStream;
+
+enum IoPolicy io_policy = IO_CACHED;
+
+/* Error handler of the current thread */
+static __thread ErrorHandler *error_handler;
+
+/* Values of long options given on the command line */
+#define MAX_OPTIONS 16
+static const char *option_names[MAX_OPTIONS];
+static size_t option_name_lens[MAX_OPTIONS];
+static const char *option_values[MAX_OPTIONS];
+static int num_options;
+
 static bool no_seek(InputStream *is, off_t pos)
 {   /* seeking not supported */
     (void)is;
@@ -14,20 +70,55 @@ static bool no_seek(InputStream *is, off_t pos)
     return false;
 }
 
+static off_t no_size(InputStream *is)
+{   /* size not known */
+    (void)is;
+    return -1;
+}
+
 static size_t FS_read(FileStream *fs, void *buf, size_t len)
 {
     int res;
+    off_t pos;
+
     assert((size_t)(int)len == len);
     res = gzread(fs->file, buf, len);
+
+    /* Drop data read sequentially from the page cache */
+    if (io_policy != IO_CACHED && !fs->random)
+    {
+        pos = lseek(fs->fd, 0, SEEK_CUR);
+        if (pos - fs->dropped >= DROP_INTERVAL)
+        {
+            posix_fadvise( fs->fd, fs->dropped, pos - fs->dropped,
+                           POSIX_FADV_DONTNEED );
+            fs->dropped = pos;
+        }
+    }
     return (res < 0) ? 0 : (size_t)res;
 }
 
 static bool FS_seek(FileStream *fs, off_t pos)
 {
     assert((off_t)(z_off_t)pos == pos);
+
+    /* Data read at random may be read again, so it is kept in the cache */
+    if (pos != 0 && !fs->random)
+    {
+        fs->random = true;
+        if (io_policy != IO_CACHED)
+        {
+            posix_fadvise(fs->fd, 0, 0, POSIX_FADV_NORMAL);
+        }
+    }
     return gzseek(fs->file, (z_off_t)pos, SEEK_SET) != (z_off_t)-1;
 }
 
+static off_t FS_size(FileStream *fs)
+{
+    return fs->size;
+}
+
 static void FS_close(FileStream *fs)
 {
     assert(fs->file != NULL);
@@ -36,14 +127,162 @@ static void FS_close(FileStream *fs)
     free(fs);
 }
 
+static size_t DS_read(DirectStream *ds, void *buf, size_t len)
+{
+    size_t total = 0, n;
+    ssize_t res;
+
+    while (total < len && ds->pos < ds->size)
+    {
+        if (ds->random)
+        {
+            /* Read directly into the caller's buffer */
+            res = pread(ds->fd, (char*)buf + total, len - total, ds->pos);
+            if (res <= 0) break;
+            n = res;
+        }
+        else
+        {
+            if ( ds->pos <  ds->buf_pos ||
+                 ds->pos >= ds->buf_pos + (off_t)ds->buf_len )
+            {
+                /* Refill the buffer, starting at an aligned offset */
+                ds->buf_pos = ds->pos - ds->pos%DIRECT_ALIGN;
+                res = pread(ds->fd, ds->buf, DIRECT_BUFFER, ds->buf_pos);
+                ds->buf_len = (res < 0) ? 0 : (size_t)res;
+                if (ds->pos >= ds->buf_pos + (off_t)ds->buf_len) break;
+            }
+            n = ds->buf_pos + ds->buf_len - ds->pos;
+            if (n > len - total) n = len - total;
+            memcpy((char*)buf + total, ds->buf + (ds->pos - ds->buf_pos), n);
+        }
+        total   += n;
+        ds->pos += n;
+    }
+    return total;
+}
+
+static bool DS_seek(DirectStream *ds, off_t pos)
+{
+    /* Data read at random may be read again, so it is read through the cache
+       from now on */
+    if (pos != 0 && !ds->random)
+    {
+        ds->random = true;
+        fcntl(ds->fd, F_SETFL, fcntl(ds->fd, F_GETFL) & ~O_DIRECT);
+    }
+    ds->pos = pos;
+    return true;
+}
+
+static off_t DS_size(DirectStream *ds)
+{
+    return ds->size;
+}
+
+static void DS_close(DirectStream *ds)
+{
+    close(ds->fd);
+    free(ds->buf);
+    free(ds);
+}
+
+/* Opens a large uncompressed file for direct I/O, or returns NULL if this is
+   not possible (in which case the file should be opened normally). */
+static InputStream *OpenDirectInputStream(const char *path)
+{
+#ifdef O_DIRECT
+    DirectStream *ds;
+    unsigned char magic[2];
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    if ( fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+         st.st_size < DIRECT_MIN_SIZE || pread(fd, magic, 2, 0) != 2 ||
+         (magic[0] == 0x1f && magic[1] == 0x8b) )
+    {
+        /* Too small, or possibly gzipped */
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    fd = open(path, O_RDONLY | O_DIRECT);
+    if (fd < 0) return NULL;
+    ds = malloc(sizeof(DirectStream));
+    if (ds == NULL || posix_memalign( (void**)&ds->buf, DIRECT_ALIGN,
+                                      DIRECT_BUFFER ) != 0)
+    {
+        free(ds);
+        close(fd);
+        return NULL;
+    }
+    ds->is.read  = (void*)DS_read;
+    ds->is.seek  = (void*)DS_seek;
+    ds->is.size  = (void*)DS_size;
+    ds->is.close = (void*)DS_close;
+    ds->fd       = fd;
+    ds->size     = st.st_size;
+    ds->pos      = 0;
+    ds->buf_pos  = 0;
+    ds->buf_len  = 0;
+    ds->random   = false;
+    return &ds->is;
+#else
+    (void)path;
+    return NULL;
+#endif
+}
+
 InputStream *OpenFileInputStream(const char *path)
 {
+    InputStream *is;
     FileStream *fs;
     gzFile file;
+    struct stat st;
+    unsigned char magic[6];
+    ssize_t len;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    /* Detect xz and zstd compressed files by their magic bytes */
+    len = pread(fd, magic, sizeof(magic), 0);
+    if (len == 6 && memcmp(magic, "\xfd" "7zXZ\0", 6) == 0)
+    {
+        is = OpenXzInputStream(fd);
+        if (is == NULL) close(fd);
+        return is;
+    }
+#ifdef WITH_ZSTD
+    if (len >= 4 && memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0)
+    {
+        is = OpenZstdInputStream(fd);
+        if (is == NULL) close(fd);
+        return is;
+    }
+#endif
+
+    if (io_policy == IO_DIRECT && (is = OpenDirectInputStream(path)) != NULL)
+    {
+        close(fd);
+        return is;
+    }
 
     /* Open (possible gzipped) file */
-    file = gzopen(path, "rb");
-    if (file == NULL) return NULL;
+    file = gzdopen(fd, "rb");
+    if (file == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    if (io_policy != IO_CACHED)
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
 
     /* Initialize stream data structure */
     fs = malloc(sizeof(FileStream));
@@ -54,12 +293,33 @@ InputStream *OpenFileInputStream(const char *path)
     }
     fs->is.read  = (void*)FS_read;
     fs->is.seek  = gzdirect(file) ? (void*)FS_seek : no_seek;
+    fs->is.size  = gzdirect(file) ? (void*)FS_size : no_size;
     fs->is.close = (void*)FS_close;
     fs->file = file;
+    fs->size = (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) ? st.st_size : -1;
+    fs->fd   = fd;
+    fs->dropped = 0;
+    fs->random  = false;
 
     return &fs->is;
 }
 
+bool set_io_policy(const char *name)
+{
+    if (strcmp(name, "cached") == 0) io_policy = IO_CACHED;
+    else if (strcmp(name, "stream") == 0) io_policy = IO_STREAM;
+    else if (strcmp(name, "direct") == 0) io_policy = IO_DIRECT;
+    else return false;
+    return true;
+}
+
+void release_cache(FILE *fp)
+{
+    if (io_policy == IO_CACHED) return;
+    fflush(fp);
+    posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_DONTNEED);
+}
+
 
 static size_t stdin_read(InputStream *is, void *buf, size_t len)
 {
@@ -74,10 +334,225 @@ static void stdin_close(InputStream *is)
 
 InputStream *OpenStdinInputStream()
 {
-    static InputStream is = { stdin_read, no_seek, stdin_close };
+    static InputStream is = { stdin_read, no_seek, no_size, stdin_close };
     return &is;
 }
 
+static size_t CS_read(ConcatStream *cs, void *buf, size_t len)
+{
+    InputStream *part;
+    size_t total = 0, n;
+
+    while (total < len && cs->cur < cs->nparts)
+    {
+        part = cs->parts[cs->cur];
+        n = part->read(part, (char*)buf + total, len - total);
+        if (n == 0)
+        {
+            /* Pad the end of the part to a whole number of blocks */
+            n = (BS - cs->pos%BS)%BS;
+            if (n == 0)
+            {
+                if (++cs->cur < cs->nparts)
+                {
+                    cs->parts[cs->cur]->seek(cs->parts[cs->cur], 0);
+                }
+                cs->pos = 0;
+                continue;
+            }
+            if (n > len - total) n = len - total;
+            memset((char*)buf + total, 0, n);
+        }
+        total   += n;
+        cs->pos += n;
+    }
+    return total;
+}
+
+/* Returns the size of a part padded to a whole number of blocks, or -1. */
+static off_t CS_part_size(InputStream *part)
+{
+    off_t size = part->size(part);
+    return (size < 0) ? -1 : size + (BS - size%BS)%BS;
+}
+
+static bool CS_seek(ConcatStream *cs, off_t pos)
+{
+    off_t size;
+    int n;
+
+    for (n = 0; n < cs->nparts; ++n)
+    {
+        size = CS_part_size(cs->parts[n]);
+        if (size < 0) return false;
+        if (pos < size || n == cs->nparts - 1) break;
+        pos -= size;
+    }
+    if (!cs->parts[n]->seek(cs->parts[n], pos)) return false;
+    cs->cur = n;
+    cs->pos = pos;
+    return true;
+}
+
+static off_t CS_size(ConcatStream *cs)
+{
+    off_t size, total = 0;
+    int n;
+
+    for (n = 0; n < cs->nparts; ++n)
+    {
+        size = CS_part_size(cs->parts[n]);
+        if (size < 0) return -1;
+        total += size;
+    }
+    return total;
+}
+
+static void CS_close(ConcatStream *cs)
+{
+    int n;
+
+    for (n = 0; n < cs->nparts; ++n) cs->parts[n]->close(cs->parts[n]);
+    free(cs->parts);
+    free(cs);
+}
+
+InputStream *OpenConcatInputStream(InputStream **parts, int nparts)
+{
+    ConcatStream *cs;
+
+    assert(nparts > 0);
+    cs = malloc(sizeof(ConcatStream));
+    if (cs == NULL) return NULL;
+    cs->parts = malloc(nparts*sizeof(InputStream*));
+    if (cs->parts == NULL)
+    {
+        free(cs);
+        return NULL;
+    }
+    memcpy(cs->parts, parts, nparts*sizeof(InputStream*));
+    cs->is.read  = (void*)CS_read;
+    cs->is.seek  = (void*)CS_seek;
+    cs->is.size  = (void*)CS_size;
+    cs->is.close = (void*)CS_close;
+    cs->nparts = nparts;
+    cs->cur    = 0;
+    cs->pos    = 0;
+
+    return &cs->is;
+}
+
+static bool FOS_write(FileOutputStream *fos, const void *buf, size_t len)
+{
+    return fwrite(buf, 1, len, fos->fp) == len;
+}
+
+static bool FOS_seek(FileOutputStream *fos, off_t pos)
+{
+    return fseeko(fos->fp, pos, SEEK_SET) == 0;
+}
+
+static size_t FOS_read(FileOutputStream *fos, void *buf, size_t len)
+{
+    return fread(buf, 1, len, fos->fp);
+}
+
+static void FOS_close(FileOutputStream *fos)
+{
+    fflush(fos->fp);
+    free(fos);
+}
+
+OutputStream *OpenFileOutputStream(FILE *fp)
+{
+    FileOutputStream *fos;
+
+    fos = malloc(sizeof(FileOutputStream));
+    if (fos == NULL) return NULL;
+    fos->os.write  = (void*)FOS_write;
+    fos->os.seek   = (void*)FOS_seek;
+    fos->os.read   = (void*)FOS_read;
+    fos->os.close  = (void*)FOS_close;
+    fos->os.fd     = fileno(fp);
+    fos->os.digest_started = false;
+    fos->os.bytes  = 0;
+    fos->fp = fp;
+
+    return &fos->os;
+}
+
+void push_error_handler(ErrorHandler *eh)
+{
+    eh->prev = error_handler;
+    eh->message[0] = '\0';
+    error_handler = eh;
+}
+
+void pop_error_handler(ErrorHandler *eh)
+{
+    assert(error_handler == eh);
+    error_handler = eh->prev;
+}
+
+void fail(const char *fmt, ...)
+{
+    ErrorHandler *eh = error_handler;
+    va_list ap;
+
+    va_start(ap, fmt);
+    if (eh == NULL)
+    {
+        vfprintf(stderr, fmt, ap);
+        fputc('\n', stderr);
+        exit(EXIT_FAILURE);
+    }
+    vsnprintf(eh->message, sizeof(eh->message), fmt, ap);
+    va_end(ap);
+    error_handler = eh->prev;
+    longjmp(eh->env, 1);
+}
+
+bool set_option(const char *arg, const char *allowed)
+{
+    const char *value = strchr(arg, '='), *p;
+    size_t len;
+    int n;
+
+    if (value == NULL || value == arg) return false;
+    len = value - arg;
+    for (p = strchr(allowed, ' '); p != NULL; p = strchr(p + 1, ' '))
+    {
+        if (strncmp(p + 1, arg, len) == 0 && p[1 + len] == ' ') break;
+    }
+    if (p == NULL) return false;
+    for (n = 0; n < num_options; ++n)
+    {
+        if (option_name_lens[n] == len &&
+            strncmp(option_names[n], arg, len) == 0) break;
+    }
+    if (n == MAX_OPTIONS) return false;
+    if (n == num_options) ++num_options;
+    option_names[n]     = arg;
+    option_name_lens[n] = len;
+    option_values[n]    = value + 1;
+    return true;
+}
+
+const char *get_option(const char *name)
+{
+    int n;
+
+    for (n = 0; n < num_options; ++n)
+    {
+        if (option_name_lens[n] == strlen(name) &&
+            strncmp(option_names[n], name, option_name_lens[n]) == 0)
+        {
+            return option_values[n];
+        }
+    }
+    return NULL;
+}
+
 void redirect_stdout(const char *path)
 {
     if (freopen(path, "r+b", stdout) != NULL)
@@ -88,18 +563,37 @@ void redirect_stdout(const char *path)
 
     if (freopen(path, "w+b", stdout) == NULL)
     {
-        fprintf(stderr, "Cannot not open '%s' for writing!\n", path);
+        fprintf(stderr, "Cannot open '%s' for writing!\n", path);
         exit(1);
     }
 }
 
-void read_data(InputStream *is, void *buf, size_t len)
+FILE *open_output(const char *path)
 {
-    if (is->read(is, buf, len) != len)
+    FILE *fp = fopen(path, "rb");
+
+    if (fp != NULL)
     {
-        fprintf(stderr, "Read failed!\n");
-        abort();
+        fprintf(stderr, "Output file '%s' exists! (Not overwritten.)\n", path);
+        exit(1);
+    }
+    fp = fopen(path, "w+b");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Cannot open '%s' for writing!\n", path);
+        exit(1);
     }
+    return fp;
+}
+
+void read_data(InputStream *is, void *buf, size_t len)
+{
+    if (is->read(is, buf, len) != len) fail("Read failed!");
+}
+
+uint64_t parse_uint64(uint8_t *buf)
+{
+    return ((uint64_t)parse_uint32(buf) << 32) | parse_uint32(buf + 4);
 }
 
 uint32_t parse_uint32(uint8_t *buf)
@@ -116,6 +610,13 @@ uint16_t parse_uint16(uint8_t *buf)
            ((uint16_t)buf[1] <<  0);
 }
 
+uint64_t read_uint64(InputStream *is)
+{
+    uint8_t buf[8];
+    read_data(is, buf, 8);
+    return parse_uint64(buf);
+}
+
 uint32_t read_uint32(InputStream *is)
 {
     uint8_t buf[4];
@@ -130,16 +631,20 @@ uint16_t read_uint16(InputStream *is)
     return parse_uint16(buf);
 }
 
-void write_data(void *buf, size_t len)
+void write_data(OutputStream *os, const void *buf, size_t len)
 {
-    if (fwrite(buf, 1, len, stdout) != len)
-    {
-        fprintf(stderr, "Write failed!\n");
-        abort();
-    }
+    if (!os->write(os, buf, len)) fail("Write failed!");
+    if (os->digest_started) MD5_Update(&os->md5_ctx, buf, len);
+    os->bytes += len;
+}
+
+void write_uint64(OutputStream *os, uint64_t i)
+{
+    write_uint32(os, (uint32_t)(i >> 32));
+    write_uint32(os, (uint32_t)i);
 }
 
-void write_uint32(uint32_t i)
+void write_uint32(OutputStream *os, uint32_t i)
 {
     uint8_t buf[4];
     buf[3] = i&255;
@@ -149,16 +654,46 @@ void write_uint32(uint32_t i)
     buf[1] = i&255;
     i >>= 8;
     buf[0] = i&255;
-    write_data(buf, 4);
+    write_data(os, buf, 4);
 }
 
-void write_uint16(uint16_t i)
+void write_uint16(OutputStream *os, uint16_t i)
 {
     uint8_t buf[2];
     buf[1] = i&255;
     i >>= 8;
     buf[0] = i&255;
-    write_data(buf, 2);
+    write_data(os, buf, 2);
+}
+
+void seek_output(OutputStream *os, off_t pos)
+{
+    if (os->seek == NULL || !os->seek(os, pos)) fail("Seek failed.");
+}
+
+void read_output(OutputStream *os, void *buf, size_t len)
+{
+    if (os->read == NULL || os->read(os, buf, len) != len) fail("Read failed.");
+}
+
+void start_output_digest(OutputStream *os)
+{
+    MD5_Init(&os->md5_ctx);
+    os->digest_started = true;
+    os->bytes = 0;
+}
+
+off_t get_output_digest(OutputStream *os, uint8_t digest[DS])
+{
+    MD5_CTX md5_ctx;
+
+    assert(os->digest_started);
+    if (digest != NULL)
+    {
+        md5_ctx = os->md5_ctx;
+        MD5_Final(digest, &md5_ctx);
+    }
+    return os->bytes;
 }
 
 void hexstring(char *str, uint8_t *data, size_t size)
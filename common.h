@@ -5,6 +5,7 @@
 
 #include <assert.h>
 #include <libgen.h>
+#include <setjmp.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -15,50 +16,159 @@
 #define BS 512          /* block size (512 bytes for TAR) */
 #define DS 16           /* digest size (16 bytes for MD5) */
 #define HT 1000001      /* hash table index size (entries) */
-#define NC 32767        /* max. number of blocks to copy per instruction */
 #define NA 2048         /* max. number of blocks to append per instruction */
+#define MAX_BASES 64    /* max. number of base files of a differences file */
 
 #define MAGIC_LEN 8
 #define MAGIC_STR "tardiff0"
+#define MAGIC_STR_WIDE "tardiff1"
+#define MAGIC_STR_EDITS "tardiff2"  /* narrow format with edit lists */
 
 typedef struct InputStream
 {
     size_t ( *read  )(struct InputStream *is, void *buf, size_t len);
     bool   ( *seek  )(struct InputStream *is, off_t pos);
+    off_t  ( *size  )(struct InputStream *is);
     void   ( *close )(struct InputStream *is);
 } InputStream;
 
 InputStream *OpenStdinInputStream();
 InputStream *OpenFileInputStream(const char *path);
 
-/* Redirects standard output to a file at the given path, or aborts if the file
+/* Creates an input stream that reads the concatenation of `nparts' streams,
+   each padded with zeroes to a whole number of blocks. The stream is seekable
+   if all parts are seekable and have a known size. Closing it closes the
+   parts. */
+InputStream *OpenConcatInputStream(InputStream **parts, int nparts);
+
+/* Output streams. Streams may be implemented by the caller, in which case
+   `seek' and `read' may be NULL if the stream does not support them (this is
+   required to patch from a non-seekable input file only), and `fd' should be
+   -1. The remaining fields are maintained by write_data() and friends. */
+typedef struct OutputStream
+{
+    bool   ( *write )(struct OutputStream *os, const void *buf, size_t len);
+    bool   ( *seek  )(struct OutputStream *os, off_t pos);
+    size_t ( *read  )(struct OutputStream *os, void *buf, size_t len);
+    void   ( *close )(struct OutputStream *os);
+    int    fd;                  /* underlying file descriptor (or -1) */
+
+    bool    digest_started;     /* is the digest of written data computed? */
+    MD5_CTX md5_ctx;            /* digest of data written */
+    off_t   bytes;              /* number of bytes written */
+} OutputStream;
+
+/* Creates an output stream that writes to the given file, which is flushed
+   (but not closed) when the stream is closed. */
+OutputStream *OpenFileOutputStream(FILE *fp);
+
+/* Error handling: fatal errors are reported with fail(). If an error handler
+   has been installed by the calling thread, control returns to it (by means
+   of longjmp()); otherwise, the message is printed and the process exits.
+   Library functions install a handler as follows:
+
+        ErrorHandler eh;
+        if (setjmp(eh.env) != 0) { ... eh.message describes the error ... }
+        push_error_handler(&eh);
+        ...
+        pop_error_handler(&eh);
+*/
+typedef struct ErrorHandler
+{
+    jmp_buf             env;
+    char                message[256];
+    struct ErrorHandler *prev;
+} ErrorHandler;
+
+void push_error_handler(ErrorHandler *eh);
+void pop_error_handler(ErrorHandler *eh);
+void fail(const char *fmt, ...)
+    __attribute__((noreturn, format(printf, 1, 2)));
+
+/* Redirects standard output to a file at the given path, or exits if the file
    cannot be opened, or if it exists and is not empty (in case the file will be
    closed leaving the contents intact). */
 void redirect_stdout(const char *path);
 
-/* Reads data from the given input stream into a buffer or aborts on failure. */
+/* Opens a new file at the given path for writing, or exits if the file cannot
+   be opened, or if it exists. */
+FILE *open_output(const char *path);
+
+/* Reads data from the given input stream into a buffer or fails. */
 void read_data(InputStream *is, void *buf, size_t len);
 
+/* Interprets the first eight bytes in `buf' as a 64-bit big-endian integer. */
+uint64_t parse_uint64(uint8_t *buf);
+
 /* Interprets the first four bytes in `buf' as a 32-bit big-endian integer. */
 uint32_t parse_uint32(uint8_t *buf);
 
 /* Interprets the first two bytes in `buf' as a 16-bit big-endian integer. */
 uint16_t parse_uint16(uint8_t *buf);
 
-/* Reads a big-endian 32-bit unsigned integer or aborts. */
+/* Reads a big-endian 64-bit unsigned integer or fails. */
+uint64_t read_uint64(InputStream *is);
+
+/* Reads a big-endian 32-bit unsigned integer or fails. */
 uint32_t read_uint32(InputStream *is);
 
-/* Reads a big-endian 16-bit unsigned integer or aborts. */
+/* Reads a big-endian 16-bit unsigned integer or fails. */
 uint16_t read_uint16(InputStream *is);
 
-/* Writes data from the given buffer to standard output or aborts on failure. */
-void write_data(void *buf, size_t len);
+/* Writes data from the given buffer to an output stream or fails. */
+void write_data(OutputStream *os, const void *buf, size_t len);
+
+/* Writes a big-endian 64-bit unsigned integer to an output stream or fails. */
+void write_uint64(OutputStream *os, uint64_t i);
+
+/* Writes a big-endian 32-bit unsigned integer to an output stream or fails. */
+void write_uint32(OutputStream *os, uint32_t i);
+
+/* Writes a big-endian 16-bit unsigned integer to an output stream or fails. */
+void write_uint16(OutputStream *os, uint16_t i);
+
+/* Seeks to an absolute position in an output stream or fails. */
+void seek_output(OutputStream *os, off_t pos);
+
+/* Reads data from an output stream (at its current position) or fails. */
+void read_output(OutputStream *os, void *buf, size_t len);
+
+/* Starts computing an MD5 digest of all data subsequently written to `os' by
+   the functions above, and resets the count of bytes written to zero. */
+void start_output_digest(OutputStream *os);
+
+/* Returns the number of bytes written since start_output_digest() was called,
+   and stores the digest of those bytes in `digest' (if it is non-NULL). */
+off_t get_output_digest(OutputStream *os, uint8_t digest[DS]);
+
+/* Stores the value of a long option given on the command line (as
+   "name=value"). Returns false if the option is not one of the space-separated
+   names in `allowed'. */
+bool set_option(const char *arg, const char *allowed);
+
+/* Returns the value of a long option given on the command line as
+   --name=value, or NULL if it was not given. */
+const char *get_option(const char *name);
+
+/* Policy for caching data of input files and temporary files:
+   IO_CACHED    reads through the page cache (the default);
+   IO_STREAM    drops data read sequentially from the page cache, and data
+                spilled to temporary files after writing it;
+   IO_DIRECT    like IO_STREAM, but reads large uncompressed input files with
+                direct I/O while they are read sequentially.
+   Data of input files that are read at random (e.g. file 1 when patching) is
+   kept in the cache, since it may be read again. The policy applies to files
+   opened after it is set. */
+enum IoPolicy { IO_CACHED, IO_STREAM, IO_DIRECT };
+extern enum IoPolicy io_policy;
 
-/* Writes a big-endian 32-bit unsigned integer to standard output or aborts. */
-void write_uint32(uint32_t i);
+/* Sets the I/O policy by name ("cached", "stream" or "direct"). Returns false
+   if the name is invalid. */
+bool set_io_policy(const char *name);
 
-/* Writes a big-endian 16-bit unsigned integer to standard output or aborts. */
-void write_uint16(uint16_t i);
+/* Drops the contents of a temporary file from the page cache, after writing
+   the data buffered in memory, unless the I/O policy is IO_CACHED. */
+void release_cache(FILE *fp);
 
 /* Write the hexidecimal representation of the `size` bytes pointed to by `data`
    to the buffer `str` which must have room for at least 2*size + 1 bytes. */
@@ -0,0 +1,535 @@
+#include "common.h"
+#include "libtardiff.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Serves diff, patch and verify requests over a Unix socket, using indices of
+   a fixed set of base files that are built once, when the server starts, and
+   kept for its lifetime (in memory and memory-mapped temporary files).
+
+   A client sends a request line "<command> <name>\n", where the command is
+   diff, patch or verify and the name identifies a base file, followed by its
+   input (file 2, or a differences file), and then shuts down its side of the
+   connection. The server streams its output back as chunks, each preceded by
+   its length as a 32-bit big-endian integer, followed by an empty chunk and a
+   status line, which is "OK" or "ERROR <message>". Since output is produced
+   while input is read, the client must send and receive concurrently.
+
+   Requests are served by a pool of workers. When a memory budget is given,
+   the number of workers is limited so that the indices, plus JOB_MEMORY for
+   each worker, fit within it. */
+
+#define CHUNK_SIZE  65536           /* max. bytes per chunk of output */
+#define JOB_MEMORY  (16 << 20)      /* memory reserved per worker */
+#define MAX_LINE    300             /* max. length of request/status lines */
+
+/* A base file that requests apply to */
+typedef struct Base
+{
+    const char   *name;
+    const char   *path;
+    struct stat  st;                /* status of the file when indexed */
+    TardiffIndex *index;
+} Base;
+
+typedef struct Server
+{
+    int  fd;                        /* listening socket */
+    Base *bases;
+    int  nbase;
+    bool tar_mode, wide_format;
+} Server;
+
+/* Output stream that sends data to a socket in chunks */
+typedef struct ChunkStream
+{
+    OutputStream os;
+    int          fd;
+    size_t       len;               /* number of bytes buffered */
+    char         buf[CHUNK_SIZE];
+} ChunkStream;
+
+/* Input stream that receives data from a socket, until the peer shuts down
+   its side of the connection */
+typedef struct SocketStream
+{
+    InputStream is;
+    int         fd;
+} SocketStream;
+
+/* Request being sent by a client */
+typedef struct Upload
+{
+    int         fd;
+    InputStream *is;
+} Upload;
+
+static const char *socket_path;     /* removed when the server is stopped */
+
+static bool send_all(int fd, const void *buf, size_t len)
+{
+    ssize_t res;
+
+    while (len > 0)
+    {
+        res = send(fd, buf, len, MSG_NOSIGNAL);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) return false;
+        buf  = (const char*)buf + res;
+        len -= res;
+    }
+    return true;
+}
+
+/* Receives up to `len' bytes, and returns the number of bytes received, which
+   is less than `len' only at the end of the stream or on error. */
+static size_t recv_all(int fd, void *buf, size_t len)
+{
+    size_t total = 0;
+    ssize_t res;
+
+    while (total < len)
+    {
+        res = recv(fd, (char*)buf + total, len - total, 0);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) break;
+        total += res;
+    }
+    return total;
+}
+
+/* Receives a line (without the newline character) one byte at a time, so no
+   data following it is consumed. */
+static bool recv_line(int fd, char line[MAX_LINE])
+{
+    size_t len = 0;
+
+    while (len < MAX_LINE)
+    {
+        if (recv_all(fd, &line[len], 1) != 1) return false;
+        if (line[len] == '\n')
+        {
+            line[len] = '\0';
+            return true;
+        }
+        ++len;
+    }
+    return false;
+}
+
+static bool send_chunk(ChunkStream *cs)
+{
+    uint8_t header[4];
+    bool ok;
+
+    header[0] = cs->len >> 24;
+    header[1] = cs->len >> 16;
+    header[2] = cs->len >> 8;
+    header[3] = cs->len;
+    ok = send_all(cs->fd, header, 4) && send_all(cs->fd, cs->buf, cs->len);
+    cs->len = 0;
+    return ok;
+}
+
+static bool CS_write(ChunkStream *cs, const void *buf, size_t len)
+{
+    size_t n;
+
+    while (len > 0)
+    {
+        if (cs->len == CHUNK_SIZE && !send_chunk(cs)) return false;
+        n = CHUNK_SIZE - cs->len;
+        if (n > len) n = len;
+        memcpy(cs->buf + cs->len, buf, n);
+        cs->len += n;
+        buf  = (const char*)buf + n;
+        len -= n;
+    }
+    return true;
+}
+
+static size_t SS_read(SocketStream *ss, void *buf, size_t len)
+{
+    return recv_all(ss->fd, buf, len);
+}
+
+static bool SS_seek(SocketStream *ss, off_t pos)
+{   /* seeking not supported */
+    (void)ss;
+    (void)pos;
+    return false;
+}
+
+static off_t SS_size(SocketStream *ss)
+{   /* size not known */
+    (void)ss;
+    return -1;
+}
+
+static bool null_write(OutputStream *os, const void *buf, size_t len)
+{   /* discard output */
+    (void)os;
+    (void)buf;
+    (void)len;
+    return true;
+}
+
+/* Sends the output buffered, the end of the output, and the status line.
+   Multi-line error messages are joined with semicolons to fit on one line. */
+static void send_status(ChunkStream *cs, const char *error)
+{
+    char line[MAX_LINE + 8], *p;
+
+    if (cs->len > 0 && !send_chunk(cs)) return;
+    if (!send_chunk(cs)) return;
+    snprintf( line, sizeof(line), "%s%.*s", error != NULL ? "ERROR " : "OK",
+              MAX_LINE, error != NULL ? error : "" );
+    for (p = line; *p != '\0'; ++p) if (*p == '\n') *p = ';';
+    strcat(line, "\n");
+    send_all(cs->fd, line, strlen(line));
+}
+
+static Base *find_base(Server *srv, const char *name)
+{
+    int n;
+
+    for (n = 0; n < srv->nbase; ++n)
+    {
+        if (strcmp(srv->bases[n].name, name) == 0) return &srv->bases[n];
+    }
+    return NULL;
+}
+
+static void handle_request(Server *srv, int fd)
+{
+    char line[MAX_LINE], *name = NULL;
+    ChunkStream *cs;
+    SocketStream ss;
+    OutputStream null_os;
+    InputStream *is_file1;
+    TardiffContext tc;
+    struct stat st;
+    Base *base = NULL;
+    bool ok = false;
+
+    cs = calloc(1, sizeof(ChunkStream));
+    if (cs == NULL) return;
+    cs->os.write = (void*)CS_write;
+    cs->os.fd    = -1;
+    cs->fd       = fd;
+    ss.is.read   = (void*)SS_read;
+    ss.is.seek   = (void*)SS_seek;
+    ss.is.size   = (void*)SS_size;
+    ss.is.close  = NULL;
+    ss.fd        = fd;
+    memset(&null_os, 0, sizeof(null_os));
+    null_os.write = null_write;
+    null_os.fd    = -1;
+
+    tardiff_init(&tc);
+    tc.tar_mode    = srv->tar_mode;
+    tc.wide_format = srv->wide_format;
+
+    if (recv_line(fd, line) && (name = strchr(line, ' ')) != NULL)
+    {
+        *name++ = '\0';
+        base = find_base(srv, name);
+    }
+    if (name == NULL)
+    {
+        snprintf(tc.error, sizeof(tc.error), "Invalid request!");
+    }
+    else
+    if (base == NULL)
+    {
+        snprintf(tc.error, sizeof(tc.error), "Unknown base file: %s", name);
+    }
+    else
+    if ( stat(base->path, &st) != 0 || st.st_size != base->st.st_size ||
+         st.st_mtime != base->st.st_mtime )
+    {
+        snprintf( tc.error, sizeof(tc.error),
+                  "Base file '%s' changed since it was indexed!", name );
+    }
+    else
+    if (strcmp(line, "diff") == 0)
+    {
+        ok = tardiff_diff_index(&tc, base->index, &ss.is, &cs->os);
+    }
+    else
+    if (strcmp(line, "patch") == 0 || strcmp(line, "verify") == 0)
+    {
+        is_file1 = OpenFileInputStream(base->path);
+        if (is_file1 == NULL)
+        {
+            snprintf( tc.error, sizeof(tc.error),
+                      "Cannot open '%s' for reading!", base->path );
+        }
+        else
+        {
+            ok = tardiff_patch( &tc, is_file1, &ss.is,
+                                strcmp(line, "patch") == 0 ? &cs->os
+                                                           : &null_os );
+            is_file1->close(is_file1);
+        }
+    }
+    else
+    {
+        snprintf(tc.error, sizeof(tc.error), "Unknown command: %.200s", line);
+    }
+    send_status(cs, ok ? NULL : tc.error);
+    free(cs);
+}
+
+static void *serve_requests(void *arg)
+{
+    Server *srv = arg;
+    int fd;
+
+    for (;;)
+    {
+        fd = accept(srv->fd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fail("accept() failed!");
+        }
+        handle_request(srv, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static void stop_server(int sig)
+{
+    unlink(socket_path);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void make_address(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+        fail("Socket path too long: %s", path);
+    }
+    strcpy(addr->sun_path, path);
+}
+
+/* Parses a positive integer option, or fails. */
+static unsigned long long parse_count(const char *name, const char *value)
+{
+    unsigned long long count;
+    char *end;
+
+    count = strtoull(value, &end, 10);
+    if (*end != '\0' || end == value || count == 0)
+    {
+        fail("Invalid value for --%s: %s", name, value);
+    }
+    return count;
+}
+
+/* Indexes the base files (given as <name>=<file>) and serves requests on the
+   socket at `path' until the process is stopped. */
+static void serve(const char *path, char **specs, int nbase, const char *flags)
+{
+    Server srv;
+    Base *base;
+    InputStream *is;
+    TardiffContext tc;
+    struct sockaddr_un addr;
+    struct stat st;
+    unsigned long long memory = 0, budget, nworker;
+    pthread_t thread;
+    char *sep;
+    int n;
+
+    nworker = (get_option("workers") != NULL)
+            ? parse_count("workers", get_option("workers"))
+            : (unsigned long long)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworker < 1) nworker = 1;
+
+    srv.tar_mode    = strchr(flags, 't') != NULL;
+    srv.wide_format = strchr(flags, 'w') != NULL;
+    srv.nbase       = nbase;
+    srv.bases       = calloc(nbase, sizeof(Base));
+    if (srv.bases == NULL) fail("Out of memory!");
+    tardiff_init(&tc);
+    tc.tar_mode = srv.tar_mode;
+    for (n = 0; n < nbase; ++n)
+    {
+        base = &srv.bases[n];
+        sep = strchr(specs[n], '=');
+        if (sep == NULL || sep == specs[n])
+        {
+            fail("Invalid base file: %s (expected <name>=<file>)", specs[n]);
+        }
+        *sep = '\0';
+        base->name = specs[n];
+        base->path = sep + 1;
+        if (find_base(&srv, base->name) != base)
+        {
+            fail("Duplicate base file name: %s", base->name);
+        }
+        is = OpenFileInputStream(base->path);
+        if (is == NULL || stat(base->path, &base->st) != 0)
+        {
+            fail("Cannot open '%s' for reading!", base->path);
+        }
+        base->index = tardiff_index_create(&tc, is);
+        is->close(is);
+        if (base->index == NULL) fail("%s: %s", base->path, tc.error);
+        memory += tardiff_index_memory(base->index);
+        fprintf(stderr, "Indexed %s (%s).\n", base->name, base->path);
+    }
+
+    if (get_option("memory") != NULL)
+    {
+        budget = parse_count("memory", get_option("memory")) << 20;
+        if (memory + JOB_MEMORY > budget)
+        {
+            fail( "Memory budget too small (indices use %llu MB)!",
+                  memory >> 20 );
+        }
+        if (nworker > (budget - memory)/JOB_MEMORY)
+        {
+            nworker = (budget - memory)/JOB_MEMORY;
+        }
+    }
+
+    /* Replace a socket left behind by a previous server */
+    make_address(&addr, path);
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+    srv.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (srv.fd < 0) fail("Cannot create socket!");
+    if (bind(srv.fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        fail("Cannot bind socket to '%s'!", path);
+    }
+    socket_path = path;
+    signal(SIGINT, stop_server);
+    signal(SIGTERM, stop_server);
+    if (listen(srv.fd, SOMAXCONN) != 0) fail("Cannot listen on socket!");
+    fprintf( stderr, "Serving %d base file(s) (%llu MB of indices) with %llu "
+             "worker(s) on %s.\n", nbase, memory >> 20, nworker, path );
+
+    /* The calling thread is one of the workers */
+    while (--nworker > 0)
+    {
+        if (pthread_create(&thread, NULL, serve_requests, &srv) != 0)
+        {
+            fail("Cannot create thread!");
+        }
+        pthread_detach(thread);
+    }
+    serve_requests(&srv);
+}
+
+static void *upload(void *arg)
+{
+    Upload *up = arg;
+    char buf[CHUNK_SIZE];
+    size_t len;
+
+    while ((len = up->is->read(up->is, buf, sizeof(buf))) > 0)
+    {
+        if (!send_all(up->fd, buf, len)) break;
+    }
+    shutdown(up->fd, SHUT_WR);
+    return NULL;
+}
+
+/* Sends a request with the given input file, and writes the output received
+   to the given output file (unless it is NULL). */
+static int request( const char *path, const char *command, const char *name,
+                    const char *input, const char *output )
+{
+    struct sockaddr_un addr;
+    char line[MAX_LINE], buf[CHUNK_SIZE];
+    uint8_t header[4];
+    pthread_t thread;
+    Upload up;
+    size_t len;
+
+    if (strlen(command) + strlen(name) + 2 > MAX_LINE || strchr(name, '\n'))
+    {
+        fail("Invalid base file name: %s", name);
+    }
+    up.is = (strcmp(input, "-") == 0) ? OpenStdinInputStream()
+                                      : OpenFileInputStream(input);
+    if (up.is == NULL) fail("Cannot open '%s' for reading!", input);
+
+    make_address(&addr, path);
+    up.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ( up.fd < 0 ||
+         connect(up.fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 )
+    {
+        fail("Cannot connect to '%s'!", path);
+    }
+    snprintf(line, sizeof(line), "%s %s\n", command, name);
+    if (!send_all(up.fd, line, strlen(line))) fail("Write failed!");
+    if (pthread_create(&thread, NULL, upload, &up) != 0)
+    {
+        fail("Cannot create thread!");
+    }
+
+    if (output != NULL && strcmp(output, "-") != 0) redirect_stdout(output);
+    for (;;)
+    {
+        if (recv_all(up.fd, header, 4) != 4) fail("Connection lost!");
+        len = parse_uint32(header);
+        if (len == 0) break;
+        if (len > CHUNK_SIZE || recv_all(up.fd, buf, len) != len)
+        {
+            fail("Connection lost!");
+        }
+        if (output != NULL && fwrite(buf, 1, len, stdout) != len)
+        {
+            fail("Write failed!");
+        }
+    }
+    if (!recv_line(up.fd, line)) fail("Connection lost!");
+    pthread_join(thread, NULL);
+    close(up.fd);
+    up.is->close(up.is);
+    if (fflush(stdout) != 0) fail("Write failed!");
+
+    if (strcmp(line, "OK") != 0)
+    {
+        fprintf( stderr, "%s\n", strncmp(line, "ERROR ", 6) == 0
+                                 ? line + 6 : line );
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int tardiffd(int argc, char *argv[], const char *flags)
+{
+    const char *command = argv[1];
+
+    if (strcmp(command, "serve") == 0 && argc >= 3)
+    {
+        serve(argv[0], argv + 2, argc - 2, flags);
+    }
+    else
+    if ( (strcmp(command, "diff") == 0 || strcmp(command, "patch") == 0) &&
+         argc == 5 )
+    {
+        return request(argv[0], command, argv[2], argv[3], argv[4]);
+    }
+    else
+    if (strcmp(command, "verify") == 0 && argc == 4)
+    {
+        return request(argv[0], command, argv[2], argv[3], NULL);
+    }
+    fprintf(stderr, "Invalid daemon command: %s (see usage)\n", command);
+    return EXIT_FAILURE;
+}
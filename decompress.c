@@ -0,0 +1,653 @@
+#include "decompress.h"
+#include <lzma.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef WITH_ZSTD
+#define ZSTD_STATIC_LINKING_ONLY    /* for ZSTD_getFrameHeader() */
+#include <zstd.h>
+#endif
+
+#define FRAME_MEMORY    (512 << 20) /* max. memory for decompressed frames */
+#define SEQUENTIAL      4           /* frames read in order before those
+                                       behind the cursor are freed */
+#define STREAM_BUFFER   (1 << 16)   /* bytes read at a time when streaming */
+
+/* A frame (xz block or zstd frame) that can be decompressed independently */
+typedef struct Frame
+{
+    off_t       coff;       /* offset of the compressed frame in the file */
+    size_t      csize;      /* compressed size */
+    off_t       uoff;       /* offset of the decompressed data */
+    size_t      usize;      /* decompressed size */
+    lzma_check  check;      /* integrity check (xz only) */
+} Frame;
+
+enum SlotState { SLOT_EMPTY, SLOT_QUEUED, SLOT_BUSY, SLOT_READY, SLOT_FAILED };
+
+/* Buffer holding a decompressed frame */
+typedef struct Slot
+{
+    enum SlotState  state;
+    size_t          frame;  /* index of the frame held */
+    uint64_t        used;   /* time of last use (for eviction) */
+    char            *data;  /* decompressed frame (allocated when used) */
+} Slot;
+
+/* Seekable stream of frames, which are decompressed by a pool of threads. The
+   reading thread queues the frame it needs, and when it reads sequentially,
+   the frames following it. Frames stay in their slots until evicted, so reads
+   at random that hit a recently used frame are served from memory. Slots are
+   allocated when first used, and once SEQUENTIAL frames have been read in
+   order, each frame is freed when the next one is read, so sequential reads
+   use memory for the frames decoded ahead only. */
+typedef struct FrameStream
+{
+    InputStream     is;
+    int             fd;
+    bool            (*decode)(const Frame *frame, const uint8_t *in, char *out);
+    Frame           *frames;
+    size_t          nframes, capacity;
+    off_t           size;       /* total decompressed size */
+    off_t           pos;        /* current position */
+    size_t          next;       /* frame following the one read last */
+    size_t          sequential; /* number of frames read in order */
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    Slot            *slots;
+    size_t          nslots;
+    size_t          slot_size;  /* size of the largest frame */
+    size_t          ahead;      /* number of frames to decode ahead */
+    uint64_t        clock;
+    bool            stop;       /* should the threads terminate? */
+    pthread_t       *threads;
+    size_t          nthreads;
+} FrameStream;
+
+/* Non-seekable stream decompressed as a whole */
+typedef struct CodecStream
+{
+    InputStream     is;
+    int             fd;
+    uint8_t         in[STREAM_BUFFER];
+    bool            eof;        /* has the end of the file been reached? */
+    lzma_stream     xz;
+#ifdef WITH_ZSTD
+    ZSTD_DStream    *zds;
+    ZSTD_inBuffer   zin;
+    bool            zframe;     /* is a zstd frame incomplete? */
+#endif
+} CodecStream;
+
+static bool read_at(int fd, void *buf, size_t len, off_t pos)
+{
+    ssize_t res;
+
+    while (len > 0)
+    {
+        res = pread(fd, buf, len, pos);
+        if (res <= 0) return false;
+        buf  = (char*)buf + res;
+        len -= res;
+        pos += res;
+    }
+    return true;
+}
+
+static bool add_frame( FrameStream *fs, off_t coff, uint64_t csize,
+                       uint64_t usize, lzma_check check )
+{
+    Frame *frame;
+
+    if (usize == 0) return true;
+    if (csize > SIZE_MAX || usize > FRAME_MEMORY/2) return false;
+    if (fs->nframes == fs->capacity)
+    {
+        fs->capacity = fs->capacity ? 2*fs->capacity : 64;
+        frame = realloc(fs->frames, fs->capacity*sizeof(Frame));
+        if (frame == NULL) return false;
+        fs->frames = frame;
+    }
+    frame = &fs->frames[fs->nframes++];
+    frame->coff  = coff;
+    frame->csize = csize;
+    frame->uoff  = fs->size;
+    frame->usize = usize;
+    frame->check = check;
+    fs->size += usize;
+    return true;
+}
+
+/* Returns the index of the frame containing position `pos' */
+static size_t locate_frame(FrameStream *fs, off_t pos)
+{
+    size_t lo = 0, hi = fs->nframes, mid;
+
+    while (hi - lo > 1)
+    {
+        mid = lo + (hi - lo)/2;
+        if (fs->frames[mid].uoff <= pos) lo = mid; else hi = mid;
+    }
+    return lo;
+}
+
+static Slot *find_slot(FrameStream *fs, size_t f)
+{
+    size_t n;
+
+    for (n = 0; n < fs->nslots; ++n)
+    {
+        if (fs->slots[n].state != SLOT_EMPTY && fs->slots[n].frame == f)
+        {
+            return &fs->slots[n];
+        }
+    }
+    return NULL;
+}
+
+/* Returns the least recently used slot that is not being decoded into and
+   does not hold a frame in the range [lo:hi), or NULL if there is none. */
+static Slot *free_slot(FrameStream *fs, size_t lo, size_t hi)
+{
+    Slot *slot, *best = NULL;
+
+    for (slot = fs->slots; slot < fs->slots + fs->nslots; ++slot)
+    {
+        if (slot->state == SLOT_BUSY) continue;
+        if ( slot->state != SLOT_EMPTY &&
+             slot->frame >= lo && slot->frame < hi ) continue;
+        if (best == NULL || slot->used < best->used) best = slot;
+    }
+    return best;
+}
+
+static void queue_frame(FrameStream *fs, Slot *slot, size_t f)
+{
+    slot->state = SLOT_QUEUED;
+    slot->frame = f;
+    slot->used  = ++fs->clock;
+}
+
+/* Returns the slot holding frame `f', after decoding it if necessary. */
+static Slot *get_frame(FrameStream *fs, size_t f)
+{
+    Slot *slot, *prev, *ahead;
+    size_t g;
+
+    pthread_mutex_lock(&fs->lock);
+    slot = find_slot(fs, f);
+    if (slot == NULL)
+    {
+        /* There are more slots than threads, so some slot is not busy */
+        slot = free_slot(fs, 0, 0);
+        assert(slot != NULL);
+        queue_frame(fs, slot, f);
+    }
+    slot->used = ++fs->clock;
+    if (f != fs->next && f + 1 != fs->next) fs->sequential = 0;
+    if (f == fs->next)
+    {
+        /* Reading sequentially; free the previous frame if it is unlikely to
+           be read again, and decode the following frames ahead */
+        ++fs->sequential;
+        prev = (f > 0 && fs->sequential >= SEQUENTIAL)
+             ? find_slot(fs, f - 1) : NULL;
+        if (prev != NULL && prev->state == SLOT_READY)
+        {
+            free(prev->data);
+            prev->data  = NULL;
+            prev->state = SLOT_EMPTY;
+        }
+        for (g = f + 1; g < fs->nframes && g <= f + fs->ahead; ++g)
+        {
+            if (find_slot(fs, g) != NULL) continue;
+            ahead = free_slot(fs, f, f + fs->ahead + 1);
+            if (ahead == NULL) break;
+            queue_frame(fs, ahead, g);
+        }
+    }
+    fs->next = f + 1;
+    pthread_cond_broadcast(&fs->cond);
+    while (slot->state == SLOT_QUEUED || slot->state == SLOT_BUSY)
+    {
+        pthread_cond_wait(&fs->cond, &fs->lock);
+    }
+    if (slot->state == SLOT_FAILED)
+    {
+        slot->state = SLOT_EMPTY;
+        slot = NULL;
+    }
+    pthread_mutex_unlock(&fs->lock);
+    return slot;
+}
+
+static void *decode_frames(void *arg)
+{
+    FrameStream *fs = arg;
+    Slot *slot, *s;
+    const Frame *frame;
+    uint8_t *in = NULL;
+    size_t in_size = 0;
+    bool ok;
+
+    pthread_mutex_lock(&fs->lock);
+    while (!fs->stop)
+    {
+        /* Take the first queued frame */
+        slot = NULL;
+        for (s = fs->slots; s < fs->slots + fs->nslots; ++s)
+        {
+            if ( s->state == SLOT_QUEUED &&
+                 (slot == NULL || s->frame < slot->frame) ) slot = s;
+        }
+        if (slot == NULL)
+        {
+            pthread_cond_wait(&fs->cond, &fs->lock);
+            continue;
+        }
+        slot->state = SLOT_BUSY;
+        frame = &fs->frames[slot->frame];
+        pthread_mutex_unlock(&fs->lock);
+
+        if (frame->csize > in_size)
+        {
+            free(in);
+            in = malloc(frame->csize);
+            in_size = (in != NULL) ? frame->csize : 0;
+        }
+        if (slot->data == NULL) slot->data = malloc(fs->slot_size);
+        ok = in != NULL && slot->data != NULL &&
+             read_at(fs->fd, in, frame->csize, frame->coff) &&
+             fs->decode(frame, in, slot->data);
+
+        pthread_mutex_lock(&fs->lock);
+        slot->state = ok ? SLOT_READY : SLOT_FAILED;
+        pthread_cond_broadcast(&fs->cond);
+    }
+    pthread_mutex_unlock(&fs->lock);
+    free(in);
+    return NULL;
+}
+
+static size_t FR_read(FrameStream *fs, void *buf, size_t len)
+{
+    size_t total = 0, f, n;
+    const Frame *frame;
+    Slot *slot;
+
+    while (total < len && fs->pos < fs->size)
+    {
+        f = locate_frame(fs, fs->pos);
+        slot = get_frame(fs, f);
+        if (slot == NULL) fail("Decompression failed!");
+        frame = &fs->frames[f];
+        n = frame->uoff + frame->usize - fs->pos;
+        if (n > len - total) n = len - total;
+        memcpy((char*)buf + total, slot->data + (fs->pos - frame->uoff), n);
+        total   += n;
+        fs->pos += n;
+    }
+    return total;
+}
+
+static bool FR_seek(FrameStream *fs, off_t pos)
+{
+    if (pos < 0 || pos > fs->size) return false;
+    fs->pos = pos;
+    return true;
+}
+
+static off_t FR_size(FrameStream *fs)
+{
+    return fs->size;
+}
+
+/* Stops the threads and frees the stream, but leaves the file open. */
+static void free_frames(FrameStream *fs)
+{
+    size_t n;
+
+    if (fs == NULL) return;
+    if (fs->nthreads > 0)
+    {
+        pthread_mutex_lock(&fs->lock);
+        fs->stop = true;
+        pthread_cond_broadcast(&fs->cond);
+        pthread_mutex_unlock(&fs->lock);
+        for (n = 0; n < fs->nthreads; ++n) pthread_join(fs->threads[n], NULL);
+    }
+    if (fs->slots != NULL)
+    {
+        for (n = 0; n < fs->nslots; ++n) free(fs->slots[n].data);
+        pthread_mutex_destroy(&fs->lock);
+        pthread_cond_destroy(&fs->cond);
+    }
+    free(fs->threads);
+    free(fs->slots);
+    free(fs->frames);
+    free(fs);
+}
+
+static void FR_close(FrameStream *fs)
+{
+    close(fs->fd);
+    free_frames(fs);
+}
+
+/* Allocates slots and starts the threads that decode frames. Returns false if
+   the frames are too large or resources are exhausted. */
+static bool start_frames(FrameStream *fs)
+{
+    size_t max_usize = 1, n;
+    long ncpu;
+
+    for (n = 0; n < fs->nframes; ++n)
+    {
+        if (fs->frames[n].usize > max_usize) max_usize = fs->frames[n].usize;
+    }
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) ncpu = 1;
+
+    /* Use as many slots as fit in memory (up to one per frame), since frames
+       read at random are likely to be read again */
+    fs->nslots = FRAME_MEMORY/max_usize;
+    if (fs->nslots > fs->nframes + 1) fs->nslots = fs->nframes + 1;
+    if (fs->nslots < 2) return false;
+    fs->ahead = (fs->nslots - 1 < (size_t)ncpu) ? fs->nslots - 1 : (size_t)ncpu;
+    fs->slot_size = max_usize;
+
+    fs->slots = calloc(fs->nslots, sizeof(Slot));
+    fs->threads = malloc(fs->ahead*sizeof(pthread_t));
+    if (fs->slots == NULL || fs->threads == NULL) return false;
+    pthread_mutex_init(&fs->lock, NULL);
+    pthread_cond_init(&fs->cond, NULL);
+
+    /* Leave at least one slot that is not decoded into */
+    while ( fs->nthreads < fs->ahead &&
+            pthread_create( &fs->threads[fs->nthreads], NULL,
+                            decode_frames, fs ) == 0 ) ++fs->nthreads;
+    return fs->nthreads > 0;
+}
+
+static FrameStream *open_frames( int fd,
+    bool (*decode)(const Frame *frame, const uint8_t *in, char *out) )
+{
+    FrameStream *fs;
+
+    fs = calloc(1, sizeof(FrameStream));
+    if (fs == NULL) return NULL;
+    fs->is.read  = (void*)FR_read;
+    fs->is.seek  = (void*)FR_seek;
+    fs->is.size  = (void*)FR_size;
+    fs->is.close = (void*)FR_close;
+    fs->fd       = fd;
+    fs->decode   = decode;
+    return fs;
+}
+
+static size_t CS_read_xz(CodecStream *cs, void *buf, size_t len)
+{
+    lzma_ret ret = LZMA_OK;
+    ssize_t res;
+
+    cs->xz.next_out  = buf;
+    cs->xz.avail_out = len;
+    while (cs->xz.avail_out > 0 && ret == LZMA_OK)
+    {
+        if (cs->xz.avail_in == 0 && !cs->eof)
+        {
+            res = read(cs->fd, cs->in, sizeof(cs->in));
+            if (res < 0) fail("Read failed!");
+            cs->eof = (res == 0);
+            cs->xz.next_in  = cs->in;
+            cs->xz.avail_in = res;
+        }
+        ret = lzma_code(&cs->xz, cs->eof ? LZMA_FINISH : LZMA_RUN);
+        if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+        {
+            fail("Decompression failed!");
+        }
+    }
+    return len - cs->xz.avail_out;
+}
+
+static bool CS_seek(CodecStream *cs, off_t pos)
+{   /* seeking not supported */
+    (void)cs;
+    (void)pos;
+    return false;
+}
+
+static off_t CS_size(CodecStream *cs)
+{   /* size not known */
+    (void)cs;
+    return -1;
+}
+
+static void CS_close(CodecStream *cs)
+{
+    lzma_end(&cs->xz);
+#ifdef WITH_ZSTD
+    ZSTD_freeDStream(cs->zds);
+#endif
+    close(cs->fd);
+    free(cs);
+}
+
+static CodecStream *open_codec(int fd)
+{
+    CodecStream *cs;
+    lzma_stream init = LZMA_STREAM_INIT;
+
+    cs = calloc(1, sizeof(CodecStream));
+    if (cs == NULL) return NULL;
+    cs->is.seek  = (void*)CS_seek;
+    cs->is.size  = (void*)CS_size;
+    cs->is.close = (void*)CS_close;
+    cs->fd       = fd;
+    cs->xz       = init;
+    return cs;
+}
+
+/* Determines the blocks of an xz file from the indices of its streams. */
+static bool xz_frames(FrameStream *fs)
+{
+    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_index *index = NULL;
+    lzma_index_iter iter;
+    lzma_ret ret = LZMA_OK;
+    uint8_t buf[BUFSIZ];
+    struct stat st;
+    off_t pos = 0;
+    ssize_t res;
+    bool ok = true;
+
+    if (fstat(fs->fd, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+    if ( lzma_file_info_decoder( &strm, &index, UINT64_MAX,
+                                 st.st_size ) != LZMA_OK ) return false;
+    do {
+        if (strm.avail_in == 0)
+        {
+            res = pread(fs->fd, buf, sizeof(buf), pos);
+            if (res <= 0) break;
+            strm.next_in  = buf;
+            strm.avail_in = res;
+            pos += res;
+        }
+        ret = lzma_code(&strm, LZMA_RUN);
+        if (ret == LZMA_SEEK_NEEDED)
+        {
+            pos = strm.seek_pos;
+            strm.avail_in = 0;
+        }
+    } while (ret == LZMA_OK || ret == LZMA_SEEK_NEEDED);
+    lzma_end(&strm);
+    if (ret != LZMA_STREAM_END) return false;
+
+    lzma_index_iter_init(&iter, index);
+    while (ok && !lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK))
+    {
+        ok = add_frame( fs, iter.block.compressed_file_offset,
+                        iter.block.total_size, iter.block.uncompressed_size,
+                        iter.stream.flags->check );
+    }
+    lzma_index_end(index, NULL);
+    return ok;
+}
+
+static bool xz_decode(const Frame *frame, const uint8_t *in, char *out)
+{
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block block;
+    size_t in_pos, out_pos = 0;
+    bool ok;
+
+    memset(&block, 0, sizeof(block));
+    block.version     = 1;
+    block.check       = frame->check;
+    block.filters     = filters;
+    block.header_size = lzma_block_header_size_decode(in[0]);
+    if ( block.header_size > frame->csize ||
+         lzma_block_header_decode(&block, NULL, in) != LZMA_OK ) return false;
+    in_pos = block.header_size;
+    ok = lzma_block_buffer_decode( &block, NULL, in, &in_pos, frame->csize,
+                                   (uint8_t*)out, &out_pos,
+                                   frame->usize ) == LZMA_OK &&
+         out_pos == frame->usize;
+    lzma_filters_free(filters, NULL);
+    return ok;
+}
+
+InputStream *OpenXzInputStream(int fd)
+{
+    FrameStream *fs;
+    CodecStream *cs;
+    lzma_mt mt;
+
+    fs = open_frames(fd, xz_decode);
+    if (fs != NULL && xz_frames(fs) && start_frames(fs)) return &fs->is;
+    free_frames(fs);
+
+    /* Decompress as a single stream. liblzma decodes blocks in parallel if
+       their sizes are stored in the block headers. */
+    cs = open_codec(fd);
+    if (cs == NULL) return NULL;
+    memset(&mt, 0, sizeof(mt));
+    mt.flags   = LZMA_CONCATENATED;
+    mt.threads = lzma_cputhreads();
+    if (mt.threads == 0) mt.threads = 1;
+    mt.memlimit_threading = lzma_physmem()/4;
+    mt.memlimit_stop      = UINT64_MAX;
+    if (lzma_stream_decoder_mt(&cs->xz, &mt) != LZMA_OK)
+    {
+        free(cs);
+        return NULL;
+    }
+    cs->is.read = (void*)CS_read_xz;
+    return &cs->is;
+}
+
+#ifdef WITH_ZSTD
+/* Determines the frames of a zstd file by walking the headers of its frames
+   and blocks. Fails if the decompressed size of a frame is unknown. */
+static bool zstd_frames(FrameStream *fs)
+{
+    uint8_t buf[ZSTD_FRAMEHEADERSIZE_MAX];
+    ZSTD_frameHeader zfh;
+    struct stat st;
+    off_t coff = 0, pos;
+    ssize_t res;
+    uint32_t header;
+
+    if (fstat(fs->fd, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+    while (coff < st.st_size)
+    {
+        res = pread(fs->fd, buf, sizeof(buf), coff);
+        if (res <= 0 || ZSTD_getFrameHeader(&zfh, buf, res) != 0) return false;
+        if (zfh.frameType == ZSTD_skippableFrame)
+        {
+            coff += zfh.headerSize + zfh.frameContentSize;
+            continue;
+        }
+        if ( zfh.frameContentSize == ZSTD_CONTENTSIZE_UNKNOWN ||
+             zfh.frameContentSize > FRAME_MEMORY/2 ) return false;
+
+        /* Skip blocks; each has a 3 byte header, and RLE blocks store 1 byte */
+        pos = coff + zfh.headerSize;
+        do {
+            if (!read_at(fs->fd, buf, 3, pos)) return false;
+            header = buf[0] | buf[1] << 8 | (uint32_t)buf[2] << 16;
+            pos += 3 + (((header >> 1)&3) == 1 ? 1 : header >> 3);
+        } while ((header&1) == 0);
+        if (zfh.checksumFlag) pos += 4;
+        if ( pos > st.st_size || !add_frame( fs, coff, pos - coff,
+                                             zfh.frameContentSize, 0 ) )
+        {
+            return false;
+        }
+        coff = pos;
+    }
+    return true;
+}
+
+static bool zstd_decode(const Frame *frame, const uint8_t *in, char *out)
+{
+    size_t res;
+
+    res = ZSTD_decompress(out, frame->usize, in, frame->csize);
+    return !ZSTD_isError(res) && res == frame->usize;
+}
+
+static size_t CS_read_zstd(CodecStream *cs, void *buf, size_t len)
+{
+    ZSTD_outBuffer out = { buf, len, 0 };
+    ssize_t res;
+    size_t ret;
+
+    while (out.pos < out.size)
+    {
+        if (cs->zin.pos == cs->zin.size)
+        {
+            if (cs->eof) break;
+            res = read(cs->fd, cs->in, sizeof(cs->in));
+            if (res < 0) fail("Read failed!");
+            if (res == 0)
+            {
+                cs->eof = true;
+                if (cs->zframe) fail("Decompression failed!");
+                break;
+            }
+            cs->zin.src  = cs->in;
+            cs->zin.size = res;
+            cs->zin.pos  = 0;
+        }
+        ret = ZSTD_decompressStream(cs->zds, &out, &cs->zin);
+        if (ZSTD_isError(ret)) fail("Decompression failed!");
+        cs->zframe = (ret != 0);
+    }
+    return out.pos;
+}
+
+InputStream *OpenZstdInputStream(int fd)
+{
+    FrameStream *fs;
+    CodecStream *cs;
+
+    fs = open_frames(fd, zstd_decode);
+    if (fs != NULL && zstd_frames(fs) && start_frames(fs)) return &fs->is;
+    free_frames(fs);
+
+    /* Decompress as a single stream */
+    cs = open_codec(fd);
+    if (cs == NULL) return NULL;
+    cs->zds = ZSTD_createDStream();
+    if (cs->zds == NULL)
+    {
+        free(cs);
+        return NULL;
+    }
+    cs->zframe  = true;
+    cs->is.read = (void*)CS_read_zstd;
+    return &cs->is;
+}
+#endif /* def WITH_ZSTD */
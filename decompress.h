@@ -0,0 +1,23 @@
+#ifndef DECOMPRESS_H_INCLUDED
+#define DECOMPRESS_H_INCLUDED
+
+#include "common.h"
+
+/* Input streams that decompress xz and (when compiled with WITH_ZSTD) zstd
+   files. Both formats consist of frames (xz blocks or zstd frames) that can
+   be decoded independently. When the frame boundaries can be determined (from
+   the index of an xz file, or by walking the headers of zstd frames that
+   store their decompressed size), frames are decoded by a pool of threads
+   ahead of the reader, and the stream is seekable and has a known size.
+   Otherwise, the file is decompressed as a single non-seekable stream.
+
+   Both functions take ownership of the file descriptor `fd' if they succeed,
+   and return NULL if they fail (in which case `fd' is left open). */
+
+InputStream *OpenXzInputStream(int fd);
+
+#ifdef WITH_ZSTD
+InputStream *OpenZstdInputStream(int fd);
+#endif
+
+#endif /* ndef DECOMPRESS_H_INCLUDED */
@@ -0,0 +1,496 @@
+#include "md5blocks.h"
+#include "patch.h"
+#include "progress.h"
+#include "tar.h"
+#include <errno.h>
+#include <unistd.h>
+
+#define RANGE_BLOCKS 256        /* blocks reconstructed at a time (128 KB) */
+#define NO_BLOCK     ((uint64_t)-1)
+
+/* Random access to the output of a differences file. The instruction that
+   generates a given output block is located using the instruction index (if
+   the differences file contains one) and then by reading instruction headers
+   only, so the output can be read without reconstructing it entirely. */
+typedef struct Cursor
+{
+    InputStream      *is_file1;
+    InputStream      *is_diff;
+    InstructionIndex *index;    /* instruction index (or NULL) */
+    enum DiffFormat  format;    /* format of the differences file */
+    off_t            pos1;      /* current position in file 1 (or -1) */
+    off_t            pos_diff;  /* current position in diff file (or -1) */
+    uint64_t         T;         /* first output block of current instruction */
+    off_t            offset;    /* offset of current instruction */
+    off_t            payload;   /* offset of appended blocks (or -1) */
+    Instruction      ins;       /* current instruction */
+    bool             end;       /* end of instructions reached? */
+    ChunkDigests     *chunks;   /* output chunk digests (or NULL) */
+    uint64_t         next;      /* next block of the chunk being checked */
+    MD5_CTX          md5_ctx;   /* digest of the chunk being checked */
+    uint64_t         checked;   /* number of chunks checked */
+    bool             mismatch;  /* did a checked chunk differ? */
+} Cursor;
+
+static void seek_diff(Cursor *c, off_t pos)
+{
+    if (c->pos_diff != pos && !c->is_diff->seek(c->is_diff, pos))
+    {
+        fail("Seek failed.");
+    }
+    c->pos_diff = pos;
+}
+
+static void read_diff(Cursor *c, void *buf, size_t len)
+{
+    read_data(c->is_diff, buf, len);
+    c->pos_diff += len;
+}
+
+/* Reads an edit list from the differences file at the current position. */
+static size_t read_edits(Cursor *c, uint8_t *buf)
+{
+    size_t size = read_edit_list(c->is_diff, buf);
+    if (size == 0)
+    {
+        fail("Invalid diff data.");
+    }
+    c->pos_diff += size;
+    return size;
+}
+
+/* Reads the header of the instruction at `offset', which starts at output
+   block `T'. */
+static void load_instruction(Cursor *c, off_t offset, uint64_t T)
+{
+    uint8_t buf[MAX_INSTRUCTION_LEN];
+
+    seek_diff(c, offset);
+    read_diff(c, buf, INSTRUCTION_LEN(c->format));
+    switch (parse_instruction(buf, c->format, &c->ins))
+    {
+    case INSTRUCTION_OK:
+        c->end = false;
+        break;
+
+    case INSTRUCTION_END:
+        c->end = true;
+        break;
+
+    case INSTRUCTION_INVALID:
+        fail("Invalid diff data.");
+    }
+    c->T       = T;
+    c->offset  = offset;
+    c->payload = c->ins.patched ? -1 : offset + INSTRUCTION_LEN(c->format);
+}
+
+/* Determines the offset of the appended blocks of the current instruction,
+   by skipping over the edit lists of its copied blocks (if any). */
+static off_t payload_offset(Cursor *c)
+{
+    uint8_t buf[MAX_EDIT_LIST];
+    uint32_t n;
+
+    if (c->payload < 0)
+    {
+        seek_diff(c, c->offset + INSTRUCTION_LEN(c->format));
+        for (n = 0; n < c->ins.C; ++n) read_edits(c, buf);
+        c->payload = c->pos_diff;
+    }
+    return c->payload;
+}
+
+/* Reads output block `t' into `data'. Returns false if the output file has
+   fewer than t + 1 blocks. */
+static bool read_block(Cursor *c, uint64_t t, char data[BS])
+{
+    uint8_t buf[MAX_EDIT_LIST];
+    IndexEntry *e;
+    uint64_t i;
+
+    /* Jump to the closest indexed instruction, if it is ahead of the cursor */
+    e = (c->index != NULL) ? InstructionIndex_find(c->index, t) : NULL;
+    if (e != NULL && (t < c->T || e->T > c->T))
+    {
+        load_instruction(c, e->offset, e->T);
+    }
+    else
+    if (t < c->T)
+    {
+        load_instruction(c, MAGIC_LEN, 0);
+    }
+
+    /* Advance to the instruction that generates block `t' */
+    while (!c->end && t - c->T >= (uint64_t)c->ins.C + c->ins.A)
+    {
+        load_instruction( c, payload_offset(c) + (off_t)BS*c->ins.A,
+                          c->T + c->ins.C + c->ins.A );
+    }
+    if (c->end) return false;
+
+    i = t - c->T;
+    if (i < c->ins.C)
+    {
+        /* Copied block */
+        if (c->pos1 != (off_t)(BS*(c->ins.S + i)) &&
+            !c->is_file1->seek(c->is_file1, (off_t)(BS*(c->ins.S + i))))
+        {
+            fail("Seek failed.");
+        }
+        read_data(c->is_file1, data, BS);
+        c->pos1 = (off_t)(BS*(c->ins.S + i + 1));
+        if (c->ins.patched)
+        {
+            seek_diff(c, c->offset + INSTRUCTION_LEN(c->format));
+            do read_edits(c, buf); while (i-- > 0);
+            apply_edit_list(buf, data);
+        }
+    }
+    else
+    {
+        /* Appended block */
+        seek_diff(c, payload_offset(c) + (off_t)BS*(i - c->ins.C));
+        read_diff(c, data, BS);
+    }
+    return true;
+}
+
+/* Reads output block `t' like read_block(), and checks each chunk that is read
+   entirely and in order against its digest. Since the output depends on file
+   1, this detects a file 1 that the differences file was not made for. */
+static bool read_checked(Cursor *c, uint64_t t, char data[BS])
+{
+    ChunkDigests *cd = c->chunks;
+    uint8_t digest[DS];
+    uint64_t first;
+
+    if (!read_block(c, t, data)) return false;
+    if (cd == NULL) return true;
+    if (t%cd->chunk_blocks == 0)
+    {
+        MD5_Init(&c->md5_ctx);
+        c->next = t;
+    }
+    if (t != c->next) return true;
+    md5_blocks(data, 1, &digest);
+    MD5_Update(&c->md5_ctx, digest, DS);
+    c->next = t + 1;
+    if (c->next%cd->chunk_blocks == 0 || c->next == cd->total_blocks)
+    {
+        MD5_Final(digest, &c->md5_ctx);
+        first = t - t%cd->chunk_blocks;
+        if (memcmp(digest, cd->digests[t/cd->chunk_blocks], DS) != 0)
+        {
+            fprintf(stderr, "Blocks %llu to %llu differ.\n",
+                    (unsigned long long)first, (unsigned long long)t);
+            c->mismatch = true;
+        }
+        ++c->checked;
+        c->next = NO_BLOCK;
+    }
+    return true;
+}
+
+/* Writes `len' bytes of output starting at byte `pos' to `os'.
+   Returns the number of bytes written, which is less than `len' only if the
+   end of the output was reached. */
+static uint64_t extract_bytes( Cursor *c, uint64_t pos, uint64_t len,
+                               OutputStream *os )
+{
+    char data[BS];
+    uint64_t written = 0;
+    size_t skip, n;
+
+    while (written < len)
+    {
+        if (!read_checked(c, pos/BS, data)) break;
+        skip = pos%BS;
+        n = BS - skip;
+        if (n > len - written) n = len - written;
+        write_data(os, data + skip, n);
+        pos     += n;
+        written += n;
+    }
+    return written;
+}
+
+/* Finds the member with the given `path' in the output tar file, by reading
+   its headers only, and writes its contents to `os'. */
+static bool extract_member( Cursor *c, const char *path, OutputStream *os,
+                            TarParser *tp )
+{
+    char data[BS];
+    uint64_t t = 0;
+
+    TarParser_init(tp);
+    while (read_checked(c, t++, data))
+    {
+        switch (TarParser_next(tp, data))
+        {
+        case TAR_HEADER:
+            if (strcmp(tp->path, path) == 0)
+            {
+                return extract_bytes(c, t*BS, tp->size, os) == tp->size;
+            }
+            t += TarParser_skip_data(tp);
+            break;
+
+        case TAR_OTHER:
+            /* End-of-archive reached */
+            return false;
+
+        default:
+            break;
+        }
+    }
+    return false;
+}
+
+/* Prepares a cursor at the start of the output of a differences file, and
+   loads the trailer of the differences file into `trailer' (which must be
+   freed with free_trailer). */
+static void open_cursor( Cursor *c, InputStream *is_file1,
+                         InputStream *is_diff, Trailer *trailer )
+{
+    char magic_buf[MAGIC_LEN];
+    int format;
+
+    /* Both input files must be seekable */
+    if (!is_file1->seek(is_file1, 0) || is_diff->size(is_diff) < 0)
+    {
+        fail("File 1 and the diff file must be seekable!");
+    }
+    trailer->chunks = NULL;
+    trailer->index  = NULL;
+    trailer->bases  = NULL;
+    if (!load_trailer(is_diff, trailer) || trailer->index == NULL)
+    {
+        fprintf(stderr, "WARNING: differences file has no instruction index; "
+                        "all instructions must be read.\n");
+    }
+    c->is_file1 = is_file1;
+    c->is_diff  = is_diff;
+    c->index    = trailer->index;
+    c->pos1     = 0;
+    c->pos_diff = -1;
+    c->chunks   = trailer->chunks;
+    c->next     = NO_BLOCK;
+    c->checked  = 0;
+    c->mismatch = false;
+
+    /* Read and verify file magic number */
+    seek_diff(c, 0);
+    if ( is_diff->read(is_diff, magic_buf, MAGIC_LEN) != MAGIC_LEN ||
+         (format = parse_magic(magic_buf)) < 0 )
+    {
+        fail("Not a diff file!");
+    }
+    c->format   = format;
+    c->pos_diff = MAGIC_LEN;
+    load_instruction(c, MAGIC_LEN, 0);
+}
+
+bool patch_extract( InputStream *is_file1, InputStream *is_diff,
+                    const char *member, const char *range, OutputStream *os )
+{
+    char *end;
+    uint64_t first = 0, last = (uint64_t)-1;
+    Trailer trailer;
+    Cursor c;
+    bool ok;
+
+    /* Parse byte range */
+    if (range != NULL)
+    {
+        first = strtoull(range, &end, 10);
+        if (*end != '-' || end == range) goto invalid_range;
+        if (end[1] != '\0')
+        {
+            range = end + 1;
+            last = strtoull(range, &end, 10);
+            if (*end != '\0' || last < first) goto invalid_range;
+        }
+    }
+
+    open_cursor(&c, is_file1, is_diff, &trailer);
+    if (member != NULL)
+    {
+        TarParser *tp = malloc(sizeof(TarParser));
+        assert(tp != NULL);
+        ok = extract_member(&c, member, os, tp);
+        free(tp);
+        if (!ok) fprintf(stderr, "Member '%s' not found!\n", member);
+    }
+    else
+    {
+        ok = extract_bytes(&c, first, last - first, os) == last - first ||
+             last == (uint64_t)-1;
+        if (!ok) fprintf(stderr, "Byte range exceeds output file size!\n");
+    }
+
+    if (c.mismatch)
+    {
+        fprintf(stderr, "Output verification failed! "
+                        "(Is file 1 the right base file?)\n");
+        ok = false;
+    }
+    else
+    if (trailer.chunks == NULL)
+    {
+        fprintf(stderr, "WARNING: differences file has no chunk digests; "
+                        "output cannot be verified.\n");
+    }
+    else
+    if (c.checked == 0)
+    {
+        fprintf(stderr, "WARNING: no complete chunk of %u blocks was read; "
+                        "output could not be verified!\n"
+                        "WARNING: use --blocks= or a full patch to verify "
+                        "file 1.\n", trailer.chunks->chunk_blocks);
+    }
+    free_trailer(&trailer);
+
+    return ok;
+
+invalid_range:
+    fail("Invalid byte range: %s", range);
+}
+
+/* Writes `len' bytes to `fd' at offset `pos', or fails. */
+static void write_at(int fd, const char *data, size_t len, off_t pos)
+{
+    ssize_t res;
+
+    while (len > 0)
+    {
+        res = pwrite(fd, data, len, pos);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) fail("Write failed.");
+        data += res;
+        len  -= res;
+        pos  += res;
+    }
+}
+
+bool patch_blocks( InputStream *is_file1, InputStream *is_diff,
+                   const char *range, int fd )
+{
+    Progress *progress = active_progress;
+    const char *spec = range;
+    char *data, *end;
+    uint8_t (*digests)[DS], digest[DS];
+    uint64_t first, last = (uint64_t)-1, t, lo, hi, b, w0, w1, total = 0;
+    uint32_t cb = 0;
+    ChunkDigests *chunks;
+    MD5_CTX md5_ctx;
+    Trailer trailer;
+    Cursor c;
+    size_t n, k;
+    bool ok = true, past_end = false;
+
+    /* Parse block range */
+    first = strtoull(range, &end, 10);
+    if (*end != '-' || end == range) goto invalid_range;
+    if (end[1] != '\0')
+    {
+        range = end + 1;
+        last = strtoull(range, &end, 10);
+        if (*end != '\0' || last < first) goto invalid_range;
+    }
+
+    open_cursor(&c, is_file1, is_diff, &trailer);
+    chunks = trailer.chunks;
+    if (chunks == NULL)
+    {
+        fprintf(stderr, "WARNING: differences file has no chunk digests; "
+                        "output cannot be verified.\n");
+    }
+    else
+    {
+        /* Verify whole chunks, reconstructing the blocks of partial chunks at
+           the start and end of the range without writing them */
+        total = chunks->total_blocks;
+        cb    = chunks->chunk_blocks;
+        if (last == (uint64_t)-1) last = total;
+        if (first > total || last > total)
+        {
+            free_trailer(&trailer);
+            fprintf(stderr, "Block range exceeds output file size!\n");
+            return false;
+        }
+    }
+    lo = first;
+    hi = last;
+    if (chunks != NULL && first < last)
+    {
+        lo = first - first%cb;
+        if (last%cb != 0) hi = (last - last%cb + cb < total)
+                             ? last - last%cb + cb : total;
+    }
+
+    data    = malloc(RANGE_BLOCKS*BS);
+    digests = malloc(RANGE_BLOCKS*DS);
+    assert(data != NULL && digests != NULL);
+    progress_phase("patch", last != (uint64_t)-1 ? (hi - lo)*BS : 0);
+    MD5_Init(&md5_ctx);
+    for (t = lo; t < hi; t += n)
+    {
+        for (n = 0; n < RANGE_BLOCKS && t + n < hi; ++n)
+        {
+            if (!read_block(&c, t + n, data + n*BS)) break;
+        }
+        if (n == 0) break;
+
+        if (chunks != NULL)
+        {
+            md5_blocks(data, n, digests);
+            for (k = 0; k < n; ++k)
+            {
+                b = t + k;
+                MD5_Update(&md5_ctx, digests[k], DS);
+                if ((b + 1)%cb != 0 && b + 1 != total) continue;
+                MD5_Final(digest, &md5_ctx);
+                MD5_Init(&md5_ctx);
+                if (memcmp(digest, chunks->digests[b/cb], DS) != 0)
+                {
+                    fprintf(stderr, "Blocks %llu to %llu differ.\n",
+                            (unsigned long long)(b - b%cb),
+                            (unsigned long long)b);
+                    ok = false;
+                }
+            }
+        }
+
+        /* Write the blocks that are part of the range */
+        w0 = (t > first) ? t : first;
+        w1 = (t + n < last) ? t + n : last;
+        if (w0 < w1)
+        {
+            write_at( fd, data + (w0 - t)*BS, (w1 - w0)*BS,
+                      (off_t)(w0*BS) );
+        }
+        progress_add(progress, n*BS);
+    }
+
+    /* Without chunk digests, the size of file 2 is unknown, so an open range
+       that yields no blocks is valid only if it starts at the end exactly */
+    if (t == first && last == (uint64_t)-1 && first > 0)
+    {
+        past_end = !read_block(&c, first - 1, data);
+    }
+    free(data);
+    free(digests);
+    free_trailer(&trailer);
+
+    if (past_end || t < first || (last != (uint64_t)-1 && t < hi))
+    {
+        fprintf(stderr, "Block range exceeds output file size!\n");
+        return false;
+    }
+    if (!ok) fprintf(stderr, "Output verification failed!\n");
+    return ok;
+
+invalid_range:
+    fail("Invalid block range: %s", spec);
+}
@@ -0,0 +1,697 @@
+#include "format.h"
+
+#define TAG_LEN 4
+#define TAG_CHUNKS "CHNK"
+#define TAG_INDEX  "INDX"
+#define TAG_BASES  "BASE"
+
+int parse_magic(const char magic[MAGIC_LEN])
+{
+    if (memcmp(magic, MAGIC_STR, MAGIC_LEN) == 0) return FORMAT_NARROW;
+    if (memcmp(magic, MAGIC_STR_EDITS, MAGIC_LEN) == 0) return FORMAT_NARROW;
+    if (memcmp(magic, MAGIC_STR_WIDE, MAGIC_LEN) == 0) return FORMAT_WIDE;
+    return -1;
+}
+
+bool magic_has_edits(const char magic[MAGIC_LEN])
+{
+    return memcmp(magic, MAGIC_STR, MAGIC_LEN) != 0;
+}
+
+void write_magic(OutputStream *os, enum DiffFormat format, bool edits)
+{
+    write_data( os, format == FORMAT_WIDE ? MAGIC_STR_WIDE :
+                    edits ? MAGIC_STR_EDITS : MAGIC_STR, MAGIC_LEN );
+}
+
+enum InstructionStatus parse_instruction( uint8_t *buf, enum DiffFormat format,
+                                          Instruction *ins )
+{
+    uint64_t none, limit;
+    uint32_t max = MAX_COUNT(format);
+
+    if (format == FORMAT_WIDE)
+    {
+        /* Version 2.0 */
+        ins->S = parse_uint64(buf + 0);
+        ins->C = parse_uint32(buf + 8);
+        ins->A = parse_uint32(buf + 12);
+        none   = 0xffffffffffffffffull;
+        limit  = (uint64_t)INT64_MAX/BS;    /* block offsets must fit off_t */
+    }
+    else
+    {
+        ins->S = parse_uint32(buf + 0);
+        ins->C = parse_uint16(buf + 4);
+        ins->A = parse_uint16(buf + 6);
+        none   = 0xffffffffu;
+        limit  = 0xffffffffu;
+    }
+    ins->patched = false;
+
+    if (ins->S == none && ins->C == 2*max + 1 && ins->A == 2*max + 1)
+    {
+        return INSTRUCTION_END;
+    }
+    if (ins->C > max && ins->S < none)
+    {
+        /* Copied blocks are modified by edit lists (version 1.2) */
+        ins->C &= max;
+        ins->patched = true;
+    }
+    if ( ins->C > max || ins->A > max || (ins->S < none) != (ins->C > 0) ||
+         (ins->C > 0 && (ins->S > limit || ins->C > limit - ins->S)) )
+    {
+        return INSTRUCTION_INVALID;
+    }
+    return INSTRUCTION_OK;
+}
+
+void write_instruction( OutputStream *os, enum DiffFormat format,
+                        const Instruction *ins )
+{
+    uint32_t C = ins->patched ? (ins->C | (MAX_COUNT(format) + 1)) : ins->C;
+
+    if (format == FORMAT_WIDE)
+    {
+        write_uint64(os, ins->C > 0 ? ins->S : 0xffffffffffffffffull);
+        write_uint32(os, C);
+        write_uint32(os, ins->A);
+    }
+    else
+    {
+        write_uint32(os, ins->C > 0 ? (uint32_t)ins->S : 0xffffffffu);
+        write_uint16(os, C);
+        write_uint16(os, ins->A);
+    }
+}
+
+void write_end_instruction(OutputStream *os, enum DiffFormat format)
+{
+    if (format == FORMAT_WIDE) write_uint64(os, 0xffffffffffffffffull);
+    write_uint32(os, 0xffffffffu);
+    write_uint32(os, 0xffffffffu);
+}
+
+size_t read_edit_list(InputStream *is, uint8_t *buf)
+{
+    size_t size, n, E;
+    uint16_t offset, len, end = 0;
+
+    if (is->read(is, buf, 2) != 2) return 0;
+    E = parse_uint16(buf);
+    if (E > BS) return 0;
+    size = 2;
+    for (n = 0; n < E; ++n)
+    {
+        if (is->read(is, buf + size, 4) != 4) return 0;
+        offset = parse_uint16(buf + size);
+        len    = parse_uint16(buf + size + 2);
+        if (len == 0 || offset < end || len > BS - offset) return 0;
+        end = offset + len;
+        size += 4;
+        if (is->read(is, buf + size, len) != len) return 0;
+        size += len;
+    }
+    return size;
+}
+
+void apply_edit_list(const uint8_t *edits, char data[BS])
+{
+    size_t n, E = parse_uint16((uint8_t*)edits);
+    uint16_t offset, len;
+
+    edits += 2;
+    for (n = 0; n < E; ++n)
+    {
+        offset = parse_uint16((uint8_t*)edits);
+        len    = parse_uint16((uint8_t*)edits + 2);
+        memcpy(data + offset, edits + 4, len);
+        edits += 4 + len;
+    }
+}
+
+/* Encodes the runs of bytes in `data' for which `changed' is set, where runs
+   separated by fewer than `gap' unchanged bytes are combined. */
+static size_t encode_edits( const char data[BS], const bool changed[BS],
+                            size_t gap, uint8_t *buf )
+{
+    size_t size = 2, E = 0, i = 0, j, k;
+
+    for (;;)
+    {
+        while (i < BS && !changed[i]) ++i;
+        if (i == BS) break;
+
+        /* Find the end of the run, including small gaps */
+        for (j = k = i; k < BS && k < j + gap; ++k)
+        {
+            if (changed[k]) j = k + 1;
+        }
+        buf[size + 0] = i >> 8;
+        buf[size + 1] = i & 255;
+        buf[size + 2] = (j - i) >> 8;
+        buf[size + 3] = (j - i) & 255;
+        memcpy(buf + size + 4, data + i, j - i);
+        size += 4 + (j - i);
+        ++E;
+        i = j;
+    }
+    buf[0] = E >> 8;
+    buf[1] = E & 255;
+    return size;
+}
+
+size_t make_edit_list(const char old[BS], const char new[BS], uint8_t *buf)
+{
+    bool changed[BS];
+    size_t i;
+
+    for (i = 0; i < BS; ++i) changed[i] = old[i] != new[i];
+
+    /* Combine runs when the gap is smaller than the 4 byte run header */
+    return encode_edits(new, changed, 5, buf);
+}
+
+/* Applies an edit list to `data' and marks the changed bytes. */
+static void mark_edits(const uint8_t *edits, char data[BS], bool changed[BS])
+{
+    size_t n, E = parse_uint16((uint8_t*)edits);
+    uint16_t offset, len;
+
+    edits += 2;
+    for (n = 0; n < E; ++n)
+    {
+        offset = parse_uint16((uint8_t*)edits);
+        len    = parse_uint16((uint8_t*)edits + 2);
+        memcpy(data + offset, edits + 4, len);
+        memset(changed + offset, true, len);
+        edits += 4 + len;
+    }
+}
+
+size_t merge_edit_lists(const uint8_t *a, const uint8_t *b, uint8_t *buf)
+{
+    char data[BS];
+    bool changed[BS];
+
+    memset(changed, false, BS);
+    mark_edits(a, data, changed);
+    mark_edits(b, data, changed);
+    return encode_edits(data, changed, 1, buf);
+}
+
+EditStore *EditStore_create()
+{
+    EditStore *es = malloc(sizeof(EditStore));
+    assert(es != NULL);
+    es->fp = tmpfile();
+    if (es->fp == NULL)
+    {
+        fail("Couldn't open temporary file!");
+    }
+    es->size = 0;
+    return es;
+}
+
+off_t EditStore_add(EditStore *es, const uint8_t *edits, size_t size)
+{
+    off_t offset = es->size;
+    uint8_t buf[2] = { size >> 8, size & 255 };
+
+    assert(size <= MAX_EDIT_LIST);
+    if ( fseeko(es->fp, offset, SEEK_SET) != 0 ||
+         fwrite(buf, 2, 1, es->fp) != 1 ||
+         fwrite(edits, size, 1, es->fp) != 1 )
+    {
+        fail("Write to temporary file failed!");
+    }
+    es->size += 2 + size;
+    return offset;
+}
+
+size_t EditStore_get(EditStore *es, off_t offset, uint8_t *buf)
+{
+    size_t size;
+
+    if ( fseeko(es->fp, offset, SEEK_SET) != 0 ||
+         fread(buf, 2, 1, es->fp) != 1 ||
+         (size = parse_uint16(buf)) > MAX_EDIT_LIST ||
+         fread(buf, size, 1, es->fp) != 1 )
+    {
+        fail("Read from temporary file failed!");
+    }
+    return size;
+}
+
+void EditStore_apply(EditStore *es, off_t offset, char data[BS])
+{
+    uint8_t edits[MAX_EDIT_LIST];
+
+    EditStore_get(es, offset, edits);
+    apply_edit_list(edits, data);
+}
+
+void EditStore_destroy(EditStore *es)
+{
+    if (es == NULL) return;
+    fclose(es->fp);
+    free(es);
+}
+
+ChunkDigests *ChunkDigests_create(uint32_t chunk_blocks)
+{
+    ChunkDigests *cd;
+
+    assert(chunk_blocks > 0);
+    cd = malloc(sizeof(ChunkDigests));
+    if (cd == NULL) return NULL;
+    cd->chunk_blocks = chunk_blocks;
+    cd->total_blocks = 0;
+    cd->count        = 0;
+    cd->capacity     = 0;
+    cd->digests      = NULL;
+    return cd;
+}
+
+/* Makes room for one more chunk digest and returns a pointer to it. */
+static uint8_t *next_digest(ChunkDigests *cd)
+{
+    if (cd->count == cd->capacity)
+    {
+        cd->capacity = (cd->capacity == 0) ? 64 : 2*cd->capacity;
+        cd->digests = realloc(cd->digests, cd->capacity*sizeof(*cd->digests));
+        assert(cd->digests != NULL);
+    }
+    return cd->digests[cd->count++];
+}
+
+void ChunkDigests_add(ChunkDigests *cd, const uint8_t digest[DS])
+{
+    if (cd->total_blocks%cd->chunk_blocks == 0) MD5_Init(&cd->md5_ctx);
+    MD5_Update(&cd->md5_ctx, digest, DS);
+    if (++cd->total_blocks%cd->chunk_blocks == 0)
+    {
+        MD5_Final(next_digest(cd), &cd->md5_ctx);
+    }
+}
+
+void ChunkDigests_finish(ChunkDigests *cd)
+{
+    if (cd->count < cd->total_blocks/cd->chunk_blocks +
+                    (cd->total_blocks%cd->chunk_blocks != 0))
+    {
+        MD5_Final(next_digest(cd), &cd->md5_ctx);
+    }
+}
+
+size_t ChunkDigests_mismatch(ChunkDigests *a, ChunkDigests *b, size_t i)
+{
+    for ( ; i < a->count || i < b->count; ++i)
+    {
+        if (i >= a->count || i >= b->count ||
+            memcmp(a->digests[i], b->digests[i], DS) != 0) break;
+    }
+    return i;
+}
+
+void ChunkDigests_destroy(ChunkDigests *cd)
+{
+    if (cd == NULL) return;
+    free(cd->digests);
+    free(cd);
+}
+
+InstructionIndex *InstructionIndex_create(uint32_t interval)
+{
+    InstructionIndex *ii = malloc(sizeof(InstructionIndex));
+    if (ii == NULL) return NULL;
+    ii->interval = interval;
+    ii->count    = 0;
+    ii->capacity = 0;
+    ii->entries  = NULL;
+    return ii;
+}
+
+void InstructionIndex_add(InstructionIndex *ii, uint64_t T, off_t offset)
+{
+    if (ii->count > 0 && T - ii->entries[ii->count - 1].T < ii->interval)
+    {
+        return;
+    }
+    if (ii->count == ii->capacity)
+    {
+        ii->capacity = ii->capacity ? 2*ii->capacity : 64;
+        ii->entries = realloc(ii->entries, ii->capacity*sizeof(IndexEntry));
+        assert(ii->entries != NULL);
+    }
+    ii->entries[ii->count].T      = T;
+    ii->entries[ii->count].offset = offset;
+    ++ii->count;
+}
+
+IndexEntry *InstructionIndex_find(InstructionIndex *ii, uint64_t T)
+{
+    size_t lo = 0, hi = ii->count, mid;
+
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo)/2;
+        if (ii->entries[mid].T <= T) lo = mid + 1; else hi = mid;
+    }
+    return (lo > 0) ? &ii->entries[lo - 1] : NULL;
+}
+
+void InstructionIndex_destroy(InstructionIndex *ii)
+{
+    if (ii == NULL) return;
+    free(ii->entries);
+    free(ii);
+}
+
+BaseList *BaseList_create()
+{
+    BaseList *bl = malloc(sizeof(BaseList));
+    if (bl == NULL) return NULL;
+    bl->count    = 0;
+    bl->capacity = 0;
+    bl->nblocks  = NULL;
+    bl->digests  = NULL;
+    return bl;
+}
+
+void BaseList_add(BaseList *bl, uint64_t nblocks, const uint8_t digest[DS])
+{
+    if (bl->count == bl->capacity)
+    {
+        bl->capacity = bl->capacity ? 2*bl->capacity : 4;
+        bl->nblocks = realloc(bl->nblocks, bl->capacity*sizeof(uint64_t));
+        bl->digests = realloc(bl->digests, bl->capacity*DS);
+        assert(bl->nblocks != NULL && bl->digests != NULL);
+    }
+    bl->nblocks[bl->count] = nblocks;
+    memcpy(bl->digests[bl->count], digest, DS);
+    ++bl->count;
+}
+
+BaseList *BaseList_copy(const BaseList *bl)
+{
+    BaseList *copy;
+    size_t n;
+
+    if (bl == NULL) return NULL;
+    copy = BaseList_create();
+    assert(copy != NULL);
+    for (n = 0; n < bl->count; ++n)
+    {
+        BaseList_add(copy, bl->nblocks[n], bl->digests[n]);
+    }
+    return copy;
+}
+
+void BaseList_destroy(BaseList *bl)
+{
+    if (bl == NULL) return;
+    free(bl->nblocks);
+    free(bl->digests);
+    free(bl);
+}
+
+void write_trailer(OutputStream *os, off_t footer_offset,
+                   ChunkDigests *chunks, InstructionIndex *index,
+                   BaseList *bases)
+{
+    uint8_t digest[DS];
+    size_t n;
+
+    /* Chunk digests section */
+    if (chunks != NULL)
+    {
+        assert(chunks->count <= (0xffffffffu - 12)/DS);
+        write_data(os, TAG_CHUNKS, TAG_LEN);
+        write_uint32(os, 12 + DS*chunks->count);
+        write_uint32(os, chunks->chunk_blocks);
+        write_uint64(os, chunks->total_blocks);
+        write_data(os, chunks->digests, DS*chunks->count);
+    }
+
+    /* Instruction index section */
+    if (index != NULL)
+    {
+        assert(index->count <= (0xffffffffu - 4)/16);
+        write_data(os, TAG_INDEX, TAG_LEN);
+        write_uint32(os, 4 + 16*index->count);
+        write_uint32(os, index->interval);
+        for (n = 0; n < index->count; ++n)
+        {
+            write_uint64(os, index->entries[n].T);
+            write_uint64(os, index->entries[n].offset);
+        }
+    }
+
+    /* Base files section */
+    if (bases != NULL)
+    {
+        assert(bases->count <= 0xffffffffu/(8 + DS));
+        write_data(os, TAG_BASES, TAG_LEN);
+        write_uint32(os, (8 + DS)*bases->count);
+        for (n = 0; n < bases->count; ++n)
+        {
+            write_uint64(os, bases->nblocks[n]);
+            write_data(os, bases->digests[n], DS);
+        }
+    }
+
+    /* End of sections */
+    write_uint32(os, 0);
+    write_uint32(os, 0);
+
+    /* Tail */
+    write_uint64(os, footer_offset);
+    get_output_digest(os, digest);
+    write_data(os, digest, DS);
+    write_data(os, TAIL_STR, TAIL_LEN - 8 - DS);
+}
+
+/* Reads data and adds it to the digest (if non-NULL). */
+static bool read_hashed(InputStream *is, void *buf, size_t len, MD5_CTX *ctx)
+{
+    if (is->read(is, buf, len) != len) return false;
+    if (ctx != NULL) MD5_Update(ctx, buf, len);
+    return true;
+}
+
+/* Reads the contents of a chunk digests section. */
+static bool read_chunks(InputStream *is, uint32_t len, MD5_CTX *ctx,
+                        ChunkDigests **chunks)
+{
+    uint8_t buf[12];
+    ChunkDigests *cd;
+    uint32_t chunk_blocks;
+    uint64_t total_blocks;
+    size_t count;
+
+    if (len < 12 || (len - 12)%DS != 0) return false;
+    if (!read_hashed(is, buf, 12, ctx)) return false;
+    chunk_blocks = parse_uint32(buf);
+    total_blocks = parse_uint64(buf + 4);
+    count = (len - 12)/DS;
+    if (chunk_blocks == 0 ||
+        count != total_blocks/chunk_blocks + (total_blocks%chunk_blocks != 0))
+    {
+        return false;
+    }
+
+    cd = ChunkDigests_create(chunk_blocks);
+    assert(cd != NULL);
+    cd->total_blocks = total_blocks;
+    cd->count = cd->capacity = count;
+    cd->digests = malloc(DS*count + 1);
+    assert(cd->digests != NULL);
+    if (!read_hashed(is, cd->digests, DS*count, ctx))
+    {
+        ChunkDigests_destroy(cd);
+        return false;
+    }
+    ChunkDigests_destroy(*chunks);
+    *chunks = cd;
+    return true;
+}
+
+/* Reads the contents of an instruction index section. */
+static bool read_index(InputStream *is, uint32_t len, MD5_CTX *ctx,
+                       InstructionIndex **index)
+{
+    uint8_t buf[16];
+    InstructionIndex *ii;
+    size_t n, count;
+
+    if (len < 4 || (len - 4)%16 != 0) return false;
+    if (!read_hashed(is, buf, 4, ctx)) return false;
+    count = (len - 4)/16;
+
+    ii = InstructionIndex_create(parse_uint32(buf));
+    assert(ii != NULL);
+    ii->entries = malloc(count*sizeof(IndexEntry) + 1);
+    assert(ii->entries != NULL);
+    ii->capacity = count;
+    for (n = 0; n < count; ++n)
+    {
+        if (!read_hashed(is, buf, 16, ctx)) break;
+        ii->entries[n].T      = parse_uint64(buf);
+        ii->entries[n].offset = (off_t)parse_uint64(buf + 8);
+        if (n > 0 && ii->entries[n].T <= ii->entries[n - 1].T) break;
+    }
+    ii->count = n;
+    if (n < count)
+    {
+        InstructionIndex_destroy(ii);
+        return false;
+    }
+    InstructionIndex_destroy(*index);
+    *index = ii;
+    return true;
+}
+
+/* Reads the contents of a base files section. */
+static bool read_bases(InputStream *is, uint32_t len, MD5_CTX *ctx,
+                       BaseList **bases)
+{
+    uint8_t buf[8 + DS];
+    BaseList *bl;
+    size_t n, count;
+
+    if (len == 0 || len%(8 + DS) != 0) return false;
+    count = len/(8 + DS);
+
+    bl = BaseList_create();
+    assert(bl != NULL);
+    for (n = 0; n < count; ++n)
+    {
+        if (!read_hashed(is, buf, 8 + DS, ctx))
+        {
+            BaseList_destroy(bl);
+            return false;
+        }
+        BaseList_add(bl, parse_uint64(buf), buf + 8);
+    }
+    BaseList_destroy(*bases);
+    *bases = bl;
+    return true;
+}
+
+enum TrailerStatus read_trailer(InputStream *is, MD5_CTX *md5_ctx,
+                                Trailer *trailer)
+{
+    uint8_t buf[BS], digest[DS];
+    uint32_t len;
+    size_t nread;
+
+    trailer->chunks = NULL;
+    trailer->index  = NULL;
+    trailer->bases  = NULL;
+
+    /* Check for a version 1.1 file without trailer */
+    nread = is->read(is, buf, TAG_LEN);
+    if (nread == 0) return TRAILER_NONE;
+    if (nread != TAG_LEN) return TRAILER_INVALID;
+    if (md5_ctx != NULL) MD5_Update(md5_ctx, buf, TAG_LEN);
+
+    /* Process sections until an empty tag is found */
+    for (;;)
+    {
+        if (!read_hashed(is, buf + TAG_LEN, 4, md5_ctx)) goto invalid;
+        len = parse_uint32(buf + TAG_LEN);
+        if (memcmp(buf, "\0\0\0\0", TAG_LEN) == 0)
+        {
+            if (len != 0) goto invalid;
+            break;
+        }
+        if (memcmp(buf, TAG_CHUNKS, TAG_LEN) == 0)
+        {
+            if (!read_chunks(is, len, md5_ctx, &trailer->chunks)) goto invalid;
+        }
+        else
+        if (memcmp(buf, TAG_INDEX, TAG_LEN) == 0)
+        {
+            if (!read_index(is, len, md5_ctx, &trailer->index)) goto invalid;
+        }
+        else
+        if (memcmp(buf, TAG_BASES, TAG_LEN) == 0)
+        {
+            if (!read_bases(is, len, md5_ctx, &trailer->bases)) goto invalid;
+        }
+        else  /* skip unknown section */
+        {
+            while (len > 0)
+            {
+                nread = (len < BS) ? len : BS;
+                if (!read_hashed(is, buf, nread, md5_ctx)) goto invalid;
+                len -= nread;
+            }
+        }
+        if (!read_hashed(is, buf, TAG_LEN, md5_ctx)) goto invalid;
+    }
+
+    /* Read tail */
+    if (!read_hashed(is, buf, 8, md5_ctx)) goto invalid;
+    trailer->footer_offset = (off_t)parse_uint64(buf);
+    if (is->read(is, trailer->diff_digest, DS) != DS) goto invalid;
+    if (is->read(is, buf, TAIL_LEN - 8 - DS) != TAIL_LEN - 8 - DS ||
+        memcmp(buf, TAIL_STR, TAIL_LEN - 8 - DS) != 0) goto invalid;
+    if (md5_ctx != NULL)
+    {
+        MD5_Final(digest, md5_ctx);
+        if (memcmp(digest, trailer->diff_digest, DS) != 0)
+        {
+            free_trailer(trailer);
+            return TRAILER_CORRUPT;
+        }
+    }
+    return TRAILER_OK;
+
+invalid:
+    free_trailer(trailer);
+    return TRAILER_INVALID;
+}
+
+bool load_trailer(InputStream *is, Trailer *trailer)
+{
+    uint8_t tail[TAIL_LEN];
+    off_t size, footer_offset;
+
+    /* Locate and read the tail */
+    size = is->size(is);
+    if (size < MAGIC_LEN + 8 + 2*DS + 8 + TAIL_LEN) return false;
+    if (!is->seek(is, size - TAIL_LEN) ||
+        is->read(is, tail, TAIL_LEN) != TAIL_LEN ||
+        memcmp(tail + 8 + DS, TAIL_STR, TAIL_LEN - 8 - DS) != 0)
+    {
+        return false;
+    }
+    footer_offset = (off_t)parse_uint64(tail);
+    if (footer_offset < MAGIC_LEN + 8 || footer_offset > size - TAIL_LEN)
+    {
+        return false;
+    }
+
+    /* Parse sections following the file digests */
+    if (!is->seek(is, footer_offset + 2*DS) ||
+        read_trailer(is, NULL, trailer) != TRAILER_OK) return false;
+    if (trailer->footer_offset != footer_offset)
+    {
+        free_trailer(trailer);
+        return false;
+    }
+    return true;
+}
+
+void free_trailer(Trailer *trailer)
+{
+    ChunkDigests_destroy(trailer->chunks);
+    trailer->chunks = NULL;
+    InstructionIndex_destroy(trailer->index);
+    trailer->index = NULL;
+    BaseList_destroy(trailer->bases);
+    trailer->bases = NULL;
+}
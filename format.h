@@ -0,0 +1,233 @@
+#ifndef FORMAT_H_INCLUDED
+#define FORMAT_H_INCLUDED
+
+#include "common.h"
+
+/* Functions to read and write instructions and the extended footer of
+   differences files (version 2.0; see FILEFORMAT.txt) */
+
+#ifndef CHUNK_BLOCKS
+#define CHUNK_BLOCKS 131072     /* blocks per output chunk digest (64 MB) */
+#endif
+
+#ifndef INDEX_BLOCKS
+#define INDEX_BLOCKS 8192       /* output blocks per instruction index entry */
+#endif
+
+#define TAIL_LEN 32
+#define TAIL_STR "tardifft"
+
+#define MAX_EDIT_LIST (2 + 5*BS)    /* max. size of an encoded edit list */
+#define MAX_PATCH_EDITS (BS/4)      /* max. edit list size emitted by tardiff */
+
+/* Encodings of instruction headers, selected by the magic string. The wide
+   format (version 2.0) has 64-bit block indices and 32-bit block counts, and
+   is used only if file 1 has more than 2^32 - 1 blocks (about 2 TB). */
+enum DiffFormat { FORMAT_NARROW, FORMAT_WIDE };
+
+#define MAX_INSTRUCTION_LEN 16
+#define INSTRUCTION_LEN(format) ((format) == FORMAT_WIDE ? 16 : 8)
+
+/* Maximum number of blocks copied or appended by a single instruction */
+#define MAX_COUNT(format) ((format) == FORMAT_WIDE ? 0x7fffffffu : 0x7fffu)
+
+/* A decoded instruction header */
+typedef struct Instruction
+{
+    uint64_t S;                 /* first block to copy (if C > 0) */
+    uint32_t C;                 /* number of blocks to copy */
+    uint32_t A;                 /* number of blocks to append */
+    bool     patched;           /* copied blocks are followed by edit lists */
+} Instruction;
+
+enum InstructionStatus { INSTRUCTION_OK, INSTRUCTION_END,
+                         INSTRUCTION_INVALID };
+
+/* Temporary storage for edit lists that must be applied later. */
+typedef struct EditStore
+{
+    FILE  *fp;                  /* temporary file containing edit lists */
+    off_t size;                 /* size of the temporary file */
+} EditStore;
+
+/* Digests of consecutive chunks of a file. The digest of a chunk is the MD5
+   digest of the concatenated MD5 digests of the blocks it contains. */
+typedef struct ChunkDigests
+{
+    uint32_t chunk_blocks;      /* number of blocks per chunk */
+    uint64_t total_blocks;      /* total number of blocks */
+    size_t   count;             /* number of chunk digests */
+    size_t   capacity;          /* allocated number of chunk digests */
+    uint8_t  (*digests)[DS];    /* chunk digests */
+    MD5_CTX  md5_ctx;           /* digest of the current (partial) chunk */
+} ChunkDigests;
+
+/* An entry of the instruction index. */
+typedef struct IndexEntry
+{
+    uint64_t T;                 /* index of first output block of instruction */
+    off_t    offset;            /* offset of the instruction in the file */
+} IndexEntry;
+
+/* Sparse index of the instructions of a differences file, which lists about
+   one instruction per `interval' output blocks, so the instruction that
+   generates a given output block can be found without reading the file. */
+typedef struct InstructionIndex
+{
+    uint32_t   interval;        /* minimum distance between entries (blocks) */
+    size_t     count;           /* number of entries */
+    size_t     capacity;        /* allocated number of entries */
+    IndexEntry *entries;        /* entries, ordered by T */
+} InstructionIndex;
+
+/* Base files of a differences file that copies blocks from several files.
+   Block indices refer to the concatenation of the base files, each of which is
+   padded with zeroes to a whole number of blocks. */
+typedef struct BaseList
+{
+    size_t   count;             /* number of base files */
+    size_t   capacity;          /* allocated number of base files */
+    uint64_t *nblocks;          /* number of blocks of each base file */
+    uint8_t  (*digests)[DS];    /* MD5 digest of each (padded) base file */
+} BaseList;
+
+/* Contents of the extended footer of a differences file. */
+typedef struct Trailer
+{
+    off_t        footer_offset; /* offset of the output file digest */
+    ChunkDigests *chunks;       /* output chunk digests (or NULL if absent) */
+    InstructionIndex *index;    /* instruction index (or NULL if absent) */
+    BaseList     *bases;        /* base files (or NULL if there is only one) */
+    uint8_t      diff_digest[DS];   /* digest of the differences file */
+} Trailer;
+
+enum TrailerStatus { TRAILER_NONE, TRAILER_OK, TRAILER_INVALID,
+                     TRAILER_CORRUPT };
+
+/* Returns the format of a differences file starting with the given magic
+   string, or -1 if it is not a differences file. */
+int parse_magic(const char magic[MAGIC_LEN]);
+
+/* Returns whether a differences file with the given (valid) magic string may
+   contain edit lists. */
+bool magic_has_edits(const char magic[MAGIC_LEN]);
+
+/* Writes the magic string of a differences file in the given format. The
+   narrow format has a distinct magic string if `edits' is set, so tools that
+   cannot apply edit lists reject the file before reading any of it. */
+void write_magic(OutputStream *os, enum DiffFormat format, bool edits);
+
+/* Decodes the instruction header in `buf', which is INSTRUCTION_LEN(format)
+   bytes long. */
+enum InstructionStatus parse_instruction( uint8_t *buf, enum DiffFormat format,
+                                          Instruction *ins );
+
+/* Writes an instruction header. S is ignored if no blocks are copied. */
+void write_instruction( OutputStream *os, enum DiffFormat format,
+                        const Instruction *ins );
+
+/* Writes the header that marks the end of the instructions. */
+void write_end_instruction(OutputStream *os, enum DiffFormat format);
+
+/* Reads an encoded edit list into `buf', which must have room for at least
+   MAX_EDIT_LIST bytes. Returns its size, or 0 if it is invalid. */
+size_t read_edit_list(InputStream *is, uint8_t *buf);
+
+/* Applies an encoded edit list to a block. */
+void apply_edit_list(const uint8_t *edits, char data[BS]);
+
+/* Encodes the changes from block `old' to block `new' as an edit list into
+   `buf' (which must have room for at least MAX_EDIT_LIST bytes) and returns
+   its size. */
+size_t make_edit_list(const char old[BS], const char new[BS], uint8_t *buf);
+
+/* Encodes the combined effect of applying edit list `a' followed by edit list
+   `b' into `buf' (which must have room for MAX_EDIT_LIST bytes) and returns
+   its size. */
+size_t merge_edit_lists(const uint8_t *a, const uint8_t *b, uint8_t *buf);
+
+/* Creates an empty edit store, or aborts if no temporary file can be made. */
+EditStore *EditStore_create();
+
+/* Adds an encoded edit list of `size' bytes, and returns its offset. */
+off_t EditStore_add(EditStore *es, const uint8_t *edits, size_t size);
+
+/* Reads the edit list at `offset' into `buf' (which must have room for
+   MAX_EDIT_LIST bytes) and returns its size. */
+size_t EditStore_get(EditStore *es, off_t offset, uint8_t *buf);
+
+/* Applies the edit list at `offset' to a block. */
+void EditStore_apply(EditStore *es, off_t offset, char data[BS]);
+
+/* Closes the temporary file and frees the edit store. */
+void EditStore_destroy(EditStore *es);
+
+/* Creates an empty list of chunk digests. */
+ChunkDigests *ChunkDigests_create(uint32_t chunk_blocks);
+
+/* Adds the digest of the next block. */
+void ChunkDigests_add(ChunkDigests *cd, const uint8_t digest[DS]);
+
+/* Completes the digest of the last chunk (if it is partial). */
+void ChunkDigests_finish(ChunkDigests *cd);
+
+/* Returns the index of the first chunk that differs between `a' and `b',
+   starting from chunk `i', or the number of chunks in the longest list. */
+size_t ChunkDigests_mismatch(ChunkDigests *a, ChunkDigests *b, size_t i);
+
+/* Frees the chunk digests. */
+void ChunkDigests_destroy(ChunkDigests *cd);
+
+/* Creates an empty instruction index. */
+InstructionIndex *InstructionIndex_create(uint32_t interval);
+
+/* Adds the instruction at `offset' that starts at output block `T', if it is
+   at least `interval' blocks after the last entry (or the first instruction).
+   Instructions must be added in order. */
+void InstructionIndex_add(InstructionIndex *ii, uint64_t T, off_t offset);
+
+/* Returns the last entry with an output block index less than or equal to
+   `T', or NULL if there is none. */
+IndexEntry *InstructionIndex_find(InstructionIndex *ii, uint64_t T);
+
+/* Frees the instruction index. */
+void InstructionIndex_destroy(InstructionIndex *ii);
+
+/* Creates an empty list of base files. */
+BaseList *BaseList_create();
+
+/* Adds a base file with the given number of blocks and digest. */
+void BaseList_add(BaseList *bl, uint64_t nblocks, const uint8_t digest[DS]);
+
+/* Returns a copy of a list of base files (or NULL if `bl' is NULL). */
+BaseList *BaseList_copy(const BaseList *bl);
+
+/* Frees the list of base files. */
+void BaseList_destroy(BaseList *bl);
+
+/* Writes the extended footer to an output stream. The file digests must have
+   been written at `footer_offset', and start_output_digest() must have been
+   called before writing the header. `chunks', `index' and `bases' may be
+   NULL. */
+void write_trailer(OutputStream *os, off_t footer_offset,
+                   ChunkDigests *chunks, InstructionIndex *index,
+                   BaseList *bases);
+
+/* Reads the extended footer that follows the file digests from `is'. If
+   `md5_ctx' is non-NULL, it must contain the digest of all preceding data,
+   and the stored digest of the differences file is verified. Returns
+   TRAILER_NONE (if the file ends after the file digests), TRAILER_OK (in which
+   case `trailer' must be freed with free_trailer) or an error status. */
+enum TrailerStatus read_trailer(InputStream *is, MD5_CTX *md5_ctx,
+                                Trailer *trailer);
+
+/* Reads the extended footer from the end of a seekable differences file,
+   without verifying the digest of the file. Returns true if successful, in
+   which case `trailer' must be freed with free_trailer. The stream position is
+   undefined afterwards. */
+bool load_trailer(InputStream *is, Trailer *trailer);
+
+/* Frees data associated with a trailer. */
+void free_trailer(Trailer *trailer);
+
+#endif /* ndef FORMAT_H_INCLUDED */
@@ -1,46 +1,79 @@
 #include "identify.h"
+#include "format.h"
+#include "libtardiff.h"
+#include "stats.h"
 
-static bool process_diff(InputStream *is, struct File *file,
-                         FILE *fp, const char **error)
+static bool process_diff(InputStream *is, const char magic[MAGIC_LEN],
+                         enum DiffFormat format, struct File *file, FILE *fp,
+                         const char **error)
 {
-    uint8_t     data[BS];
-    uint32_t    S;
-    uint16_t    C, A;
+    uint8_t     data[MAX_EDIT_LIST];
+    Instruction ins;
+    size_t      size;
     char        digest1_str[2*DS + 1];
     char        digest2_str[2*DS + 1];
-    uint32_t    TC = 0, TA = 0;
+    uint64_t    TC = 0, TA = 0, runs = 0, next_S = 0;
+    MD5_CTX     md5_ctx;
+    Trailer     trailer;
+    const char  *checksum_str = "";
+    char        bases_str[32] = "";
+    enum InstructionStatus status;
+
+    file->diff.bases = NULL;
+
+    /* Compute digest of the entire file, to verify it (if possible) */
+    MD5_Init(&md5_ctx);
+    MD5_Update(&md5_ctx, magic, MAGIC_LEN);
 
     for (;;)
     {
-        if (is->read(is, data, 8) != 8)
+        size = INSTRUCTION_LEN(format);
+        if (is->read(is, data, size) != size)
         {
             *error = "read failed -- file truncated?";
             return false;
         }
+        MD5_Update(&md5_ctx, data, size);
 
-        S = parse_uint32(data + 0);
-        C = parse_uint16(data + 4);
-        A = parse_uint16(data + 6);
+        status = parse_instruction(data, format, &ins);
+        if (status == INSTRUCTION_END) break;
 
-        if (S == 0xffffffffu && C == 0xffffu && A == 0xffffu) break;
-
-        if (C > 0x7fff || A > 0x7fff || (S < 0xffffffffu) != (C > 0))
+        if (status == INSTRUCTION_INVALID)
         {
             *error = "invalid diff data";
             return false;
         }
 
-        TC += C;
-        TA += A;
+        TC += ins.C;
+        TA += ins.A;
+        if (ins.C > 0)
+        {
+            /* Count copies that do not continue the previous one */
+            if (runs == 0 || ins.S != next_S) ++runs;
+            next_S = ins.S + ins.C;
+        }
+
+        while (ins.patched && ins.C > 0)
+        {
+            size = read_edit_list(is, data);
+            if (size == 0)
+            {
+                *error = "invalid edit list -- file truncated?";
+                return false;
+            }
+            MD5_Update(&md5_ctx, data, size);
+            ins.C -= 1;
+        }
 
-        while (A > 0)
+        while (ins.A > 0)
         {
             if (is->read(is, data, BS) != BS)
             {
                 *error = "read failed -- file truncated?";
                 return false;
             }
-            A -= 1;
+            MD5_Update(&md5_ctx, data, BS);
+            ins.A -= 1;
         }
     }
 
@@ -49,12 +82,41 @@ static bool process_diff(InputStream *is, struct File *file,
         *error = "read failed -- file truncated?";
         return false;
     }
+    MD5_Update(&md5_ctx, file->diff.digest2, DS);
     hexstring(digest2_str, file->diff.digest2, DS);
 
     if (is->read(is, file->diff.digest1, DS) == DS)
     {
         /* Version 1.1 file */
+        MD5_Update(&md5_ctx, file->diff.digest1, DS);
         hexstring(digest1_str, file->diff.digest1, DS);
+
+        /* Version 1.2 file: verify digest of the differences file */
+        switch (read_trailer(is, &md5_ctx, &trailer))
+        {
+        case TRAILER_NONE:
+            break;
+
+        case TRAILER_OK:
+            if (trailer.bases != NULL)
+            {
+                snprintf( bases_str, sizeof(bases_str), ", %d base files",
+                          (int)trailer.bases->count );
+                file->diff.bases = trailer.bases;
+                trailer.bases = NULL;
+            }
+            free_trailer(&trailer);
+            checksum_str = ", checksum OK";
+            break;
+
+        case TRAILER_INVALID:
+            *error = "invalid footer -- file truncated?";
+            return false;
+
+        case TRAILER_CORRUPT:
+            *error = "checksum mismatch -- file corrupted!";
+            return false;
+        }
     }
     else
     {
@@ -66,11 +128,13 @@ static bool process_diff(InputStream *is, struct File *file,
     file->type = FILE_DIFF;
     file->diff.copied = TC;
     file->diff.added  = TA;
+    file->diff.runs   = runs;
 
     if (fp != NULL)
     {
-        fprintf(fp, "%s -> %s (%d blocks, %6.3f%% new)\n",
-            digest1_str, digest2_str, TC + TA, 100.0*TA/(TC + TA) );
+        fprintf(fp, "%s -> %s (%llu blocks, %6.3f%% new%s%s)\n",
+            digest1_str, digest2_str, (unsigned long long)(TC + TA),
+            100.0*TA/(TC + TA), bases_str, checksum_str );
     }
 
     return true;
@@ -80,9 +144,9 @@ static bool process_data(
     InputStream *is, char *buf, size_t buf_size, size_t len,
     struct File *file, FILE *fp, const char **error)
 {
-    MD5_CTX     md5_ctx;
+    MD5_CTX     md5_ctx, padded_ctx;
     char        digest_str[2*DS + 1];
-    size_t      total = 0;
+    uint64_t    total = 0;
 
     /* Compute MD5 hash of contents */
     MD5_Init(&md5_ctx);
@@ -92,13 +156,26 @@ static bool process_data(
         MD5_Update(&md5_ctx, buf, len);
         len = is->read(is, buf, buf_size);
     }
+    padded_ctx = md5_ctx;
     MD5_Final(file->data.digest, &md5_ctx);
 
+    /* Base files are identified by their digest padded to whole blocks */
+    if (total%BS == 0)
+    {
+        memcpy(file->data.padded, file->data.digest, DS);
+    }
+    else
+    {
+        memset(buf, 0, BS - total%BS);
+        MD5_Update(&padded_ctx, buf, BS - total%BS);
+        MD5_Final(file->data.padded, &padded_ctx);
+    }
+
     hexstring(digest_str, file->data.digest, DS);
     if (fp != NULL)
     {
-        fprintf(fp, "%s (%d blocks)\n",
-                digest_str, (int)(total/BS + (bool)(total%BS)) );
+        fprintf(fp, "%s (%llu blocks)\n", digest_str,
+                (unsigned long long)(total/BS + (bool)(total%BS)) );
     }
 
     file->type = FILE_DATA;
@@ -106,16 +183,61 @@ static bool process_data(
     return true;
 }
 
+/* Identifies the file read from `is', and stores its type and properties in
+   `file'. Returns false (and stores an error message in `error') if the file
+   cannot be read or is invalid. */
+static bool identify_stream( InputStream *is, struct File *file, FILE *fp,
+                             const char **error )
+{
+    char   buf[512];
+    size_t len;
+    int    format = -1;
+
+    assert(sizeof(buf) >= MAGIC_LEN);
+
+    len = is->read(is, buf, MAGIC_LEN);
+    if (len == MAGIC_LEN) format = parse_magic(buf);
+    if (len == MAGIC_LEN ? format < 0 : memcmp(buf, MAGIC_STR, len) != 0)
+    {
+        /* File does NOT start with a prefix of the signature; assume this
+           is not a differences file, but a regular data file instead. */
+        if (fp != NULL)
+        {
+            fprintf(fp, "data: ");
+            fflush(stdout);
+        }
+        return process_data(is, buf, sizeof(buf), len, file, fp, error);
+    }
+
+    /* File starts with prefix of signature */
+    if (len < MAGIC_LEN)
+    {
+        if (len == 0)
+        {
+            *error = "unreadable or empty file";
+        }
+        else
+        {
+            *error = "incomplete signature -- file truncated?";
+        }
+        return false;
+    }
+
+    /* Valid signature; process as differences file */
+    if (fp != NULL)
+    {
+        fprintf(fp, "diff: ");
+        fflush(stdout);
+    }
+    return process_diff(is, buf, format, file, fp, error);
+}
+
 static bool process_file(const char *path, FILE *fp, struct File ***files)
 {
     struct File *file;
-    bool        res, is_diff;
+    bool        res;
     const char  *error = NULL;
     InputStream *is;
-    char        buf[512];
-    size_t      len;
-
-    assert(sizeof(buf) >= MAGIC_LEN);
 
     /* Allocate file entry: */
     file = malloc(sizeof(struct File));
@@ -135,6 +257,7 @@ static bool process_file(const char *path, FILE *fp, struct File ***files)
 
     is = (strcmp(path, "-") == 0) ? OpenStdinInputStream()
                                   : OpenFileInputStream(path);
+    is = stats_input_stream(is, file->path);
     if (is == NULL)
     {
         error = "failed to open file";
@@ -142,49 +265,10 @@ static bool process_file(const char *path, FILE *fp, struct File ***files)
     }
     else
     {
-        len = is->read(is, buf, MAGIC_LEN);
-        is_diff = memcmp(buf, MAGIC_STR, len) == 0;
-        if (is_diff)
-        {
-            /* File starts with prefix of signature */
-            if (len < MAGIC_LEN)
-            {
-                if (len == 0)
-                {
-                    error = "unreadable or empty file";
-                }
-                else
-                {
-                    error = "incomplete signature -- file truncated?";
-                }
-                res = false;
-            }
-            else
-            {
-                /* Valid signature; process as differences file */
-                if (fp != NULL)
-                {
-                    fprintf(fp, "diff: ");
-                    fflush(stdout);
-                }
-                res = process_diff(is, file, fp, &error);
-            }
-        }
-        else
-        {
-            /* File does NOT start with a prefix of the signature; assume this
-               is not a differences file, but a regular data file instead. */
-            if (fp != NULL)
-            {
-                fprintf(fp, "data: ");
-                fflush(stdout);
-            }
-            res = process_data(is, buf, sizeof(buf), len, file, fp, &error);
-        }
+        res = identify_stream(is, file, fp, &error);
+        is->close(is);
     }
 
-    if (is != NULL) is->close(is);
-
     if (!res)
     {
         assert(error != NULL);
@@ -196,6 +280,29 @@ static bool process_file(const char *path, FILE *fp, struct File ***files)
     return res;
 }
 
+bool tardiff_identify(TardiffContext *tc, InputStream *is, struct File *file)
+{
+    const char *error = NULL;
+    ErrorHandler eh;
+
+    if (setjmp(eh.env) != 0)
+    {
+        strcpy(tc->error, eh.message);
+        return false;
+    }
+    push_error_handler(&eh);
+    if (!identify_stream(is, file, NULL, &error))
+    {
+        file->type = FILE_INVALID;
+        file->invalid.error = error;
+        snprintf(tc->error, sizeof(tc->error), "%s", error);
+        pop_error_handler(&eh);
+        return false;
+    }
+    pop_error_handler(&eh);
+    return true;
+}
+
 bool identify_files(const char **paths, int npath, FILE *fp,
                     struct File **files)
 {
@@ -210,12 +317,52 @@ bool identify_files(const char **paths, int npath, FILE *fp,
     return res;
 }
 
+bool bases_present(struct File *files, struct File *file)
+{
+    struct File *data;
+    BaseList *bl;
+    size_t n;
+
+    if (file->type != FILE_DIFF || file->diff.bases == NULL) return false;
+    bl = file->diff.bases;
+    for (n = 0; n < bl->count; ++n)
+    {
+        for (data = files; data != NULL; data = data->next)
+        {
+            if (data->type == FILE_DATA &&
+                memcmp(data->data.padded, bl->digests[n], DS) == 0) break;
+        }
+        if (data == NULL) return false;
+    }
+    return true;
+}
+
+void write_bases(struct File *files, struct File *file, FILE *fp)
+{
+    BaseList *bl = file->diff.bases;
+    struct File *data;
+    size_t n;
+
+    fprintf(fp, "%s: applies to", file->path);
+    for (n = 0; n < bl->count; ++n)
+    {
+        for (data = files; data != NULL; data = data->next)
+        {
+            if (data->type == FILE_DATA &&
+                memcmp(data->data.padded, bl->digests[n], DS) == 0) break;
+        }
+        fprintf(fp, " %s", data->path);
+    }
+    fprintf(fp, "\n");
+}
+
 void free_files(struct File *files)
 {
     struct File *file, *next;
     for (file = files; file != NULL; file = next)
     {
         next = file->next;
+        if (file->type == FILE_DIFF) BaseList_destroy(file->diff.bases);
         free(file->path);
         free(file);
     }
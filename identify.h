@@ -2,6 +2,7 @@
 #define IDENTIFY_H_INCLUDED
 
 #include "common.h"
+#include "format.h"
 
 /* Common functions used to identify files passed on the command line. */
 
@@ -14,15 +15,18 @@ struct InvalidFile
 
 struct DataFile
 {
-    uint8_t         digest[DS];
+    uint8_t         digest[DS];     /* file digest */
+    uint8_t         padded[DS];     /* digest of the file padded to blocks */
 };
 
 struct DiffFile
 {
     uint8_t         digest1[DS];    /* input file digest */
     uint8_t         digest2[DS];    /* output file digest */
-    uint32_t        copied;         /* number of blocks copied */
-    uint32_t        added;          /* number of blocks added */
+    uint64_t        copied;         /* number of blocks copied */
+    uint64_t        added;          /* number of blocks added */
+    uint64_t        runs;           /* number of contiguous runs copied */
+    BaseList        *bases;         /* base files (NULL if only one) */
 };
 
 struct File
@@ -46,6 +50,14 @@ struct File
 bool identify_files(const char **paths, int npath, FILE *fp,
                     struct File **files);
 
+/* Returns whether `file' is a differences file with multiple base files, all
+   of which are data files in the list `files'. */
+bool bases_present(struct File *files, struct File *file);
+
+/* Prints the data files in `files' that `file' applies to, if
+   bases_present(files, file) holds. */
+void write_bases(struct File *files, struct File *file, FILE *fp);
+
 /* Frees a file list as returned by identify_files. */
 void free_files(struct File *files);
 
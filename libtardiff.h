@@ -0,0 +1,91 @@
+#ifndef LIBTARDIFF_H_INCLUDED
+#define LIBTARDIFF_H_INCLUDED
+
+#include "common.h"
+#include "identify.h"
+
+/* Reentrant interface to the tardiff operations, for use by programs that
+   link against libtardiff instead of running the command line tools.
+
+   Input is read from InputStreams and output is written to OutputStreams,
+   which may be implemented by the caller (see common.h). All state of an
+   operation is kept in the caller-supplied context and in memory allocated
+   for the duration of the call, so different threads may perform operations
+   concurrently, provided they use different contexts and streams.
+
+   Each function returns true on success. On failure, it returns false and
+   stores a description of the error in the context; the output written so
+   far is then incomplete. Streams are never closed by these functions.
+   Warnings are still printed on standard error. */
+
+typedef struct TardiffContext
+{
+    bool tar_mode;              /* match blocks per tar member (diff only) */
+    bool wide_format;           /* always use 64-bit indices (diff only) */
+    char error[1024];           /* message describing the last error */
+} TardiffContext;
+
+/* Initializes a context with default settings. */
+void tardiff_init(TardiffContext *tc);
+
+/* Writes a differences file to `os' that describes how to generate the file
+   read from `file2' from the file read from `file1'. */
+bool tardiff_diff( TardiffContext *tc, InputStream *file1, InputStream *file2,
+                   OutputStream *os );
+
+/* Like tardiff_diff(), but also writes the reverse differences file, which
+   generates file 1 from file 2, to `reverse' (unless it is NULL). Both files
+   are read and hashed once, but `file1' must be seekable, since blocks that
+   do not occur in file 2 are read again. */
+bool tardiff_diff_both( TardiffContext *tc, InputStream *file1,
+                        InputStream *file2, OutputStream *os,
+                        OutputStream *reverse );
+
+/* Like tardiff_diff(), but copies blocks from the concatenation of `nbase'
+   base files (each padded with zeroes to a whole number of blocks) instead of
+   a single file 1. The base files are listed in the differences file, and must
+   be passed to tarpatch in the same order. */
+bool tardiff_diff_bases( TardiffContext *tc, InputStream **bases, int nbase,
+                         InputStream *file2, OutputStream *os );
+
+/* An index of file 1, which can be used to generate differences files from
+   the same file 1 to several files 2 without reading file 1 again. The index
+   is kept in memory and in memory-mapped temporary files. */
+typedef struct TardiffIndex TardiffIndex;
+
+/* Reads file 1 and builds its index, in tar-aware mode if set in the context.
+   Returns NULL on failure. The index must be freed with
+   tardiff_index_destroy(). */
+TardiffIndex *tardiff_index_create(TardiffContext *tc, InputStream *file1);
+
+/* Returns the approximate number of bytes of memory used by the index. */
+uint64_t tardiff_index_memory(const TardiffIndex *index);
+
+/* Like tardiff_diff(), but copies blocks from the file 1 indexed in `index'
+   (so the tar_mode setting of the context is ignored). The index is not
+   modified, so several threads may use the same index concurrently. */
+bool tardiff_diff_index( TardiffContext *tc, const TardiffIndex *index,
+                         InputStream *file2, OutputStream *os );
+
+/* Frees an index. */
+void tardiff_index_destroy(TardiffIndex *index);
+
+/* Applies the differences file read from `diff' to the file read from
+   `file1', and writes the resulting file to `os', verifying it afterwards.
+   Either `file1' must be seekable, or `os' must support seeking and reading
+   back data written. */
+bool tardiff_patch( TardiffContext *tc, InputStream *file1, InputStream *diff,
+                    OutputStream *os );
+
+/* Composes `ndiff' differences files, each of which applies to the output of
+   the previous one, and writes the resulting differences file to `os'. */
+bool tardiff_merge( TardiffContext *tc, InputStream **diffs, int ndiff,
+                    OutputStream *os );
+
+/* Determines whether the file read from `is' is a differences file or a data
+   file, and stores its type and properties in `file' (its `path' and `next'
+   fields are left unchanged). For a differences file with multiple base files,
+   `file->diff.bases' must be freed with BaseList_destroy. */
+bool tardiff_identify(TardiffContext *tc, InputStream *is, struct File *file);
+
+#endif /* ndef LIBTARDIFF_H_INCLUDED */
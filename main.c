@@ -1,3 +1,5 @@
+#include "progress.h"
+#include "stats.h"
 #include <assert.h>
 #include <libgen.h>
 #include <stdbool.h>
@@ -9,34 +11,95 @@ extern int tardiff(int argc, char *argv[], char *flags);
 extern int tarpatch(int argc, char *argv[], char *flags);
 extern int tardiffinfo(int argc, char *argv[], char *flags);
 extern int tardiffmerge(int argc, char *argv[], char *flags);
+extern int tardiffstore(int argc, char *argv[], char *flags);
+extern int tardiffchain(int argc, char *argv[], char *flags);
+extern int tardiffd(int argc, char *argv[], char *flags);
 
-static enum Tool { none, diff, patch, info, merge } tool = none;
+static enum Tool { none, diff, patch, info, merge, store, chain, daemon }
+    tool = none;
 
 static void (*usage_func)(void);
 static int (*tool_func)(int, char**, char*);
 static int min_args, max_args;
 static const char *tool_flags;
+static const char *tool_options;
 static char flags[256];
+static Stats stats;
+static const char * const tool_names[] = {
+    "none", "tardiff", "tarpatch", "tardiffinfo", "tardiffmerge",
+    "tardiffstore", "tardiffchain", "tardiffd" };
 
 static void usage_tardiff()
 {
     printf("Usage:\n"
-           "\ttardiff <file1> <file2> <diff>\n"
-           "\ttardiff (-p|--patch) <file1> <diff> <file2>\n"
+           "\ttardiff [-t] [-w] [--reverse=<diff>] <file1> [<base>..] <file2>"
+           " <diff>\n"
+           "\ttardiff (-p|--patch) [-f] <file1> [<base>..] <diff> [..] <file2>"
+           "\n"
+           "\ttardiff (-p|--patch) (--member=<path>|--bytes=<start>-[<end>])\n"
+           "\t\t<file1> <diff> <output>\n"
+           "\ttardiff (-p|--patch) --blocks=<first>-[<end>] <file1> <diff>"
+           " <output>\n"
+           "\ttardiff (-p|--patch) [-f] --in-place=<journal>\n"
+           "\t\t<file1> <diff> [..]\n"
            "\ttardiff (-m|--merge) [-f] <diff1> <diff2> [..] <diff>\n"
-           "\ttardiff (-i|--info)  <file> [..]\n");
+           "\ttardiff (-m|--merge) --onto=<merged> <diff1> <diff>\n"
+           "\ttardiff (-i|--info)  <file> [..]\n"
+           "\ttardiff (-s|--store) <store> add <name> <file>\n"
+           "\ttardiff (-s|--store) <store> restore <name> <file>\n"
+           "\ttardiff (-s|--store) <store> remove <name>\n"
+           "\ttardiff (-s|--store) <store> gc\n"
+           "\ttardiff (-c|--chain) [--budget=<blocks>] <directory>\n"
+           "\ttardiff (-d|--daemon) [-t] [-w] [--workers=<n>] [--memory=<MB>]\n"
+           "\t\t<socket> serve <name>=<file1> [..]\n"
+           "\ttardiff (-d|--daemon) <socket> diff <name> <file2> <diff>\n"
+           "\ttardiff (-d|--daemon) <socket> patch <name> <diff> <file2>\n"
+           "\ttardiff (-d|--daemon) <socket> verify <name> <diff>\n"
+           "All tools accept --stats to report statistics on standard error,"
+           "\n--progress=<fd|path> to report progress, and --io=<cached|stream|"
+           "direct>\nto control caching of input and temporary files.\n");
 }
 
 static void usage_tarpatch()
 {
     printf("Usage:\n"
-           "\ttarpatch <file1> <diff> <file2>\n");
+           "\ttarpatch [-f] <file1> [<base>..] <diff> [..] <file2>\n"
+           "\ttarpatch (--member=<path>|--bytes=<start>-[<end>])\n"
+           "\t\t<file1> <diff> <output>\n"
+           "\ttarpatch --blocks=<first>-[<end>] <file1> <diff> <output>\n"
+           "\ttarpatch [-f] --in-place=<journal> <file1> <diff> [..]\n");
 }
 
 static void usage_tardiffmerge()
 {
     printf("Usage:\n"
-           "\ttardiffmerge [-f] <diff1> <diff2> [..] <diff>\n");
+           "\ttardiffmerge [-f] <diff1> <diff2> [..] <diff>\n"
+           "\ttardiffmerge --onto=<merged> <diff1> <diff>\n");
+}
+
+static void usage_tardiffstore()
+{
+    printf("Usage:\n"
+           "\ttardiffstore <store> add <name> <file>\n"
+           "\ttardiffstore <store> restore <name> <file>\n"
+           "\ttardiffstore <store> remove <name>\n"
+           "\ttardiffstore <store> gc\n");
+}
+
+static void usage_tardiffchain()
+{
+    printf("Usage:\n"
+           "\ttardiffchain [--budget=<blocks>] <directory>\n");
+}
+
+static void usage_tardiffd()
+{
+    printf("Usage:\n"
+           "\ttardiffd [-t] [-w] [--workers=<n>] [--memory=<MB>]\n"
+           "\t\t<socket> serve <name>=<file1> [..]\n"
+           "\ttardiffd <socket> diff <name> <file2> <diff>\n"
+           "\ttardiffd <socket> patch <name> <diff> <file2>\n"
+           "\ttardiffd <socket> verify <name> <diff>\n");
 }
 
 static void usage_tardiffinfo()
@@ -57,8 +120,9 @@ static bool select_tool(enum Tool new_tool)
         tool_func   = &tardiff;
         if (usage_func == NULL) usage_func  = &usage_tardiff;
         min_args    =  3;
-        max_args    =  3;
-        tool_flags  = "";
+        max_args    = -1;
+        tool_flags  = "tw";
+        tool_options = " reverse ";
         break;
 
     case patch:
@@ -66,8 +130,9 @@ static bool select_tool(enum Tool new_tool)
         tool_func   = &tarpatch;
         if (usage_func == NULL) usage_func  = &usage_tarpatch;
         min_args    =  3;
-        max_args    =  3;
-        tool_flags  = "";
+        max_args    = -1;
+        tool_flags  = "f";
+        tool_options = " member bytes blocks in-place ";
         break;
 
     case merge:
@@ -77,6 +142,37 @@ static bool select_tool(enum Tool new_tool)
         min_args    =  3;
         max_args    = -1;
         tool_flags  = "f";
+        tool_options = " onto ";
+        break;
+
+    case store:
+        tool        = store;
+        tool_func   = &tardiffstore;
+        if (usage_func == NULL) usage_func  = &usage_tardiffstore;
+        min_args    =  2;
+        max_args    =  4;
+        tool_flags  = "";
+        tool_options = "";
+        break;
+
+    case chain:
+        tool        = chain;
+        tool_func   = &tardiffchain;
+        if (usage_func == NULL) usage_func  = &usage_tardiffchain;
+        min_args    =  1;
+        max_args    =  1;
+        tool_flags  = "";
+        tool_options = " budget ";
+        break;
+
+    case daemon:
+        tool        = daemon;
+        tool_func   = &tardiffd;
+        if (usage_func == NULL) usage_func  = &usage_tardiffd;
+        min_args    =  2;
+        max_args    = -1;
+        tool_flags  = "tw";
+        tool_options = " workers memory ";
         break;
 
     case info:
@@ -86,6 +182,7 @@ static bool select_tool(enum Tool new_tool)
         min_args    =  1;
         max_args    = -1;
         tool_flags  = "";
+        tool_options = "";
         break;
 
     default:
@@ -128,6 +225,20 @@ static char **parse_options(int argc, char *argv[])
               ? select_tool(info) :
               (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--merge") == 0)
               ? select_tool(merge) :
+              (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--store") == 0)
+              ? select_tool(store) :
+              (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--chain") == 0)
+              ? select_tool(chain) :
+              (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--daemon") == 0)
+              ? select_tool(daemon) :
+              (strcmp(argv[i], "--stats") == 0)
+              ? (active_stats = &stats) != NULL :
+              (strncmp(argv[i], "--progress=", 11) == 0)
+              ? progress_start(argv[i] + 11) :
+              (strncmp(argv[i], "--io=", 5) == 0)
+              ? set_io_policy(argv[i] + 5) :
+              (argv[i][1] == '-')
+              ? set_option(argv[i] + 2, tool_options) :
               (argv[i][0] == '-' && argv[i][1] != '\0' && argv[i][2] == '\0')
               ? add_flag(argv[i][1]) : false))
         {
@@ -142,7 +253,7 @@ int main(int argc, char *argv[])
 {
     const char *name = basename(argv[0]);
     char **args_begin, **args_end;
-    int num_args;
+    int num_args, res;
 
     if (strcmp(name, "tarpatch") == 0)
         select_tool(patch);
@@ -152,6 +263,15 @@ int main(int argc, char *argv[])
     else
     if (strcmp(name, "tardiffinfo") == 0)
         select_tool(info);
+    else
+    if (strcmp(name, "tardiffstore") == 0)
+        select_tool(store);
+    else
+    if (strcmp(name, "tardiffchain") == 0)
+        select_tool(chain);
+    else
+    if (strcmp(name, "tardiffd") == 0)
+        select_tool(daemon);
     else
         select_tool(diff);
 
@@ -159,11 +279,31 @@ int main(int argc, char *argv[])
     args_begin = parse_options(argc, argv);
     args_end   = &argv[argc];
     num_args   = args_end - args_begin;
+    if (tool == patch && get_option("in-place") != NULL)
+    {
+        /* File 1 is overwritten, so there is no output file argument */
+        --min_args;
+    }
+    if (tool == merge && get_option("onto") != NULL)
+    {
+        /* A single differences file is merged into the given one */
+        min_args = max_args = 2;
+    }
     if (num_args < min_args || (max_args != -1 && num_args > max_args))
     {
         (*usage_func)();
         exit(EXIT_FAILURE);
     }
 
-    return (*tool_func)(num_args, args_begin, flags);
+    if (active_stats != NULL) stats_init(&stats, tool_names[tool]);
+    res = (*tool_func)(num_args, args_begin, flags);
+    progress_stop();
+    if (active_stats != NULL)
+    {
+        stats_phase_end();
+        stats_print(&stats, stderr);
+        stats_free(&stats);
+    }
+
+    return res;
 }
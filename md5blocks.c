@@ -0,0 +1,121 @@
+#include "md5blocks.h"
+#include <pthread.h>
+
+#define CONCAT_(a, b) a ## b
+#define CONCAT(a, b) CONCAT_(a, b)
+
+/* MD5 round functions and step (see RFC 1321) */
+#define F(x, y, z) ((((y) ^ (z)) & (x)) ^ (z))
+#define G(x, y, z) ((((x) ^ (y)) & (z)) ^ (y))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define I(x, y, z) ((y) ^ ((x) | ~(z)))
+#define ROTL(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+#define STEP(f, a, b, c, d, x, t, s) \
+    ((a) += f((b), (c), (d)) + (x) + (t), (a) = ROTL((a), (s)) + (b))
+
+static inline uint32_t load_le32(const char *p)
+{
+    const uint8_t *q = (const uint8_t*)p;
+    return (uint32_t)q[0] | (uint32_t)q[1] << 8 |
+           (uint32_t)q[2] << 16 | (uint32_t)q[3] << 24;
+}
+
+static inline void store_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+/* Hashes blocks one at a time with OpenSSL */
+static void md5_blocks_openssl(const char *data, uint8_t (*digests)[DS])
+{
+    MD5_CTX md5_ctx;
+
+    MD5_Init(&md5_ctx);
+    MD5_Update(&md5_ctx, data, BS);
+    MD5_Final(digests[0], &md5_ctx);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#define KERNEL md5_blocks_sse2
+#define LANES 4
+#define TARGET "sse2"
+#include "md5lanes.h"
+#undef KERNEL
+#undef LANES
+#undef TARGET
+
+#define KERNEL md5_blocks_avx2
+#define LANES 8
+#define TARGET "avx2"
+#include "md5lanes.h"
+#undef KERNEL
+#undef LANES
+#undef TARGET
+
+#define KERNEL md5_blocks_avx512
+#define LANES 16
+#define TARGET "avx512f"
+#include "md5lanes.h"
+#undef KERNEL
+#undef LANES
+#undef TARGET
+
+#define HAVE_KERNELS 1
+
+#endif
+
+/* Kernels from wide to narrow. The last one hashes a single block, and is used
+   for blocks left over by the wider kernels. */
+static struct Kernel
+{
+    void (*func)(const char *data, uint8_t (*digests)[DS]);
+    size_t lanes;
+} kernels[4];
+
+static size_t num_kernels;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void select_kernels()
+{
+    struct Kernel *k = kernels;
+
+#ifdef HAVE_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        k->func = md5_blocks_avx512, k->lanes = 16, ++k;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        k->func = md5_blocks_avx2, k->lanes = 8, ++k;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        k->func = md5_blocks_sse2, k->lanes = 4, ++k;
+    }
+#endif
+    k->func = md5_blocks_openssl, k->lanes = 1, ++k;
+    num_kernels = k - kernels;
+}
+
+void md5_blocks(const void *data, size_t n, uint8_t (*digests)[DS])
+{
+    const char *p = data;
+    size_t i;
+
+    pthread_once(&kernels_once, select_kernels);
+    for (i = 0; i < num_kernels; ++i)
+    {
+        while (n >= kernels[i].lanes)
+        {
+            kernels[i].func(p, digests);
+            p       += kernels[i].lanes*BS;
+            digests += kernels[i].lanes;
+            n       -= kernels[i].lanes;
+        }
+    }
+}
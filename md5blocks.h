@@ -0,0 +1,13 @@
+#ifndef MD5BLOCKS_H_INCLUDED
+#define MD5BLOCKS_H_INCLUDED
+
+#include "common.h"
+
+/* Computes the MD5 digests of `n' consecutive blocks of BS bytes at `data',
+   and stores them in `digests'. The digests are identical to those computed
+   with MD5_Init(), MD5_Update() and MD5_Final() for each block, but several
+   blocks are hashed in parallel using the widest SIMD instructions supported
+   by the processor (which are selected when the function is first called). */
+void md5_blocks(const void *data, size_t n, uint8_t (*digests)[DS]);
+
+#endif /* ndef MD5BLOCKS_H_INCLUDED */
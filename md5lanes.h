@@ -0,0 +1,131 @@
+/* MD5 kernel that hashes LANES consecutive blocks in parallel, one in each
+   lane of a vector. This file is included by md5blocks.c once for each kernel,
+   with KERNEL (the function name), LANES and TARGET (the instruction set, as
+   accepted by the target attribute) defined. Vector operations are written
+   with GCC's vector extensions, so each inclusion compiles to the instruction
+   set of its target. */
+
+#define VEC     CONCAT(KERNEL, _vec)
+
+typedef uint32_t VEC __attribute__((vector_size(4*LANES)));
+
+__attribute__((target(TARGET)))
+static void KERNEL(const char *data, uint8_t (*digests)[DS])
+{
+    VEC a, b, c, d, aa, bb, cc, dd, x[16];
+    uint32_t words[16][LANES];
+    int chunk, i, j;
+
+    a = (VEC){ 0 } + 0x67452301u;
+    b = (VEC){ 0 } + 0xefcdab89u;
+    c = (VEC){ 0 } + 0x98badcfeu;
+    d = (VEC){ 0 } + 0x10325476u;
+
+    /* Each block consists of 8 chunks of 64 bytes, followed by a padding chunk
+       which is the same for all blocks */
+    for (chunk = 0; chunk <= BS/64; ++chunk)
+    {
+        if (chunk < BS/64)
+        {
+            for (i = 0; i < 16; ++i)
+            {
+                for (j = 0; j < LANES; ++j)
+                {
+                    words[i][j] = load_le32(data + j*BS + chunk*64 + 4*i);
+                }
+            }
+        }
+        else
+        {
+            memset(words, 0, sizeof(words));
+            for (j = 0; j < LANES; ++j)
+            {
+                words[0][j]  = 0x80;
+                words[14][j] = 8*BS;
+            }
+        }
+        memcpy(x, words, sizeof(x));
+
+        aa = a, bb = b, cc = c, dd = d;
+
+        STEP(F, a, b, c, d, x[ 0], 0xd76aa478,  7);
+        STEP(F, d, a, b, c, x[ 1], 0xe8c7b756, 12);
+        STEP(F, c, d, a, b, x[ 2], 0x242070db, 17);
+        STEP(F, b, c, d, a, x[ 3], 0xc1bdceee, 22);
+        STEP(F, a, b, c, d, x[ 4], 0xf57c0faf,  7);
+        STEP(F, d, a, b, c, x[ 5], 0x4787c62a, 12);
+        STEP(F, c, d, a, b, x[ 6], 0xa8304613, 17);
+        STEP(F, b, c, d, a, x[ 7], 0xfd469501, 22);
+        STEP(F, a, b, c, d, x[ 8], 0x698098d8,  7);
+        STEP(F, d, a, b, c, x[ 9], 0x8b44f7af, 12);
+        STEP(F, c, d, a, b, x[10], 0xffff5bb1, 17);
+        STEP(F, b, c, d, a, x[11], 0x895cd7be, 22);
+        STEP(F, a, b, c, d, x[12], 0x6b901122,  7);
+        STEP(F, d, a, b, c, x[13], 0xfd987193, 12);
+        STEP(F, c, d, a, b, x[14], 0xa679438e, 17);
+        STEP(F, b, c, d, a, x[15], 0x49b40821, 22);
+
+        STEP(G, a, b, c, d, x[ 1], 0xf61e2562,  5);
+        STEP(G, d, a, b, c, x[ 6], 0xc040b340,  9);
+        STEP(G, c, d, a, b, x[11], 0x265e5a51, 14);
+        STEP(G, b, c, d, a, x[ 0], 0xe9b6c7aa, 20);
+        STEP(G, a, b, c, d, x[ 5], 0xd62f105d,  5);
+        STEP(G, d, a, b, c, x[10], 0x02441453,  9);
+        STEP(G, c, d, a, b, x[15], 0xd8a1e681, 14);
+        STEP(G, b, c, d, a, x[ 4], 0xe7d3fbc8, 20);
+        STEP(G, a, b, c, d, x[ 9], 0x21e1cde6,  5);
+        STEP(G, d, a, b, c, x[14], 0xc33707d6,  9);
+        STEP(G, c, d, a, b, x[ 3], 0xf4d50d87, 14);
+        STEP(G, b, c, d, a, x[ 8], 0x455a14ed, 20);
+        STEP(G, a, b, c, d, x[13], 0xa9e3e905,  5);
+        STEP(G, d, a, b, c, x[ 2], 0xfcefa3f8,  9);
+        STEP(G, c, d, a, b, x[ 7], 0x676f02d9, 14);
+        STEP(G, b, c, d, a, x[12], 0x8d2a4c8a, 20);
+
+        STEP(H, a, b, c, d, x[ 5], 0xfffa3942,  4);
+        STEP(H, d, a, b, c, x[ 8], 0x8771f681, 11);
+        STEP(H, c, d, a, b, x[11], 0x6d9d6122, 16);
+        STEP(H, b, c, d, a, x[14], 0xfde5380c, 23);
+        STEP(H, a, b, c, d, x[ 1], 0xa4beea44,  4);
+        STEP(H, d, a, b, c, x[ 4], 0x4bdecfa9, 11);
+        STEP(H, c, d, a, b, x[ 7], 0xf6bb4b60, 16);
+        STEP(H, b, c, d, a, x[10], 0xbebfbc70, 23);
+        STEP(H, a, b, c, d, x[13], 0x289b7ec6,  4);
+        STEP(H, d, a, b, c, x[ 0], 0xeaa127fa, 11);
+        STEP(H, c, d, a, b, x[ 3], 0xd4ef3085, 16);
+        STEP(H, b, c, d, a, x[ 6], 0x04881d05, 23);
+        STEP(H, a, b, c, d, x[ 9], 0xd9d4d039,  4);
+        STEP(H, d, a, b, c, x[12], 0xe6db99e5, 11);
+        STEP(H, c, d, a, b, x[15], 0x1fa27cf8, 16);
+        STEP(H, b, c, d, a, x[ 2], 0xc4ac5665, 23);
+
+        STEP(I, a, b, c, d, x[ 0], 0xf4292244,  6);
+        STEP(I, d, a, b, c, x[ 7], 0x432aff97, 10);
+        STEP(I, c, d, a, b, x[14], 0xab9423a7, 15);
+        STEP(I, b, c, d, a, x[ 5], 0xfc93a039, 21);
+        STEP(I, a, b, c, d, x[12], 0x655b59c3,  6);
+        STEP(I, d, a, b, c, x[ 3], 0x8f0ccc92, 10);
+        STEP(I, c, d, a, b, x[10], 0xffeff47d, 15);
+        STEP(I, b, c, d, a, x[ 1], 0x85845dd1, 21);
+        STEP(I, a, b, c, d, x[ 8], 0x6fa87e4f,  6);
+        STEP(I, d, a, b, c, x[15], 0xfe2ce6e0, 10);
+        STEP(I, c, d, a, b, x[ 6], 0xa3014314, 15);
+        STEP(I, b, c, d, a, x[13], 0x4e0811a1, 21);
+        STEP(I, a, b, c, d, x[ 4], 0xf7537e82,  6);
+        STEP(I, d, a, b, c, x[11], 0xbd3af235, 10);
+        STEP(I, c, d, a, b, x[ 2], 0x2ad7d2bb, 15);
+        STEP(I, b, c, d, a, x[ 9], 0xeb86d391, 21);
+
+        a += aa, b += bb, c += cc, d += dd;
+    }
+
+    for (j = 0; j < LANES; ++j)
+    {
+        store_le32(digests[j] +  0, a[j]);
+        store_le32(digests[j] +  4, b[j]);
+        store_le32(digests[j] +  8, c[j]);
+        store_le32(digests[j] + 12, d[j]);
+    }
+}
+
+#undef VEC
@@ -0,0 +1,84 @@
+#ifndef MERGE_H_INCLUDED
+#define MERGE_H_INCLUDED
+
+#include "common.h"
+#include "format.h"
+
+/* Functions to compose a sequence of differences files, used by tardiffmerge
+   and by tarpatch when it is given more than one differences file. */
+
+/* A merged patch file is described by a sequence of block references (one for
+   each block in the output file). The reference is made either to a block in
+   the original file (if is == NULL) in which case offset is a multiple of the
+   block size, or a block stored at the specified offset and file. If `edits'
+   is nonnegative, the edit list stored at that offset in the edit store
+   returned by merged_edits() must be applied to the block.
+*/
+typedef struct BlockRef
+{
+    InputStream *is;
+    off_t offset;
+    off_t edits;
+} BlockRef;
+
+/* State of a merge operation. */
+typedef struct MergeContext MergeContext;
+
+/* Creates a new merge context. merge_cleanup() must be called afterwards to
+   release its resources. */
+MergeContext *merge_create();
+
+/* Composes the differences file read from `is' (which must apply to the
+   output of the previously merged file) with the files merged before, or
+   fails. The stream must remain open until merging is finished. */
+void merge_stream(MergeContext *mc, InputStream *is);
+
+/* Composes a sequence of differences files with the files merged before, like
+   merge_stream() does for each of them in order, but reads the files in
+   parallel, and composes adjacent files as soon as both have been read (so
+   the temporary space used does not grow with the number of files). */
+void merge_streams(MergeContext *mc, InputStream **streams, int nstream);
+
+/* Identifies the differences files with the given paths, orders them so each
+   file applies to the output of the previous one (if `order_files' is true),
+   and composes them. Returns false (after printing an error message) if the
+   files cannot be composed. */
+bool merge_diffs(MergeContext *mc, char **paths, int npath, bool order_files);
+
+/* Writes a differences file equivalent to the composed files to `os'. */
+void merge_output(MergeContext *mc, OutputStream *os);
+
+/* Writes a differences file equivalent to the merged differences file read
+   from `is_merged' followed by the differences file read from `is' to `os',
+   using a new merge context. Instead of composing the block references of all
+   blocks, the copied blocks of the new file are looked up in the merged file
+   using its instruction index, so the time taken is proportional to the size
+   of the new file (rather than that of the files merged before). Both streams
+   must be seekable, and the merged file must have an extended footer. */
+void merge_onto( MergeContext *mc, InputStream *is_merged, InputStream *is,
+                 OutputStream *os );
+
+/* Returns the composed block references, and stores their number in
+   `num_blocks'. */
+BlockRef *merged_blocks(MergeContext *mc, size_t *num_blocks);
+
+/* Stores the MD5 digest of the final output file in `digest', and returns its
+   chunk digests, or NULL if these are not known. */
+ChunkDigests *merged_digests(MergeContext *mc, uint8_t digest[DS]);
+
+/* Returns the base files that the original file consists of, or NULL if it is
+   a single file. */
+BaseList *merged_bases(MergeContext *mc);
+
+/* Stores the MD5 digest of the original file in `digest' and returns true,
+   or returns false if it is not known (for version 1.0 files). */
+bool merged_source_digest(MergeContext *mc, uint8_t digest[DS]);
+
+/* Returns the edit store containing the edit lists of the composed blocks. */
+EditStore *merged_edits(MergeContext *mc);
+
+/* Closes the differences files opened by merge_diffs(), and frees the
+   composed block references and the context itself. */
+void merge_cleanup(MergeContext *mc);
+
+#endif /* ndef MERGE_H_INCLUDED */
@@ -1,10 +1,12 @@
-#include "common.h"
+#include "patch.h"
 #include "binsort.h"
+#include "progress.h"
 
 struct CopyBlock
 {
-    uint32_t S;  /* source block index */
-    uint32_t T;  /* target block index */
+    uint64_t S;     /* source block index */
+    uint64_t T;     /* target block index */
+    off_t    E;     /* offset of edit list in edit store (or -1 if none) */
 };
 
 static int cb_compare(const void *a, const void *b)
@@ -17,86 +19,146 @@ static int cb_compare(const void *a, const void *b)
     return 0;
 }
 
-void patch_backward(InputStream *is_file1, InputStream *is_diff,
-                   uint8_t digest_out[DS])
+/* Reads file 1 in sequence, and copies blocks to the output file as described
+   by the sorted copy instructions in `bs'. Output position `T' is the current
+   position of output stream `os'. Edit lists are taken from `es'. */
+static void copy_from_file1( InputStream *is_file1, BinSort *bs, uint64_t T,
+                             EditStore *es, OutputStream *os )
+{
+    Progress *progress = active_progress;
+    char edited[BS];
+    char data[BS];
+    uint64_t s = 0, t = T;
+    struct CopyBlock *cb  = BinSort_mmap(bs), *end = cb + BinSort_size(bs);
+
+    progress_phase("copy", (uint64_t)BinSort_size(bs)*BS);
+    for ( ; cb != end; ++cb)
+    {
+        for ( ; s <= cb->S; ++s) read_data(is_file1, data, BS);
+        assert(s == cb->S + 1);
+        if (cb->T != t) seek_output(os, (off_t)cb->T*BS);
+        if (cb->E < 0)
+        {
+            write_data(os, data, BS);
+        }
+        else
+        {
+            memcpy(edited, data, BS);
+            EditStore_apply(es, cb->E, edited);
+            write_data(os, edited, BS);
+        }
+        t = cb->T + 1;
+        progress_add(progress, BS);
+    }
+}
+
+void patch_backward( InputStream *is_file1, InputStream *is_diff,
+                     enum DiffFormat format, OutputStream *os, Verifier *v )
 {
     BinSort *bs = BinSort_create(sizeof(struct CopyBlock), 1<<20, cb_compare);
-    uint32_t T = 0;
+    Progress *progress = active_progress;
+    EditStore *es = NULL;
+    uint64_t T = 0;
     char data[BS];
+    uint8_t buf[MAX_EDIT_LIST];
+    size_t size;
+    Instruction ins;
+    enum InstructionStatus status;
 
     /* Process differences file and copy new blocks into output: */
     for (;;)
     {
-        uint32_t S = read_uint32(is_diff);
-        uint16_t C = read_uint16(is_diff);
-        uint16_t A = read_uint16(is_diff);
-
-        if (S == 0xffffffffu && C == 0xffffu && A == 0xffffu) break;
-
-        if (C > 0x7fff || A > 0x7fff || (S < 0xffffffffu) != (C > 0))
+        read_data(is_diff, buf, INSTRUCTION_LEN(format));
+        status = parse_instruction(buf, format, &ins);
+        if (status == INSTRUCTION_END) break;
+        if (status == INSTRUCTION_INVALID)
         {
-            fprintf(stderr, "Invalid diff data.\n");
-            abort();
+            fail("Invalid diff data.");
         }
 
-        assert(T + C + A >= T);  /* detect overflow */
+        assert(T + ins.C + ins.A >= T);  /* detect overflow */
 
-        while (C-- > 0)
+        while (ins.C-- > 0)
         {
             static char zeroes[BS];
-            struct CopyBlock cb = { S++, T++ };
+            struct CopyBlock cb = { ins.S++, T++, -1 };
+            if (ins.patched)
+            {
+                /* Keep edit list until the block is copied */
+                size = read_edit_list(is_diff, buf);
+                if (size == 0)
+                {
+                    fail("Invalid diff data.");
+                }
+                if (es == NULL) es = EditStore_create();
+                cb.E = EditStore_add(es, buf, size);
+            }
             BinSort_add(bs, &cb);
-            write_data(zeroes, BS);
+            write_data(os, zeroes, BS);
+            progress_add(progress, BS);
         }
 
-        while (A-- > 0)
+        while (ins.A-- > 0)
         {
             read_data(is_diff, data, BS);
-            write_data(data, BS);
+            write_data(os, data, BS);
+            progress_add(progress, BS);
             T++;
         }
     }
 
     /* Process file 1 in sequence: */
-    {
-        uint32_t s = 0, t = T;
-        struct CopyBlock *cb  = BinSort_mmap(bs), *end = cb + BinSort_size(bs);
-        for ( ; cb != end; ++cb)
-        {
-            for ( ; s <= cb->S; ++s) read_data(is_file1, data, BS);
-            assert(s == cb->S + 1);
-            if (cb->T != t && fseeko(stdout, (off_t)cb->T*BS, SEEK_SET) != 0)
-            {
-                fprintf(stderr, "Seek failed.\n");
-                abort();
-            }
-            write_data(data, BS);
-            t = cb->T + 1;
-        }
-    }
+    copy_from_file1(is_file1, bs, T, es, os);
 
+    EditStore_destroy(es);
     BinSort_destroy(bs);
 
     /* Calculcate checksum of output file: */
-    {
-        MD5_CTX md5_ctx;
-        uint32_t t;
+    Verifier_add_file(v, os, T);
+}
+
+void patch_chain_backward( InputStream *is_file1, const BlockRef *blocks,
+                           size_t num_blocks, EditStore *edits,
+                           OutputStream *os, Verifier *v )
+{
+    BinSort *bs = BinSort_create(sizeof(struct CopyBlock), 1<<20, cb_compare);
+    Progress *progress = active_progress;
+    uint64_t T;
+    char data[BS];
 
-        if (fseeko(stdout, 0, SEEK_SET) != 0)
+    /* Copy blocks from differences files into output: */
+    for (T = 0; T < num_blocks; ++T)
+    {
+        if (blocks[T].is == NULL)
         {
-            fprintf(stderr, "Seek failed.\n");
-            abort();
+            static char zeroes[BS];
+            struct CopyBlock cb = { blocks[T].offset/BS, T, blocks[T].edits };
+            BinSort_add(bs, &cb);
+            write_data(os, zeroes, BS);
         }
-        MD5_Init(&md5_ctx);
-        for (t = 0; t < T; ++t)
+        else
         {
-            if (fread(data, BS, 1, stdout) != 1)
+            if ( (T == 0 || blocks[T - 1].is != blocks[T].is ||
+                  blocks[T - 1].offset + BS != blocks[T].offset) &&
+                 !blocks[T].is->seek(blocks[T].is, blocks[T].offset) )
+            {
+                fail("Seek failed.");
+            }
+            read_data(blocks[T].is, data, BS);
+            if (blocks[T].edits >= 0)
             {
-                fprintf(stderr, "Read failed.\n");
-                abort();
+                EditStore_apply(edits, blocks[T].edits, data);
             }
-            MD5_Update(&md5_ctx, data, BS);
+            write_data(os, data, BS);
         }
-        MD5_Final(digest_out, &md5_ctx);
+        progress_add(progress, BS);
     }
+
+    /* Process file 1 in sequence: */
+    copy_from_file1(is_file1, bs, T, edits, os);
+
+    BinSort_destroy(bs);
+
+    /* Calculcate checksum of output file: */
+    Verifier_add_file(v, os, T);
 }
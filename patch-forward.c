@@ -1,52 +1,462 @@
-#include "common.h"
+#include "patch.h"
+#include "progress.h"
+#include "stats.h"
+#include <pthread.h>
 
-void patch_forward(InputStream *is_file1, InputStream *is_diff,
-                   uint8_t digest_out[DS])
+/* Output blocks are produced into a ring of buffers that pass through four
+   stages, each in its own thread, so decoding, reading, writing and hashing
+   overlap. The calling thread parses the instructions and reads the diff file
+   (which is sequential), storing added blocks and edit lists directly in the
+   buffer, and queues the runs of blocks to be copied from file 1. A fetch
+   thread reads those runs from file 1 and applies the edit lists, so seeks in
+   file 1 do not stall decoding. Two more threads write the buffers to the
+   output file and hash them. A buffer is reused only after it has been both
+   written and hashed.
+
+   File 1 is read by a single fetch thread through its input stream, which may
+   be a concatenation of base files or a decompressor, and so cannot be shared
+   between readers. patch_chain_forward() has nothing to decode, so there the
+   calling thread fetches the blocks itself. */
+#define PIPE_BUFFERS    4       /* number of buffers in the ring */
+#define PIPE_BLOCKS     1024    /* blocks per buffer (512 KB) */
+#define NO_EDITS        ((size_t)-1)
+
+/* A run of blocks to be read from file 1 */
+typedef struct Fetch
 {
-    MD5_CTX file2_md5_ctx;
-    char data[BS];
-    uint32_t S;
-    uint16_t C, A;
+    off_t           offset;     /* byte offset in file 1 */
+    size_t          pos;        /* first block in the buffer */
+    size_t          count;      /* number of blocks */
+} Fetch;
 
-    MD5_Init(&file2_md5_ctx);
+/* Everything the fetch stage needs to complete a buffer */
+typedef struct Slot
+{
+    size_t          nblocks;    /* blocks stored in the buffer */
+    size_t          nfetch;     /* runs of blocks to read from file 1 */
+    Fetch           fetch[PIPE_BLOCKS];
+    uint8_t         *edits;     /* encoded edit lists */
+    size_t          edits_len, edits_cap;
+    size_t          edit[PIPE_BLOCKS];  /* offset of each block's edit list
+                                           in `edits', or NO_EDITS */
+} Slot;
 
-    for (;;)
+typedef struct Pipeline
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    char            *data;      /* PIPE_BUFFERS buffers */
+    Slot            *slots;     /* PIPE_BUFFERS slots */
+    size_t          filled;     /* number of buffers produced */
+    size_t          fetched;    /* number of buffers fetched */
+    size_t          written;    /* number of buffers written */
+    size_t          hashed;     /* number of buffers hashed */
+    size_t          pos;        /* blocks in the buffer being filled */
+    bool            finished;   /* have all buffers been produced? */
+    bool            failed;     /* did an operation fail? */
+    char            message[256];   /* describes the failure */
+    InputStream     *file1;     /* file 1 (if fetched by a separate thread) */
+    off_t           file1_pos;  /* current offset in file 1 */
+    OutputStream    *os;
+    Verifier        *v;
+    Progress        *progress;
+    Stats           *stats;     /* statistics of the calling thread */
+    pthread_t       threads[3]; /* writer, hasher and fetcher (if any) */
+    int             nthread;
+} Pipeline;
+
+static char *buffer(Pipeline *p, size_t i)
+{
+    return p->data + (i%PIPE_BUFFERS)*PIPE_BLOCKS*BS;
+}
+
+/* Waits until buffer number `*count' has passed the previous stage (which has
+   processed `*limit' buffers), and returns it, or returns NULL if there are no
+   more buffers to process. */
+static char *next_buffer(Pipeline *p, size_t *count, size_t *limit)
+{
+    char *data = NULL;
+
+    pthread_mutex_lock(&p->lock);
+    while ( *count == *limit && !p->failed &&
+            !(p->finished && *count == p->filled) )
+    {
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+    if (*count < *limit && !p->failed) data = buffer(p, *count);
+    pthread_mutex_unlock(&p->lock);
+    return data;
+}
+
+static void buffer_done(Pipeline *p, size_t *count)
+{
+    pthread_mutex_lock(&p->lock);
+    ++*count;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void pipeline_failed(Pipeline *p, const char *message)
+{
+    pthread_mutex_lock(&p->lock);
+    if (!p->failed)
     {
-        S = read_uint32(is_diff);
-        C = read_uint16(is_diff);
-        A = read_uint16(is_diff);
+        p->failed = true;
+        snprintf(p->message, sizeof(p->message), "%s", message);
+    }
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
 
-        if (S == 0xffffffffu && C == 0xffffu && A == 0xffffu) break;
+static void *fetch_buffers(void *arg)
+{
+    Pipeline *p = arg;
+    ErrorHandler eh;
+    Slot *s;
+    Fetch *f;
+    char *data;
+    size_t i;
 
-        if (C > 0x7fff || A > 0x7fff || (S < 0xffffffffu) != (C > 0))
+    if (setjmp(eh.env) != 0)
+    {
+        pipeline_failed(p, eh.message);
+        return NULL;
+    }
+    push_error_handler(&eh);
+    while ((data = next_buffer(p, &p->fetched, &p->filled)) != NULL)
+    {
+        s = &p->slots[p->fetched%PIPE_BUFFERS];
+        for (i = 0; i < s->nfetch; ++i)
         {
-            fprintf(stderr, "Invalid diff data.\n");
-            abort();
+            f = &s->fetch[i];
+            if (f->offset != p->file1_pos)
+            {
+                if (p->stats != NULL) ++p->stats->patch_seeks;
+                if (!p->file1->seek(p->file1, f->offset)) fail("Seek failed.");
+            }
+            read_data(p->file1, data + f->pos*BS, f->count*BS);
+            p->file1_pos = f->offset + (off_t)f->count*BS;
         }
-
-        if (S < 0xffffffffu)
+        for (i = 0; i < s->nblocks; ++i)
         {
-            if (!is_file1->seek(is_file1, (off_t)BS*S))
+            if (s->edit[i] != NO_EDITS)
             {
-                fprintf(stderr, "Seek failed.\n");
-                abort();
+                apply_edit_list(s->edits + s->edit[i], data + i*BS);
             }
+        }
+        buffer_done(p, &p->fetched);
+    }
+    pop_error_handler(&eh);
+    return NULL;
+}
+
+static void *write_buffers(void *arg)
+{
+    Pipeline *p = arg;
+    ErrorHandler eh;
+    char *data;
+
+    if (setjmp(eh.env) != 0)
+    {
+        pipeline_failed(p, eh.message);
+        return NULL;
+    }
+    push_error_handler(&eh);
+    while ((data = next_buffer(p, &p->written, &p->fetched)) != NULL)
+    {
+        write_data( p->os, data,
+                    p->slots[p->written%PIPE_BUFFERS].nblocks*BS );
+        buffer_done(p, &p->written);
+    }
+    pop_error_handler(&eh);
+    return NULL;
+}
+
+static void *hash_buffers(void *arg)
+{
+    Pipeline *p = arg;
+    char *data;
+    size_t n;
+
+    while ((data = next_buffer(p, &p->hashed, &p->fetched)) != NULL)
+    {
+        n = p->slots[p->hashed%PIPE_BUFFERS].nblocks;
+        Verifier_add_blocks(p->v, data, n);
+        progress_add(p->progress, n*BS);
+        buffer_done(p, &p->hashed);
+    }
+    return NULL;
+}
+
+static void pipeline_stop(Pipeline *p)
+{
+    int n;
+
+    for (n = 0; n < p->nthread; ++n) pthread_join(p->threads[n], NULL);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    for (n = 0; n < PIPE_BUFFERS; ++n) free(p->slots[n].edits);
+    free(p->slots);
+    free(p->data);
+}
+
+/* Stops the pipeline after an error in the calling thread. */
+static void pipeline_abort(Pipeline *p)
+{
+    pipeline_failed(p, "");
+    pipeline_stop(p);
+}
+
+static void start_thread(Pipeline *p, void *(*func)(void *))
+{
+    if (pthread_create(&p->threads[p->nthread], NULL, func, p) != 0)
+    {
+        pipeline_abort(p);
+        fail("Cannot create thread!");
+    }
+    ++p->nthread;
+}
+
+/* Starts the pipeline. If `file1' is not NULL, blocks queued with
+   pipeline_fetch() are read from it by a separate thread; otherwise the
+   caller stores all data in the buffers itself. */
+static void pipeline_start( Pipeline *p, InputStream *file1,
+                            OutputStream *os, Verifier *v )
+{
+    p->data  = malloc(PIPE_BUFFERS*PIPE_BLOCKS*BS);
+    p->slots = calloc(PIPE_BUFFERS, sizeof(Slot));
+    assert(p->data != NULL && p->slots != NULL);
+    p->filled   = p->fetched = p->written = p->hashed = p->pos = 0;
+    p->finished = p->failed = false;
+    p->file1    = file1;
+    p->file1_pos = -1;
+    p->os       = os;
+    p->v        = v;
+    p->progress = active_progress;
+    p->stats    = active_stats;
+    p->nthread  = 0;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    start_thread(p, write_buffers);
+    start_thread(p, hash_buffers);
+    if (file1 != NULL) start_thread(p, fetch_buffers);
+}
+
+/* Passes the buffer being filled on to the next stage. */
+static void submit_buffer(Pipeline *p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->slots[p->filled%PIPE_BUFFERS].nblocks = p->pos;
+    ++p->filled;
+    if (p->file1 == NULL) p->fetched = p->filled;
+    p->pos = 0;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Returns space for up to `*n' output blocks, and stores the number of blocks
+   available (which is at least 1) in `*n'. The blocks are passed on by
+   pipeline_commit(). */
+static char *pipeline_reserve(Pipeline *p, size_t *n)
+{
+    char message[sizeof(p->message)];
+    Slot *s;
+    size_t i;
+
+    if (p->pos == PIPE_BLOCKS) submit_buffer(p);
+    if (p->pos == 0)
+    {
+        /* Wait until the next buffer has been written and hashed */
+        pthread_mutex_lock(&p->lock);
+        while ( !p->failed && (p->filled - p->written == PIPE_BUFFERS ||
+                               p->filled - p->hashed  == PIPE_BUFFERS) )
+        {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        memcpy(message, p->message, sizeof(message));
+        pthread_mutex_unlock(&p->lock);
+        if (p->failed) fail("%s", message);
+
+        s = &p->slots[p->filled%PIPE_BUFFERS];
+        s->nfetch = s->edits_len = 0;
+        for (i = 0; i < PIPE_BLOCKS; ++i) s->edit[i] = NO_EDITS;
+    }
+    if (*n > PIPE_BLOCKS - p->pos) *n = PIPE_BLOCKS - p->pos;
+    return buffer(p, p->filled) + p->pos*BS;
+}
+
+/* Queues the `n' reserved blocks to be read from file 1 at `offset'. */
+static void pipeline_fetch(Pipeline *p, off_t offset, size_t n)
+{
+    Slot *s = &p->slots[p->filled%PIPE_BUFFERS];
+    Fetch *f;
+
+    if (s->nfetch > 0)
+    {
+        /* Extend the previous run if this one continues it */
+        f = &s->fetch[s->nfetch - 1];
+        if ( f->pos + f->count == p->pos &&
+             f->offset + (off_t)f->count*BS == offset )
+        {
+            f->count += n;
+            return;
+        }
+    }
+    f = &s->fetch[s->nfetch++];
+    f->offset = offset;
+    f->pos    = p->pos;
+    f->count  = n;
+}
+
+/* Reads the edit list of reserved block `k' from `is', to be applied after
+   the block has been fetched. Returns false if it is invalid. */
+static bool pipeline_read_edits(Pipeline *p, size_t k, InputStream *is)
+{
+    Slot *s = &p->slots[p->filled%PIPE_BUFFERS];
+    size_t size;
+
+    if (s->edits_cap - s->edits_len < MAX_EDIT_LIST)
+    {
+        s->edits_cap = 2*s->edits_cap + MAX_EDIT_LIST;
+        s->edits = realloc(s->edits, s->edits_cap);
+        assert(s->edits != NULL);
+    }
+    size = read_edit_list(is, s->edits + s->edits_len);
+    if (size == 0) return false;
+    s->edit[p->pos + k] = s->edits_len;
+    s->edits_len += size;
+    return true;
+}
+
+static void pipeline_commit(Pipeline *p, size_t n)
+{
+    p->pos += n;
+}
 
-            while (C-- > 0)
+/* Waits until all blocks have been written and hashed, and stops the
+   pipeline, or fails if writing failed. */
+static void pipeline_finish(Pipeline *p)
+{
+    if (p->pos > 0) submit_buffer(p);
+    pthread_mutex_lock(&p->lock);
+    p->finished = true;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pipeline_stop(p);
+    if (p->failed) fail("%s", p->message);
+}
+
+void patch_forward( InputStream *is_file1, InputStream *is_diff,
+                    enum DiffFormat format, OutputStream *os, Verifier *v )
+{
+    uint8_t buf[MAX_INSTRUCTION_LEN];
+    Instruction ins;
+    enum InstructionStatus status;
+    ErrorHandler eh;
+    Pipeline p;
+    char *data;
+    off_t offset;
+    size_t n, k;
+
+    pipeline_start(&p, is_file1, os, v);
+    if (setjmp(eh.env) != 0)
+    {
+        pipeline_abort(&p);
+        fail("%s", eh.message);
+    }
+    push_error_handler(&eh);
+    for (;;)
+    {
+        read_data(is_diff, buf, INSTRUCTION_LEN(format));
+        status = parse_instruction(buf, format, &ins);
+        if (status == INSTRUCTION_END) break;
+        if (status == INSTRUCTION_INVALID)
+        {
+            fail("Invalid diff data.");
+        }
+
+        if (ins.C > 0)
+        {
+            offset = (off_t)BS*ins.S;
+            while (ins.C > 0)
             {
-                read_data(is_file1, data, BS);
-                write_data(data, BS);
-                MD5_Update(&file2_md5_ctx, data, BS);
+                n = ins.C;
+                pipeline_reserve(&p, &n);
+                pipeline_fetch(&p, offset, n);
+                for (k = 0; ins.patched && k < n; ++k)
+                {
+                    if (!pipeline_read_edits(&p, k, is_diff))
+                    {
+                        fail("Invalid diff data.");
+                    }
+                }
+                pipeline_commit(&p, n);
+                offset += (off_t)n*BS;
+                ins.C  -= n;
             }
         }
 
-        while (A-- > 0)
+        while (ins.A > 0)
         {
-            read_data(is_diff, data, BS);
-            write_data(data, BS);
-            MD5_Update(&file2_md5_ctx, data, BS);
+            n = ins.A;
+            data = pipeline_reserve(&p, &n);
+            read_data(is_diff, data, n*BS);
+            pipeline_commit(&p, n);
+            ins.A -= n;
         }
     }
+    pop_error_handler(&eh);
+    pipeline_finish(&p);
+}
 
-    MD5_Final(digest_out, &file2_md5_ctx);
+void patch_chain_forward( InputStream *is_file1, const BlockRef *blocks,
+                          size_t num_blocks, EditStore *edits,
+                          OutputStream *os, Verifier *v )
+{
+    ErrorHandler eh;
+    InputStream *is;
+    Pipeline p;
+    char *data;
+    size_t n, m, run, k, i;
+
+    pipeline_start(&p, NULL, os, v);
+    if (setjmp(eh.env) != 0)
+    {
+        pipeline_abort(&p);
+        fail("%s", eh.message);
+    }
+    push_error_handler(&eh);
+    for (n = 0; n < num_blocks; n += run)
+    {
+        /* Seek to the start of a run of consecutive blocks */
+        is = (blocks[n].is == NULL) ? is_file1 : blocks[n].is;
+        for (run = 1; n + run < num_blocks; ++run)
+        {
+            if ( blocks[n + run].is != blocks[n].is ||
+                 blocks[n + run].offset != blocks[n + run - 1].offset + BS )
+            {
+                break;
+            }
+        }
+        if (active_stats != NULL) ++active_stats->patch_seeks;
+        if (!is->seek(is, blocks[n].offset)) fail("Seek failed.");
+
+        for (m = 0; m < run; m += k)
+        {
+            k = run - m;
+            data = pipeline_reserve(&p, &k);
+            read_data(is, data, k*BS);
+            for (i = 0; i < k; ++i)
+            {
+                if (blocks[n + m + i].edits >= 0)
+                {
+                    EditStore_apply(edits, blocks[n + m + i].edits,
+                                    data + i*BS);
+                }
+            }
+            pipeline_commit(&p, k);
+        }
+    }
+    pop_error_handler(&eh);
+    pipeline_finish(&p);
 }
@@ -0,0 +1,545 @@
+#include "patch.h"
+#include "binsort.h"
+#include "progress.h"
+#include "stats.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+/* In-place patching overwrites file 1 with file 2. Each copied block must be
+   read before any block it is copied to is overwritten, so copies are
+   ordered by a depth-first search over the blocks that read each target
+   block. A cycle in this order (e.g. two swapped blocks) is broken by saving
+   ("spilling") the target block to the journal before overwriting it.
+   Appended blocks are written last, since they read nothing from file 1.
+
+   Crash safety is provided by a journal with the following layout:
+        block 0:        header identifying files 1 and 2
+        two slots:      each holding a batch of blocks to be written
+        spill area:     spilled blocks, in the order they were saved
+
+   The blocks of each batch are first written to a slot (alternating between
+   the two) and synchronized, and only then written to file 1. Since the order
+   of copies is fully determined by the differences files, an interrupted
+   patch is resumed by rewriting the last valid batch and recomputing the
+   order up to that batch, without reading file 1. Integers in the journal
+   are stored in native byte order, since it is only read on the same host. */
+
+#define JOURNAL_MAGIC "tardiffj"
+#define BATCH_BLOCKS  2048      /* blocks per batch */
+#define SLOT_SIZE     (BS + 8*BATCH_BLOCKS + BS*BATCH_BLOCKS)
+#define SPILL_OFFSET  (BS + 2*(off_t)SLOT_SIZE)
+#define SLOT_HEADER   28        /* bytes of slot header covered by digest */
+#define NO_SPILL      0xffffffffffffffffull
+
+/* A copy to block T that reads block S */
+typedef struct Reader
+{
+    uint64_t S;
+    uint64_t T;
+} Reader;
+
+/* A copy on the search stack, with the next reader of its target to visit */
+typedef struct Frame
+{
+    uint64_t T;
+    size_t   next;
+    bool     cycle;             /* is target read by a copy on the stack? */
+} Frame;
+
+typedef struct SpilledBlock
+{
+    uint64_t block;             /* block index in file 1 */
+    uint64_t index;             /* index in spill area of the journal */
+} SpilledBlock;
+
+typedef struct InPlace
+{
+    int          fd;            /* file 1 (and 2) */
+    int          fd_journal;
+    const BlockRef *blocks;
+    size_t       num_blocks;
+    EditStore    *edits;
+
+    /* Copies sorted by source block, and their state by target block */
+    Reader       *readers;
+    size_t       nreaders;
+    uint8_t      *done;         /* bitmap of completed copies */
+    uint8_t      *active;       /* bitmap of copies on the stack */
+
+    /* Spilled blocks, sorted by block index */
+    SpilledBlock *spilled;
+    size_t       nspilled, spilled_capacity;
+
+    /* Current batch, built in the slot buffer */
+    uint8_t      *slot;
+    uint32_t     count;         /* number of blocks in the batch */
+    uint64_t     batch;         /* number of the batch (from 1) */
+    uint64_t     executed;      /* number of copies executed */
+    uint64_t     resumed;       /* number of copies executed before resume */
+    uint64_t     resumed_spilled;   /* number of blocks spilled before resume */
+
+    Progress     *progress;
+} InPlace;
+
+static int compar_reader(const void *a_in, const void *b_in)
+{
+    const Reader *a = a_in, *b = b_in;
+    if (a->S != b->S) return (a->S < b->S) ? -1 : +1;
+    if (a->T != b->T) return (a->T < b->T) ? -1 : +1;
+    return 0;
+}
+
+static bool get_bit(const uint8_t *bits, uint64_t i)
+{
+    return (bits[i/8] >> (i%8)) & 1;
+}
+
+static void set_bit(uint8_t *bits, uint64_t i, bool value)
+{
+    if (value) bits[i/8] |= 1 << (i%8); else bits[i/8] &= ~(1 << (i%8));
+}
+
+static void pread_all(int fd, void *buf, size_t len, off_t pos)
+{
+    ssize_t res;
+
+    while (len > 0)
+    {
+        res = pread(fd, buf, len, pos);
+        if (res <= 0) fail("Read failed!");
+        buf  = (char*)buf + res;
+        len -= res;
+        pos += res;
+    }
+}
+
+static void pwrite_all(int fd, const void *buf, size_t len, off_t pos)
+{
+    ssize_t res;
+
+    while (len > 0)
+    {
+        res = pwrite(fd, buf, len, pos);
+        if (res <= 0) fail("Write failed!");
+        buf  = (const char*)buf + res;
+        len -= res;
+        pos += res;
+    }
+}
+
+static void sync_file(int fd)
+{
+    if (fdatasync(fd) != 0) fail("Synchronizing file failed!");
+}
+
+/* Reads block `i' of file 1; a partial last block is padded with zeroes. */
+static void read_block(InPlace *ip, uint64_t i, char data[BS])
+{
+    ssize_t res = pread(ip->fd, data, BS, (off_t)BS*i);
+
+    if (res <= 0) fail("Read failed!");
+    if (res < BS) memset(data + res, 0, BS - res);
+}
+
+/* Returns whether copy `T' must be executed, which is not the case for
+   appended blocks and blocks that are copied to their own position. */
+static bool is_copy(InPlace *ip, uint64_t T)
+{
+    const BlockRef *br = &ip->blocks[T];
+    return br->is == NULL && (br->offset/BS != (off_t)T || br->edits >= 0);
+}
+
+/* Returns the index of the first reader of block `S'. */
+static size_t first_reader(InPlace *ip, uint64_t S)
+{
+    size_t lo = 0, hi = ip->nreaders, mid;
+
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo)/2;
+        if (ip->readers[mid].S < S) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+static uint64_t find_spilled(InPlace *ip, uint64_t block)
+{
+    size_t lo = 0, hi = ip->nspilled, mid;
+
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo)/2;
+        if (ip->spilled[mid].block < block) lo = mid + 1; else hi = mid;
+    }
+    return (lo < ip->nspilled && ip->spilled[lo].block == block)
+           ? ip->spilled[lo].index : NO_SPILL;
+}
+
+/* Saves block `block' of file 1 to the spill area, before it is overwritten.
+   When resuming, blocks spilled before the interruption are registered
+   only. */
+static void spill_block(InPlace *ip, uint64_t block)
+{
+    char data[BS];
+    size_t i;
+
+    if (ip->nspilled == ip->spilled_capacity)
+    {
+        ip->spilled_capacity = ip->spilled_capacity ? 2*ip->spilled_capacity
+                                                    : 64;
+        ip->spilled = realloc( ip->spilled,
+                               ip->spilled_capacity*sizeof(SpilledBlock) );
+        assert(ip->spilled != NULL);
+    }
+    for (i = ip->nspilled; i > 0 && ip->spilled[i - 1].block > block; --i)
+    {
+        ip->spilled[i] = ip->spilled[i - 1];
+    }
+    ip->spilled[i].block = block;
+    ip->spilled[i].index = ip->nspilled++;
+
+    if (ip->executed >= ip->resumed)
+    {
+        if (active_stats != NULL) ++active_stats->patch_spills;
+        read_block(ip, block, data);
+        pwrite_all( ip->fd_journal, data, BS,
+                    SPILL_OFFSET + (off_t)BS*(ip->nspilled - 1) );
+    }
+}
+
+/* Writes the current batch to the journal, and then to file 1. */
+static void commit_batch(InPlace *ip)
+{
+    uint8_t *targets = ip->slot + BS, *data = ip->slot + BS + 8*BATCH_BLOCKS;
+    off_t slot_offset = BS + (off_t)SLOT_SIZE*(ip->batch%2);
+    MD5_CTX md5_ctx;
+    uint32_t n;
+
+    if (ip->count == 0) return;
+
+    /* Slot header: batch, count, copies executed, blocks spilled, digest */
+    memset(ip->slot, 0, BS);
+    memcpy(ip->slot, &ip->batch, 8);
+    memcpy(ip->slot + 8, &ip->count, 4);
+    memcpy(ip->slot + 12, &ip->executed, 8);
+    memcpy(ip->slot + 20, &ip->nspilled, 8);
+    MD5_Init(&md5_ctx);
+    MD5_Update(&md5_ctx, ip->slot, SLOT_HEADER);
+    MD5_Update(&md5_ctx, targets, 8*ip->count);
+    MD5_Update(&md5_ctx, data, (size_t)BS*ip->count);
+    MD5_Final(ip->slot + SLOT_HEADER, &md5_ctx);
+    pwrite_all( ip->fd_journal, ip->slot, BS + 8*BATCH_BLOCKS +
+                (size_t)BS*ip->count, slot_offset );
+    sync_file(ip->fd_journal);
+
+    for (n = 0; n < ip->count; ++n)
+    {
+        uint64_t T;
+        memcpy(&T, targets + 8*n, 8);
+        pwrite_all(ip->fd, data + (size_t)BS*n, BS, (off_t)BS*T);
+    }
+    sync_file(ip->fd);
+
+    ip->count = 0;
+    ++ip->batch;
+}
+
+/* Executes the copy to block `T', after all other copies that read block `T'
+   have been executed. If `spill' is set, block `T' is still to be read by
+   copies on the stack, so it is spilled first. */
+static void execute(InPlace *ip, uint64_t T, bool spill)
+{
+    const BlockRef *br = &ip->blocks[T];
+    uint64_t S = br->offset/BS, i;
+    char *data;
+
+    if (spill) spill_block(ip, T);
+    if (ip->executed++ < ip->resumed)
+    {
+        if (ip->executed == ip->resumed && ip->nspilled != ip->resumed_spilled)
+        {
+            fail("Journal does not match the differences files!");
+        }
+        return;
+    }
+
+    data = (char*)ip->slot + BS + 8*BATCH_BLOCKS + (size_t)BS*ip->count;
+    i = find_spilled(ip, S);
+    if (i != NO_SPILL)
+    {
+        pread_all(ip->fd_journal, data, BS, SPILL_OFFSET + (off_t)BS*i);
+    }
+    else
+    {
+        read_block(ip, S, data);
+    }
+    if (br->edits >= 0) EditStore_apply(ip->edits, br->edits, data);
+    memcpy(ip->slot + BS + 8*ip->count, &T, 8);
+    progress_add(ip->progress, BS);
+    if (++ip->count == BATCH_BLOCKS) commit_batch(ip);
+}
+
+/* Executes all copies in dependency order. */
+static void execute_copies(InPlace *ip)
+{
+    Frame *stack = NULL, *f;
+    size_t depth = 0, capacity = 0, next;
+    uint64_t root, T;
+
+    for (root = 0; root < ip->num_blocks; ++root)
+    {
+        if (!is_copy(ip, root) || get_bit(ip->done, root)) continue;
+
+        T = root;
+        for (;;)
+        {
+            /* Push copy to block T */
+            if (depth == capacity)
+            {
+                capacity = capacity ? 2*capacity : 1024;
+                stack = realloc(stack, capacity*sizeof(Frame));
+                assert(stack != NULL);
+            }
+            f = &stack[depth++];
+            f->T     = T;
+            f->next  = first_reader(ip, T);
+            f->cycle = false;
+            set_bit(ip->active, T, true);
+
+            /* Pop copies until one has an unvisited reader */
+            for (;;)
+            {
+                f = &stack[depth - 1];
+                for (next = f->next; next < ip->nreaders &&
+                                     ip->readers[next].S == f->T; ++next)
+                {
+                    T = ip->readers[next].T;
+                    if (T == f->T || get_bit(ip->done, T)) continue;
+                    if (get_bit(ip->active, T)) f->cycle = true;
+                    else break;
+                }
+                f->next = next;
+                if (next < ip->nreaders && ip->readers[next].S == f->T) break;
+
+                execute(ip, f->T, f->cycle);
+                set_bit(ip->active, f->T, false);
+                set_bit(ip->done, f->T, true);
+                if (--depth == 0) break;
+            }
+            if (depth == 0) break;
+            ++stack[depth - 1].next;
+        }
+    }
+    free(stack);
+    commit_batch(ip);
+}
+
+/* Writes the appended blocks, which are read from the differences files. */
+static void write_appended(InPlace *ip)
+{
+    const BlockRef *br;
+    char data[BS];
+    uint64_t T;
+
+    for (T = 0; T < ip->num_blocks; ++T)
+    {
+        br = &ip->blocks[T];
+        if (br->is == NULL) continue;
+        if (!br->is->seek(br->is, br->offset)) fail("Seek failed.");
+        read_data(br->is, data, BS);
+        if (br->edits >= 0) EditStore_apply(ip->edits, br->edits, data);
+        pwrite_all(ip->fd, data, BS, (off_t)BS*T);
+        progress_add(ip->progress, BS);
+    }
+}
+
+/* Reads the journal at the start of an interrupted patch, rewrites its last
+   valid batch, and determines where to resume. */
+static void recover(InPlace *ip)
+{
+    uint8_t *targets = ip->slot + BS, *data = ip->slot + BS + 8*BATCH_BLOCKS;
+    uint8_t digest[DS];
+    uint64_t batch, best = 0, T;
+    uint32_t count;
+    MD5_CTX md5_ctx;
+    int k;
+
+    for (k = 0; k < 2; ++k)
+    {
+        if (pread(ip->fd_journal, ip->slot, BS,
+                  BS + (off_t)SLOT_SIZE*k) != BS) continue;
+        memcpy(&batch, ip->slot, 8);
+        memcpy(&count, ip->slot + 8, 4);
+        if (batch <= best || batch%2 != (uint64_t)k ||
+            count == 0 || count > BATCH_BLOCKS) continue;
+        if (pread(ip->fd_journal, targets, 8*BATCH_BLOCKS + (size_t)BS*count,
+                  BS + (off_t)SLOT_SIZE*k + BS) !=
+            (ssize_t)(8*BATCH_BLOCKS + (size_t)BS*count)) continue;
+        MD5_Init(&md5_ctx);
+        MD5_Update(&md5_ctx, ip->slot, SLOT_HEADER);
+        MD5_Update(&md5_ctx, targets, 8*count);
+        MD5_Update(&md5_ctx, data, (size_t)BS*count);
+        MD5_Final(digest, &md5_ctx);
+        if (memcmp(digest, ip->slot + SLOT_HEADER, DS) != 0) continue;
+        best = batch;
+    }
+    if (best == 0) return;  /* no batch was written to file 1 */
+
+    /* Rewrite the last batch, which may have been written partially */
+    pread_all(ip->fd_journal, ip->slot, BS + 8*BATCH_BLOCKS, BS +
+              (off_t)SLOT_SIZE*(best%2));
+    memcpy(&count, ip->slot + 8, 4);
+    memcpy(&ip->resumed, ip->slot + 12, 8);
+    memcpy(&ip->resumed_spilled, ip->slot + 20, 8);
+    pread_all(ip->fd_journal, data, (size_t)BS*count, BS +
+              (off_t)SLOT_SIZE*(best%2) + BS + 8*BATCH_BLOCKS);
+    for (k = 0; k < (int)count; ++k)
+    {
+        memcpy(&T, targets + 8*k, 8);
+        if (T >= ip->num_blocks) fail("Invalid journal!");
+        pwrite_all(ip->fd, data + (size_t)BS*k, BS, (off_t)BS*T);
+    }
+    sync_file(ip->fd);
+    ip->batch = best + 1;
+
+    fprintf(stderr, "Resuming interrupted patch after %llu of %llu copied "
+                    "blocks.\n", (unsigned long long)ip->resumed,
+                    (unsigned long long)ip->nreaders);
+}
+
+/* Computes the MD5 digest of file 1. */
+static void file_digest(int fd, uint8_t digest[DS])
+{
+    char buf[256*BS];
+    MD5_CTX md5_ctx;
+    ssize_t res;
+    off_t pos = 0;
+
+    MD5_Init(&md5_ctx);
+    while ((res = pread(fd, buf, sizeof(buf), pos)) > 0)
+    {
+        MD5_Update(&md5_ctx, buf, res);
+        pos += res;
+        progress_add(active_progress, res);
+    }
+    if (res < 0) fail("Read failed!");
+    if (pos%BS != 0)
+    {
+        /* Digests cover whole blocks */
+        memset(buf, 0, BS - pos%BS);
+        MD5_Update(&md5_ctx, buf, BS - pos%BS);
+    }
+    MD5_Final(digest, &md5_ctx);
+}
+
+bool patch_in_place( const char *path, MergeContext *mc,
+                     const char *journal_path )
+{
+    InPlace ip;
+    BinSort *bs;
+    Verifier verifier;
+    OutputStream *os;
+    FILE *fp;
+    char header[BS], journal_header[BS], report[1024];
+    uint8_t digest1[DS], digest2[DS], digest[DS];
+    uint64_t T, appended = 0;
+    bool resume, ok;
+
+    memset(&ip, 0, sizeof(ip));
+    ip.blocks = merged_blocks(mc, &ip.num_blocks);
+    ip.edits  = merged_edits(mc);
+    Verifier_init(&verifier, merged_digests(mc, digest2));
+    if (!merged_source_digest(mc, digest1))
+    {
+        fail("Differences file lacks the digest of file 1!");
+    }
+
+    fp = fopen(path, "r+b");
+    if (fp == NULL) fail("Cannot open '%s' for writing!", path);
+    ip.fd = fileno(fp);
+
+    /* Open the journal, which exists if a previous patch was interrupted */
+    memset(header, 0, BS);
+    memcpy(header, JOURNAL_MAGIC, 8);
+    memcpy(header + 8, digest1, DS);
+    memcpy(header + 8 + DS, digest2, DS);
+    ip.fd_journal = open(journal_path, O_RDWR | O_CREAT, 0600);
+    if (ip.fd_journal < 0)
+    {
+        fail("Cannot open journal '%s'!", journal_path);
+    }
+    resume = pread(ip.fd_journal, journal_header, BS, 0) == BS;
+    if (resume && memcmp(journal_header, header, BS) != 0)
+    {
+        fail("Journal '%s' belongs to a different patch!", journal_path);
+    }
+    if (!resume)
+    {
+        /* Verify file 1 before it is modified */
+        stats_phase("verify");
+        progress_phase("verify", 0);
+        file_digest(ip.fd, digest);
+        if (memcmp(digest, digest1, DS) != 0)
+        {
+            fail("Differences file does not apply to '%s'!", path);
+        }
+        pwrite_all(ip.fd_journal, header, BS, 0);
+        sync_file(ip.fd_journal);
+    }
+
+    /* Sort copies by source block */
+    stats_phase("sort");
+    progress_phase("sort", 0);
+    bs = BinSort_create(sizeof(Reader), 65536, compar_reader);
+    assert(bs != NULL);
+    for (T = 0; T < ip.num_blocks; ++T)
+    {
+        if (is_copy(&ip, T))
+        {
+            Reader r = { ip.blocks[T].offset/BS, T };
+            BinSort_add(bs, &r);
+        }
+        appended += ip.blocks[T].is != NULL;
+    }
+    ip.nreaders = BinSort_size(bs);
+    ip.readers  = (ip.nreaders > 0) ? BinSort_mmap(bs) : NULL;
+    ip.done     = calloc(ip.num_blocks/8 + 1, 1);
+    ip.active   = calloc(ip.num_blocks/8 + 1, 1);
+    ip.slot     = malloc(SLOT_SIZE);
+    assert(ip.done != NULL && ip.active != NULL && ip.slot != NULL);
+    ip.batch    = 1;
+
+    stats_phase("patch");
+    progress_phase("patch", (ip.nreaders + appended)*BS);
+    ip.progress = active_progress;
+    if (resume) recover(&ip);
+    execute_copies(&ip);
+    write_appended(&ip);
+    if (ftruncate(ip.fd, (off_t)BS*ip.num_blocks) != 0)
+    {
+        fail("Truncating '%s' failed!", path);
+    }
+    sync_file(ip.fd);
+
+    close(ip.fd_journal);
+    free(ip.slot);
+    free(ip.active);
+    free(ip.done);
+    free(ip.spilled);
+    BinSort_destroy(bs);
+
+    os = OpenFileOutputStream(fp);
+    assert(os != NULL);
+    Verifier_add_file(&verifier, os, ip.num_blocks);
+    stats_phase("verify");
+    ok = Verifier_finish(&verifier, digest2, report, sizeof(report));
+    stats_phase_end();
+    if (!ok) fprintf(stderr, "%s\n", report);
+    os->close(os);
+
+    /* File 2 is complete, so the journal is no longer needed (an interrupted
+       verification is repeated when the patch is resumed) */
+    unlink(journal_path);
+
+    return ok;
+}
@@ -0,0 +1,61 @@
+#ifndef PATCH_H_INCLUDED
+#define PATCH_H_INCLUDED
+
+#include "common.h"
+#include "merge.h"
+#include "verify.h"
+
+/* Generates file 2 on-line, but requires seeking in file 1.  This is the
+   preferred method of applying patches when the input file is seekable, since
+   it only takes linear time. The instructions are read from `is_diff' (just
+   past the magic string) in the given `format'. */
+void patch_forward( InputStream *is_file1, InputStream *is_diff,
+                    enum DiffFormat format, OutputStream *os, Verifier *v );
+
+/* Generates file 2 out of order, but reads through file 1 only once.  This
+   requires re-ordering the diff instructions which may be time consuming,
+   but has the advantage of working when file 1 is non-seekable. */
+void patch_backward( InputStream *is_file1, InputStream *is_diff,
+                     enum DiffFormat format, OutputStream *os, Verifier *v );
+
+/* Generates file 2 from file 1 and a composed list of block references, in
+   order, by seeking in file 1 and the differences files. */
+void patch_chain_forward( InputStream *is_file1, const BlockRef *blocks,
+                          size_t num_blocks, EditStore *edits,
+                          OutputStream *os, Verifier *v );
+
+/* Generates file 2 from file 1 and a composed list of block references, while
+   reading through file 1 only once. */
+void patch_chain_backward( InputStream *is_file1, const BlockRef *blocks,
+                           size_t num_blocks, EditStore *edits,
+                           OutputStream *os, Verifier *v );
+
+/* Rewrites the file at `path' (file 1) into file 2 in place, as described by
+   the composed differences files in `mc', and verifies the result. Progress
+   is recorded in a journal at `journal_path', so that an interrupted patch is
+   resumed by calling this function again with the same arguments. Returns
+   false (after printing an error message) if verification fails. */
+bool patch_in_place( const char *path, MergeContext *mc,
+                     const char *journal_path );
+
+/* Writes the contents of a single member, or a range of bytes, of file 2 to
+   `os', reading only the necessary parts of file 1 and the diff file. Chunks
+   of file 2 that are read entirely are verified against the chunk digests of
+   the diff file (if any), and a warning is printed if none could be checked.
+   Returns false (after printing an error message) if the member or range does
+   not exist, or if verification fails. */
+bool patch_extract( InputStream *is_file1, InputStream *is_diff,
+                    const char *member, const char *range, OutputStream *os );
+
+/* Writes blocks <first> up to (but not including) <end> of file 2, given as
+   a `range' of the form "<first>-[<end>]", to the file descriptor `fd' at
+   their offset in file 2, so that several processes can each write a part of
+   the same file. Like patch_extract(), only the necessary parts of file 1 and
+   the diff file are read. If the diff file contains chunk digests, the chunks
+   overlapping the range are verified (reconstructing the blocks of partial
+   chunks at either end without writing them). Returns false (after printing
+   an error message) if the range does not exist or verification fails. */
+bool patch_blocks( InputStream *is_file1, InputStream *is_diff,
+                   const char *range, int fd );
+
+#endif /* ndef PATCH_H_INCLUDED */
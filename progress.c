@@ -0,0 +1,155 @@
+#include "progress.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define INTERVAL 1              /* seconds between progress records */
+
+__thread Progress *active_progress;
+
+static Progress progress;
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+/* Writes a progress record. `rate' is the throughput in bytes per second. */
+static void write_record( Progress *p, const char *phase, uint64_t done,
+                          uint64_t total, double elapsed, double rate )
+{
+    char buf[512], total_str[32], eta_str[32];
+    size_t len, pos;
+    ssize_t res;
+
+    strcpy(total_str, "null");
+    strcpy(eta_str, "null");
+    if (total > 0)
+    {
+        snprintf(total_str, sizeof(total_str), "%llu",
+                 (unsigned long long)total);
+        if (rate > 0 && done <= total)
+        {
+            snprintf(eta_str, sizeof(eta_str), "%.1f", (total - done)/rate);
+        }
+    }
+    len = snprintf( buf, sizeof(buf),
+                    "{\"phase\": \"%s\", \"done\": %llu, \"total\": %s, "
+                    "\"elapsed_s\": %.1f, \"bytes_per_s\": %.0f, "
+                    "\"eta_s\": %s}\n", phase, (unsigned long long)done,
+                    total_str, elapsed, rate, eta_str );
+    for (pos = 0; pos < len; pos += res)
+    {
+        res = write(p->fd, buf + pos, len - pos);
+        if (res < 0 && errno == EINTR) res = 0; else if (res <= 0) break;
+    }
+}
+
+/* Timer thread: writes a record every INTERVAL seconds until stopped. The
+   throughput is computed over the last interval of the current phase. */
+static void *progress_thread(void *arg)
+{
+    Progress *p = arg;
+    struct timespec deadline;
+    double start = now(), last_time = start, t;
+    uint64_t last_done = 0, done;
+    unsigned last_gen = 0, gen;
+    double rate = 0;
+    bool stop;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    pthread_mutex_lock(&p->lock);
+    do {
+        deadline.tv_sec += INTERVAL;
+        while (!p->stop && pthread_cond_timedwait(&p->cond, &p->lock,
+                                                  &deadline) != ETIMEDOUT) { }
+        stop = p->stop;
+
+        gen  = atomic_load_explicit(&p->generation, memory_order_acquire);
+        done = atomic_load_explicit(&p->done, memory_order_relaxed);
+        t    = now();
+        if (gen != last_gen)
+        {
+            /* New phase started since the last record */
+            last_gen  = gen;
+            last_done = 0;
+            last_time = atomic_load(&p->phase_start);
+        }
+        if (t > last_time && done >= last_done)
+        {
+            rate = (done - last_done)/(t - last_time);
+        }
+        last_time = t;
+        last_done = done;
+        write_record( p, atomic_load(&p->phase), done,
+                      atomic_load_explicit(&p->total, memory_order_relaxed),
+                      t - start, rate );
+    } while (!stop);
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+bool progress_start(const char *target)
+{
+    Progress *p = &progress;
+    char *end;
+    long fd;
+
+    if (active_progress != NULL) return false;
+    fd = strtol(target, &end, 10);
+    if (*target == '\0' || *end != '\0' || fd < 0)
+    {
+        fd = open(target, O_WRONLY | O_CREAT | O_APPEND, 0666);
+        if (fd < 0)
+        {
+            fprintf(stderr, "Cannot open '%s' for writing!\n", target);
+            return false;
+        }
+        p->close_fd = true;
+    }
+    p->fd = (int)fd;
+    atomic_init(&p->done, 0);
+    atomic_init(&p->total, 0);
+    atomic_init(&p->phase, "start");
+    atomic_init(&p->generation, 0);
+    atomic_init(&p->phase_start, now());
+    p->stop = false;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    if (pthread_create(&p->thread, NULL, progress_thread, p) != 0) return false;
+    active_progress = p;
+    return true;
+}
+
+void progress_phase(const char *name, uint64_t total)
+{
+    Progress *p = active_progress;
+
+    if (p == NULL) return;
+    atomic_store_explicit(&p->done, 0, memory_order_relaxed);
+    atomic_store_explicit(&p->total, total, memory_order_relaxed);
+    atomic_store_explicit(&p->phase, name, memory_order_relaxed);
+    atomic_store_explicit(&p->phase_start, now(), memory_order_relaxed);
+    atomic_fetch_add_explicit(&p->generation, 1, memory_order_release);
+}
+
+void progress_stop()
+{
+    Progress *p = active_progress;
+
+    if (p == NULL) return;
+    pthread_mutex_lock(&p->lock);
+    p->stop = true;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    if (p->close_fd) close(p->fd);
+    active_progress = NULL;
+}
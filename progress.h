@@ -0,0 +1,50 @@
+#ifndef PROGRESS_H_INCLUDED
+#define PROGRESS_H_INCLUDED
+
+#include "common.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+/* Optional progress reporting, enabled with --progress=<fd|path>. A timer
+   thread periodically writes a line of JSON describing the current phase,
+   the number of bytes processed (and the total, if known), the current
+   throughput and the estimated time remaining. The processing threads only
+   increment a counter, which costs a single relaxed atomic addition. */
+
+typedef struct Progress
+{
+    atomic_uint_fast64_t   done;        /* bytes processed in current phase */
+    atomic_uint_fast64_t   total;       /* bytes in current phase (or 0) */
+    _Atomic(const char *)  phase;       /* name of the current phase */
+    atomic_uint            generation;  /* incremented when phase changes */
+    _Atomic double         phase_start; /* time at which the phase started */
+
+    int                    fd;          /* destination of progress records */
+    bool                   close_fd;    /* was `fd' opened by us? */
+    pthread_t              thread;
+    pthread_mutex_t        lock;
+    pthread_cond_t         cond;
+    bool                   stop;
+} Progress;
+
+/* Progress of the current thread's operation, or NULL if not reported. */
+extern __thread Progress *active_progress;
+
+/* Starts reporting progress of the calling thread's operation to `target',
+   which is a file descriptor number or a path. Returns false if the target
+   cannot be opened. */
+bool progress_start(const char *target);
+
+/* Starts a new phase which processes `total' bytes (0 if unknown). */
+void progress_phase(const char *name, uint64_t total);
+
+/* Stops reporting progress, after writing a final record. */
+void progress_stop();
+
+/* Adds `n' to the number of bytes processed in the current phase. */
+static inline void progress_add(Progress *p, uint64_t n)
+{
+    if (p != NULL) atomic_fetch_add_explicit(&p->done, n, memory_order_relaxed);
+}
+
+#endif /* ndef PROGRESS_H_INCLUDED */
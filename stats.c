@@ -0,0 +1,248 @@
+#include "stats.h"
+#include <time.h>
+
+__thread Stats *active_stats;
+
+typedef struct StatsInputStream
+{
+    InputStream is;
+    InputStream *inner;
+    StatsStream *ss;
+} StatsInputStream;
+
+typedef struct StatsOutputStream
+{
+    OutputStream os;
+    OutputStream *inner;
+    StatsStream  *ss;
+} StatsOutputStream;
+
+static double clock_seconds(clockid_t clk)
+{
+    struct timespec ts;
+
+    clock_gettime(clk, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+void stats_init(Stats *st, const char *tool)
+{
+    memset(st, 0, sizeof(Stats));
+    st->tool = tool;
+}
+
+void stats_phase(const char *name)
+{
+    Stats *st = active_stats;
+
+    if (st == NULL) return;
+    if ( st->phase_running &&
+         strcmp(st->phases[st->nphase].name, name) == 0 ) return;
+    stats_phase_end();
+    if (st->nphase == MAX_PHASES) return;
+    st->phases[st->nphase].name = name;
+    st->phase_running = true;
+    st->phase_wall = clock_seconds(CLOCK_MONOTONIC);
+    st->phase_cpu  = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+void stats_phase_end()
+{
+    Stats *st = active_stats;
+    StatsPhase *ph;
+
+    if (st == NULL || !st->phase_running) return;
+    ph = &st->phases[st->nphase++];
+    ph->wall = clock_seconds(CLOCK_MONOTONIC) - st->phase_wall;
+    ph->cpu  = clock_seconds(CLOCK_PROCESS_CPUTIME_ID) - st->phase_cpu;
+    st->phase_running = false;
+}
+
+void stats_instruction(uint32_t C, uint32_t A, bool patched)
+{
+    Stats *st = active_stats;
+
+    if (st == NULL) return;
+    if (C > 0 && A > 0) ++st->instr_mixed;
+    else if (C > 0) ++st->instr_copy;
+    else ++st->instr_append;
+    if (patched) ++st->instr_patched;
+    st->blocks_copied   += C;
+    st->blocks_appended += A;
+}
+
+static StatsStream *add_stream(const char *name)
+{
+    Stats *st = active_stats;
+    StatsStream *ss;
+
+    if (st == NULL) return NULL;
+    if (st->nstream == st->stream_capacity)
+    {
+        /* Streams are allocated separately, so they do not move */
+        st->stream_capacity = st->stream_capacity > 0
+                            ? 2*st->stream_capacity : 8;
+        st->streams = realloc( st->streams,
+                               st->stream_capacity*sizeof(StatsStream*) );
+        assert(st->streams != NULL);
+    }
+    ss = malloc(sizeof(StatsStream));
+    assert(ss != NULL);
+    st->streams[st->nstream++] = ss;
+    ss->name = strdup(name);
+    assert(ss->name != NULL);
+    ss->bytes_read = ss->bytes_written = 0;
+    return ss;
+}
+
+static size_t SIS_read(StatsInputStream *sis, void *buf, size_t len)
+{
+    size_t res = sis->inner->read(sis->inner, buf, len);
+    sis->ss->bytes_read += res;
+    return res;
+}
+
+static bool SIS_seek(StatsInputStream *sis, off_t pos)
+{
+    return sis->inner->seek(sis->inner, pos);
+}
+
+static off_t SIS_size(StatsInputStream *sis)
+{
+    return sis->inner->size(sis->inner);
+}
+
+static void SIS_close(StatsInputStream *sis)
+{
+    sis->inner->close(sis->inner);
+    free(sis);
+}
+
+InputStream *stats_input_stream(InputStream *is, const char *name)
+{
+    StatsInputStream *sis;
+    StatsStream *ss;
+
+    if (is == NULL || (ss = add_stream(name)) == NULL) return is;
+    sis = malloc(sizeof(StatsInputStream));
+    assert(sis != NULL);
+    sis->is.read  = (void*)SIS_read;
+    sis->is.seek  = (void*)SIS_seek;
+    sis->is.size  = (void*)SIS_size;
+    sis->is.close = (void*)SIS_close;
+    sis->inner    = is;
+    sis->ss       = ss;
+    return &sis->is;
+}
+
+static bool SOS_write(StatsOutputStream *sos, const void *buf, size_t len)
+{
+    sos->ss->bytes_written += len;
+    return sos->inner->write(sos->inner, buf, len);
+}
+
+static bool SOS_seek(StatsOutputStream *sos, off_t pos)
+{
+    return sos->inner->seek(sos->inner, pos);
+}
+
+static size_t SOS_read(StatsOutputStream *sos, void *buf, size_t len)
+{
+    size_t res = sos->inner->read(sos->inner, buf, len);
+    sos->ss->bytes_read += res;
+    return res;
+}
+
+static void SOS_close(StatsOutputStream *sos)
+{
+    sos->inner->close(sos->inner);
+    free(sos);
+}
+
+OutputStream *stats_output_stream(OutputStream *os, const char *name)
+{
+    StatsOutputStream *sos;
+    StatsStream *ss;
+
+    if (os == NULL || (ss = add_stream(name)) == NULL) return os;
+    sos = malloc(sizeof(StatsOutputStream));
+    assert(sos != NULL);
+    sos->os.write  = (void*)SOS_write;
+    sos->os.seek   = os->seek != NULL ? (void*)SOS_seek : NULL;
+    sos->os.read   = os->read != NULL ? (void*)SOS_read : NULL;
+    sos->os.close  = (void*)SOS_close;
+    sos->os.fd     = os->fd;
+    sos->os.digest_started = false;
+    sos->os.bytes  = 0;
+    sos->inner     = os;
+    sos->ss        = ss;
+    return &sos->os;
+}
+
+void stats_print(Stats *st, FILE *fp)
+{
+    uint64_t copies = st->instr_copy + st->instr_mixed,
+             lookups = st->lookup_hits + st->lookup_misses;
+    int n;
+
+    fprintf(fp, "{\n  \"tool\": \"%s\",\n  \"phases\": [", st->tool);
+    for (n = 0; n < st->nphase; ++n)
+    {
+        fprintf(fp, "%s\n    { \"name\": \"%s\", \"wall_s\": %.6f, "
+                    "\"cpu_s\": %.6f }", n > 0 ? "," : "",
+                    st->phases[n].name, st->phases[n].wall, st->phases[n].cpu);
+    }
+    fprintf(fp, "\n  ],\n  \"streams\": [");
+    for (n = 0; n < st->nstream; ++n)
+    {
+        fprintf(fp, "%s\n    { \"name\": \"%s\", \"bytes_read\": %llu, "
+                    "\"bytes_written\": %llu }", n > 0 ? "," : "",
+                    st->streams[n]->name,
+                    (unsigned long long)st->streams[n]->bytes_read,
+                    (unsigned long long)st->streams[n]->bytes_written);
+    }
+    fprintf(fp, "\n  ],\n"
+                "  \"sort\": { \"runs_spilled\": %llu, "
+                "\"merge_passes\": %llu },\n",
+                (unsigned long long)st->sort_runs,
+                (unsigned long long)st->sort_merges);
+    fprintf(fp, "  \"lookup\": { \"hits\": %llu, \"misses\": %llu, "
+                "\"continuation_hits\": %llu, \"filtered\": %llu, "
+                "\"skipped\": %llu, \"hit_rate\": %.4f, "
+                "\"continuation_rate\": %.4f },\n",
+                (unsigned long long)st->lookup_hits,
+                (unsigned long long)st->lookup_misses,
+                (unsigned long long)st->lookup_continued,
+                (unsigned long long)st->lookup_filtered,
+                (unsigned long long)st->lookup_skipped,
+                lookups ? (double)st->lookup_hits/lookups : 0.0,
+                st->lookup_hits ? (double)st->lookup_continued/st->lookup_hits
+                                : 0.0);
+    fprintf(fp, "  \"instructions\": { \"copy\": %llu, \"append\": %llu, "
+                "\"mixed\": %llu, \"patched\": %llu, \"blocks_copied\": %llu, "
+                "\"blocks_appended\": %llu, \"avg_copy_run\": %.2f },\n",
+                (unsigned long long)st->instr_copy,
+                (unsigned long long)st->instr_append,
+                (unsigned long long)st->instr_mixed,
+                (unsigned long long)st->instr_patched,
+                (unsigned long long)st->blocks_copied,
+                (unsigned long long)st->blocks_appended,
+                copies ? (double)st->blocks_copied/copies : 0.0);
+    fprintf(fp, "  \"patch\": { \"seeks\": %llu, \"spills\": %llu }\n}\n",
+                (unsigned long long)st->patch_seeks,
+                (unsigned long long)st->patch_spills);
+}
+
+void stats_free(Stats *st)
+{
+    int n;
+
+    for (n = 0; n < st->nstream; ++n)
+    {
+        free(st->streams[n]->name);
+        free(st->streams[n]);
+    }
+    free(st->streams);
+    st->streams = NULL;
+    st->nstream = st->stream_capacity = 0;
+}
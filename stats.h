@@ -0,0 +1,93 @@
+#ifndef STATS_H_INCLUDED
+#define STATS_H_INCLUDED
+
+#include "common.h"
+
+/* Optional instrumentation of the tools, enabled with --stats. Statistics are
+   collected in the Stats structure that `active_stats' points to, which is
+   NULL (the default) to disable collection. The pointer is thread-local, so
+   library users can collect statistics per operation. */
+
+#define MAX_PHASES  8
+
+typedef struct StatsPhase
+{
+    const char *name;
+    double     wall, cpu;           /* time spent, in seconds */
+} StatsPhase;
+
+typedef struct StatsStream
+{
+    char       *name;               /* copy of the name given */
+    uint64_t   bytes_read, bytes_written;
+} StatsStream;
+
+typedef struct Stats
+{
+    const char  *tool;
+
+    /* Phases, in order; the last one is running if `phase_running' is set */
+    int         nphase;
+    StatsPhase  phases[MAX_PHASES];
+    bool        phase_running;
+    double      phase_wall, phase_cpu;      /* start of running phase */
+
+    /* Streams wrapped with stats_input_stream()/stats_output_stream() */
+    int         nstream, stream_capacity;
+    StatsStream **streams;
+
+    /* Block sorting */
+    uint64_t    sort_runs;          /* sorted runs spilled to disk */
+    uint64_t    sort_merges;        /* merge passes over spilled runs */
+
+    /* Lookup of file 2 blocks in file 1 */
+    uint64_t    lookup_hits;        /* matching block found */
+    uint64_t    lookup_misses;      /* no matching block found */
+    uint64_t    lookup_continued;   /* match follows the previous match */
+    uint64_t    lookup_filtered;    /* misses rejected by the filter */
+    uint64_t    lookup_skipped;     /* blocks of common prefix/suffix */
+
+    /* Instructions generated */
+    uint64_t    instr_copy;         /* copy only */
+    uint64_t    instr_append;       /* append only */
+    uint64_t    instr_mixed;        /* copy and append */
+    uint64_t    instr_patched;      /* copied blocks are patched */
+    uint64_t    blocks_copied;
+    uint64_t    blocks_appended;
+
+    /* Patching */
+    uint64_t    patch_seeks;        /* seeks in input files (forward only) */
+    uint64_t    patch_spills;       /* blocks saved to the journal (in place) */
+} Stats;
+
+extern __thread Stats *active_stats;
+
+/* Initializes `st' for collecting statistics of the given tool. */
+void stats_init(Stats *st, const char *tool);
+
+/* Ends the running phase (if any), and starts a new one, unless the running
+   phase has the same name. */
+void stats_phase(const char *name);
+
+/* Ends the running phase (if any). */
+void stats_phase_end();
+
+/* Counts an emitted instruction that copies C blocks (which are patched if
+   `patched' is set) and appends A blocks. */
+void stats_instruction(uint32_t C, uint32_t A, bool patched);
+
+/* Returns a stream that counts the bytes read from or written to `is' or `os'
+   under the given name, and closes the underlying stream when it is closed.
+   Returns the stream unchanged when statistics are not collected. */
+InputStream *stats_input_stream(InputStream *is, const char *name);
+OutputStream *stats_output_stream(OutputStream *os, const char *name);
+
+/* Prints the statistics collected as a JSON document. */
+void stats_print(Stats *st, FILE *fp);
+
+/* Frees the memory allocated for `st'. Streams returned by
+   stats_input_stream() and stats_output_stream() must not be used after
+   this. */
+void stats_free(Stats *st);
+
+#endif /* ndef STATS_H_INCLUDED */
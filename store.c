@@ -0,0 +1,998 @@
+#include "common.h"
+#include "progress.h"
+#include "stats.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/* A block store keeps any number of files ("snapshots") in a directory, in
+   which each distinct block is stored only once:
+        packs/<n>           compressed frames of up to FRAME_BLOCKS blocks
+        frames              table locating each frame in a pack
+        index               digests of stored blocks and their ids, sorted
+        snapshots/<name>    manifest listing the blocks of a snapshot as runs
+        lock                locked while the store is in use
+
+   The id of a block is FRAME_BLOCKS*frame + position in the frame, so blocks
+   are located without searching, and ids are never reused. Adding a snapshot
+   writes a new pack, appends its frames to the frame table, rewrites the
+   index (merging in the new blocks) and finally writes the manifest. Each
+   file is synchronized before a file that refers to it is written, so an
+   interrupted operation leaves only unreferenced data, which is removed by
+   the garbage collector. The garbage collector removes frames that no
+   manifest refers to, by copying the remaining frames of a pack to a new
+   pack. Integers are stored in big-endian byte order. */
+
+#define FRAME_BLOCKS    256     /* blocks per compressed frame (128 KB) */
+#define FRAME_ENTRY     24      /* size of a frame table entry */
+#define INDEX_ENTRY     (DS + 8)    /* size of an index entry */
+#define RUN_LEN         12      /* size of a run in a manifest */
+#define MANIFEST_MAGIC  "tardiffs"
+#define MANIFEST_HEADER (MAGIC_LEN + 8 + DS + 8)
+#define NO_ID           0xffffffffffffffffull
+
+/* Location of a compressed frame (`nblocks' is 0 if it has been removed) */
+typedef struct FrameInfo
+{
+    uint64_t offset;
+    uint32_t pack;
+    uint32_t size;
+    uint32_t nblocks;
+} FrameInfo;
+
+/* A block added to the store by the current operation */
+typedef struct NewBlock
+{
+    uint8_t  digest[DS];
+    uint64_t id;                /* NO_ID if the hash table entry is empty */
+} NewBlock;
+
+/* Position of a frame in the pack files (used to copy frames in order) */
+typedef struct FramePos
+{
+    uint32_t pack;
+    uint64_t offset;
+    size_t   frame;
+} FramePos;
+
+/* A run of consecutive block ids in a manifest */
+typedef struct Run
+{
+    uint64_t first;
+    uint32_t count;
+} Run;
+
+typedef struct Store
+{
+    const char *dir;
+    int        fd_lock;
+
+    /* Index of stored blocks, sorted by digest (mapped from the index file) */
+    uint8_t    *index;
+    size_t     nindex;
+
+    /* Frame table */
+    FrameInfo  *frames;
+    size_t     nframes, frames_capacity;
+    uint32_t   next_pack;       /* number of the next pack to create */
+    uint8_t    *live;           /* bitmap of frames in use (during gc) */
+
+    /* Blocks added by the current operation, in an open addressing hash table
+       with a power of two capacity */
+    NewBlock   *added;
+    size_t     nadded, added_capacity;
+
+    /* Frame being written, or last frame read */
+    char       *frame_data;
+    uint64_t   frame;           /* number of frame read (or NO_ID) */
+    uint32_t   frame_blocks;    /* number of blocks in frame being written */
+    uint8_t    *packed;         /* compressed frame data */
+    FILE       *pack;           /* pack being written or read (or NULL) */
+    uint32_t   pack_number;
+} Store;
+
+static void put_uint32(uint8_t *buf, uint32_t i)
+{
+    buf[0] = i >> 24;
+    buf[1] = i >> 16;
+    buf[2] = i >>  8;
+    buf[3] = i >>  0;
+}
+
+static void put_uint64(uint8_t *buf, uint64_t i)
+{
+    put_uint32(buf, i >> 32);
+    put_uint32(buf + 4, i);
+}
+
+/* Stores the path of a file in the store directory in `buf'. */
+static void store_path(Store *st, char buf[4096], const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static void store_path(Store *st, char buf[4096], const char *fmt, ...)
+{
+    va_list ap;
+    int len = snprintf(buf, 4096, "%s/", st->dir);
+
+    va_start(ap, fmt);
+    if (len < 0 || len >= 4096 || vsnprintf(buf + len, 4096 - len, fmt, ap)
+                                  >= 4096 - len)
+    {
+        fail("Path name too long!");
+    }
+    va_end(ap);
+}
+
+static void write_file(FILE *fp, const void *buf, size_t len)
+{
+    if (len > 0 && fwrite(buf, len, 1, fp) != 1)
+    {
+        fail("Write to store failed!");
+    }
+}
+
+static void read_file(FILE *fp, void *buf, size_t len)
+{
+    if (len > 0 && fread(buf, len, 1, fp) != 1)
+    {
+        fail("Read from store failed!");
+    }
+}
+
+/* Flushes and synchronizes a file, and closes it. */
+static void close_synced(FILE *fp)
+{
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0 || fclose(fp) != 0)
+    {
+        fail("Write to store failed!");
+    }
+}
+
+/* Synchronizes a directory of the store, so renamed files are durable. */
+static void sync_dir(Store *st, const char *name)
+{
+    char path[4096];
+    int fd;
+
+    store_path(st, path, "%s", name);
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fsync(fd) != 0) fail("Synchronizing '%s' failed!", path);
+    close(fd);
+}
+
+/* Replaces file `name' with the temporary file `tmp_name'. */
+static void replace_file(Store *st, const char *tmp_name, const char *name)
+{
+    char tmp_path[4096], path[4096];
+
+    store_path(st, tmp_path, "%s", tmp_name);
+    store_path(st, path, "%s", name);
+    if (rename(tmp_path, path) != 0) fail("Renaming '%s' failed!", tmp_path);
+}
+
+/* Returns whether `name' may name a snapshot. */
+static bool valid_name(const char *name)
+{
+    return name[0] != '\0' && name[0] != '.' && strchr(name, '/') == NULL;
+}
+
+/* Maps the index file. */
+static void map_index(Store *st)
+{
+    char path[4096];
+    struct stat s;
+    int fd;
+
+    store_path(st, path, "index");
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        if (errno != ENOENT) fail("Cannot open '%s'!", path);
+        return;
+    }
+    if (fstat(fd, &s) != 0 || s.st_size%INDEX_ENTRY != 0)
+    {
+        fail("Invalid block index '%s'!", path);
+    }
+    st->nindex = s.st_size/INDEX_ENTRY;
+    if (st->nindex > 0)
+    {
+        st->index = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (st->index == MAP_FAILED)
+        {
+            st->index = NULL;
+            fail("mmap() failed!");
+        }
+    }
+    close(fd);
+}
+
+static void unmap_index(Store *st)
+{
+    if (st->index != NULL) munmap(st->index, st->nindex*INDEX_ENTRY);
+    st->index = NULL;
+    st->nindex = 0;
+}
+
+static FrameInfo *add_frame(Store *st)
+{
+    if (st->nframes == st->frames_capacity)
+    {
+        st->frames_capacity = st->frames_capacity ? 2*st->frames_capacity
+                                                  : 1024;
+        st->frames = realloc(st->frames, st->frames_capacity*sizeof(FrameInfo));
+        assert(st->frames != NULL);
+    }
+    return &st->frames[st->nframes++];
+}
+
+/* Reads the frame table. An incomplete last entry (left by an interrupted
+   operation) is ignored. */
+static void read_frames(Store *st)
+{
+    uint8_t buf[FRAME_ENTRY];
+    char path[4096];
+    FrameInfo *fi;
+    FILE *fp;
+
+    store_path(st, path, "frames");
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        if (errno != ENOENT) fail("Cannot open '%s'!", path);
+        return;
+    }
+    while (fread(buf, FRAME_ENTRY, 1, fp) == 1)
+    {
+        fi = add_frame(st);
+        fi->offset  = parse_uint64(buf);
+        fi->pack    = parse_uint32(buf + 8);
+        fi->size    = parse_uint32(buf + 12);
+        fi->nblocks = parse_uint32(buf + 16);
+        if (fi->nblocks > FRAME_BLOCKS) fail("Invalid frame table '%s'!", path);
+    }
+    fclose(fp);
+}
+
+/* Writes frame table entries `first' through `last' (exclusive). */
+static void write_frames(Store *st, FILE *fp, size_t first, size_t last)
+{
+    uint8_t buf[FRAME_ENTRY];
+    FrameInfo *fi;
+
+    memset(buf, 0, FRAME_ENTRY);
+    for ( ; first < last; ++first)
+    {
+        fi = &st->frames[first];
+        put_uint64(buf, fi->offset);
+        put_uint32(buf + 8, fi->pack);
+        put_uint32(buf + 12, fi->size);
+        put_uint32(buf + 16, fi->nblocks);
+        write_file(fp, buf, FRAME_ENTRY);
+    }
+}
+
+/* Returns the number of a pack file name, or -1 if it is not one. */
+static long pack_number(const char *name)
+{
+    char *end;
+    long n;
+
+    if (name[0] < '0' || name[0] > '9') return -1;
+    n = strtol(name, &end, 10);
+    return (*end == '\0' && n >= 0 && n < 0xffffffffl) ? n : -1;
+}
+
+/* Opens (and creates, if `create' is true) the store in directory `dir', and
+   locks it for shared or exclusive use. */
+static Store *open_store(const char *dir, bool create, bool exclusive)
+{
+    char path[4096];
+    Store *st;
+    DIR *d;
+    struct dirent *de;
+    long n;
+
+    st = calloc(1, sizeof(Store));
+    assert(st != NULL);
+    st->dir     = dir;
+    st->fd_lock = -1;
+    st->frame   = NO_ID;
+    st->frame_data = malloc(FRAME_BLOCKS*BS);
+    st->packed  = malloc(compressBound(FRAME_BLOCKS*BS));
+    assert(st->frame_data != NULL && st->packed != NULL);
+
+    if (create)
+    {
+        if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+        {
+            fail("Cannot create store directory '%s'!", dir);
+        }
+        store_path(st, path, "packs");
+        if (mkdir(path, 0777) != 0 && errno != EEXIST)
+        {
+            fail("Cannot create '%s'!", path);
+        }
+        store_path(st, path, "snapshots");
+        if (mkdir(path, 0777) != 0 && errno != EEXIST)
+        {
+            fail("Cannot create '%s'!", path);
+        }
+    }
+
+    store_path(st, path, "lock");
+    st->fd_lock = open(path, create ? O_RDWR | O_CREAT : O_RDONLY, 0666);
+    if (st->fd_lock < 0) fail("Cannot open store '%s'!", dir);
+    if (flock(st->fd_lock, exclusive ? LOCK_EX : LOCK_SH) != 0)
+    {
+        fail("Cannot lock store '%s'!", dir);
+    }
+
+    read_frames(st);
+    map_index(st);
+
+    /* Packs left by interrupted operations may exist, so scan the directory
+       to find an unused pack number */
+    store_path(st, path, "packs");
+    d = opendir(path);
+    if (d == NULL) fail("Cannot read '%s'!", path);
+    while ((de = readdir(d)) != NULL)
+    {
+        n = pack_number(de->d_name);
+        if (n >= (long)st->next_pack) st->next_pack = n + 1;
+    }
+    closedir(d);
+
+    return st;
+}
+
+static void close_store(Store *st)
+{
+    if (st->pack != NULL) fclose(st->pack);
+    unmap_index(st);
+    if (st->fd_lock >= 0) close(st->fd_lock);
+    free(st->frames);
+    free(st->added);
+    free(st->live);
+    free(st->frame_data);
+    free(st->packed);
+    free(st);
+}
+
+/* Returns the id of the stored block with the given digest, or NO_ID. */
+static uint64_t find_block(Store *st, const uint8_t digest[DS])
+{
+    size_t lo = 0, hi = st->nindex, mid;
+    int d;
+
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo)/2;
+        d = memcmp(st->index + mid*INDEX_ENTRY, digest, DS);
+        if (d == 0) return parse_uint64(st->index + mid*INDEX_ENTRY + DS);
+        if (d < 0) lo = mid + 1; else hi = mid;
+    }
+    return NO_ID;
+}
+
+/* Returns the hash table entry for the given digest, which is empty if the
+   block was not added by the current operation. */
+static NewBlock *find_added(Store *st, const uint8_t digest[DS])
+{
+    size_t mask = st->added_capacity - 1, i;
+
+    i = (size_t)parse_uint64((uint8_t*)digest) & mask;
+    while ( st->added[i].id != NO_ID &&
+            memcmp(st->added[i].digest, digest, DS) != 0 )
+    {
+        i = (i + 1) & mask;
+    }
+    return &st->added[i];
+}
+
+/* Resizes the hash table of added blocks. */
+static void grow_added(Store *st)
+{
+    NewBlock *old = st->added, *nb;
+    size_t n, capacity = st->added_capacity;
+
+    st->added_capacity = capacity ? 2*capacity : 65536;
+    st->added = malloc(st->added_capacity*sizeof(NewBlock));
+    assert(st->added != NULL);
+    for (n = 0; n < st->added_capacity; ++n) st->added[n].id = NO_ID;
+    for (n = 0; n < capacity; ++n)
+    {
+        if (old[n].id == NO_ID) continue;
+        nb = find_added(st, old[n].digest);
+        *nb = old[n];
+    }
+    free(old);
+}
+
+/* Compresses the frame being written and appends it to the pack. */
+static void flush_frame(Store *st)
+{
+    uLongf size = compressBound(FRAME_BLOCKS*BS);
+    FrameInfo *fi;
+    off_t offset;
+
+    if (st->frame_blocks == 0) return;
+    if (compress2( st->packed, &size, (Bytef*)st->frame_data,
+                   (uLong)st->frame_blocks*BS, Z_DEFAULT_COMPRESSION ) != Z_OK)
+    {
+        fail("Compression failed!");
+    }
+    offset = ftello(st->pack);
+    if (offset < 0) fail("Write to store failed!");
+    write_file(st->pack, st->packed, size);
+
+    fi = add_frame(st);
+    fi->offset  = offset;
+    fi->pack    = st->pack_number;
+    fi->size    = size;
+    fi->nblocks = st->frame_blocks;
+    st->frame_blocks = 0;
+}
+
+/* Stores a new block, and returns its id. */
+static uint64_t add_block(Store *st, const uint8_t digest[DS], char data[BS])
+{
+    NewBlock *nb;
+
+    if (2*(st->nadded + 1) > st->added_capacity) grow_added(st);
+    nb = find_added(st, digest);
+    if (nb->id != NO_ID) return nb->id;
+
+    memcpy(nb->digest, digest, DS);
+    nb->id = (uint64_t)FRAME_BLOCKS*st->nframes + st->frame_blocks;
+    ++st->nadded;
+    memcpy(st->frame_data + (size_t)BS*st->frame_blocks, data, BS);
+    if (++st->frame_blocks == FRAME_BLOCKS) flush_frame(st);
+    return nb->id;
+}
+
+static int compar_new_block(const void *a_in, const void *b_in)
+{
+    const NewBlock *a = a_in, *b = b_in;
+
+    /* Empty entries sort last */
+    if (a->id == NO_ID || b->id == NO_ID)
+    {
+        return (a->id == NO_ID) - (b->id == NO_ID);
+    }
+    return memcmp(a->digest, b->digest, DS);
+}
+
+/* Writes a new index, containing the entries of the current index for which
+   `keep' returns true (or all, if it is NULL) and the added blocks. */
+static void write_index(Store *st, bool (*keep)(Store *, uint64_t))
+{
+    uint8_t buf[INDEX_ENTRY], *old;
+    char path[4096];
+    size_t i = 0, j = 0;
+    uint64_t id;
+    FILE *fp;
+
+    if (st->nadded > 0)
+    {
+        qsort(st->added, st->added_capacity, sizeof(NewBlock),
+              compar_new_block);
+    }
+    store_path(st, path, "index.tmp");
+    fp = fopen(path, "wb");
+    if (fp == NULL) fail("Cannot open '%s' for writing!", path);
+    while (i < st->nindex || j < st->nadded)
+    {
+        old = st->index + i*INDEX_ENTRY;
+        if ( j == st->nadded ||
+             (i < st->nindex && memcmp(old, st->added[j].digest, DS) < 0) )
+        {
+            id = parse_uint64(old + DS);
+            if (keep == NULL || keep(st, id)) write_file(fp, old, INDEX_ENTRY);
+            ++i;
+        }
+        else
+        {
+            memcpy(buf, st->added[j].digest, DS);
+            put_uint64(buf + DS, st->added[j].id);
+            write_file(fp, buf, INDEX_ENTRY);
+            ++j;
+        }
+    }
+    close_synced(fp);
+    replace_file(st, "index.tmp", "index");
+    sync_dir(st, ".");
+
+    /* The hash table is no longer ordered by hash */
+    free(st->added);
+    st->added = NULL;
+    st->nadded = st->added_capacity = 0;
+    unmap_index(st);
+    map_index(st);
+}
+
+/* Reads the header of a manifest and returns the number of runs, storing the
+   file size and digest in `size' and `digest'. */
+static uint64_t read_manifest_header( FILE *fp, uint64_t *size,
+                                      uint8_t digest[DS] )
+{
+    uint8_t buf[MANIFEST_HEADER];
+
+    if ( fread(buf, MANIFEST_HEADER, 1, fp) != 1 ||
+         memcmp(buf, MANIFEST_MAGIC, MAGIC_LEN) != 0 )
+    {
+        fail("Invalid snapshot manifest!");
+    }
+    *size = parse_uint64(buf + MAGIC_LEN);
+    memcpy(digest, buf + MAGIC_LEN + 8, DS);
+    return parse_uint64(buf + MAGIC_LEN + 8 + DS);
+}
+
+static void read_run(FILE *fp, Run *run)
+{
+    uint8_t buf[RUN_LEN];
+
+    read_file(fp, buf, RUN_LEN);
+    run->first = parse_uint64(buf);
+    run->count = parse_uint32(buf + 8);
+}
+
+static void write_run(FILE *fp, const Run *run)
+{
+    uint8_t buf[RUN_LEN];
+
+    put_uint64(buf, run->first);
+    put_uint32(buf + 8, run->count);
+    write_file(fp, buf, RUN_LEN);
+}
+
+/* Opens the manifest of a snapshot for reading, or fails. */
+static FILE *open_manifest(Store *st, const char *name)
+{
+    char path[4096];
+    FILE *fp;
+
+    if (!valid_name(name)) fail("Invalid snapshot name '%s'!", name);
+    store_path(st, path, "snapshots/%s", name);
+    fp = fopen(path, "rb");
+    if (fp == NULL) fail("Snapshot '%s' does not exist!", name);
+    return fp;
+}
+
+/* Adds the file read from `is' to the store as snapshot `name'. */
+static void store_add(Store *st, const char *name, InputStream *is)
+{
+    Progress *progress = active_progress;
+    char path[4096], tmp_name[4096], data[BS];
+    uint8_t buf[MANIFEST_HEADER], digest[DS];
+    size_t first_frame = st->nframes;
+    uint64_t id, size = 0, nblocks = 0, nruns = 0, added;
+    Run run = { NO_ID, 0 };
+    MD5_CTX file_md5_ctx, md5_ctx;
+    size_t nread;
+    off_t packed;
+    FILE *manifest, *fp;
+    int fd;
+
+    if (!valid_name(name)) fail("Invalid snapshot name '%s'!", name);
+    store_path(st, path, "snapshots/%s", name);
+    if (access(path, F_OK) == 0) fail("Snapshot '%s' exists!", name);
+
+    /* Create a new pack */
+    st->pack_number = st->next_pack++;
+    store_path(st, path, "packs/%u", (unsigned)st->pack_number);
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0 || (st->pack = fdopen(fd, "wb")) == NULL)
+    {
+        fail("Cannot create '%s'!", path);
+    }
+
+    /* Write the manifest to a temporary file, leaving room for the header */
+    snprintf(tmp_name, sizeof(tmp_name), "snapshots/.%s.tmp", name);
+    store_path(st, path, "%s", tmp_name);
+    manifest = fopen(path, "wb");
+    if (manifest == NULL) fail("Cannot open '%s' for writing!", path);
+    memset(buf, 0, MANIFEST_HEADER);
+    write_file(manifest, buf, MANIFEST_HEADER);
+
+    stats_phase("add");
+    progress_phase("add", is->size(is) > 0 ? is->size(is) : 0);
+    MD5_Init(&file_md5_ctx);
+    while ((nread = is->read(is, data, BS)) > 0)
+    {
+        memset(data + nread, 0, BS - nread);
+        MD5_Update(&file_md5_ctx, data, nread);
+        size += nread;
+        ++nblocks;
+
+        MD5_Init(&md5_ctx);
+        MD5_Update(&md5_ctx, data, BS);
+        MD5_Final(digest, &md5_ctx);
+        id = find_block(st, digest);
+        if (id == NO_ID) id = add_block(st, digest, data);
+
+        /* Extend the current run, or start a new one */
+        if (run.count > 0 && id == run.first + run.count &&
+            run.count < 0xffffffffu)
+        {
+            ++run.count;
+        }
+        else
+        {
+            if (run.count > 0) write_run(manifest, &run), ++nruns;
+            run.first = id;
+            run.count = 1;
+        }
+        progress_add(progress, nread);
+        if (nread < BS) break;
+    }
+    if (run.count > 0) write_run(manifest, &run), ++nruns;
+    MD5_Final(digest, &file_md5_ctx);
+
+    /* Write the new pack and frames, then the index */
+    flush_frame(st);
+    packed = ftello(st->pack);
+    close_synced(st->pack);
+    st->pack = NULL;
+    added = st->nadded;
+    if (st->nframes == first_frame)
+    {
+        store_path(st, path, "packs/%u", (unsigned)st->pack_number);
+        unlink(path);
+    }
+    else
+    {
+        /* Append to the frame table (replacing an incomplete entry left by an
+           interrupted operation, if any) */
+        sync_dir(st, "packs");
+        store_path(st, path, "frames");
+        fd = open(path, O_WRONLY | O_CREAT, 0666);
+        if ( fd < 0 || ftruncate(fd, (off_t)FRAME_ENTRY*first_frame) != 0 ||
+             lseek(fd, 0, SEEK_END) < 0 || (fp = fdopen(fd, "wb")) == NULL )
+        {
+            fail("Cannot open '%s' for writing!", path);
+        }
+        write_frames(st, fp, first_frame, st->nframes);
+        close_synced(fp);
+        write_index(st, NULL);
+    }
+
+    /* Complete the manifest */
+    if (fseeko(manifest, 0, SEEK_SET) != 0) fail("Seek failed.");
+    memcpy(buf, MANIFEST_MAGIC, MAGIC_LEN);
+    put_uint64(buf + MAGIC_LEN, size);
+    memcpy(buf + MAGIC_LEN + 8, digest, DS);
+    put_uint64(buf + MAGIC_LEN + 8 + DS, nruns);
+    write_file(manifest, buf, MANIFEST_HEADER);
+    close_synced(manifest);
+    snprintf(path, sizeof(path), "snapshots/%s", name);
+    replace_file(st, tmp_name, path);
+    sync_dir(st, "snapshots");
+    stats_phase_end();
+
+    printf("%s: %llu blocks in %llu runs, %llu new blocks (%llu bytes "
+           "compressed)\n", name, (unsigned long long)nblocks,
+           (unsigned long long)nruns, (unsigned long long)added,
+           (unsigned long long)packed);
+}
+
+/* Reads frame `frame' into the frame buffer. */
+static void load_frame(Store *st, uint64_t frame)
+{
+    char path[4096];
+    FrameInfo *fi;
+    uLongf size = FRAME_BLOCKS*BS;
+
+    if (frame >= st->nframes || st->frames[frame].nblocks == 0)
+    {
+        fail("Block is missing from the store!");
+    }
+    fi = &st->frames[frame];
+    if (st->pack == NULL || st->pack_number != fi->pack)
+    {
+        if (st->pack != NULL) fclose(st->pack);
+        store_path(st, path, "packs/%u", (unsigned)fi->pack);
+        st->pack = fopen(path, "rb");
+        if (st->pack == NULL) fail("Cannot open '%s'!", path);
+        st->pack_number = fi->pack;
+    }
+    if (fi->size > compressBound(FRAME_BLOCKS*BS) ||
+        fseeko(st->pack, (off_t)fi->offset, SEEK_SET) != 0)
+    {
+        fail("Invalid frame table entry!");
+    }
+    read_file(st->pack, st->packed, fi->size);
+    if ( uncompress( (Bytef*)st->frame_data, &size, st->packed,
+                     fi->size ) != Z_OK || size != (uLongf)fi->nblocks*BS )
+    {
+        fail("Corrupt frame in store!");
+    }
+    st->frame = frame;
+}
+
+/* Writes snapshot `name' to `os' and verifies it. */
+static bool store_restore(Store *st, const char *name, OutputStream *os)
+{
+    Progress *progress = active_progress;
+    uint8_t digest_expected[DS], digest[DS];
+    uint64_t size, written = 0, nruns, n, id;
+    MD5_CTX md5_ctx;
+    size_t len;
+    Run run;
+    FILE *fp;
+
+    fp = open_manifest(st, name);
+    nruns = read_manifest_header(fp, &size, digest_expected);
+
+    stats_phase("restore");
+    progress_phase("restore", size);
+    MD5_Init(&md5_ctx);
+    for (n = 0; n < nruns; ++n)
+    {
+        read_run(fp, &run);
+        for (id = run.first; id - run.first < run.count; ++id)
+        {
+            if (st->frame != id/FRAME_BLOCKS) load_frame(st, id/FRAME_BLOCKS);
+            if (id%FRAME_BLOCKS >= st->frames[st->frame].nblocks)
+            {
+                fail("Block is missing from the store!");
+            }
+            len = (size - written < BS) ? size - written : BS;
+            write_data(os, st->frame_data + BS*(id%FRAME_BLOCKS), len);
+            MD5_Update(&md5_ctx, st->frame_data + BS*(id%FRAME_BLOCKS), len);
+            written += len;
+            progress_add(progress, len);
+        }
+    }
+    fclose(fp);
+    MD5_Final(digest, &md5_ctx);
+    stats_phase_end();
+
+    if (written != size || memcmp(digest, digest_expected, DS) != 0)
+    {
+        fprintf(stderr, "Restored file verification failed!\n");
+        return false;
+    }
+    return true;
+}
+
+/* Removes snapshot `name' (its blocks are removed by the garbage collector). */
+static void store_remove(Store *st, const char *name)
+{
+    char path[4096];
+
+    fclose(open_manifest(st, name));
+    store_path(st, path, "snapshots/%s", name);
+    if (unlink(path) != 0) fail("Cannot remove '%s'!", path);
+    sync_dir(st, "snapshots");
+}
+
+/* Returns whether block `id' is in a frame that is in use. */
+static bool is_live(Store *st, uint64_t id)
+{
+    return (st->live[id/FRAME_BLOCKS/8] >> (id/FRAME_BLOCKS%8)) & 1;
+}
+
+static int compar_frame_pos(const void *a_in, const void *b_in)
+{
+    const FramePos *a = a_in, *b = b_in;
+    if (a->pack != b->pack) return (a->pack < b->pack) ? -1 : +1;
+    if (a->offset != b->offset) return (a->offset < b->offset) ? -1 : +1;
+    return 0;
+}
+
+/* Removes frames that are not referred to by any snapshot, and pack files
+   that contain no frames. */
+static void store_gc(Store *st)
+{
+    char path[4096];
+    uint8_t digest[DS], *repack, *used;
+    uint64_t size, nruns, n, frame;
+    uint64_t removed = 0, old_bytes = 0, new_bytes = 0;
+    size_t i, j;
+    FramePos *order;
+    FrameInfo *fi;
+    struct dirent *de;
+    FILE *fp, *in;
+    DIR *d;
+    Run run;
+    long p;
+
+    stats_phase("gc");
+    progress_phase("gc", 0);
+
+    /* Mark frames referred to by manifests */
+    st->live = calloc(st->nframes/8 + 1, 1);
+    assert(st->live != NULL);
+    store_path(st, path, "snapshots");
+    d = opendir(path);
+    if (d == NULL) fail("Cannot read '%s'!", path);
+    while ((de = readdir(d)) != NULL)
+    {
+        if (!valid_name(de->d_name)) continue;
+        fp = open_manifest(st, de->d_name);
+        nruns = read_manifest_header(fp, &size, digest);
+        for (n = 0; n < nruns; ++n)
+        {
+            read_run(fp, &run);
+            if (run.count == 0) continue;
+            for ( frame = run.first/FRAME_BLOCKS;
+                  frame <= (run.first + run.count - 1)/FRAME_BLOCKS; ++frame )
+            {
+                if (frame >= st->nframes)
+                {
+                    fail("Snapshot '%s' refers to a missing block!",
+                         de->d_name);
+                }
+                st->live[frame/8] |= 1 << (frame%8);
+            }
+        }
+        fclose(fp);
+    }
+    closedir(d);
+
+    /* Remove blocks of unused frames from the index */
+    write_index(st, is_live);
+
+    /* Find packs that contain unused frames, and order frames by position */
+    repack = calloc(st->next_pack/8 + 1, 1);
+    used   = calloc(st->next_pack/8 + 1, 1);
+    order  = malloc(st->nframes*sizeof(FramePos) + 1);
+    assert(repack != NULL && used != NULL && order != NULL);
+    for (i = 0; i < st->nframes; ++i)
+    {
+        fi = &st->frames[i];
+        order[i].pack   = fi->pack;
+        order[i].offset = fi->offset;
+        order[i].frame  = i;
+        if (fi->nblocks == 0) continue;
+        old_bytes += fi->size;
+        if (!is_live(st, (uint64_t)FRAME_BLOCKS*i))
+        {
+            repack[fi->pack/8] |= 1 << (fi->pack%8);
+            ++removed;
+        }
+    }
+    qsort(order, st->nframes, sizeof(FramePos), compar_frame_pos);
+
+    /* Copy the remaining frames of those packs to new packs */
+    for (i = 0; i < st->nframes; i = j)
+    {
+        uint32_t pack = order[i].pack;
+
+        for (j = i; j < st->nframes && order[j].pack == pack; ++j) { }
+        if (!((repack[pack/8] >> (pack%8)) & 1)) continue;
+
+        store_path(st, path, "packs/%u", (unsigned)pack);
+        in = fopen(path, "rb");
+        if (in == NULL) fail("Cannot open '%s'!", path);
+        st->pack_number = st->next_pack++;
+        store_path(st, path, "packs/%u", (unsigned)st->pack_number);
+        fp = fopen(path, "wb");
+        if (fp == NULL) fail("Cannot create '%s'!", path);
+        for ( ; i < j; ++i)
+        {
+            fi = &st->frames[order[i].frame];
+            if (fi->nblocks == 0) continue;
+            if (!is_live(st, (uint64_t)FRAME_BLOCKS*order[i].frame))
+            {
+                memset(fi, 0, sizeof(FrameInfo));
+                continue;
+            }
+            if (fseeko(in, (off_t)fi->offset, SEEK_SET) != 0)
+            {
+                fail("Read from store failed!");
+            }
+            read_file(in, st->packed, fi->size);
+            fi->offset = ftello(fp);
+            fi->pack   = st->pack_number;
+            write_file(fp, st->packed, fi->size);
+        }
+        fclose(in);
+        close_synced(fp);
+    }
+    free(order);
+    free(repack);
+    sync_dir(st, "packs");
+
+    /* Replace the frame table */
+    store_path(st, path, "frames.tmp");
+    fp = fopen(path, "wb");
+    if (fp == NULL) fail("Cannot open '%s' for writing!", path);
+    write_frames(st, fp, 0, st->nframes);
+    close_synced(fp);
+    replace_file(st, "frames.tmp", "frames");
+    sync_dir(st, ".");
+
+    /* Remove pack files that are no longer used */
+    for (i = 0; i < st->nframes; ++i)
+    {
+        fi = &st->frames[i];
+        if (fi->nblocks == 0) continue;
+        used[fi->pack/8] |= 1 << (fi->pack%8);
+        new_bytes += fi->size;
+    }
+    store_path(st, path, "packs");
+    d = opendir(path);
+    if (d == NULL) fail("Cannot read '%s'!", path);
+    while ((de = readdir(d)) != NULL)
+    {
+        p = pack_number(de->d_name);
+        if (p < 0 || (p < (long)st->next_pack && ((used[p/8] >> (p%8)) & 1)))
+        {
+            continue;
+        }
+        store_path(st, path, "packs/%s", de->d_name);
+        if (unlink(path) != 0) fail("Cannot remove '%s'!", path);
+    }
+    closedir(d);
+    free(used);
+    stats_phase_end();
+
+    printf("Removed %llu frames; packed data reduced from %llu to %llu "
+           "bytes.\n", (unsigned long long)removed,
+           (unsigned long long)old_bytes, (unsigned long long)new_bytes);
+}
+
+int tardiffstore(int argc, char *argv[], const char *flags)
+{
+    const char *command = argv[1];
+    InputStream *is;
+    OutputStream *os;
+    Store *st;
+    bool ok = true;
+
+    (void)flags;
+
+    if (strcmp(command, "add") == 0 && argc == 4)
+    {
+        is = (strcmp(argv[3], "-") == 0) ? OpenStdinInputStream()
+                                         : OpenFileInputStream(argv[3]);
+        if (is == NULL)
+        {
+            fprintf(stderr, "Cannot open '%s' for reading!\n", argv[3]);
+            exit(EXIT_FAILURE);
+        }
+        is = stats_input_stream(is, "file");
+        st = open_store(argv[0], true, true);
+        store_add(st, argv[2], is);
+        is->close(is);
+    }
+    else
+    if (strcmp(command, "restore") == 0 && argc == 4)
+    {
+        st = open_store(argv[0], false, false);
+        fclose(open_manifest(st, argv[2]));  /* fail before creating output */
+        if (strcmp(argv[3], "-") != 0) redirect_stdout(argv[3]);
+        os = stats_output_stream(OpenFileOutputStream(stdout), "file");
+        assert(os != NULL);
+        ok = store_restore(st, argv[2], os);
+        os->close(os);
+    }
+    else
+    if (strcmp(command, "remove") == 0 && argc == 3)
+    {
+        st = open_store(argv[0], false, true);
+        store_remove(st, argv[2]);
+    }
+    else
+    if (strcmp(command, "gc") == 0 && argc == 2)
+    {
+        st = open_store(argv[0], false, true);
+        store_gc(st);
+    }
+    else
+    {
+        fprintf(stderr, "Invalid store command: %s (see usage)\n", command);
+        return EXIT_FAILURE;
+    }
+    close_store(st);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
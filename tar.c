@@ -0,0 +1,226 @@
+#include "tar.h"
+
+/* Offsets and sizes of ustar header fields */
+#define NAME_OFS      0
+#define NAME_LEN    100
+#define SIZE_OFS    124
+#define SIZE_LEN     12
+#define CHKSUM_OFS  148
+#define CHKSUM_LEN    8
+#define TYPE_OFS    156
+#define MAGIC_OFS   257
+#define PREFIX_OFS  345
+#define PREFIX_LEN  155
+
+/* Parses a numeric field, which is either octal or base-256 encoded. */
+static uint64_t parse_number(const char *field, size_t len)
+{
+    uint64_t res = 0;
+    size_t i;
+
+    if ((uint8_t)field[0] & 0x80)
+    {
+        /* GNU base-256 encoding */
+        res = (uint8_t)field[0] & 0x3f;
+        for (i = 1; i < len; ++i) res = (res << 8) | (uint8_t)field[i];
+        return res;
+    }
+    for (i = 0; i < len && field[i] == ' '; ++i) { }
+    for ( ; i < len && field[i] >= '0' && field[i] <= '7'; ++i)
+    {
+        res = 8*res + (field[i] - '0');
+    }
+    return res;
+}
+
+/* Returns whether `data' is a ustar header block with a valid checksum. */
+static bool valid_header(const char data[BS])
+{
+    uint64_t sum = 0;
+    size_t i;
+
+    for (i = 0; i < BS; ++i)
+    {
+        sum += (i >= CHKSUM_OFS && i < CHKSUM_OFS + CHKSUM_LEN)
+               ? ' ' : (uint8_t)data[i];
+    }
+    return sum != CHKSUM_LEN*' ' &&
+           parse_number(data + CHKSUM_OFS, CHKSUM_LEN) == sum;
+}
+
+/* Copies a field that is not necessarily null-terminated. */
+static size_t copy_field(char *dst, const char *src, size_t len)
+{
+    size_t n = 0;
+    while (n < len && src[n] != '\0') dst[n] = src[n], ++n;
+    dst[n] = '\0';
+    return n;
+}
+
+/* Extracts "path" and "size" records from pax extended header data. */
+static void parse_pax(TarParser *tp)
+{
+    size_t pos = 0, len, klen;
+    char *rec, *key, *end;
+
+    while (pos < tp->ext_len)
+    {
+        rec = tp->ext + pos;
+        len = strtoul(rec, &key, 10);
+        if (len == 0 || *key != ' ' || len > tp->ext_len - pos) break;
+        ++key;
+        end = rec + len - 1;   /* points to the newline */
+        for (klen = 0; key + klen < end && key[klen] != '='; ++klen) { }
+        if (key + klen < end)
+        {
+            if (klen == 4 && memcmp(key, "path", 4) == 0)
+            {
+                memcpy(tp->next_path, key + 5, end - (key + 5));
+                tp->next_path[end - (key + 5)] = '\0';
+                tp->next_path_known = true;
+            }
+            else
+            if (klen == 4 && memcmp(key, "size", 4) == 0)
+            {
+                tp->next_size = strtoull(key + 5, NULL, 10);
+                tp->next_size_known = true;
+            }
+        }
+        pos += len;
+    }
+}
+
+/* Processes extended header data after it has been read completely. */
+static void finish_ext(TarParser *tp)
+{
+    tp->ext[tp->ext_len] = '\0';
+    if (tp->ext_type == 'x')
+    {
+        parse_pax(tp);
+    }
+    else
+    if (tp->ext_type == 'L')
+    {
+        strcpy(tp->next_path, tp->ext);
+        tp->next_path_known = true;
+    }
+    tp->in_ext = false;
+
+    /* The path of the member may be known before its header is read */
+    if (tp->next_path_known)
+    {
+        strcpy(tp->path, tp->next_path);
+        tp->path_known = true;
+    }
+}
+
+/* Processes a header block; returns the block type. */
+static enum TarBlockType process_header(TarParser *tp, const char data[BS])
+{
+    char type = data[TYPE_OFS];
+    uint64_t size = parse_number(data + SIZE_OFS, SIZE_LEN);
+    size_t n;
+
+    /* A member starts with its first (extended) header */
+    tp->member_start = !tp->in_meta;
+    if (tp->member_start) tp->path_known = false;
+
+    if (type == 'x' || type == 'g' || type == 'L' || type == 'K' || type == 'X')
+    {
+        /* Extended header; data follows */
+        tp->in_meta   = true;
+        tp->in_ext    = true;
+        tp->ext_type  = type;
+        tp->ext_len   = 0;
+        tp->remaining = size/BS + (size%BS != 0);
+        if (tp->remaining == 0) finish_ext(tp);
+        return TAR_META;
+    }
+
+    /* Regular member header */
+    if (tp->next_path_known)
+    {
+        strcpy(tp->path, tp->next_path);
+    }
+    else
+    {
+        n = 0;
+        if (memcmp(data + MAGIC_OFS, "ustar\0", 6) == 0 &&
+            data[PREFIX_OFS] != '\0')
+        {
+            n = copy_field(tp->path, data + PREFIX_OFS, PREFIX_LEN);
+            tp->path[n++] = '/';
+        }
+        copy_field(tp->path + n, data + NAME_OFS, NAME_LEN);
+    }
+    if (tp->next_size_known) size = tp->next_size;
+    tp->next_path_known = tp->next_size_known = false;
+    tp->path_known = true;
+    tp->in_meta = false;
+
+    /* Links, devices, directories and FIFOs have no data */
+    tp->size = (type >= '1' && type <= '6') ? 0 : size;
+    tp->data_blocks = tp->size/BS + (tp->size%BS != 0);
+    tp->remaining = tp->data_blocks;
+    return TAR_HEADER;
+}
+
+void TarParser_init(TarParser *tp)
+{
+    tp->remaining       = 0;
+    tp->in_ext          = false;
+    tp->in_meta         = false;
+    tp->ext_len         = 0;
+    tp->next_path_known = false;
+    tp->next_size_known = false;
+    tp->member_start    = false;
+    tp->path_known      = false;
+    tp->size            = 0;
+    tp->data_blocks     = 0;
+}
+
+enum TarBlockType TarParser_next(TarParser *tp, const char data[BS])
+{
+    tp->member_start = false;
+
+    if (tp->in_ext)
+    {
+        /* Extended header data */
+        if (tp->ext_len + BS < TAR_MAX_EXT)
+        {
+            memcpy(tp->ext + tp->ext_len, data, BS);
+            tp->ext_len += BS;
+        }
+        if (--tp->remaining == 0) finish_ext(tp);
+        return TAR_META;
+    }
+
+    if (tp->remaining > 0)
+    {
+        /* Member data */
+        --tp->remaining;
+        return TAR_DATA;
+    }
+
+    if (!valid_header(data))
+    {
+        /* End-of-archive marker, or not a tar archive at all */
+        tp->path_known = tp->in_meta = false;
+        tp->next_path_known = tp->next_size_known = false;
+        return TAR_OTHER;
+    }
+
+    return process_header(tp, data);
+}
+
+uint64_t TarParser_skip_data(TarParser *tp)
+{
+    uint64_t n = 0;
+
+    if (!tp->in_ext)
+    {
+        n = tp->remaining;
+        tp->remaining = 0;
+    }
+    return n;
+}
@@ -0,0 +1,51 @@
+#ifndef TAR_H_INCLUDED
+#define TAR_H_INCLUDED
+
+#include "common.h"
+
+/* Incremental parser for tar archives (ustar, pax and GNU formats), used to
+   associate blocks with archive members as they are scanned. */
+
+#define TAR_MAX_EXT 65536       /* max. size of extended header data kept */
+
+enum TarBlockType
+{
+    TAR_OTHER,                  /* not part of a member (e.g. end-of-archive) */
+    TAR_META,                   /* extended header or extended header data */
+    TAR_HEADER,                 /* ustar header of a member */
+    TAR_DATA                    /* member data */
+};
+
+typedef struct TarParser
+{
+    uint64_t remaining;         /* blocks remaining in current data */
+    bool     in_meta;           /* extended headers read for next member? */
+    bool     in_ext;            /* reading extended header data? */
+    char     ext_type;          /* type of extended header being read */
+    size_t   ext_len;           /* length of extended header data kept */
+    char     ext[TAR_MAX_EXT];  /* extended header data */
+    bool     next_path_known;   /* has the next member's path been set? */
+    char     next_path[TAR_MAX_EXT];
+    bool     next_size_known;   /* has the next member's size been set? */
+    uint64_t next_size;
+
+    /* Information about the current member: */
+    bool     member_start;      /* does the last block start a new member? */
+    bool     path_known;        /* is the member's path known yet? */
+    char     path[TAR_MAX_EXT]; /* path of the member (if known) */
+    uint64_t size;              /* size of the member data in bytes */
+    uint64_t data_blocks;       /* number of data blocks (after the header) */
+} TarParser;
+
+/* Initializes a parser at the start of an archive. */
+void TarParser_init(TarParser *tp);
+
+/* Processes the next block of the archive, updating the member information
+   in the parser, and returns the type of the block. */
+enum TarBlockType TarParser_next(TarParser *tp, const char data[BS]);
+
+/* Skips the remaining data blocks of the current member, and returns their
+   number. The caller must not pass these blocks to TarParser_next(). */
+uint64_t TarParser_skip_data(TarParser *tp);
+
+#endif /* ndef TAR_H_INCLUDED */
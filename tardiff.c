@@ -1,26 +1,121 @@
 #include "common.h"
 #include "binsort.h"
+#include "bloom.h"
+#include "format.h"
+#include "libtardiff.h"
+#include "md5blocks.h"
+#include "progress.h"
+#include "stats.h"
+#include "tar.h"
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define NO_BLOCK    0xffffffffffffffffull
+#define PATCH_RUN   64          /* max. number of patched blocks copied */
+#define MAX_PENDING 64          /* max. number of metadata blocks buffered */
+#define SCAN_BLOCKS 64          /* blocks read and hashed at a time */
+#define COMMON_BLOCKS 2048      /* blocks compared at a time (1 MB) */
 
 typedef struct BlockInfo
 {
     uint8_t  digest[DS];
-    uint32_t index;
+    uint64_t index;
 } BlockInfo;
 
-/* Block sorting */
-static BinSort *bs;
-static BlockInfo *blocks;
-static size_t nblocks;
+/* Describes a member of tar file 1 (in tar-aware mode) */
+typedef struct MemberInfo
+{
+    uint8_t  digest[DS];        /* MD5 digest of the member's path */
+    uint64_t first;             /* index of the first (extended) header */
+    uint64_t header;            /* index of the ustar header */
+    uint64_t end;               /* index one past the last data block */
+    uint64_t store;             /* index of first header in header store */
+} MemberInfo;
+
+/* State of a diff operation */
+typedef struct DiffContext
+{
+    OutputStream *os;               /* differences file */
+
+    /* Block sorting */
+    BinSort   *bs;
+    BlockInfo *blocks;
+    size_t    nblocks;
+    uint64_t  next_index;           /* index of block following last match */
+
+    /* Digests of file 1 blocks in index order (used to continue a run of
+       matching blocks without searching the sorted blocks) */
+    FILE      *digest_store;
+    uint8_t   (*digests)[DS];
+
+    /* Filter over the digests of file 1, which rejects most blocks that do not
+       occur in file 1 without searching the sorted blocks (or NULL) */
+    BloomFilter *filter;
+
+    /* MD5 digests for tar files
+       (used to detect errors when merging and applying patches) */
+    MD5_CTX file1_md5_ctx, file2_md5_ctx;
+
+    /* Base files that file 1 consists of (NULL if it is a single file), and
+       the digest of the base file being scanned */
+    BaseList *bases;
+    MD5_CTX  base_md5_ctx;
+
+    /* Chunk digests for file 2 (used to verify patches per chunk) */
+    ChunkDigests *file2_chunks;
+
+    /* Number of identical blocks at the start and at the end of files 1 and 2
+       (which are copied without hashing and looking up file 2 blocks), the
+       number of blocks of file 2, and the digest of the common prefix */
+    uint64_t prefix, suffix, file2_blocks;
+    MD5_CTX  prefix_md5_ctx;
 
-/* MD5 digests for tar files
-   (used to detect errors when merging and applying patches) */
-static MD5_CTX file1_md5_ctx, file2_md5_ctx;
+    /* Format of the differences file (wide if file 1 is too large for the
+       narrow format, or if requested) */
+    enum DiffFormat format;
 
-/* Counts for patch instruction */
-static uint32_t S = 0xffffffffu;    /* seek to */
-static uint16_t C = 0;              /* copy existing blocks*/
-static uint16_t A = 0;              /* append new blocks */
-static char new_blocks[NA][BS];
+    /* Index of generated instructions (used for random access) */
+    InstructionIndex *instr_index;
+    uint64_t T;                     /* output blocks generated */
+
+    /* Tar-aware mode: members of file 1 sorted by path digest, and the header
+       blocks of file 1 (kept to encode header changes as edit lists) */
+    bool       tar_mode;
+    TarParser  tar_parser;
+    BinSort    *member_bs;
+    MemberInfo *members;
+    size_t     nmembers;
+    MemberInfo member;              /* member of file 1 being indexed */
+    FILE       *header_store;
+    uint64_t   header_store_blocks;
+
+    /* Member of file 1 with the same path as the current member of file 2,
+       and metadata blocks of file 2 buffered until the member's path is
+       known */
+    MemberInfo *cur_member;
+    uint32_t   meta_pos;
+    size_t     npending;
+    uint32_t   pending_pos[MAX_PENDING];
+    uint8_t    pending_digest[MAX_PENDING][DS];
+    char       pending_data[MAX_PENDING][BS];
+
+    /* Context of the reverse differences file, from file 2 to file 1, which
+       is generated after this one (or NULL) */
+    struct DiffContext *reverse;
+
+    /* Is the index of file 1 shared with a TardiffIndex (so it is neither
+       modified nor freed with this context)? */
+    bool shared;
+
+    /* Counts for patch instruction */
+    uint64_t S;                     /* seek to */
+    uint32_t C;                     /* copy existing blocks*/
+    uint32_t A;                     /* append new blocks */
+    bool     P;                     /* copied blocks are patched */
+    char     new_blocks[NA][BS];
+    uint8_t  patch_edits[PATCH_RUN*MAX_PATCH_EDITS];
+    size_t   patch_edits_size;
+} DiffContext;
 
 static int compar_block_info(const void *a_in, const void *b_in)
 {
@@ -32,190 +127,1043 @@ static int compar_block_info(const void *a_in, const void *b_in)
     return 0;
 }
 
-static void emit_instruction()
+static int compar_member_info(const void *a_in, const void *b_in)
 {
-    if (C == 0 && A == 0) return;   /* empty instruction */
+    const MemberInfo *a = a_in, *b = b_in;
+    int d = memcmp(a->digest, b->digest, DS);
+    if (d != 0) return d;
+    if (a->first < b->first) return -1;
+    if (a->first > b->first) return +1;
+    return 0;
+}
+
+static void emit_instruction(DiffContext *ctx)
+{
+    Instruction ins;
+
+    if (ctx->C == 0 && ctx->A == 0) return;   /* empty instruction */
 
     /* Output current instruction */
-    write_uint32(S);
-    write_uint16(C);
-    write_uint16(A);
+    stats_instruction(ctx->C, ctx->A, ctx->P);
+    InstructionIndex_add( ctx->instr_index, ctx->T,
+                          get_output_digest(ctx->os, NULL) );
+    ctx->T += ctx->C + ctx->A;
+    ins.S = ctx->S;
+    ins.C = ctx->C;
+    ins.A = ctx->A;
+    ins.patched = ctx->P;
+    write_instruction(ctx->os, ctx->format, &ins);
+
+    /* Append edit lists of patched blocks (new in version 1.2) */
+    write_data(ctx->os, ctx->patch_edits, ctx->patch_edits_size);
 
     /* Append new data blocks */
-    write_data(new_blocks, BS*A);
+    write_data(ctx->os, ctx->new_blocks, BS*ctx->A);
 
     /* Reset instruction */
-    S = 0xffffffffu;
-    C = A = 0;
+    ctx->S = NO_BLOCK;
+    ctx->C = ctx->A = 0;
+    ctx->P = false;
+    ctx->patch_edits_size = 0;
+}
+
+static void append_block(DiffContext *ctx, char data[BS])
+{
+    memcpy(ctx->new_blocks[ctx->A++], data, BS);
+    if (ctx->A == NA) emit_instruction(ctx);
 }
 
-static void append_block(char data[BS])
+static void copy_block(DiffContext *ctx, uint64_t index)
 {
-    memcpy(new_blocks[A++], data, BS);
-    if (A == NA) emit_instruction();
+    if (ctx->A != 0 || ctx->P || index != ctx->S + ctx->C)
+    {
+        emit_instruction(ctx);
+    }
+    if (ctx->C == 0) ctx->S = index;
+    ctx->C += 1;
+    if (ctx->C == MAX_COUNT(ctx->format)) emit_instruction(ctx);
 }
 
-static void copy_block(uint32_t index)
+static void patch_block( DiffContext *ctx, uint64_t index,
+                         uint8_t *edits, size_t size )
 {
-    if (A != 0 || index != S + C) emit_instruction();
-    if (C == 0) S = index;
-    C += 1;
-    if (C == NC) emit_instruction();
+    if (ctx->A != 0 || (ctx->C > 0 && !ctx->P) || index != ctx->S + ctx->C)
+    {
+        emit_instruction(ctx);
+    }
+    if (ctx->C == 0) ctx->S = index, ctx->P = true;
+    memcpy(ctx->patch_edits + ctx->patch_edits_size, edits, size);
+    ctx->patch_edits_size += size;
+    ctx->C += 1;
+    if (ctx->C == PATCH_RUN) emit_instruction(ctx);
 }
 
-/* Returns a pointer to a block in file 1 matching the given `digest', or NULL
-   if none exist.  If possible, the block returned has index one greater than
-   the last-found block. */
-static BlockInfo *lookup(uint8_t digest[DS])
+/* Returns the first block in file 1 with the given `digest' and an index
+   greater than or equal to `index', or the position where it would be. */
+static BlockInfo *lower_bound( DiffContext *ctx, uint8_t digest[DS],
+                               uint64_t index )
 {
-    static size_t next_index;
-    BlockInfo *lo, *hi;
+    BlockInfo *lo = ctx->blocks, *hi = ctx->blocks + ctx->nblocks;
     int d;
 
-    /* Binary search for matching block: */
-    lo = blocks;
-    hi = blocks + nblocks;
     while (lo < hi)
     {
         BlockInfo *p = lo + (hi - lo)/2;
         d = memcmp(p->digest, digest, DS);
-        if (d == 0 && p->index == next_index)
+        if (d < 0 || (d == 0 && p->index < index)) lo = p + 1; else hi = p;
+    }
+    return lo;
+}
+
+/* Returns the index of a block in file 1 matching the given `digest', or
+   NO_BLOCK if none exist.  If possible, the block returned has index one
+   greater than the last-found block. In tar-aware mode, blocks of the same
+   member of file 1 (given by `member', which may be NULL) are preferred. */
+static uint64_t lookup( DiffContext *ctx, uint8_t digest[DS],
+                        const MemberInfo *member )
+{
+    BlockInfo *lo, *p, *end = ctx->blocks + ctx->nblocks;
+    uint64_t next = ctx->next_index;
+    bool cont;
+
+    if (ctx->nblocks == 0) return NO_BLOCK;
+
+    /* Continue the current run if the next block of file 1 matches; the
+       sorted blocks are only searched at discontinuities. */
+    if ( next < ctx->nblocks && memcmp(ctx->digests[next], digest, DS) == 0 &&
+         (member == NULL || (next >= member->first && next < member->end)) )
+    {
+        ctx->next_index = next + 1;
+        return next;
+    }
+    if (ctx->filter != NULL && !BloomFilter_test(ctx->filter, digest))
+    {
+        if (active_stats != NULL) ++active_stats->lookup_filtered;
+        return NO_BLOCK;
+    }
+
+    lo = lower_bound(ctx, digest, ctx->next_index);
+    cont = lo < end && memcmp(lo->digest, digest, DS) == 0 &&
+           lo->index == ctx->next_index;
+
+    if ( member != NULL && (!cont || ctx->next_index < member->first ||
+                            ctx->next_index >= member->end) )
+    {
+        /* Prefer the first matching block in the same member */
+        p = lower_bound(ctx, digest, member->first);
+        if ( p < end && memcmp(p->digest, digest, DS) == 0 &&
+             p->index < member->end )
         {
-            ++next_index;
-            return p;
+            ctx->next_index = p->index + 1;
+            return p->index;
         }
-        if (d < 0 || (d == 0 && p->index < next_index)) lo = p + 1; else hi = p;
     }
-    if (lo < blocks + nblocks && memcmp(lo->digest, digest, DS) == 0)
+    if (lo < end && memcmp(lo->digest, digest, DS) == 0)
     {
-        next_index = lo->index + 1;
-        return lo;
+        ctx->next_index = lo->index + 1;
+        return lo->index;
     }
-    if (lo > blocks && memcmp((lo - 1)->digest, digest, DS) == 0)
+    if (lo > ctx->blocks && memcmp((lo - 1)->digest, digest, DS) == 0)
     {
-        next_index = (lo - 1)->index + 1;
-        return lo - 1;
+        ctx->next_index = (lo - 1)->index + 1;
+        return (lo - 1)->index;
+    }
+    return NO_BLOCK;
+}
+
+/* Returns the member of file 1 with the given path, or NULL if none exists. */
+static MemberInfo *find_member(DiffContext *ctx, const char *path)
+{
+    MemberInfo *lo = ctx->members, *hi = ctx->members + ctx->nmembers;
+    MD5_CTX md5_ctx;
+    uint8_t digest[DS];
+
+    MD5_Init(&md5_ctx);
+    MD5_Update(&md5_ctx, path, strlen(path));
+    MD5_Final(digest, &md5_ctx);
+
+    while (lo < hi)
+    {
+        MemberInfo *p = lo + (hi - lo)/2;
+        if (memcmp(p->digest, digest, DS) < 0) lo = p + 1; else hi = p;
+    }
+    if ( lo < ctx->members + ctx->nmembers &&
+         memcmp(lo->digest, digest, DS) == 0 )
+    {
+        return lo;
     }
     return NULL;
 }
 
+/* Adds a header block of file 1 with the given `index' to the member index. */
+static void index_member(DiffContext *ctx, uint64_t index, char data[BS])
+{
+    MemberInfo *mi = &ctx->member;
+    enum TarBlockType type = TarParser_next(&ctx->tar_parser, data);
+    MD5_CTX md5_ctx;
+
+    if (type != TAR_META && type != TAR_HEADER) return;
+
+    if (ctx->tar_parser.member_start)
+    {
+        mi->first = index;
+        mi->store = ctx->header_store_blocks;
+    }
+    if (fwrite(data, BS, 1, ctx->header_store) != 1)
+    {
+        fail("Write to temporary file failed!");
+    }
+    ++ctx->header_store_blocks;
+
+    if (type == TAR_HEADER)
+    {
+        mi->header = index;
+        mi->end = (ctx->tar_parser.data_blocks < NO_BLOCK - index)
+               ? index + 1 + ctx->tar_parser.data_blocks : NO_BLOCK;
+        MD5_Init(&md5_ctx);
+        MD5_Update( &md5_ctx, ctx->tar_parser.path,
+                    strlen(ctx->tar_parser.path) );
+        MD5_Final(mi->digest, &md5_ctx);
+        BinSort_add(ctx->member_bs, mi);
+    }
+}
+
+/* Encodes a block of file 2 as block `old_index' of file 1 (a header block of
+   the current member) patched with an edit list, if that is small enough.
+   Returns whether the block was encoded. */
+static bool patch_header(DiffContext *ctx, uint64_t old_index, char data[BS])
+{
+    char old_data[BS];
+    uint8_t edits[MAX_EDIT_LIST];
+    size_t size;
+
+    if ( pread( fileno(ctx->header_store), old_data, BS,
+                (off_t)BS*(ctx->cur_member->store + old_index -
+                           ctx->cur_member->first) ) != BS )
+    {
+        fail("Read from temporary file failed!");
+    }
+    size = make_edit_list(old_data, data, edits);
+    if (size > MAX_PATCH_EDITS) return false;
+    patch_block(ctx, old_index, edits, size);
+    return true;
+}
+
+/* Builds patch instructions for a block of file 2, according to wether or not
+   it is found in file 1. `old_index' is the index of the corresponding header
+   block in file 1 (in tar-aware mode) or NO_BLOCK. */
+static void match_block( DiffContext *ctx, uint8_t digest[DS], char data[BS],
+                         uint64_t old_index )
+{
+    uint64_t next_index = ctx->next_index;
+    uint64_t index = lookup(ctx, digest, ctx->cur_member);
+
+    if (active_stats != NULL)
+    {
+        if (index == NO_BLOCK) ++active_stats->lookup_misses;
+        else ++active_stats->lookup_hits;
+        if (index != NO_BLOCK && index == next_index)
+        {
+            ++active_stats->lookup_continued;
+        }
+    }
+    if (index != NO_BLOCK)
+    {
+        copy_block(ctx, index);
+    }
+    else
+    if (old_index == NO_BLOCK || !patch_header(ctx, old_index, data))
+    {
+        append_block(ctx, data);
+    }
+}
+
+/* Processes buffered metadata blocks of the current member. */
+static void flush_pending(DiffContext *ctx)
+{
+    size_t n;
+    uint64_t old_index;
+
+    for (n = 0; n < ctx->npending; ++n)
+    {
+        old_index = NO_BLOCK;
+        if ( ctx->cur_member != NULL &&
+             ctx->pending_pos[n] < ctx->cur_member->header -
+                                   ctx->cur_member->first )
+        {
+            old_index = ctx->cur_member->first + ctx->pending_pos[n];
+        }
+        match_block( ctx, ctx->pending_digest[n], ctx->pending_data[n],
+                     old_index );
+    }
+    ctx->npending = 0;
+}
+
+/* Processes a block of file 2 in tar-aware mode. Metadata blocks are buffered
+   until the member's ustar header is found, so all blocks of a member can be
+   matched against the member with the same path in file 1. */
+static void match_tar_block(DiffContext *ctx, BlockInfo *block, char data[BS])
+{
+    enum TarBlockType type = TarParser_next(&ctx->tar_parser, data);
+
+    if (ctx->tar_parser.member_start)
+    {
+        flush_pending(ctx);
+        ctx->cur_member = NULL;
+        ctx->meta_pos = 0;
+    }
+
+    switch (type)
+    {
+    case TAR_META:
+        if (ctx->npending == MAX_PENDING) flush_pending(ctx);
+        ctx->pending_pos[ctx->npending] = ctx->meta_pos++;
+        memcpy(ctx->pending_digest[ctx->npending], block->digest, DS);
+        memcpy(ctx->pending_data[ctx->npending], data, BS);
+        ++ctx->npending;
+        break;
+
+    case TAR_HEADER:
+        ctx->cur_member = find_member(ctx, ctx->tar_parser.path);
+        flush_pending(ctx);
+        match_block( ctx, block->digest, data, ctx->cur_member != NULL
+                                               ? ctx->cur_member->header
+                                               : NO_BLOCK );
+        break;
+
+    case TAR_DATA:
+        match_block(ctx, block->digest, data, NO_BLOCK);
+        break;
+
+    case TAR_OTHER:
+        flush_pending(ctx);
+        ctx->cur_member = NULL;
+        match_block(ctx, block->digest, data, NO_BLOCK);
+        break;
+    }
+}
+
+/* Adds a block of the file that blocks are copied from to the index. */
+static void index_block(DiffContext *ctx, BlockInfo *block, char data[BS])
+{
+    BinSort_add(ctx->bs, block);
+    if (fwrite(block->digest, DS, 1, ctx->digest_store) != 1)
+    {
+        fail("Write to temporary file failed!");
+    }
+    if (ctx->tar_mode) index_member(ctx, block->index, data);
+}
+
 /* Callback called while enumerating over file 1. */
-static void pass_1_callback(BlockInfo *block, char data[BS])
+static void pass_1_callback( DiffContext *ctx, BlockInfo *block,
+                             char data[BS] )
 {
-    (void)data;
-    BinSort_add(bs, block);
-    MD5_Update(&file1_md5_ctx, data, BS);
+    index_block(ctx, block, data);
+    MD5_Update(&ctx->file1_md5_ctx, data, BS);
+    if (block->index + 1 == ctx->prefix)
+    {
+        ctx->prefix_md5_ctx = ctx->file1_md5_ctx;
+    }
+    if (ctx->bases != NULL) MD5_Update(&ctx->base_md5_ctx, data, BS);
 }
 
-/* Callback called while enumerating over file 1.
+/* Callback called while enumerating over file 2.
    Searches for blocks in the index and builds patch instructions according to
    wether or not the blocks were found. */
-static void pass_2_callback(BlockInfo *block, char data[BS])
+static void pass_2_callback( DiffContext *ctx, BlockInfo *block,
+                             char data[BS] )
 {
-    BlockInfo *bi = lookup(block->digest);
-    if (bi == NULL) append_block(data);
-    if (bi != NULL) copy_block(bi->index);
-    MD5_Update(&file2_md5_ctx, data, BS);
+    if (ctx->tar_mode) match_tar_block(ctx, block, data);
+    else match_block(ctx, block->digest, data, NO_BLOCK);
+    MD5_Update(&ctx->file2_md5_ctx, data, BS);
+    ChunkDigests_add(ctx->file2_chunks, block->digest);
+    if (ctx->reverse != NULL) index_block(ctx->reverse, block, data);
 }
 
-static void scan_file(const char *path, void (*callback)(BlockInfo *, char*))
+/* Enumerates over (at most `count') blocks of a file, numbering them from
+   `first', and returns the index following the last block. Blocks are read
+   and hashed SCAN_BLOCKS at a time. */
+static uint64_t scan_file( DiffContext *ctx, InputStream *is, uint64_t first,
+                           uint64_t count,
+                           void (*callback)(DiffContext *, BlockInfo *, char*) )
 {
-    MD5_CTX md5_ctx;
-    InputStream *is;
+    Progress *progress = active_progress;
+    BlockInfo block;
+    char data[SCAN_BLOCKS*BS];
+    uint8_t digests[SCAN_BLOCKS][DS];
+    size_t nread, len, size, n, k;
+
+    block.index = first;
+    do {
+        size = (count - (block.index - first) < SCAN_BLOCKS)
+             ? (count - (block.index - first))*BS : sizeof(data);
+        for (nread = 0; nread < size; nread += len)
+        {
+            len = is->read(is, data + nread, size - nread);
+            if (len == 0) break;
+        }
+        if (nread%BS != 0)
+        {
+            fprintf(stderr, "WARNING: last block padded with zeroes\n");
+            memset(data + nread, 0, BS - nread%BS);
+        }
+
+        /* Compute digests */
+        n = nread/BS + (nread%BS != 0);
+        md5_blocks(data, n, digests);
+
+        for (k = 0; k < n; ++k, ++block.index)
+        {
+            memcpy(block.digest, digests[k], DS);
+            callback(ctx, &block, data + k*BS);
+        }
+        progress_add(progress, nread);
+    } while (nread == sizeof(data));
+    return block.index;
+}
+
+/* Returns whether a block with the given digest occurs in the index. */
+static bool contains(DiffContext *ctx, uint8_t digest[DS])
+{
+    BlockInfo *p;
+
+    if (ctx->nblocks == 0) return false;
+    if ( ctx->next_index < ctx->nblocks &&
+         memcmp(ctx->digests[ctx->next_index], digest, DS) == 0 )
+    {
+        return true;
+    }
+    if (ctx->filter != NULL && !BloomFilter_test(ctx->filter, digest))
+    {
+        return false;
+    }
+    p = lower_bound(ctx, digest, 0);
+    return p < ctx->blocks + ctx->nblocks && memcmp(p->digest, digest, DS) == 0;
+}
+
+/* Enumerates over file 1 to generate the reverse differences file, using the
+   block digests computed in pass 1 (by context `fctx'). Blocks are read from
+   file 1 only where their data is needed: if they do not occur in file 2, or
+   if they may be tar headers. */
+static void scan_reverse( DiffContext *ctx, DiffContext *fctx,
+                          InputStream *is )
+{
+    Progress *progress = active_progress;
     BlockInfo block;
     char block_data[BS];
+    uint64_t pos = NO_BLOCK;
     size_t nread;
 
-    is = (strcmp(path, "-") == 0) ? OpenStdinInputStream()
-                                  : OpenFileInputStream(path);
-    if (is == NULL)
+    for (block.index = 0; block.index < fctx->nblocks; ++block.index)
     {
-        fprintf(stderr, "Cannot open '%s' for reading!\n", path);
-        exit(EXIT_FAILURE);
+        memcpy(block.digest, fctx->digests[block.index], DS);
+        if ( !contains(ctx, block.digest) ||
+             (ctx->tar_mode && (ctx->tar_parser.in_ext ||
+                                ctx->tar_parser.remaining == 0)) )
+        {
+            if (pos != block.index && !is->seek(is, (off_t)BS*block.index))
+            {
+                fail("Seek failed.");
+            }
+            nread = is->read(is, block_data, BS);
+            if (nread == 0) fail("Read failed!");
+            memset(block_data + nread, 0, BS - nread);
+            pos = block.index + 1;
+        }
+
+        if (ctx->tar_mode) match_tar_block(ctx, &block, block_data);
+        else match_block(ctx, block.digest, block_data, NO_BLOCK);
+        ChunkDigests_add(ctx->file2_chunks, block.digest);
+        progress_add(progress, BS);
+    }
+}
+
+static void write_header(DiffContext *ctx)
+{
+    start_output_digest(ctx->os);
+    write_magic(ctx->os, ctx->format, ctx->tar_mode);  /* may patch headers */
+}
+
+static void write_footer(DiffContext *ctx)
+{
+    uint8_t digest[DS];
+    off_t footer_offset;
+
+    /* emit final instruction (if any) */
+    if (ctx->tar_mode) flush_pending(ctx);
+    emit_instruction(ctx);
+
+    /* write special EOF instruction S=C=A=-1 */
+    write_end_instruction(ctx->os, ctx->format);
+
+    /* append MD5 digest of file 2 */
+    footer_offset = get_output_digest(ctx->os, NULL);
+    MD5_Final(digest, &ctx->file2_md5_ctx);
+    write_data(ctx->os, digest, DS);
+
+    /* append MD5 digest of file 1 (new in version 1.1) */
+    MD5_Final(digest, &ctx->file1_md5_ctx);
+    write_data(ctx->os, digest, DS);
+
+    /* append chunk digests and digest of the diff file (new in version 1.2) */
+    ChunkDigests_finish(ctx->file2_chunks);
+    write_trailer( ctx->os, footer_offset, ctx->file2_chunks,
+                   ctx->instr_index, ctx->bases );
+}
+
+/* Frees all resources held by a diff context. */
+static void free_context(DiffContext *ctx)
+{
+    if (ctx == NULL) return;
+    ChunkDigests_destroy(ctx->file2_chunks);
+    InstructionIndex_destroy(ctx->instr_index);
+    if (ctx->shared)
+    {
+        free(ctx);
+        return;
     }
+    BaseList_destroy(ctx->bases);
+    if (ctx->bs != NULL) BinSort_destroy(ctx->bs);
+    if (ctx->member_bs != NULL) BinSort_destroy(ctx->member_bs);
+    if (ctx->header_store != NULL) fclose(ctx->header_store);
+    if (ctx->digests != NULL) munmap(ctx->digests, DS*ctx->nblocks);
+    BloomFilter_destroy(ctx->filter);
+    if (ctx->digest_store != NULL) fclose(ctx->digest_store);
+    free(ctx);
+}
+
+/* Creates a context for a differences file written to `os'. */
+static DiffContext *create_context(TardiffContext *tc, OutputStream *os)
+{
+    DiffContext *ctx;
+
+    ctx = calloc(1, sizeof(DiffContext));
+    if (ctx == NULL) fail("Out of memory!");
 
-    for (block.index = 0; ; ++block.index)
+    ctx->os = os;
+    ctx->S  = NO_BLOCK;
+    ctx->bs = BinSort_create(sizeof(BlockInfo), 65536, compar_block_info);
+    assert(ctx->bs != NULL);
+    ctx->digest_store = tmpfile();
+    if (ctx->digest_store == NULL)
     {
-        if (block.index == 0xffffffffu)
+        free_context(ctx);
+        fail("Couldn't open temporary file!");
+    }
+
+    ctx->tar_mode = tc->tar_mode;
+    if (ctx->tar_mode)
+    {
+        ctx->member_bs = BinSort_create(sizeof(MemberInfo), 65536,
+                                        compar_member_info);
+        assert(ctx->member_bs != NULL);
+        ctx->header_store = tmpfile();
+        if (ctx->header_store == NULL)
         {
-            /* This is not very likely to happen, but ok. */
-            fprintf(stderr, "File '%s' too large!\n", path);
-            abort();
+            free_context(ctx);
+            fail("Couldn't open temporary file!");
         }
+        TarParser_init(&ctx->tar_parser);
+    }
+    return ctx;
+}
 
-        nread = is->read(is, block_data, BS);
-        if (nread == 0) break;
-        if (nread < BS)
+/* Creates a context for a differences file written to `os', which copies
+   blocks from the file indexed in `index' (a context on which sort_index()
+   has been called, and which is not modified). */
+static DiffContext *share_context( TardiffContext *tc, const DiffContext *index,
+                                   OutputStream *os )
+{
+    DiffContext *ctx;
+
+    ctx = malloc(sizeof(DiffContext));
+    if (ctx == NULL) fail("Out of memory!");
+    memcpy(ctx, index, sizeof(DiffContext));
+    ctx->shared = true;
+    ctx->os     = os;
+    ctx->format = (tc->wide_format || ctx->nblocks > 0xffffffffu)
+                ? FORMAT_WIDE : FORMAT_NARROW;
+    return ctx;
+}
+
+/* Sorts the index of the file that blocks are copied from, after all of its
+   blocks have been added, and selects the instruction format. */
+static void sort_index(TardiffContext *tc, DiffContext *ctx)
+{
+    size_t i;
+
+    if (ctx->tar_mode)
+    {
+        /* Obtain list of members sorted by path */
+        ctx->nmembers = BinSort_size(ctx->member_bs);
+        ctx->members = BinSort_mmap(ctx->member_bs);
+        TarParser_init(&ctx->tar_parser);
+        if (fflush(ctx->header_store) != 0)
         {
-            fprintf(stderr, "WARNING: last block padded with zeroes\n");
-            memset(block_data + nread, 0, BS - nread);
+            fail("Write to temporary file failed!");
         }
+    }
 
-        /* Compute digest */
-        MD5_Init(&md5_ctx);
-        MD5_Update(&md5_ctx, block_data, BS);
-        MD5_Final(block.digest, &md5_ctx);
+    /* Block indices of file 1 determine the instruction format */
+    ctx->nblocks = BinSort_size(ctx->bs);
+    ctx->format = (tc->wide_format || ctx->nblocks > 0xffffffffu)
+                ? FORMAT_WIDE : FORMAT_NARROW;
+
+    /* An empty file 1 has nothing to map; all lookups miss */
+    if (ctx->nblocks == 0) return;
 
-        callback(&block, block_data);
+    /* Obtain sorted list of blocks */
+    assert((ctx->nblocks*sizeof(BlockInfo))/sizeof(BlockInfo) == ctx->nblocks);
+    ctx->blocks = BinSort_mmap(ctx->bs);
+    assert(ctx->blocks != NULL);
+
+    /* Map digests of file 1 blocks in index order */
+    if (fflush(ctx->digest_store) != 0)
+    {
+        fail("Write to temporary file failed!");
+    }
+    ctx->digests = mmap( NULL, DS*ctx->nblocks, PROT_READ, MAP_SHARED,
+                         fileno(ctx->digest_store), 0 );
+    if (ctx->digests == MAP_FAILED)
+    {
+        ctx->digests = NULL;
+        fail("mmap() failed!");
+    }
 
-        if (nread < BS) break;
+    /* Build the filter (which is optional, so it is simply omitted if there
+       is not enough memory) */
+    ctx->filter = BloomFilter_create(ctx->nblocks);
+    for (i = 0; ctx->filter != NULL && i < ctx->nblocks; ++i)
+    {
+        BloomFilter_add(ctx->filter, ctx->digests[i]);
     }
+}
 
-    is->close(is);
+/* Writes the header of the differences file, and prepares to generate
+   instructions. */
+static void start_output(DiffContext *ctx)
+{
+    write_header(ctx);
+    ctx->file2_chunks = ChunkDigests_create(CHUNK_BLOCKS);
+    assert(ctx->file2_chunks != NULL);
+    ctx->instr_index = InstructionIndex_create(INDEX_BLOCKS);
+    assert(ctx->instr_index != NULL);
 }
 
-static void write_header()
+void tardiff_init(TardiffContext *tc)
 {
-    write_data(MAGIC_STR, MAGIC_LEN);
+    tc->tar_mode = false;
+    tc->wide_format = false;
+    tc->error[0] = '\0';
+}
+
+/* Returns the total size of the given files, or 0 if it is unknown. */
+static uint64_t total_size(InputStream **files, int nfile)
+{
+    uint64_t total = 0;
+    int n;
+
+    for (n = 0; n < nfile; ++n)
+    {
+        if (files[n]->size(files[n]) < 0) return 0;
+        total += files[n]->size(files[n]);
+    }
+    return total;
 }
 
-static void write_footer()
+/* Scans the base files that make up file 1 into the index of `ctx', and
+   sorts it. */
+static void index_files( TardiffContext *tc, DiffContext *ctx,
+                         InputStream **bases, int nbase )
 {
     uint8_t digest[DS];
+    uint64_t first, next;
+    int n;
 
-    /* emit final instruction (if any) */
-    emit_instruction();
+    /* Scan the base files and gather block info */
+    stats_phase("pass1");
+    progress_phase("pass 1", total_size(bases, nbase));
+    MD5_Init(&ctx->file1_md5_ctx);
+    for (n = 0, next = 0; n < nbase; ++n)
+    {
+        if (ctx->bases != NULL) MD5_Init(&ctx->base_md5_ctx);
+        first = next;
+        next = scan_file(ctx, bases[n], first, NO_BLOCK, &pass_1_callback);
+        if (ctx->bases != NULL)
+        {
+            MD5_Final(digest, &ctx->base_md5_ctx);
+            BaseList_add(ctx->bases, next - first, digest);
+        }
 
-    /* write special EOF instruction S=C=A=-1 */
-    write_uint32(0xffffffffu);
-    write_uint32(0xffffffffu);
+        /* Each base file is a separate tar archive */
+        if (ctx->tar_mode) TarParser_init(&ctx->tar_parser);
+    }
 
-    /* append MD5 digest of file 2 */
-    MD5_Final(digest, &file2_md5_ctx);
-    write_data(digest, DS);
+    /* Obtain sorted list of blocks */
+    stats_phase("sort");
+    progress_phase("sort", 0);
+    sort_index(tc, ctx);
+}
 
-    /* append MD5 digest of file 1 (new in version 1.1) */
-    MD5_Final(digest, &file1_md5_ctx);
-    write_data(digest, DS);
+/* Returns whether the size of a file is a known multiple of the block size,
+   and the file is seekable. */
+static bool whole_blocks(InputStream *is)
+{
+    return is->size(is) >= 0 && is->size(is)%BS == 0 && is->seek(is, 0);
 }
 
-int tardiff(int argc, char *argv[], const char *flags)
+/* Returns the number of identical blocks at the start of files 1 and 2 (or at
+   the end, if `from_end' is set), which have `n1' and `n2' blocks, comparing
+   at most `max' blocks. */
+static uint64_t count_common( InputStream *is1, uint64_t n1, InputStream *is2,
+                              uint64_t n2, uint64_t max, bool from_end )
+{
+    char *data1, *data2;
+    uint64_t count = 0, len, k;
+
+    data1 = malloc(2*COMMON_BLOCKS*BS);
+    if (data1 == NULL) return 0;
+    data2 = data1 + COMMON_BLOCKS*BS;
+    while (count < max)
+    {
+        len = (max - count < COMMON_BLOCKS) ? max - count : COMMON_BLOCKS;
+        if ( from_end && (!is1->seek(is1, (off_t)BS*(n1 - count - len)) ||
+                          !is2->seek(is2, (off_t)BS*(n2 - count - len))) )
+        {
+            break;
+        }
+        read_data(is1, data1, len*BS);
+        read_data(is2, data2, len*BS);
+        progress_add(active_progress, 2*len*BS);
+        if (memcmp(data1, data2, len*BS) == 0)
+        {
+            count += len;
+            continue;
+        }
+
+        /* Count the identical blocks adjoining the common part */
+        for (k = 0; k < len; ++k)
+        {
+            size_t pos = from_end ? (len - 1 - k)*BS : k*BS;
+            if (memcmp(data1 + pos, data2 + pos, BS) != 0) break;
+        }
+        count += k;
+        break;
+    }
+    free(data1);
+    return count;
+}
+
+/* Determines the common prefix and suffix of files 1 and 2, by comparing
+   their data directly, and leaves both files at their start. */
+static void find_common(DiffContext *ctx, InputStream *is1, InputStream *is2)
+{
+    uint64_t n1, n2, n;
+
+    if (!whole_blocks(is1) || !whole_blocks(is2)) return;
+    n1 = is1->size(is1)/BS;
+    n2 = is2->size(is2)/BS;
+    n  = (n1 < n2) ? n1 : n2;
+
+    stats_phase("common");
+    progress_phase("common", 0);
+    ctx->file2_blocks = n2;
+    ctx->prefix = count_common(is1, n1, is2, n2, n, false);
+    ctx->suffix = count_common(is1, n1, is2, n2, n - ctx->prefix, true);
+    if (!is1->seek(is1, 0) || !is2->seek(is2, 0)) fail("Seek failed.");
+}
+
+/* Copies `count' blocks of file 2, from block `first', which are identical to
+   the blocks of file 1 at the same distance from the start of file 1 (if
+   `first' is 0) or from its end. File 2 is read only to compute its digest
+   (unless the blocks form its prefix, whose digest is known). */
+static void copy_common( DiffContext *ctx, InputStream *is_file2,
+                         uint64_t first, uint64_t count )
+{
+    char data[SCAN_BLOCKS*BS];
+    uint64_t index = first + ctx->nblocks - ctx->file2_blocks, n;
+
+    if (first == 0) index = 0;
+    if (active_stats != NULL) active_stats->lookup_skipped += count;
+    for (n = 0; n < count; ++n, ++index)
+    {
+        if (first > 0 && n%SCAN_BLOCKS == 0)
+        {
+            size_t len = (count - n < SCAN_BLOCKS) ? count - n : SCAN_BLOCKS;
+            read_data(is_file2, data, len*BS);
+            MD5_Update(&ctx->file2_md5_ctx, data, len*BS);
+        }
+        copy_block(ctx, index);
+        ChunkDigests_add(ctx->file2_chunks, ctx->digests[index]);
+        progress_add(active_progress, BS);
+    }
+    ctx->next_index = index;
+}
+
+/* Scans file 2 and generates the differences file (indexing file 2 for the
+   reverse differences file, if any), except for its footer. The common prefix
+   and suffix of files 1 and 2 (if any) are copied directly. */
+static void diff_file2(DiffContext *ctx, InputStream *is_file2)
+{
+    uint64_t middle;
+
+    stats_phase("pass2");
+    progress_phase("pass 2", is_file2->size(is_file2) > 0 ?
+                             is_file2->size(is_file2) : 0);
+    start_output(ctx);
+    if (ctx->prefix > 0)
+    {
+        ctx->file2_md5_ctx = ctx->prefix_md5_ctx;
+        copy_common(ctx, is_file2, 0, ctx->prefix);
+        if (!is_file2->seek(is_file2, (off_t)BS*ctx->prefix))
+        {
+            fail("Seek failed.");
+        }
+    }
+    else
+    {
+        MD5_Init(&ctx->file2_md5_ctx);
+    }
+    if (ctx->suffix > 0)
+    {
+        middle = ctx->file2_blocks - ctx->prefix - ctx->suffix;
+        scan_file(ctx, is_file2, ctx->prefix, middle, &pass_2_callback);
+        copy_common( ctx, is_file2, ctx->prefix + middle, ctx->suffix );
+    }
+    else
+    {
+        scan_file(ctx, is_file2, ctx->prefix, NO_BLOCK, &pass_2_callback);
+    }
+}
+
+/* Generates the differences file from the concatenation of `nbase' base files
+   to file 2 and, if `os_reverse' is not NULL, the reverse differences file
+   (which requires a single base file). */
+static bool diff_files( TardiffContext *tc, InputStream **bases, int nbase,
+                        InputStream *is_file2, OutputStream *os,
+                        OutputStream *os_reverse )
 {
+    DiffContext *volatile ctx = NULL, *volatile rctx = NULL;
+    ErrorHandler eh;
+
     assert(MD5_DIGEST_LENGTH == DS);
-    assert(sizeof(BlockInfo) == 20);
+    assert(sizeof(BlockInfo) == 24);
+    assert(sizeof(MemberInfo) == 48);
+    assert(nbase > 0 && (nbase == 1 || os_reverse == NULL));
 
-    if (strcmp(argv[2], "-") != 0) redirect_stdout(argv[2]);
+    if (setjmp(eh.env) != 0)
+    {
+        free_context(rctx);
+        free_context(ctx);
+        strcpy(tc->error, eh.message);
+        return false;
+    }
+    push_error_handler(&eh);
 
-    bs = BinSort_create(sizeof(BlockInfo), 65536, compar_block_info);
-    assert(bs != NULL);
+    ctx = create_context(tc, os);
+    if (nbase > 1)
+    {
+        ctx->bases = BaseList_create();
+        assert(ctx->bases != NULL);
+    }
+    if (os_reverse != NULL)
+    {
+        /* File 1 is read again to generate the reverse differences */
+        if (!bases[0]->seek(bases[0], 0))
+        {
+            fail("File 1 must be seekable to generate reverse differences!");
+        }
+        rctx = create_context(tc, os_reverse);
+        ctx->reverse = rctx;
+    }
 
-    /* Scan file 1 and gather block info */
-    MD5_Init(&file1_md5_ctx);
-    scan_file(argv[0], &pass_1_callback);
+    if (nbase == 1 && rctx == NULL && !ctx->tar_mode)
+    {
+        find_common(ctx, bases[0], is_file2);
+    }
+    index_files(tc, ctx, bases, nbase);
+    diff_file2(ctx, is_file2);
 
-    /* Obtain sorted list of blocks */
-    nblocks = BinSort_size(bs);
-    assert((nblocks*sizeof(BlockInfo))/sizeof(BlockInfo) == nblocks);
-    blocks = BinSort_mmap(bs);
-    assert(blocks != NULL);
+    if (rctx != NULL)
+    {
+        /* The file digests of the reverse diff are those of the forward diff
+           in reverse order, so file data need not be hashed again. */
+        rctx->file1_md5_ctx = ctx->file2_md5_ctx;
+        rctx->file2_md5_ctx = ctx->file1_md5_ctx;
+        write_footer(ctx);
+
+        stats_phase("sort");
+        progress_phase("sort", 0);
+        sort_index(tc, rctx);
+
+        stats_phase("reverse");
+        progress_phase("reverse", (uint64_t)BS*ctx->nblocks);
+        start_output(rctx);
+        scan_reverse(rctx, ctx, bases[0]);
+        write_footer(rctx);
+    }
+    else
+    {
+        write_footer(ctx);
+    }
+    stats_phase_end();
+
+    pop_error_handler(&eh);
+    free_context(rctx);
+    free_context(ctx);
+    return true;
+}
+
+bool tardiff_diff( TardiffContext *tc, InputStream *is_file1,
+                   InputStream *is_file2, OutputStream *os )
+{
+    return diff_files(tc, &is_file1, 1, is_file2, os, NULL);
+}
+
+bool tardiff_diff_both( TardiffContext *tc, InputStream *is_file1,
+                        InputStream *is_file2, OutputStream *os,
+                        OutputStream *os_reverse )
+{
+    return diff_files(tc, &is_file1, 1, is_file2, os, os_reverse);
+}
+
+bool tardiff_diff_bases( TardiffContext *tc, InputStream **bases, int nbase,
+                         InputStream *is_file2, OutputStream *os )
+{
+    return diff_files(tc, bases, nbase, is_file2, os, NULL);
+}
+
+struct TardiffIndex
+{
+    DiffContext *ctx;               /* context holding the index of file 1 */
+};
+
+TardiffIndex *tardiff_index_create(TardiffContext *tc, InputStream *is_file1)
+{
+    DiffContext *volatile ctx = NULL;
+    TardiffIndex *index;
+    ErrorHandler eh;
+
+    if (setjmp(eh.env) != 0)
+    {
+        free_context(ctx);
+        strcpy(tc->error, eh.message);
+        return NULL;
+    }
+    push_error_handler(&eh);
+
+    ctx = create_context(tc, NULL);
+    index_files(tc, ctx, &is_file1, 1);
+    stats_phase_end();
+    index = malloc(sizeof(TardiffIndex));
+    if (index == NULL) fail("Out of memory!");
+    index->ctx = ctx;
+
+    pop_error_handler(&eh);
+    return index;
+}
+
+uint64_t tardiff_index_memory(const TardiffIndex *index)
+{
+    const DiffContext *ctx = index->ctx;
+
+    return (uint64_t)ctx->nblocks*(sizeof(BlockInfo) + DS) +
+           (uint64_t)ctx->nmembers*sizeof(MemberInfo) +
+           (ctx->filter != NULL ? BloomFilter_memory(ctx->filter) : 0);
+}
+
+bool tardiff_diff_index( TardiffContext *tc, const TardiffIndex *index,
+                         InputStream *is_file2, OutputStream *os )
+{
+    DiffContext *volatile ctx = NULL;
+    ErrorHandler eh;
+
+    if (setjmp(eh.env) != 0)
+    {
+        free_context(ctx);
+        strcpy(tc->error, eh.message);
+        return false;
+    }
+    push_error_handler(&eh);
+
+    ctx = share_context(tc, index->ctx, os);
+    diff_file2(ctx, is_file2);
+    write_footer(ctx);
+    stats_phase_end();
+
+    pop_error_handler(&eh);
+    free_context(ctx);
+    return true;
+}
+
+void tardiff_index_destroy(TardiffIndex *index)
+{
+    if (index == NULL) return;
+    free_context(index->ctx);
+    free(index);
+}
+
+int tardiff(int argc, char *argv[], const char *flags)
+{
+    InputStream *bases[MAX_BASES], *is_file2;
+    OutputStream *os, *os_reverse = NULL;
+    TardiffContext tc;
+    int nbase = argc - 2, n;
+    bool ok;
+
+    /* Arguments preceding file 2 are base files that make up file 1 */
+    if (nbase > MAX_BASES)
+    {
+        fprintf(stderr, "Too many base files (at most %d allowed)!\n",
+                        MAX_BASES);
+        exit(EXIT_FAILURE);
+    }
+    if (nbase > 1 && get_option("reverse") != NULL)
+    {
+        fprintf(stderr, "Reverse differences require a single file 1!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (n = 0; n < nbase; ++n)
+    {
+        bases[n] = (strcmp(argv[n], "-") == 0) ? OpenStdinInputStream()
+                                               : OpenFileInputStream(argv[n]);
+        if (bases[n] == NULL)
+        {
+            fprintf(stderr, "Cannot open '%s' for reading!\n", argv[n]);
+            exit(EXIT_FAILURE);
+        }
+        bases[n] = stats_input_stream(bases[n], n == 0 ? "file1" : "base");
+    }
+    is_file2 = (strcmp(argv[nbase], "-") == 0)
+             ? OpenStdinInputStream() : OpenFileInputStream(argv[nbase]);
+    if (is_file2 == NULL)
+    {
+        fprintf(stderr, "Cannot open '%s' for reading!\n", argv[nbase]);
+        exit(EXIT_FAILURE);
+    }
+    is_file2 = stats_input_stream(is_file2, "file2");
+
+    if (strcmp(argv[nbase + 1], "-") != 0) redirect_stdout(argv[nbase + 1]);
+    os = stats_output_stream(OpenFileOutputStream(stdout), "diff");
+    assert(os != NULL);
+    if (get_option("reverse") != NULL)
+    {
+        os_reverse = stats_output_stream(
+            OpenFileOutputStream(open_output(get_option("reverse"))),
+            "reverse" );
+        assert(os_reverse != NULL);
+    }
 
-    /* Scan file 2 and generate diff */
-    write_header();
-    MD5_Init(&file2_md5_ctx);
-    scan_file(argv[1], &pass_2_callback);
-    write_footer();
+    tardiff_init(&tc);
+    tc.tar_mode = strchr(flags, 't') != NULL;
+    tc.wide_format = strchr(flags, 'w') != NULL;
+    ok = diff_files(&tc, bases, nbase, is_file2, os, os_reverse);
+    if (!ok) fprintf(stderr, "%s\n", tc.error);
 
-    BinSort_destroy(bs);
+    if (os_reverse != NULL) os_reverse->close(os_reverse);
+    os->close(os);
+    is_file2->close(is_file2);
+    for (n = 0; n < nbase; ++n) bases[n]->close(bases[n]);
 
-    return EXIT_SUCCESS;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -1,5 +1,6 @@
 #include "common.h"
 #include "identify.h"
+#include "stats.h"
 
 static void mark_diffs_usable(struct File *files, const uint8_t digest[DS])
 {
@@ -15,7 +16,9 @@ static void mark_diffs_usable(struct File *files, const uint8_t digest[DS])
     }
 }
 
-bool write_usability_report(struct File *files, FILE *fp)
+/* Reports how multi-base diff files apply on `out', and unusable files on
+   `err'. Returns false if some files are unusable. */
+bool write_usability_report(struct File *files, FILE *out, FILE *err)
 {
     static uint8_t zero_digest[DS];
     struct File *file;
@@ -32,6 +35,21 @@ bool write_usability_report(struct File *files, FILE *fp)
         }
     }
 
+    /* Diff files with multiple base files are usable if all base files are
+       present (in any order), and so are diff files reachable from them: */
+    for (file = files; file != NULL; file = file->next)
+    {
+        if (bases_present(files, file))
+        {
+            write_bases(files, file, out);
+            if (!file->usable)
+            {
+                file->usable = true;
+                mark_diffs_usable(files, file->diff.digest2);
+            }
+        }
+    }
+
     /* To avoid gratuitous errors when using v1.0 files, mark all v1.0 diffs
        usable and those that can be reached from them usable as well. */
     mark_diffs_usable(files, zero_digest);
@@ -42,7 +60,7 @@ bool write_usability_report(struct File *files, FILE *fp)
     {
         if (!file->usable)
         {
-            fprintf(fp, "UNUSABLE FILE: %s\n", file->path);
+            fprintf(err, "UNUSABLE FILE: %s\n", file->path);
             res = false;
         }
     }
@@ -54,8 +72,10 @@ int tardiffinfo(int argc, char *argv[], const char *flags)
     struct File *files;
     bool success;
 
+    stats_phase("identify");
     success = identify_files((const char**)argv, argc, stdout, &files) &&
-              write_usability_report(files, stderr);
+              write_usability_report(files, stdout, stderr);
+    stats_phase_end();
     free_files(files);
 
     return success ? EXIT_SUCCESS : EXIT_FAILURE;
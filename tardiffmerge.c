@@ -1,26 +1,33 @@
 #include "common.h"
 #include "identify.h"
+#include "libtardiff.h"
+#include "merge.h"
+#include "progress.h"
+#include "stats.h"
+#include <pthread.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 #define MAX_DIFF_FILES 1000
 
-/* A merged patch file is described by a sequence of block references (one for
-   each block in the output file). The reference is made either to a block in
-   the original file (if fp == NULL) in which case offset is a multiple of the
-   block size, or a block stored at the specified offset and file.
-*/
-typedef struct BlockRef
+struct MergeContext
 {
-    InputStream *is;
-    off_t offset;
-} BlockRef;
-
-static InputStream *is_diff[MAX_DIFF_FILES];
-static bool orig_digest_known;
-static uint8_t orig_digest[DS];
-static uint8_t last_digest[DS];
-static size_t last_num_blocks;
-static BlockRef *last_blocks;
+    InputStream      *is_diff[MAX_DIFF_FILES];  /* streams to be closed */
+    int              num_diff_files;
+    int              num_merged;
+    enum DiffFormat  format;    /* widest format of the merged files */
+    bool             edits;     /* may the output contain edit lists? */
+    bool             orig_digest_known;
+    uint8_t          orig_digest[DS];
+    uint8_t          last_digest[DS];
+    size_t           last_num_blocks;
+    BlockRef         *last_blocks;
+    ChunkDigests     *last_chunks;
+    BaseList         *bases;    /* base files of the original file (or NULL) */
+    EditStore        *edit_store;
+    InstructionIndex *output_index;
+    pthread_mutex_t  edit_lock; /* serializes access to the edit store */
+};
 
 /* Given a list of differences files, marks all files usable that can be
    applied to another differences file. This should leave exactly one unusable
@@ -111,228 +118,1153 @@ static bool order_input(struct File **files)
     return true;
 }
 
-/* Process the differences file in input stream, starting at offset 8 (the
-   header has already been read and verified), creating a new block reference
-   list. */
-static void process_input(InputStream *is)
+/* Block references of the output of a differences file (or a sequence of
+   them), stored in a temporary file that is mapped into memory. Copied blocks
+   refer to the source file of the (first) differences file. */
+typedef struct BlockMap
+{
+    BlockRef *blocks;
+    size_t   num_blocks;
+} BlockMap;
+
+/* A differences file to be merged, and the information read from it. */
+typedef struct MergeInput
+{
+    InputStream     *is;
+    enum DiffFormat format;
+    bool            edits;      /* has patched instructions */
+    BlockMap        map;
+    bool            digest1_known;
+    uint8_t         digest1[DS], digest2[DS];
+    ChunkDigests    *chunks;
+    BaseList        *bases;
+} MergeInput;
+
+/* State of a block map being merged */
+enum MapState { MAP_UNREAD, MAP_READY, MAP_BUSY };
+
+/* The tasks of merging a sequence of differences files (reading an input
+   file, or composing two adjacent block maps), executed by a pool of threads.
+   Adjacent maps are composed as soon as both are ready, so few maps are kept
+   at once, regardless of the number of input files. */
+typedef struct MergeJob
+{
+    MergeContext    *mc;
+    MergeInput      *inputs;
+    int             ninput;
+    BlockMap        *maps;      /* merged result (if any), then the inputs */
+    enum MapState   *state;
+    int             *succ;      /* index of the following map (or nmap) */
+    int             nmap;
+    int             first;      /* index of the map of the first input */
+    int             next;       /* next input to be read */
+    int             busy;       /* number of tasks being executed */
+    bool            failed;
+    char            error[256];
+    Progress        *progress;
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;    /* signalled when a task finishes */
+} MergeJob;
+
+/* Adds an edit list to the edit store, which is shared between threads. */
+static off_t add_edits(MergeContext *mc, const uint8_t *edits, size_t size)
 {
-    FILE *fp;
-    uint32_t S;
-    uint16_t C, A;
-    size_t num_blocks;
     off_t offset;
+
+    pthread_mutex_lock(&mc->edit_lock);
+    offset = EditStore_add(mc->edit_store, edits, size);
+    pthread_mutex_unlock(&mc->edit_lock);
+    return offset;
+}
+
+/* Reads an edit list from the edit store, which is shared between threads. */
+static size_t get_edits(MergeContext *mc, off_t offset, uint8_t *buf)
+{
+    size_t size;
+
+    pthread_mutex_lock(&mc->edit_lock);
+    size = EditStore_get(mc->edit_store, offset, buf);
+    pthread_mutex_unlock(&mc->edit_lock);
+    return size;
+}
+
+/* Maps `num_blocks' block references written to temporary file `fp' into
+   memory, and closes the file. */
+static void map_blocks(FILE *fp, size_t num_blocks, BlockMap *map)
+{
+    map->blocks = NULL;
+    map->num_blocks = num_blocks;
+    if (num_blocks > 0)
+    {
+        fflush(fp); /* must flush to ensure all data can be mmap()ed */
+        map->blocks = mmap( NULL, num_blocks*sizeof(BlockRef), PROT_READ,
+                            MAP_SHARED, fileno(fp), 0 );
+        if (map->blocks == MAP_FAILED)
+        {
+            map->blocks = NULL;
+            fclose(fp);
+            fail("mmap() failed!");
+        }
+    }
+    fclose(fp);
+}
+
+static void unmap_blocks(BlockMap *map)
+{
+    if (map->blocks != NULL)
+    {
+        if (munmap(map->blocks, map->num_blocks*sizeof(BlockRef)) != 0)
+        {
+            fail("munmap() failed!");
+        }
+        map->blocks = NULL;
+    }
+}
+
+static void write_block_ref(FILE *fp, const BlockRef *br)
+{
+    if (fwrite(br, sizeof(*br), 1, fp) != 1)
+    {
+        fail("Write to temporary file failed!");
+    }
+}
+
+/* Reads the differences file of `in', creating a block map of its output in
+   which copied blocks refer to its own source file. */
+static void read_input(MergeContext *mc, MergeInput *in, Progress *progress)
+{
+    InputStream *is = in->is;
+    FILE *fp;
+    Instruction ins;
+    size_t num_blocks, size;
+    off_t offset, reported;
     BlockRef br;
-    uint8_t digest1[DS], digest2[DS];
+    char magic[MAGIC_LEN];
+    uint8_t buf[MAX_EDIT_LIST];
+    Trailer trailer;
+    enum InstructionStatus status;
+    int format;
+
+    /* Verify magic */
+    read_data(is, magic, MAGIC_LEN);
+    format = parse_magic(magic);
+    if (format < 0)
+    {
+        fail("Not a differences file!");
+    }
+    in->format = format;
 
     fp = tmpfile();
     if (fp == NULL)
     {
-        fprintf(stderr, "Couldn't open temporary file!\n");
-        exit(EXIT_FAILURE);
+        fail("Couldn't open temporary file!");
     }
 
-    offset = 8;
+    offset = reported = MAGIC_LEN;
     num_blocks = 0;
-
     for (;;)
     {
-        S = read_uint32(is);
-        C = read_uint16(is);
-        A = read_uint16(is);
-        offset += 8;
+        read_data(is, buf, INSTRUCTION_LEN(format));
+        offset += INSTRUCTION_LEN(format);
 
         /* Check for end-of-instructions. */
-        if (S == 0xffffffffu && C == 0xffffu && A == 0xffffu) break;
+        status = parse_instruction(buf, format, &ins);
+        if (status == INSTRUCTION_END) break;
 
-        if ( (C > 0x7fffu || A > 0x7fffu) || (C > 0xffffffffu - S) ||
-             (S == 0xffffffffu && C != 0) || (S != 0xffffffffu && C == 0) )
+        if (status == INSTRUCTION_INVALID)
         {
-            fprintf(stderr, "Invalid instruction in differences file!\n");
-            exit(EXIT_FAILURE);
+            fail("Invalid instruction in differences file!");
         }
 
-        while (C--)
+        while (ins.C--)
         {
-            if (last_blocks == NULL)
-            {
-                br.is = NULL;
-                br.offset = BS*S++;
-            }
-            else
+            br.is = NULL;
+            br.offset = (off_t)BS*ins.S++;
+            br.edits = -1;
+            if (ins.patched)
             {
-                if (S >= last_num_blocks)
+                in->edits = true;
+                size = read_edit_list(is, buf);
+                if (size == 0)
                 {
-                    fprintf(stderr, "Invalid block index in differences file!\n");
-                    exit(EXIT_FAILURE);
+                    fail("Invalid edit list in differences file!");
                 }
-                br = last_blocks[S++];
-            }
-            if (fwrite(&br, sizeof(br), 1, fp) != 1)
-            {
-                fprintf(stderr, "Write to temporary file failed!\n");
-                exit(EXIT_FAILURE);
+                offset += size;
+                br.edits = add_edits(mc, buf, size);
             }
+            write_block_ref(fp, &br);
             ++num_blocks;
         }
 
-        while (A--)
+        while (ins.A--)
         {
             br.is = is;
             br.offset = offset;
+            br.edits = -1;
             offset += BS;
-            if (fwrite(&br, sizeof(br), 1, fp) != 1)
-            {
-                fprintf(stderr, "Write to temporary file failed!\n");
-                exit(EXIT_FAILURE);
-            }
+            write_block_ref(fp, &br);
             ++num_blocks;
         }
 
         is->seek(is, offset);
+        progress_add(progress, offset - reported);
+        reported = offset;
     }
 
-    /* Verify MD5 digests */
-    read_data(is, digest2, DS);
-    if (is->read(is, digest1, DS) == DS)
+    /* Read MD5 digests */
+    read_data(is, in->digest2, DS);
+    in->digest1_known = is->read(is, in->digest1, DS) == DS;
+    if (in->digest1_known)
     {
-        if (last_blocks == NULL)
+        /* Keep output chunk digests (version 1.2) */
+        if (read_trailer(is, NULL, &trailer) == TRAILER_INVALID)
         {
-            orig_digest_known = true;
-            memcpy(orig_digest, digest1, DS);
+            fail("Invalid footer in differences file!");
         }
-        else
-        if (memcmp(digest1, last_digest, DS) != 0)
+        InstructionIndex_destroy(trailer.index);
+        in->chunks = trailer.chunks;
+        in->bases = trailer.bases;
+    }
+    map_blocks(fp, num_blocks, &in->map);
+}
+
+/* Composes the block maps `left' and `right' (whose copied blocks refer to
+   the output of `left') into `left', and releases `right'. */
+static void compose_maps(MergeContext *mc, BlockMap *left, BlockMap *right)
+{
+    FILE *fp;
+    BlockRef br;
+    uint8_t buf[MAX_EDIT_LIST], edits[MAX_EDIT_LIST];
+    size_t n, size;
+    uint64_t index;
+
+    fp = tmpfile();
+    if (fp == NULL)
+    {
+        fail("Couldn't open temporary file!");
+    }
+    for (n = 0; n < right->num_blocks; ++n)
+    {
+        br = right->blocks[n];
+        if (br.is == NULL)
         {
-            fprintf(stderr, "Invalid sequence of differences files!\n");
-            exit(EXIT_FAILURE);
+            index = br.offset/BS;
+            if (index >= left->num_blocks)
+            {
+                fclose(fp);
+                fail("Invalid block index in differences file!");
+            }
+            br = left->blocks[index];
+            if (right->blocks[n].edits >= 0)
+            {
+                /* Compose edit list with that of the referenced block */
+                if (br.edits >= 0)
+                {
+                    get_edits(mc, br.edits, edits);
+                    get_edits(mc, right->blocks[n].edits, buf);
+                    size = merge_edit_lists(edits, buf, buf);
+                    br.edits = add_edits(mc, buf, size);
+                }
+                else
+                {
+                    br.edits = right->blocks[n].edits;
+                }
+            }
         }
+        write_block_ref(fp, &br);
     }
-    else
+    unmap_blocks(left);
+    unmap_blocks(right);
+    map_blocks(fp, n, left);
+}
+
+/* Finds two adjacent block maps that are both ready to be composed, and
+   returns the index of the left one, or -1 if there are none. */
+static int find_pair(MergeJob *job)
+{
+    int n;
+
+    for (n = 0; job->succ[n] < job->nmap; n = job->succ[n])
     {
-        fprintf(stderr, "WARNING: differences file is missing original file "
-                        "digest; patch integrity cannot be guaranteed.\n");
+        if (job->state[n] == MAP_READY &&
+            job->state[job->succ[n]] == MAP_READY) return n;
     }
-    memcpy(last_digest, digest2, DS);
+    return -1;
+}
 
-    /* Unmap old block data */
-    if (last_blocks != NULL)
+/* Executes tasks of a merge job until none are left (or one has failed).
+   Composing maps takes precedence over reading more input files. */
+static void *run_merge_tasks(void *arg)
+{
+    MergeJob *job = arg;
+    ErrorHandler eh;
+    int left, right, input;
+
+    if (setjmp(eh.env) != 0)
+    {
+        pthread_mutex_lock(&job->lock);
+        if (!job->failed) strcpy(job->error, eh.message);
+        job->failed = true;
+        --job->busy;
+        pthread_cond_broadcast(&job->changed);
+        pthread_mutex_unlock(&job->lock);
+        return NULL;
+    }
+    push_error_handler(&eh);
+    pthread_mutex_lock(&job->lock);
+    for (;;)
     {
-        if (munmap(last_blocks, last_num_blocks*sizeof(BlockRef)) != 0)
+        left = input = -1;
+        while (!job->failed)
+        {
+            left = find_pair(job);
+            if (left >= 0 || job->next < job->ninput) break;
+            if (job->busy == 0) break;  /* all maps have been composed */
+            pthread_cond_wait(&job->changed, &job->lock);
+        }
+        if (left >= 0)
+        {
+            right = job->succ[left];
+            job->state[left] = job->state[right] = MAP_BUSY;
+        }
+        else
+        if (!job->failed && job->next < job->ninput)
+        {
+            input = job->next++;
+            job->state[job->first + input] = MAP_BUSY;
+        }
+        else
+        {
+            break;
+        }
+        ++job->busy;
+        pthread_mutex_unlock(&job->lock);
+
+        if (left >= 0)
+        {
+            compose_maps(job->mc, &job->maps[left], &job->maps[right]);
+        }
+        else
         {
-            fprintf(stderr, "munmap() failed!\n");
-            exit(EXIT_FAILURE);
+            read_input(job->mc, &job->inputs[input], job->progress);
         }
+
+        pthread_mutex_lock(&job->lock);
+        if (left >= 0)
+        {
+            job->state[left] = MAP_READY;
+            job->succ[left] = job->succ[right];
+        }
+        else
+        {
+            job->maps[job->first + input] = job->inputs[input].map;
+            job->state[job->first + input] = MAP_READY;
+        }
+        --job->busy;
+        pthread_cond_broadcast(&job->changed);
     }
+    pthread_mutex_unlock(&job->lock);
+    pop_error_handler(&eh);
+    return NULL;
+}
 
-    /* Map new block data */
-    fflush(fp); /* must flush to ensure all data can be mmap()ed */
-    last_blocks = mmap( NULL, num_blocks*sizeof(BlockRef), PROT_READ,
-                        MAP_SHARED, fileno(fp), 0 );
-    if (last_blocks == NULL)
+/* Executes the tasks of a merge job on (up to) one thread per CPU. */
+static void run_merge_job(MergeJob *job)
+{
+    pthread_t *threads;
+    long nthread, n;
+
+    nthread = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthread > job->ninput) nthread = job->ninput;
+    if (nthread < 1) nthread = 1;
+    threads = malloc(nthread*sizeof(pthread_t));
+    assert(threads != NULL);
+    for (n = 1; n < nthread; ++n)
     {
-        fprintf(stderr, "mmap() failed!\n");
-        exit(EXIT_FAILURE);
+        if (pthread_create(&threads[n], NULL, run_merge_tasks, job) != 0)
+        {
+            break;
+        }
     }
-    last_num_blocks = num_blocks;
-    fclose(fp);
+    run_merge_tasks(job);
+    while (--n > 0) pthread_join(threads[n], NULL);
+    free(threads);
 }
 
-/* Emits an instruction to generate the last (C+A) blocks before position n. */
-static void emit_instruction(size_t n, uint16_t C, uint16_t A)
+/* Blocks appended by the instruction being built, which are read from
+   `count' consecutive blocks at `offset' in `is' (with edit list `edits'
+   applied, if it is nonnegative, in which case `count' is 1). */
+typedef struct AppendRun
 {
-    uint8_t block[BS];
-    size_t a;
     InputStream *is;
+    off_t       offset;
+    off_t       edits;
+    uint32_t    count;
+} AppendRun;
+
+/* Builds the instructions of a merged differences file from a sequence of
+   copied and appended blocks. Consecutive blocks are combined into the
+   same instructions regardless of how they are added, so the output depends
+   only on the sequence of blocks. */
+typedef struct Emitter
+{
+    MergeContext *mc;
+    OutputStream *os;
+    uint32_t     max;           /* maximum number of blocks of each kind */
+    uint64_t     T;             /* index of first block of instruction */
+    uint64_t     S;             /* index of first copied block */
+    uint32_t     C, A;          /* number of copied and appended blocks */
+    bool         P;             /* are the copied blocks patched? */
+    off_t        *edits;        /* edit lists of copied blocks (if P) */
+    size_t       edits_capacity;
+    AppendRun    *runs;         /* appended blocks */
+    size_t       nruns, runs_capacity;
+} Emitter;
+
+/* Writes the instruction being built (if any). */
+static void flush_instruction(Emitter *e)
+{
+    MergeContext *mc = e->mc;
+    OutputStream *os = e->os;
+    uint8_t block[BS], edits[MAX_EDIT_LIST];
+    size_t c, n, size;
+    uint32_t a;
+    AppendRun *run;
+    Instruction ins;
 
-    assert(C + A <= n && n <= last_num_blocks);
+    if (e->C == 0 && e->A == 0) return;
 
     /* Write instruction */
-    write_uint32((C == 0) ? 0xffffffffu : last_blocks[n - A - C].offset/BS);
-    write_uint16(C);
-    write_uint16(A);
+    ins.S = (e->C == 0) ? 0 : e->S;
+    ins.C = e->C;
+    ins.A = e->A;
+    ins.patched = e->C > 0 && e->P;
+    stats_instruction(ins.C, ins.A, ins.patched);
+    InstructionIndex_add(mc->output_index, e->T, get_output_digest(os, NULL));
+    write_instruction(os, mc->format, &ins);
+
+    /* Add edit lists of copied blocks */
+    for (c = 0; ins.patched && c < e->C; ++c)
+    {
+        size = EditStore_get(mc->edit_store, e->edits[c], edits);
+        write_data(os, edits, size);
+    }
 
     /* Add instruction data */
-    for (a = 0; a < A; ++a)
+    for (n = 0; n < e->nruns; ++n)
     {
-        is = last_blocks[n - A + a].is;
-        is->seek(is, last_blocks[n - A + a].offset);
-        read_data(is, block, BS);
-        write_data(block, BS);
+        run = &e->runs[n];
+        if (!run->is->seek(run->is, run->offset))
+        {
+            fail("Seek failed.");
+        }
+        for (a = 0; a < run->count; ++a)
+        {
+            read_data(run->is, block, BS);
+            if (run->edits >= 0)
+            {
+                EditStore_apply(mc->edit_store, run->edits, (char*)block);
+            }
+            write_data(os, block, BS);
+        }
     }
+
+    e->T += e->C + e->A;
+    e->C = e->A = 0;
+    e->nruns = 0;
 }
 
-static bool generate_output()
+/* Adds `count' blocks copied from the original file, starting from block
+   `index'. If `edits' is nonnegative, `count' must be 1 and the edit list
+   stored at offset `edits' in the edit store is applied to the block. */
+static void add_copied( Emitter *e, uint64_t index, uint64_t count,
+                        off_t edits )
 {
-    size_t n;
-    uint16_t C, A;
-
-    /* Write header */
-    write_data(MAGIC_STR, MAGIC_LEN);
+    bool patched = edits >= 0;
+    uint64_t n;
 
-    /* Generate instructions */
-    C = A = 0;
-    for (n = 0; n < last_num_blocks; ++n)
+    assert(!patched || count == 1);
+    while (count > 0)
     {
-        if (last_blocks[n].is == NULL)
+        /* Check to see if we must start a new instruction */
+        if ( (e->C > 0 && (index != e->S + e->C || patched != e->P)) ||
+             e->C == e->max || e->A > 0 )
+        {
+            flush_instruction(e);
+        }
+        if (e->C == 0)
         {
-            /* Check to see if we must start a new instruction */
-            if ( (C > 0 && last_blocks[n].offset !=
-                           last_blocks[n - 1].offset + BS ) ||
-                 (C == 0x7fffu) || (A > 0) )
+            e->S = index;
+            e->P = patched;
+        }
+        if (patched)
+        {
+            if (e->C == e->edits_capacity)
             {
-                emit_instruction(n, C, A);
-                C = A = 0;
+                e->edits_capacity = e->edits_capacity ?
+                                    2*e->edits_capacity : 64;
+                e->edits = realloc( e->edits,
+                                    e->edits_capacity*sizeof(off_t) );
+                assert(e->edits != NULL);
             }
-            ++C;
+            e->edits[e->C] = edits;
+        }
+        n = e->max - e->C;
+        if (n > count) n = count;
+        e->C  += n;
+        index += n;
+        count -= n;
+    }
+}
+
+/* Adds `count' blocks stored at `offset' in `is'. If `edits' is nonnegative,
+   `count' must be 1 and the given edit list is applied to the block. */
+static void add_appended( Emitter *e, InputStream *is, off_t offset,
+                          uint64_t count, off_t edits )
+{
+    AppendRun *run;
+    uint64_t n;
+
+    assert(edits < 0 || count == 1);
+    while (count > 0)
+    {
+        if (e->A == e->max) flush_instruction(e);
+        n = e->max - e->A;
+        if (n > count) n = count;
+
+        /* Extend the last run, if these blocks follow it */
+        run = (e->nruns > 0) ? &e->runs[e->nruns - 1] : NULL;
+        if ( run != NULL && run->is == is && run->edits < 0 && edits < 0 &&
+             run->offset + (off_t)BS*run->count == offset )
+        {
+            run->count += n;
         }
         else
         {
-            if (A == 0x7fffu)
+            if (e->nruns == e->runs_capacity)
             {
-                emit_instruction(n, C, A);
-                C = A = 0;
+                e->runs_capacity = e->runs_capacity ?
+                                   2*e->runs_capacity : 64;
+                e->runs = realloc( e->runs,
+                                   e->runs_capacity*sizeof(AppendRun) );
+                assert(e->runs != NULL);
             }
-            ++A;
+            run = &e->runs[e->nruns++];
+            run->is     = is;
+            run->offset = offset;
+            run->edits  = edits;
+            run->count  = n;
         }
+        e->A   += n;
+        offset += (off_t)BS*n;
+        count  -= n;
     }
+}
+
+/* Writes the header of a merged differences file to `os', and prepares `e'
+   to build its instructions. */
+static void start_merged_output(MergeContext *mc, Emitter *e, OutputStream *os)
+{
+    start_output_digest(os);
+    write_magic(os, mc->format, mc->edits);
+    mc->output_index = InstructionIndex_create(INDEX_BLOCKS);
+    assert(mc->output_index != NULL);
+    memset(e, 0, sizeof(*e));
+    e->mc  = mc;
+    e->os  = os;
+    e->max = MAX_COUNT(mc->format);
+}
 
-    /* Emit final instruction (if necessary) */
-    if (C > 0 || A > 0) emit_instruction(last_num_blocks, C, A);
+/* Writes the last instruction and the footer of a merged differences file. */
+static void finish_merged_output(MergeContext *mc, Emitter *e)
+{
+    OutputStream *os = e->os;
+    off_t footer_offset;
+
+    flush_instruction(e);
+    free(e->edits);
+    free(e->runs);
 
     /* Write end-of-instructions */
-    write_uint32(0xffffffffu);
-    write_uint16(0xffffu);
-    write_uint16(0xffffu);
+    write_end_instruction(os, mc->format);
 
     /* Add last file digest */
-    write_data(last_digest, DS);
+    footer_offset = get_output_digest(os, NULL);
+    write_data(os, mc->last_digest, DS);
 
     /* Add first file digest (if known) */
-    if (!orig_digest_known)
+    if (!mc->orig_digest_known)
     {
         fprintf(stderr, "WARNING: original file digest unknown; "
                         "generating version 1.0 differences file.\n");
     }
     else
     {
-        write_data(orig_digest, DS);
+        write_data(os, mc->orig_digest, DS);
+
+        /* Add extended footer with the last file's chunk digests */
+        write_trailer( os, footer_offset, mc->last_chunks,
+                       mc->output_index, mc->bases );
     }
+    InstructionIndex_destroy(mc->output_index);
+    mc->output_index = NULL;
+}
 
-    return true;
+void merge_output(MergeContext *mc, OutputStream *os)
+{
+    Emitter e;
+    BlockRef *br;
+    size_t n;
+
+    start_merged_output(mc, &e, os);
+    for (n = 0; n < mc->last_num_blocks; ++n)
+    {
+        br = &mc->last_blocks[n];
+        if (br->is == NULL) add_copied(&e, br->offset/BS, 1, br->edits);
+        else add_appended(&e, br->is, br->offset, 1, br->edits);
+    }
+    finish_merged_output(mc, &e);
 }
 
-int tardiffmerge(int argc, char *argv[], char *flags)
+/* Random access to the instructions of a merged differences file. The
+   instruction that generates a given output block is located using the
+   instruction index and then by reading instruction headers only. Since the
+   file is also read by the emitter, every read is preceded by a seek. */
+typedef struct MergedCursor
 {
-    int n, num_diffs;
-    struct File *files, *file;
-    bool input_ok, output_ok, order_files;
+    InputStream      *is;
+    enum DiffFormat  format;
+    InstructionIndex *index;    /* instruction index (or NULL) */
+    uint64_t         T;         /* first output block of current instruction */
+    off_t            offset;    /* offset of current instruction */
+    off_t            payload;   /* offset of appended blocks (or -1) */
+    Instruction      ins;       /* current instruction */
+    bool             end;       /* end of instructions reached? */
+    uint32_t         nedits;    /* number of edit lists read */
+    off_t            edits_pos; /* offset of the next edit list */
+} MergedCursor;
+
+static void seek_merged(MergedCursor *c, off_t pos)
+{
+    if (!c->is->seek(c->is, pos)) fail("Seek failed.");
+}
+
+/* Reads the header of the instruction at `offset', which starts at output
+   block `T'. */
+static void load_instruction(MergedCursor *c, off_t offset, uint64_t T)
+{
+    uint8_t buf[MAX_INSTRUCTION_LEN];
+
+    seek_merged(c, offset);
+    read_data(c->is, buf, INSTRUCTION_LEN(c->format));
+    switch (parse_instruction(buf, c->format, &c->ins))
+    {
+    case INSTRUCTION_OK:
+        c->end = false;
+        break;
+
+    case INSTRUCTION_END:
+        c->end = true;
+        break;
+
+    case INSTRUCTION_INVALID:
+        fail("Invalid instruction in differences file!");
+    }
+    c->T         = T;
+    c->offset    = offset;
+    c->payload   = c->ins.patched ? -1 : offset + INSTRUCTION_LEN(c->format);
+    c->nedits    = 0;
+    c->edits_pos = offset + INSTRUCTION_LEN(c->format);
+}
+
+/* Reads the edit list of copied block `i' of the current instruction. */
+static size_t read_merged_edits(MergedCursor *c, uint32_t i, uint8_t *buf)
+{
+    size_t size = 0;
+
+    if (i < c->nedits)
+    {
+        c->nedits    = 0;
+        c->edits_pos = c->offset + INSTRUCTION_LEN(c->format);
+    }
+    seek_merged(c, c->edits_pos);
+    while (c->nedits <= i)
+    {
+        size = read_edit_list(c->is, buf);
+        if (size == 0)
+        {
+            fail("Invalid edit list in differences file!");
+        }
+        c->edits_pos += size;
+        ++c->nedits;
+    }
+    return size;
+}
+
+/* Returns the offset of the appended blocks of the current instruction. */
+static off_t merged_payload(MergedCursor *c)
+{
+    uint8_t buf[MAX_EDIT_LIST];
+
+    if (c->payload < 0)
+    {
+        if (c->ins.C > 0) read_merged_edits(c, c->ins.C - 1, buf);
+        c->payload = c->edits_pos;
+    }
+    return c->payload;
+}
+
+/* Moves the cursor to the instruction that generates output block `t', or
+   fails if the output has fewer than t + 1 blocks. */
+static void find_block(MergedCursor *c, uint64_t t)
+{
+    IndexEntry *e;
+
+    /* Jump to the closest indexed instruction, if it is ahead of the cursor */
+    e = (c->index != NULL) ? InstructionIndex_find(c->index, t) : NULL;
+    if (e != NULL && (t < c->T || e->T > c->T))
+    {
+        load_instruction(c, e->offset, e->T);
+    }
+    else
+    if (t < c->T)
+    {
+        load_instruction(c, MAGIC_LEN, 0);
+    }
+
+    while (!c->end && t - c->T >= (uint64_t)c->ins.C + c->ins.A)
+    {
+        load_instruction( c, merged_payload(c) + (off_t)BS*c->ins.A,
+                          c->T + c->ins.C + c->ins.A );
+    }
+    if (c->end) fail("Invalid block index in differences file!");
+}
+
+/* Adds the `count' output blocks of the merged file starting from block `t',
+   applying the edit lists at `edits' (one per block, or NULL if the blocks
+   are not patched) to them. */
+static void add_merged( Emitter *e, MergedCursor *c, uint64_t t,
+                        uint64_t count, const off_t *edits )
+{
+    MergeContext *mc = e->mc;
+    uint8_t buf[MAX_EDIT_LIST], later[MAX_EDIT_LIST];
+    uint64_t i, n, k;
+    off_t offset;
+    size_t size;
+
+    while (count > 0)
+    {
+        find_block(c, t);
+        i = t - c->T;
+        if (i < c->ins.C)
+        {
+            /* Blocks copied from the original file */
+            n = c->ins.C - i;
+            if (n > count) n = count;
+            if (!c->ins.patched && edits == NULL)
+            {
+                add_copied(e, c->ins.S + i, n, -1);
+            }
+            else
+            for (k = 0; k < n; ++k)
+            {
+                /* Compose edit lists of the merged and the new file */
+                if (!c->ins.patched)
+                {
+                    offset = edits[k];
+                }
+                else
+                {
+                    size = read_merged_edits(c, i + k, buf);
+                    if (edits != NULL)
+                    {
+                        EditStore_get(mc->edit_store, edits[k], later);
+                        size = merge_edit_lists(buf, later, buf);
+                    }
+                    offset = EditStore_add(mc->edit_store, buf, size);
+                }
+                add_copied(e, c->ins.S + i + k, 1, offset);
+            }
+        }
+        else
+        {
+            /* Blocks stored in the merged file */
+            n = (uint64_t)c->ins.C + c->ins.A - i;
+            if (n > count) n = count;
+            offset = merged_payload(c) + (off_t)BS*(i - c->ins.C);
+            if (edits == NULL)
+            {
+                add_appended(e, c->is, offset, n, -1);
+            }
+            else
+            for (k = 0; k < n; ++k)
+            {
+                add_appended(e, c->is, offset + (off_t)BS*k, 1, edits[k]);
+            }
+        }
+        t      += n;
+        count  -= n;
+        if (edits != NULL) edits += n;
+    }
+}
+
+/* Reads the digests and the extended footer of a merged differences file, and
+   keeps them in `mc' as if the file had been merged. */
+static void load_merged(MergeContext *mc, MergedCursor *c)
+{
+    char magic[MAGIC_LEN];
+    Trailer trailer;
+    int format;
+
+    seek_merged(c, 0);
+    read_data(c->is, magic, MAGIC_LEN);
+    format = parse_magic(magic);
+    if (format < 0)
+    {
+        fail("Not a differences file!");
+    }
+    c->format = format;
+    if (format == FORMAT_WIDE) mc->format = FORMAT_WIDE;
+    if (magic_has_edits(magic)) mc->edits = true;
+
+    trailer.chunks = NULL;
+    trailer.index  = NULL;
+    trailer.bases  = NULL;
+    if (!load_trailer(c->is, &trailer))
+    {
+        fail("Merged differences file has no extended footer!");
+    }
+    if (trailer.index == NULL)
+    {
+        fprintf(stderr, "WARNING: merged differences file has no instruction "
+                        "index; all instructions must be read.\n");
+    }
+    c->index = trailer.index;
+    ChunkDigests_destroy(trailer.chunks);
+    mc->bases = trailer.bases;
+
+    seek_merged(c, trailer.footer_offset);
+    read_data(c->is, mc->last_digest, DS);
+    read_data(c->is, mc->orig_digest, DS);
+    mc->orig_digest_known = true;
+    load_instruction(c, MAGIC_LEN, 0);
+}
+
+/* Reads the edit lists of `count' patched blocks from `is' into the edit
+   store, storing their offsets in `*edits' (which is enlarged as needed), and
+   returns their total size. */
+static off_t read_new_edits( MergeContext *mc, InputStream *is, uint32_t count,
+                             off_t **edits, size_t *capacity )
+{
+    uint8_t buf[MAX_EDIT_LIST];
+    off_t total = 0;
+    size_t size;
+    uint32_t n;
+
+    if (count > *capacity)
+    {
+        *capacity = count;
+        *edits = realloc(*edits, count*sizeof(off_t));
+        assert(*edits != NULL);
+    }
+    for (n = 0; n < count; ++n)
+    {
+        size = read_edit_list(is, buf);
+        if (size == 0)
+        {
+            fail("Invalid edit list in differences file!");
+        }
+        (*edits)[n] = EditStore_add(mc->edit_store, buf, size);
+        total += size;
+    }
+    return total;
+}
+
+/* Returns whether differences file `is' in the given format has patched
+   instructions, which are searched for from its first instruction. */
+static bool has_patched(InputStream *is, int format)
+{
+    uint8_t buf[MAX_INSTRUCTION_LEN];
+    Instruction ins;
+    off_t offset = MAGIC_LEN;
+
+    for (;;)
+    {
+        if ( !is->seek(is, offset) ||
+             is->read(is, buf, INSTRUCTION_LEN(format)) !=
+             (size_t)INSTRUCTION_LEN(format) ||
+             parse_instruction(buf, format, &ins) != INSTRUCTION_OK )
+        {
+            return false;   /* invalid instructions are reported later */
+        }
+        if (ins.patched) return true;
+        offset += INSTRUCTION_LEN(format) + (off_t)BS*ins.A;
+    }
+}
+
+void merge_onto( MergeContext *mc, InputStream *is_merged, InputStream *is,
+                 OutputStream *os )
+{
+    Progress *progress = active_progress;
+    MergedCursor c;
+    Emitter e;
+    Instruction ins;
+    Trailer trailer;
+    char magic[MAGIC_LEN];
+    uint8_t buf[MAX_INSTRUCTION_LEN], digest1[DS], digest2[DS];
+    off_t offset, reported, *edits = NULL;
+    size_t capacity = 0;
+    enum InstructionStatus status;
+    int format;
+
+    memset(&c, 0, sizeof(c));
+    c.is = is_merged;
+    load_merged(mc, &c);
+
+    /* Verify magic of the new file */
+    if (!is->seek(is, 0)) fail("Seek failed.");
+    read_data(is, magic, MAGIC_LEN);
+    format = parse_magic(magic);
+    if (format < 0)
+    {
+        fail("Not a differences file!");
+    }
+    if (format == FORMAT_WIDE) mc->format = FORMAT_WIDE;
+    if (format == FORMAT_NARROW && has_patched(is, format)) mc->edits = true;
+
+    /* Check that the new file applies to the output of the merged file before
+       writing any output, if its footer can be located */
+    trailer.chunks = NULL;
+    trailer.index  = NULL;
+    trailer.bases  = NULL;
+    if (load_trailer(is, &trailer))
+    {
+        free_trailer(&trailer);
+        if ( !is->seek(is, trailer.footer_offset + DS) ||
+             is->read(is, digest1, DS) != DS )
+        {
+            fail("Read failed.");
+        }
+        if (memcmp(digest1, mc->last_digest, DS) != 0)
+        {
+            fail("Invalid sequence of differences files!");
+        }
+    }
+
+    /* Resolve the instructions of the new file through the merged file */
+    progress_phase("merge", is->size(is) > 0 ? is->size(is) : 0);
+    start_merged_output(mc, &e, os);
+    offset = reported = MAGIC_LEN;
+    for (;;)
+    {
+        if (!is->seek(is, offset)) fail("Seek failed.");
+        read_data(is, buf, INSTRUCTION_LEN(format));
+        offset += INSTRUCTION_LEN(format);
+
+        /* Check for end-of-instructions. */
+        status = parse_instruction(buf, format, &ins);
+        if (status == INSTRUCTION_END) break;
+
+        if (status == INSTRUCTION_INVALID)
+        {
+            fail("Invalid instruction in differences file!");
+        }
+        if (ins.patched)
+        {
+            offset += read_new_edits(mc, is, ins.C, &edits, &capacity);
+        }
+        add_merged(&e, &c, ins.S, ins.C, ins.patched ? edits : NULL);
+        add_appended(&e, is, offset, ins.A, -1);
+        offset += (off_t)BS*ins.A;
+        progress_add(progress, offset - reported);
+        reported = offset;
+    }
+    free(edits);
+    InstructionIndex_destroy(c.index);
+
+    /* Verify that the new file applies to the output of the merged file */
+    read_data(is, digest2, DS);
+    if (is->read(is, digest1, DS) == DS)
+    {
+        if (memcmp(digest1, mc->last_digest, DS) != 0)
+        {
+            fail("Invalid sequence of differences files!");
+        }
+        if (read_trailer(is, NULL, &trailer) == TRAILER_INVALID)
+        {
+            fail("Invalid footer in differences file!");
+        }
+        InstructionIndex_destroy(trailer.index);
+        if (trailer.bases != NULL)
+        {
+            BaseList_destroy(trailer.bases);
+            ChunkDigests_destroy(trailer.chunks);
+            fail("Only the first differences file may have several base "
+                 "files!");
+        }
+    }
+    else
+    {
+        fprintf(stderr, "WARNING: differences file is missing original file "
+                        "digest; patch integrity cannot be guaranteed.\n");
+        trailer.chunks = NULL;
+    }
+    mc->last_chunks = trailer.chunks;
+    memcpy(mc->last_digest, digest2, DS);
+    finish_merged_output(mc, &e);
+}
+
+MergeContext *merge_create()
+{
+    MergeContext *mc;
+
+    mc = calloc(1, sizeof(MergeContext));
+    assert(mc != NULL);
+    mc->edit_store = EditStore_create();
+    pthread_mutex_init(&mc->edit_lock, NULL);
+    return mc;
+}
+
+/* Verifies that the input files form a sequence (following the files merged
+   before), and keeps the digests, chunk digests and base files of the merged
+   sequence. Ownership of the chunk digests and base files is transferred. */
+static void check_sequence(MergeContext *mc, MergeInput *inputs, int ninput)
+{
+    const char *error = NULL;
+    MergeInput *in;
+    int n;
+
+    for (n = 0; n < ninput; ++n)
+    {
+        in = &inputs[n];
 
-    num_diffs = argc - 1;
-    input_ok = output_ok = false;
-    order_files = (strchr(flags, 'f') == NULL);
+        /* Block indices in the output refer to the original file, so the
+           output must be wide if any input is */
+        if (in->format == FORMAT_WIDE) mc->format = FORMAT_WIDE;
+        if (in->edits) mc->edits = true;
+
+        if (!in->digest1_known)
+        {
+            fprintf(stderr, "WARNING: differences file is missing original "
+                            "file digest; patch integrity cannot be "
+                            "guaranteed.\n");
+        }
+        else
+        if (mc->num_merged + n == 0)
+        {
+            mc->orig_digest_known = true;
+            memcpy(mc->orig_digest, in->digest1, DS);
+
+            /* Only the original file may consist of several base files */
+            mc->bases = in->bases;
+            in->bases = NULL;
+        }
+        else
+        if (memcmp(in->digest1, mc->last_digest, DS) != 0)
+        {
+            if (error == NULL) error = "Invalid sequence of differences files!";
+        }
+        else
+        if (in->bases != NULL)
+        {
+            if (error == NULL) error = "Only the first differences file may "
+                                       "have several base files!";
+        }
+        ChunkDigests_destroy(mc->last_chunks);
+        mc->last_chunks = in->chunks;
+        in->chunks = NULL;
+        memcpy(mc->last_digest, in->digest2, DS);
+    }
+    if (error != NULL) fail("%s", error);
+}
+
+void merge_streams(MergeContext *mc, InputStream **streams, int nstream)
+{
+    MergeInput *inputs;
+    MergeJob job;
+    uint64_t total = 0;
+    int n;
+
+    if (nstream <= 0) return;
+    if (nstream > MAX_DIFF_FILES - mc->num_merged)
+    {
+        fail("Too many differences files!");
+    }
+    inputs = calloc(nstream, sizeof(MergeInput));
+    job.maps  = calloc(nstream + 1, sizeof(BlockMap));
+    job.state = calloc(nstream + 1, sizeof(enum MapState));
+    job.succ  = malloc((nstream + 1)*sizeof(int));
+    assert( inputs != NULL && job.maps != NULL && job.state != NULL &&
+            job.succ != NULL );
+    for (n = 0; n < nstream; ++n)
+    {
+        inputs[n].is = streams[n];
+        if (streams[n]->size(streams[n]) > 0)
+        {
+            total += streams[n]->size(streams[n]);
+        }
+    }
+
+    /* The result of the files merged before (if any) precedes the inputs */
+    job.first = 0;
+    if (mc->num_merged > 0)
+    {
+        job.maps[0].blocks = mc->last_blocks;
+        job.maps[0].num_blocks = mc->last_num_blocks;
+        job.state[0] = MAP_READY;
+        job.first = 1;
+        mc->last_blocks = NULL;
+        mc->last_num_blocks = 0;
+    }
+    job.nmap = job.first + nstream;
+    for (n = 0; n < job.nmap; ++n) job.succ[n] = n + 1;
+    job.mc       = mc;
+    job.inputs   = inputs;
+    job.ninput   = nstream;
+    job.next     = 0;
+    job.busy     = 0;
+    job.failed   = false;
+    job.progress = active_progress;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.changed, NULL);
+
+    /* Read the input files and compose their block maps in parallel */
+    progress_phase("merge", total);
+    run_merge_job(&job);
+    pthread_cond_destroy(&job.changed);
+    pthread_mutex_destroy(&job.lock);
+
+    /* Release block maps that were not composed because of an error */
+    for (n = 1; job.failed && n < job.nmap; ++n) unmap_blocks(&job.maps[n]);
+    mc->last_blocks = job.maps[0].blocks;
+    mc->last_num_blocks = job.maps[0].num_blocks;
+    free(job.succ);
+    free(job.state);
+    free(job.maps);
+
+    if (!job.failed) check_sequence(mc, inputs, nstream);
+    for (n = 0; n < nstream; ++n)
+    {
+        ChunkDigests_destroy(inputs[n].chunks);
+        BaseList_destroy(inputs[n].bases);
+    }
+    free(inputs);
+    if (job.failed) fail("%s", job.error);
+    mc->num_merged += nstream;
+}
+
+void merge_stream(MergeContext *mc, InputStream *is)
+{
+    merge_streams(mc, &is, 1);
+}
+
+bool merge_diffs(MergeContext *mc, char **paths, int npath, bool order_files)
+{
+    struct File *files, *file;
+    bool input_ok;
 
     /* Verify arguments are all diff files: */
-    input_ok = identify_files((const char**)argv, num_diffs, NULL, &files);
+    input_ok = identify_files((const char**)paths, npath, NULL, &files);
     for (file = files; file != NULL; file = file->next)
     {
         if (file->type == FILE_INVALID)
@@ -347,7 +1279,7 @@ int tardiffmerge(int argc, char *argv[], char *flags)
         }
         else  /* file->type == FILE_DIFF */
         {
-            static uint8_t zero_digest[DS];
+            static const uint8_t zero_digest[DS];
             if (order_files &&
                 memcmp(file->diff.digest1, zero_digest, DS) == 0)
             {
@@ -370,17 +1302,22 @@ int tardiffmerge(int argc, char *argv[], char *flags)
 
     if (input_ok)
     {
-        /* Redirect output (if necessary) */
-        if (strcmp(argv[argc - 1], "-") != 0) redirect_stdout(argv[argc - 1]);
+        int first = mc->num_diff_files;
 
-        n = 0;
+        stats_phase("merge");
         for (file = files; file != NULL; file = file->next)
         {
             InputStream *is;
-            char magic[MAGIC_LEN];
+
+            if (mc->num_diff_files == MAX_DIFF_FILES)
+            {
+                fprintf(stderr, "Too many differences files!\n");
+                break;
+            }
 
             /* Try to open again */
-            is = OpenFileInputStream(file->path);
+            is = stats_input_stream(OpenFileInputStream(file->path),
+                                    file->path);
             if (is == NULL)
             {
                 fprintf(stderr, "%s: could not be opened.\n", file->path);
@@ -388,31 +1325,151 @@ int tardiffmerge(int argc, char *argv[], char *flags)
             }
 
             /* Save pointer here, so we can close it later. */
-            is_diff[n++] = is;
+            mc->is_diff[mc->num_diff_files++] = is;
+        }
+        if (file != NULL) input_ok = false;
+        else merge_streams( mc, mc->is_diff + first,
+                            mc->num_diff_files - first );
+    }
+    free_files(files);
 
-            /* Verify magic again */
-            read_data(is, magic, MAGIC_LEN);
-            if (memcmp(magic, MAGIC_STR, MAGIC_LEN) != 0)
-            {
-                fprintf(stderr, "%s: not a differences file\n", file->path);
-                break;
-            }
+    return input_ok;
+}
 
-            /* Process entire file */
-            process_input(is);
-        }
+BlockRef *merged_blocks(MergeContext *mc, size_t *num_blocks)
+{
+    *num_blocks = mc->last_num_blocks;
+    return mc->last_blocks;
+}
+
+EditStore *merged_edits(MergeContext *mc)
+{
+    return mc->edit_store;
+}
+
+ChunkDigests *merged_digests(MergeContext *mc, uint8_t digest[DS])
+{
+    memcpy(digest, mc->last_digest, DS);
+    return mc->last_chunks;
+}
+
+BaseList *merged_bases(MergeContext *mc)
+{
+    return mc->bases;
+}
+
+bool merged_source_digest(MergeContext *mc, uint8_t digest[DS])
+{
+    memcpy(digest, mc->orig_digest, DS);
+    return mc->orig_digest_known;
+}
+
+void merge_cleanup(MergeContext *mc)
+{
+    /* Close open streams: */
+    while (mc->num_diff_files > 0)
+    {
+        InputStream *is = mc->is_diff[--mc->num_diff_files];
+        is->close(is);
+    }
+
+    if (mc->last_blocks != NULL)
+    {
+        munmap(mc->last_blocks, mc->last_num_blocks*sizeof(BlockRef));
+    }
+    ChunkDigests_destroy(mc->last_chunks);
+    BaseList_destroy(mc->bases);
+    InstructionIndex_destroy(mc->output_index);
+    EditStore_destroy(mc->edit_store);
+    pthread_mutex_destroy(&mc->edit_lock);
+    free(mc);
+}
+
+bool tardiff_merge( TardiffContext *tc, InputStream **diffs, int ndiff,
+                    OutputStream *os )
+{
+    MergeContext *volatile mc = merge_create();
+    ErrorHandler eh;
 
-        if (file == NULL)
+    if (setjmp(eh.env) != 0)
+    {
+        merge_cleanup(mc);
+        strcpy(tc->error, eh.message);
+        return false;
+    }
+    push_error_handler(&eh);
+    stats_phase("merge");
+    merge_streams(mc, diffs, ndiff);
+    stats_phase("output");
+    merge_output(mc, os);
+    stats_phase_end();
+    pop_error_handler(&eh);
+    merge_cleanup(mc);
+    return true;
+}
+
+/* Opens a differences file to be merged, which is closed by merge_cleanup(). */
+static InputStream *open_diff(MergeContext *mc, const char *path)
+{
+    InputStream *is;
+
+    is = stats_input_stream(OpenFileInputStream(path), path);
+    if (is == NULL)
+    {
+        fprintf(stderr, "%s: could not be opened.\n", path);
+        return NULL;
+    }
+    mc->is_diff[mc->num_diff_files++] = is;
+    if (is->size(is) < 0)
+    {
+        fprintf(stderr, "%s: not seekable.\n", path);
+        return NULL;
+    }
+    return is;
+}
+
+int tardiffmerge(int argc, char *argv[], char *flags)
+{
+    MergeContext *mc;
+    OutputStream *os;
+    InputStream *is_merged, *is;
+    const char *onto = get_option("onto");
+    bool ok;
+
+    mc = merge_create();
+    if (onto != NULL)
+    {
+        /* Fold a single differences file into a merged one */
+        ok = (is_merged = open_diff(mc, onto)) != NULL &&
+             (is = open_diff(mc, argv[0])) != NULL;
+        if (ok)
         {
-            output_ok = generate_output();
+            if (strcmp(argv[1], "-") != 0) redirect_stdout(argv[1]);
+            os = stats_output_stream(OpenFileOutputStream(stdout), "diff");
+            assert(os != NULL);
+            stats_phase("merge");
+            merge_onto(mc, is_merged, is, os);
+            stats_phase_end();
+            os->close(os);
         }
+        merge_cleanup(mc);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    ok = merge_diffs(mc, argv, argc - 1, strchr(flags, 'f') == NULL);
+    if (ok)
+    {
+        /* Redirect output (if necessary) */
+        if (strcmp(argv[argc - 1], "-") != 0) redirect_stdout(argv[argc - 1]);
 
-        /* Close open streams: */
-        while (n-- > 0) is_diff[n]->close(is_diff[n]);
-
-        munmap(last_blocks, last_num_blocks*sizeof(BlockRef));
+        os = stats_output_stream(OpenFileOutputStream(stdout), "diff");
+        assert(os != NULL);
+        stats_phase("output");
+        progress_phase("output", 0);
+        merge_output(mc, os);
+        stats_phase_end();
+        os->close(os);
     }
-    free_files(files);
+    merge_cleanup(mc);
 
-    return (input_ok && output_ok) ? EXIT_SUCCESS : EXIT_FAILURE;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
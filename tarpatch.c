@@ -1,85 +1,351 @@
-#include "common.h"
+#include "libtardiff.h"
+#include "patch.h"
+#include "progress.h"
+#include "stats.h"
+#include <fcntl.h>
+#include <unistd.h>
 
-/* Generates file 2 on-line, but requires seeking in file 1.  This is the
-   preferred method of applying patches when the input file is seekable, since
-   it only takes linear time. */
-extern void patch_forward(InputStream *is_file1, InputStream *is_diff,
-                          uint8_t digest[DS]);
-
-/* Generates file 2 out of order, but reads through file 1 only once.  This
-   requires re-ordering the diff instructions which may be time consuming,
-   but has the advantage of working when file 1 is non-seekable. */
-extern void patch_backward(InputStream *is_file1, InputStream *is_diff,
-                           uint8_t digest[DS]);
+/* Returns whether data written to `os' can be read back, which is required
+   to patch from a non-seekable input file. */
+static bool output_seekable(OutputStream *os)
+{
+    return os->seek != NULL && os->read != NULL && os->seek(os, 0);
+}
 
-int tarpatch(int argc, char *argv[], const char *flags)
+/* Returns whether the file at `path' is a differences file (or standard input,
+   which cannot be a base file). */
+static bool is_diff_file(const char *path)
 {
-    InputStream *is_file1, *is_diff;
-    void (*patch_func)(InputStream *, InputStream *, uint8_t[DS]);
     char magic_buf[MAGIC_LEN];
-    uint8_t digest_expected[DS], digest_computed[DS];
+    InputStream *is;
+    bool res;
 
-    assert(MD5_DIGEST_LENGTH == DS);
-    assert(argc == 3);
+    if (strcmp(path, "-") == 0) return true;
+    is = OpenFileInputStream(path);
+    if (is == NULL) return false;
+    res = is->read(is, magic_buf, MAGIC_LEN) == MAGIC_LEN &&
+          parse_magic(magic_buf) >= 0;
+    is->close(is);
+    return res;
+}
 
-    /* Open file 1 */
-    is_file1 = (strcmp(argv[0], "-") == 0) ? OpenStdinInputStream()
-                                           : OpenFileInputStream(argv[0]);
-    if (is_file1 == NULL)
+/* Checks that the base files given on the command line match those listed in
+   a differences file (`bases' is NULL if it has a single file 1), as far as
+   this can be done without reading them, and exits otherwise. */
+static void check_bases(BaseList *bases, InputStream **is_bases, int nbase)
+{
+    off_t size;
+    int n;
+
+    if ((bases == NULL) ? nbase != 1 : bases->count != (size_t)nbase)
     {
-        fprintf(stderr, "Cannot open file 1 (%s) for reading!\n", argv[0]);
+        fprintf(stderr, "Differences file requires %d base file(s) "
+                        "(%d given)!\n",
+                        bases == NULL ? 1 : (int)bases->count, nbase);
         exit(EXIT_FAILURE);
     }
+    for (n = 0; bases != NULL && n < nbase; ++n)
+    {
+        size = is_bases[n]->size(is_bases[n]);
+        if (size >= 0 && (uint64_t)size/BS + (size%BS != 0) !=
+                         bases->nblocks[n])
+        {
+            fprintf(stderr, "Base file %d has %llu blocks (expected %llu)!\n",
+                    n + 1, (unsigned long long)(size/BS + (size%BS != 0)),
+                    (unsigned long long)bases->nblocks[n]);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
 
-    /* Open diff file */
-    is_diff  = (strcmp(argv[1], "-") == 0) ? OpenStdinInputStream()
-                                           : OpenFileInputStream(argv[1]);
-    if (is_diff == NULL)
+/* Recreates file 2 from file 1 and a sequence of differences files, which are
+   composed first, so no intermediate output files need to be generated. */
+static int tarpatch_chain( InputStream *is_file1, InputStream **is_bases,
+                           int nbase, char **diffs, int ndiff,
+                           const char *output, bool order_files )
+{
+    void (*patch_func)( InputStream *, const BlockRef *, size_t, EditStore *,
+                        OutputStream *, Verifier * );
+    uint8_t digest_expected[DS];
+    char report[1024];
+    Verifier verifier;
+    MergeContext *mc;
+    OutputStream *os;
+    BlockRef *blocks;
+    size_t num_blocks;
+    bool ok;
+
+    mc = merge_create();
+    if (!merge_diffs(mc, diffs, ndiff, order_files))
     {
-        fprintf(stderr, "Cannot open diff file (%s) for reading!\n", argv[1]);
+        merge_cleanup(mc);
         exit(EXIT_FAILURE);
     }
+    check_bases(merged_bases(mc), is_bases, nbase);
+    blocks = merged_blocks(mc, &num_blocks);
+    Verifier_init(&verifier, merged_digests(mc, digest_expected));
 
     /* Redirect output (if necessary) */
-    if (strcmp(argv[2], "-") != 0) redirect_stdout(argv[2]);
+    if (strcmp(output, "-") != 0) redirect_stdout(output);
+    os = stats_output_stream(OpenFileOutputStream(stdout), "file2");
+    assert(os != NULL);
 
     if (is_file1->seek(is_file1, 0))
-        patch_func = patch_forward;
+        patch_func = patch_chain_forward;
     else
-    if (fseeko(stdout, 0, SEEK_SET) == 0)
-        patch_func = patch_backward;
+    if (output_seekable(os))
+        patch_func = patch_chain_backward;
     else
     {
         fprintf(stderr, "Neither file 1 nor file 2 is seekable!\n");
         exit(EXIT_FAILURE);
     }
 
+    stats_phase("patch");
+    progress_phase("patch", (uint64_t)num_blocks*BS);
+    patch_func(is_file1, blocks, num_blocks, merged_edits(mc), os, &verifier);
+    stats_phase("verify");
+    ok = Verifier_finish(&verifier, digest_expected, report, sizeof(report));
+    stats_phase_end();
+    if (!ok) fprintf(stderr, "%s\n", report);
+    merge_cleanup(mc);
+    os->close(os);
+    is_file1->close(is_file1);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Rewrites file 1 into file 2 in place, using the journal at `journal'. */
+static int tarpatch_in_place( const char *path, char **diffs, int ndiff,
+                              const char *journal, bool order_files )
+{
+    MergeContext *mc;
+    bool ok;
+
+    if (strcmp(path, "-") == 0)
+    {
+        fprintf(stderr, "File 1 must be a regular file to patch in place!\n");
+        exit(EXIT_FAILURE);
+    }
+    mc = merge_create();
+    if (!merge_diffs(mc, diffs, ndiff, order_files))
+    {
+        merge_cleanup(mc);
+        exit(EXIT_FAILURE);
+    }
+    if (merged_bases(mc) != NULL)
+    {
+        fprintf(stderr, "Cannot patch in place from several base files!\n");
+        exit(EXIT_FAILURE);
+    }
+    ok = patch_in_place(path, mc, journal);
+    merge_cleanup(mc);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+bool tardiff_patch( TardiffContext *tc, InputStream *is_file1,
+                    InputStream *is_diff, OutputStream *os )
+{
+    void (*patch_func)( InputStream *, InputStream *, enum DiffFormat,
+                        OutputStream *, Verifier * );
+    char magic_buf[MAGIC_LEN];
+    int format;
+    uint8_t digest_expected[DS];
+    Trailer trailer;
+    Verifier verifier;
+    ErrorHandler eh;
+    bool ok;
+
+    assert(MD5_DIGEST_LENGTH == DS);
+
+    trailer.chunks = NULL;
+    trailer.index  = NULL;
+    trailer.bases  = NULL;
+    if (setjmp(eh.env) != 0)
+    {
+        free_trailer(&trailer);
+        strcpy(tc->error, eh.message);
+        return false;
+    }
+    push_error_handler(&eh);
+
+    /* Use chunk digests for verification, if the diff file provides them */
+    if (is_diff->size(is_diff) >= 0)
+    {
+        load_trailer(is_diff, &trailer);
+        if (!is_diff->seek(is_diff, 0)) fail("Seek failed.");
+    }
+    Verifier_init(&verifier, trailer.chunks);
+
+    if (is_file1->seek(is_file1, 0))
+        patch_func = patch_forward;
+    else
+    if (output_seekable(os))
+        patch_func = patch_backward;
+    else
+        fail("Neither file 1 nor file 2 is seekable!");
+
     /* Read and verify file magic number */
     if ( is_diff->read(is_diff, magic_buf, MAGIC_LEN) != MAGIC_LEN ||
-         memcmp(magic_buf, MAGIC_STR, MAGIC_LEN) != 0 )
+         (format = parse_magic(magic_buf)) < 0 )
     {
-        fprintf(stderr, "Not a diff file!\n");
-        exit(EXIT_FAILURE);
+        fail("Not a diff file!");
     }
 
-    patch_func(is_file1, is_diff, digest_computed);
+    stats_phase("patch");
+    progress_phase("patch", trailer.chunks != NULL
+                            ? trailer.chunks->total_blocks*BS : 0);
+    patch_func(is_file1, is_diff, format, os, &verifier);
 
-    /* Read and compare output file digest */
+    /* Read expected output file digest and verify output */
     read_data(is_diff, digest_expected, DS);
-    if (memcmp(digest_expected, digest_computed, DS) != 0)
+    stats_phase("verify");
+    ok = Verifier_finish( &verifier, digest_expected, tc->error,
+                          sizeof(tc->error) );
+    stats_phase_end();
+
+    pop_error_handler(&eh);
+    free_trailer(&trailer);
+    return ok;
+}
+
+int tarpatch(int argc, char *argv[], const char *flags)
+{
+    InputStream *is_bases[MAX_BASES], *is_file1, *is_diff;
+    OutputStream *os;
+    TardiffContext tc;
+    Trailer trailer;
+    int nbase, n;
+    bool ok;
+
+    if (get_option("in-place") != NULL)
+    {
+        return tarpatch_in_place( argv[0], argv + 1, argc - 1,
+                                  get_option("in-place"),
+                                  strchr(flags, 'f') == NULL );
+    }
+    assert(argc >= 3);
+
+    /* Arguments following file 1 that are not differences files are further
+       base files, which make up file 1 together */
+    for (nbase = 1; nbase < argc - 2 && !is_diff_file(argv[nbase]); ++nbase)
     {
-        char expected_str[2*DS + 1],
-             computed_str[2*DS + 1];
+        if (nbase == MAX_BASES)
+        {
+            fprintf(stderr, "Too many base files (at most %d allowed)!\n",
+                            MAX_BASES);
+            exit(EXIT_FAILURE);
+        }
+    }
 
-        hexstring(expected_str, digest_expected, DS);
-        hexstring(computed_str, digest_computed, DS);
+    /* Open file 1 */
+    for (n = 0; n < nbase; ++n)
+    {
+        is_bases[n] = (strcmp(argv[n], "-") == 0)
+                    ? OpenStdinInputStream() : OpenFileInputStream(argv[n]);
+        if (is_bases[n] == NULL)
+        {
+            fprintf(stderr, "Cannot open file 1 (%s) for reading!\n",
+                            argv[n]);
+            exit(EXIT_FAILURE);
+        }
+        is_bases[n] = stats_input_stream(is_bases[n], n == 0 ? "file1"
+                                                             : "base");
+    }
+    is_file1 = (nbase == 1) ? is_bases[0]
+                            : OpenConcatInputStream(is_bases, nbase);
+    assert(is_file1 != NULL);
+    argv += nbase - 1;
+    argc -= nbase - 1;
 
-        fprintf(stderr, "Output file verification failed!\n"
-                        "Original file hash:  %s (expected)\n"
-                        "New file hash:       %s (computed)\n",
-                        expected_str, computed_str );
+    /* Apply a sequence of diff files at once */
+    if (argc > 3 && (get_option("member") != NULL ||
+                     get_option("bytes") != NULL ||
+                     get_option("blocks") != NULL))
+    {
+        fprintf(stderr, "Only one diff file can be used to extract data!\n");
         exit(EXIT_FAILURE);
     }
+    if (argc > 3)
+    {
+        return tarpatch_chain( is_file1, is_bases, nbase, argv + 1, argc - 2,
+                               argv[argc - 1], strchr(flags, 'f') == NULL );
+    }
+
+    /* Open diff file */
+    is_diff  = (strcmp(argv[1], "-") == 0) ? OpenStdinInputStream()
+                                           : OpenFileInputStream(argv[1]);
+    if (is_diff == NULL)
+    {
+        fprintf(stderr, "Cannot open diff file (%s) for reading!\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    is_diff = stats_input_stream(is_diff, "diff");
+
+    /* Check base files (unless the diff file is not seekable) */
+    if (is_diff->size(is_diff) >= 0)
+    {
+        if (load_trailer(is_diff, &trailer))
+        {
+            check_bases(trailer.bases, is_bases, nbase);
+            free_trailer(&trailer);
+        }
+        else
+        {
+            check_bases(NULL, is_bases, nbase);
+        }
+        if (!is_diff->seek(is_diff, 0))
+        {
+            fprintf(stderr, "Seek failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (get_option("blocks") != NULL)
+    {
+        /* Write part of file 2 in place, without truncating the output file,
+           which may be shared with other processes writing other parts */
+        int fd = (strcmp(argv[2], "-") != 0)
+               ? open(argv[2], O_WRONLY | O_CREAT, 0666) : -1;
+        if (fd < 0)
+        {
+            fprintf(stderr, "Cannot open output file (%s) for writing!\n",
+                            argv[2]);
+            exit(EXIT_FAILURE);
+        }
+        ok = patch_blocks(is_file1, is_diff, get_option("blocks"), fd);
+        if (close(fd) != 0)
+        {
+            fprintf(stderr, "Write failed.\n");
+            ok = false;
+        }
+        is_diff->close(is_diff);
+        is_file1->close(is_file1);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    /* Redirect output (if necessary) */
+    if (strcmp(argv[2], "-") != 0) redirect_stdout(argv[2]);
+    os = stats_output_stream(OpenFileOutputStream(stdout), "file2");
+    assert(os != NULL);
+
+    if (get_option("member") != NULL || get_option("bytes") != NULL)
+    {
+        /* Extract part of file 2 only */
+        ok = patch_extract( is_file1, is_diff, get_option("member"),
+                            get_option("bytes"), os );
+    }
+    else
+    {
+        tardiff_init(&tc);
+        ok = tardiff_patch(&tc, is_file1, is_diff, os);
+        if (!ok) fprintf(stderr, "%s\n", tc.error);
+    }
+
+    os->close(os);
+    is_diff->close(is_diff);
+    is_file1->close(is_file1);
 
-    return EXIT_SUCCESS;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
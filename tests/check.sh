@@ -0,0 +1,295 @@
+#!/bin/sh
+# Regression tests for the tardiff tools. Large inputs are sparse files, so
+# they take little disk space, but the outputs they are compared with are not.
+#
+# Environment variables:
+#   CHECK_DIR       scratch directory (default: a new directory in /tmp)
+#   CHECK_SIZE      size of the large input files in MB (default: 4608, which
+#                   is over 4 GB, so byte offsets do not fit in 32 bits), or 0
+#                   to skip them
+#   CHECK_HUGE      if set, also diffs sparse files of over 2^32 blocks (2 TB),
+#                   which takes hours, since every block is read and hashed
+
+set -e
+
+TESTS=$(cd "$(dirname "$0")" && pwd)
+TARDIFF="$TESTS/../tardiff"
+SIZE=${CHECK_SIZE:-4608}
+DIR=${CHECK_DIR:-$(mktemp -d "${TMPDIR:-/tmp}/tardiff-check.XXXXXX")}
+
+mkdir -p "$DIR"
+
+# Writes `count' random blocks to file `$1' at block offset `$2'.
+put() { dd if=/dev/urandom of="$1" bs=512 seek="$2" count="$3" \
+           conv=notrunc 2>/dev/null; }
+
+# Compares `len' bytes of file `$1' from byte offset `$2' with file `$4'.
+cmp_range() { tail -c +$(($2 + 1)) "$1" | head -c "$3" | cmp - "$4"; }
+
+# Writes diff `$1' without its extended footer (as version 1.1) to `$2'.
+strip_trailer() {
+    OFFSET=$(tail -c 32 "$1" | head -c 8 | od -An -tx1 | tr -d ' \n')
+    head -c $((0x$OFFSET + 32)) "$1" > "$2"
+}
+
+# Starts a test in an empty work directory.
+start() { echo "$1"; cd "$DIR"; rm -rf work; mkdir work; cd work; }
+
+echo "md5_blocks"
+"$TESTS/md5blocks"
+
+start "multiple base files"
+put b1 0 300
+put b2 0 200
+cat b1 b2 > v
+put v 150 50
+put v 500 20
+"$TARDIFF" b1 b2 v d
+"$TARDIFF" -i b2 b1 d > /dev/null
+"$TARDIFF" -p b1 b2 d out
+cmp out v
+rm -f out
+mkdir chain
+mv b1 b2 d chain
+"$TARDIFF" -c chain > /dev/null
+
+start "empty files"
+put a 0 200
+: > e
+"$TARDIFF" --reverse=r2 a e r1
+"$TARDIFF" -p a r1 out
+cmp out e
+"$TARDIFF" -p e r2 out2
+cmp out2 a
+"$TARDIFF" e a d
+"$TARDIFF" -p e d out3
+cmp out3 a
+
+start "common prefix and suffix"
+put a 0 400
+cp a b
+put b 200 1
+"$TARDIFF" --stats a b d 2> stats
+grep -q '"skipped": 399' stats
+"$TARDIFF" -p a d out
+cmp out b
+
+start "merging onto a merged file"
+put v0 0 400
+for I in 1 2 3 4 5
+do
+    cp v$((I - 1)) v$I
+    put v$I $((I*50)) 10
+    put v$I $((400 + I*5)) 5
+    "$TARDIFF" v$((I - 1)) v$I d$I
+done
+"$TARDIFF" -m d1 d2 d3 d4 m4
+"$TARDIFF" -m --onto=m4 d5 m5
+"$TARDIFF" --stats -m d1 d2 d3 d4 d5 full 2> stats
+cmp m5 full
+# Inputs are opened to order them and again to merge them, so all 11 streams
+# (more than the 8 statistics were once limited to) must be reported
+test $(grep -c '"bytes_read"' stats) -eq 11
+"$TARDIFF" -p v0 m5 out
+cmp out v5
+
+start "tar members and block ranges"
+mkdir t
+put t/f1 0 100
+put t/f2 0 50
+head -c 1000 /dev/urandom > t/f3
+tar -cf a.tar t
+put t/f2 10 5
+put t/f4 0 20
+touch -d 2000-01-01 t/f1
+tar -cf b.tar t
+touch -d 2001-01-01 t/f1
+tar -cf c.tar t
+"$TARDIFF" -t a.tar b.tar d
+"$TARDIFF" -t b.tar c.tar d2
+"$TARDIFF" -m d d2 dm
+"$TARDIFF" a.tar b.tar plain
+# Diffs with edit lists (patched headers) have their own magic string
+head -c 8 d | grep -q tardiff2
+head -c 8 dm | grep -q tardiff2
+head -c 8 plain | grep -q tardiff0
+"$TARDIFF" -p a.tar dm out2
+cmp out2 c.tar
+for F in f1 f2 f3 f4
+do
+    "$TARDIFF" -p --member=t/$F a.tar d $F 2> /dev/null
+    cmp $F t/$F
+done
+if "$TARDIFF" -p --member=t/f5 a.tar d f5 2> /dev/null; then false; fi
+"$TARDIFF" -p --blocks=10-60 a.tar d out
+tail -c +$((10*512 + 1)) b.tar | head -c $((50*512)) > range
+cmp_range out $((10*512)) $((50*512)) range
+
+if command -v xz > /dev/null
+then
+    # File 1 has several xz blocks, so it is read at random
+    start "xz compressed files"
+    put a 0 400
+    cp a b
+    put b 100 10
+    put b 400 20
+    xz -k -T0 --block-size=65536 a
+    xz -k b
+    "$TARDIFF" a.xz b.xz d
+    "$TARDIFF" -p a.xz d out
+    cmp out b
+    "$TARDIFF" -p --bytes=1000-90000 a.xz d out2 2> /dev/null
+    cmp_range b 1000 89000 out2
+fi
+
+start "store"
+put a 0 400
+cp a b
+put b 100 10
+put x 0 300
+"$TARDIFF" -s store add a a > /dev/null
+"$TARDIFF" -s store add b b > /dev/null
+"$TARDIFF" -s store add x x > /dev/null
+"$TARDIFF" -s store remove x
+"$TARDIFF" -s store gc | grep -q "Removed 2 frames"
+"$TARDIFF" -s store restore a out
+cmp out a
+"$TARDIFF" -s store restore b out2
+cmp out2 b
+if "$TARDIFF" -s store restore x out3 2> /dev/null; then false; fi
+
+start "block ranges without chunk digests"
+put a 0 200
+cp a b
+put b 100 20
+"$TARDIFF" a b d
+strip_trailer d old
+"$TARDIFF" -p --blocks=150- a old out 2> /dev/null
+tail -c $((50*512)) b > tail
+cmp_range out $((150*512)) $((50*512)) tail
+"$TARDIFF" -p --blocks=200- a old out2 2> /dev/null
+test ! -s out2
+if "$TARDIFF" -p --blocks=999999- a old out3 2> /dev/null; then false; fi
+
+# Runs tardiff with a file size limit of `$1' blocks, so it is killed when it
+# writes past that size, as if it was interrupted.
+limited() { (ulimit -c 0; ulimit -f "$1"; shift; "$TARDIFF" "$@" || exit) \
+            2> /dev/null; }
+
+# The journal slots end at block 4163, so the shift is interrupted while its
+# first batch is written to file 1. Swapping the halves of a file forms cycles,
+# which spill every other block, so the swap is interrupted when spilling its
+# 1537th block, in its second batch.
+start "interrupted in-place patches"
+put a 0 6144
+{ dd if=/dev/urandom bs=512 count=8 2> /dev/null; cat a; } > b
+"$TARDIFF" a b d
+cp a w
+if limited 4200 -p --in-place=j w d; then false; fi
+test -s j
+"$TARDIFF" -p --in-place=j w d 2> log
+grep -q Resuming log
+cmp w b
+test ! -e j
+head -c $((4096*512)) a > h
+{ tail -c $((2048*512)) h; head -c $((2048*512)) h; } > s
+"$TARDIFF" h s d2
+cp h w
+if limited 5699 -p --in-place=j w d2; then false; fi
+test -s j
+"$TARDIFF" -p --in-place=j w d2 2> log
+grep -q Resuming log
+cmp w s
+test ! -e j
+
+start "daemon"
+put a 0 200
+cp a b
+put b 50 10
+put b 200 20
+: > e
+"$TARDIFF" -d sock serve a=a e=e 2> log &
+SERVER=$!
+trap 'kill $SERVER 2> /dev/null' EXIT
+while ! grep -q Serving log
+do
+    kill -0 $SERVER
+    sleep 0.1
+done
+"$TARDIFF" -d sock diff a b d
+"$TARDIFF" -d sock verify a d
+"$TARDIFF" -d sock patch a d out
+cmp out b
+"$TARDIFF" -p a d out2
+cmp out2 b
+"$TARDIFF" -d sock diff e b de
+"$TARDIFF" -d sock patch e de out3
+cmp out3 b
+if "$TARDIFF" -d sock verify e d 2> /dev/null; then false; fi
+{ kill $SERVER; wait $SERVER; } 2> /dev/null || true
+trap - EXIT
+
+if [ "$SIZE" -gt 0 ]
+then
+    start "large files ($SIZE MB)"
+    BLOCKS=$((SIZE*2048))
+    truncate -s ${SIZE}M v0
+    put v0 0 64
+    put v0 $((BLOCKS/2)) 64
+    put v0 $((BLOCKS - 64)) 64
+    cp --sparse=always v0 v1
+    put v1 100 8
+    put v1 $((BLOCKS - 32)) 16
+    put v1 $BLOCKS 32
+    cp --sparse=always v1 v2
+    put v2 $((BLOCKS/2 + 8)) 8
+
+    # Wide format, patched forward and backward
+    "$TARDIFF" -w v0 v1 d1
+    "$TARDIFF" -w v1 v2 d2
+    "$TARDIFF" -p v0 d1 out
+    cmp out v1
+    rm -f out
+    cat v0 | "$TARDIFF" -p - d1 out
+    cmp out v1
+    rm -f out
+
+    # Merge, and patch with the merged file and with the chain directly
+    "$TARDIFF" -m d1 d2 dm
+    "$TARDIFF" -p v0 dm out
+    cmp out v2
+    rm -f out
+    "$TARDIFF" -p v0 d1 d2 out
+    cmp out v2
+    rm -f out
+
+    # Extract a byte range that straddles the 4 GB boundary, and the last blocks
+    START=$((4096*1048576 - 1000))
+    "$TARDIFF" -p --bytes=$START-$((START + 70000)) v0 d1 out
+    cmp_range v1 $START 70000 out
+    rm -f out
+    "$TARDIFF" -p --bytes=$(((BLOCKS - 40)*512))- v0 d1 out
+    cmp_range v1 $(((BLOCKS - 40)*512)) $((72*512)) out
+    rm -f out v0 v1 v2 d1 d2 dm
+fi
+
+if [ -n "$CHECK_HUGE" ]
+then
+    # Over 2^32 blocks, so the wide format is selected automatically
+    start "huge files (2 TB)"
+    truncate -s 2049G v0
+    put v0 $((1 << 32)) 64
+    cp --sparse=always v0 v1
+    put v1 $(((1 << 32) + 32)) 8
+    "$TARDIFF" v0 v1 d1
+    head -c 8 d1 | grep -q tardiff1
+    START=$(((1 << 32)*512))
+    "$TARDIFF" -p --bytes=$START-$((START + 65536)) v0 d1 out
+    cmp_range v1 $START 65536 out
+    rm -f out v0 v1 d1
+fi
+
+cd "$DIR"
+rm -rf work
+echo "all tests passed"
+if [ -z "$CHECK_DIR" ]; then rm -rf "$DIR"; fi
@@ -0,0 +1,43 @@
+#include "md5blocks.h"
+
+/* Compares md5_blocks() with OpenSSL for 1 to 33 blocks, which covers every
+   kernel width and the blocks left over by each, at an aligned and at an odd
+   address. Exits with a non-zero status if any digest differs. */
+
+#define MAX_BLOCKS 33
+
+int main()
+{
+    static char buf[MAX_BLOCKS*BS + 1];
+    uint8_t digests[MAX_BLOCKS][DS], expected[DS];
+    MD5_CTX md5_ctx;
+    size_t n, i, offset, errors = 0;
+    char *data;
+
+    srand(42);
+    for (i = 0; i < sizeof(buf); ++i) buf[i] = rand();
+    memset(buf + 3*BS, 0, BS);  /* include an all-zero block */
+
+    for (offset = 0; offset < 2; ++offset)
+    {
+        data = buf + offset;
+        for (n = 1; n <= MAX_BLOCKS; ++n)
+        {
+            memset(digests, 0, sizeof(digests));
+            md5_blocks(data, n, digests);
+            for (i = 0; i < n; ++i)
+            {
+                MD5_Init(&md5_ctx);
+                MD5_Update(&md5_ctx, data + i*BS, BS);
+                MD5_Final(expected, &md5_ctx);
+                if (memcmp(digests[i], expected, DS) != 0)
+                {
+                    fprintf(stderr, "md5_blocks: block %d of %d (offset %d) "
+                            "differs\n", (int)i, (int)n, (int)offset);
+                    ++errors;
+                }
+            }
+        }
+    }
+    return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
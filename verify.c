@@ -0,0 +1,282 @@
+#include "verify.h"
+#include "md5blocks.h"
+#include "progress.h"
+#include "stats.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+#define READ_BLOCKS 256         /* blocks read at a time when verifying */
+
+/* Shared state of threads hashing chunks of a file */
+typedef struct ChunkJob
+{
+    pthread_mutex_t lock;
+    int             fd;
+    uint64_t        nblocks;
+    uint32_t        chunk_blocks;
+    size_t          next;       /* index of next chunk to hash */
+    size_t          count;      /* total number of chunks */
+    bool            failed;     /* did a read fail? */
+    Progress        *progress;  /* progress of the verification (or NULL) */
+    uint8_t         (*digests)[DS];
+} ChunkJob;
+
+void Verifier_init(Verifier *v, ChunkDigests *expected)
+{
+    v->expected = expected;
+    if (expected != NULL)
+    {
+        v->computed = ChunkDigests_create(expected->chunk_blocks);
+        assert(v->computed != NULL);
+    }
+    else
+    {
+        v->computed = NULL;
+        MD5_Init(&v->md5_ctx);
+    }
+}
+
+void Verifier_add(Verifier *v, const void *data)
+{
+    Verifier_add_blocks(v, data, 1);
+}
+
+void Verifier_add_blocks(Verifier *v, const void *data, size_t n)
+{
+    uint8_t digests[READ_BLOCKS][DS];
+    size_t i, k;
+
+    if (v->computed == NULL)
+    {
+        MD5_Update(&v->md5_ctx, data, n*BS);
+        return;
+    }
+    for ( ; n > 0; n -= k)
+    {
+        k = (n < READ_BLOCKS) ? n : READ_BLOCKS;
+        md5_blocks(data, k, digests);
+        for (i = 0; i < k; ++i) ChunkDigests_add(v->computed, digests[i]);
+        data = (const char*)data + k*BS;
+    }
+}
+
+/* Reads exactly `len' bytes at offset `pos'. Returns false on failure. */
+static bool pread_data(int fd, void *buf, size_t len, off_t pos)
+{
+    ssize_t res;
+
+    while (len > 0)
+    {
+        res = pread(fd, buf, len, pos);
+        if (res <= 0) return false;
+        buf  = (char*)buf + res;
+        len -= res;
+        pos += res;
+    }
+    return true;
+}
+
+/* Thread function that hashes chunks until none are left. */
+static void *hash_chunks(void *arg)
+{
+    ChunkJob *job = arg;
+    MD5_CTX chunk_ctx;
+    uint8_t digests[READ_BLOCKS][DS];
+    char *buf;
+    uint64_t pos, end;
+    size_t i, n;
+
+    buf = malloc(READ_BLOCKS*BS);
+    assert(buf != NULL);
+
+    for (;;)
+    {
+        pthread_mutex_lock(&job->lock);
+        i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= job->count || job->failed) break;
+
+        pos = (uint64_t)job->chunk_blocks*i;
+        end = pos + job->chunk_blocks;
+        if (end > job->nblocks) end = job->nblocks;
+
+        MD5_Init(&chunk_ctx);
+        for ( ; pos < end; pos += n)
+        {
+            n = (end - pos < READ_BLOCKS) ? end - pos : READ_BLOCKS;
+            if (!pread_data(job->fd, buf, n*BS, (off_t)pos*BS))
+            {
+                job->failed = true;
+                break;
+            }
+            md5_blocks(buf, n, digests);
+            MD5_Update(&chunk_ctx, digests, n*DS);
+            progress_add(job->progress, n*BS);
+        }
+        MD5_Final(job->digests[i], &chunk_ctx);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+void Verifier_add_file(Verifier *v, OutputStream *os, uint64_t nblocks)
+{
+    char data[BS];
+    uint64_t t;
+
+    /* Seeking also flushes buffered output */
+    stats_phase("verify");
+    progress_phase("verify", nblocks*BS);
+    seek_output(os, 0);
+
+    if (v->computed == NULL || os->fd < 0)
+    {
+        /* Compute digest of the entire file sequentially. */
+        for (t = 0; t < nblocks; ++t)
+        {
+            read_output(os, data, BS);
+            Verifier_add(v, data);
+            progress_add(active_progress, BS);
+        }
+    }
+    else
+    {
+        /* Compute chunk digests in parallel. */
+        ChunkDigests *cd = v->computed;
+        ChunkJob job;
+        pthread_t *threads;
+        long nthread, n;
+
+        assert(cd->total_blocks == 0);
+        job.fd           = os->fd;
+        job.nblocks      = nblocks;
+        job.chunk_blocks = cd->chunk_blocks;
+        job.next         = 0;
+        job.failed       = false;
+        job.progress     = active_progress;
+        job.count        = nblocks/cd->chunk_blocks +
+                           (nblocks%cd->chunk_blocks != 0);
+        job.digests      = malloc(DS*job.count + 1);
+        assert(job.digests != NULL);
+        pthread_mutex_init(&job.lock, NULL);
+
+        nthread = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthread > (long)job.count) nthread = job.count;
+        if (nthread < 1) nthread = 1;
+        threads = malloc(nthread*sizeof(pthread_t));
+        assert(threads != NULL);
+        for (n = 1; n < nthread; ++n)
+        {
+            if (pthread_create(&threads[n], NULL, hash_chunks, &job) != 0)
+            {
+                break;
+            }
+        }
+        hash_chunks(&job);
+        while (--n > 0) pthread_join(threads[n], NULL);
+        free(threads);
+        pthread_mutex_destroy(&job.lock);
+        if (job.failed)
+        {
+            free(job.digests);
+            fail("Read failed.");
+        }
+
+        free(cd->digests);
+        cd->digests      = job.digests;
+        cd->count        = cd->capacity = job.count;
+        cd->total_blocks = nblocks;
+    }
+}
+
+/* Appends a line to the report in `buf' (of `size' bytes), truncating it if
+   it does not fit. */
+static void report(char *buf, size_t size, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static void report(char *buf, size_t size, const char *fmt, ...)
+{
+    size_t len = strlen(buf);
+    va_list ap;
+
+    if (len + 1 >= size) return;
+    if (len > 0) buf[len++] = '\n', buf[len] = '\0';
+    va_start(ap, fmt);
+    vsnprintf(buf + len, size - len, fmt, ap);
+    va_end(ap);
+}
+
+/* Reports the range of blocks covered by chunks `i' through `j' (exclusive). */
+static void report_chunks( ChunkDigests *cd, uint64_t nblocks,
+                           size_t i, size_t j, char *buf, size_t size )
+{
+    uint64_t first = (uint64_t)cd->chunk_blocks*i,
+             last  = (uint64_t)cd->chunk_blocks*j;
+
+    if (last > nblocks) last = nblocks;
+    report( buf, size, "Blocks %llu to %llu (bytes %llu to %llu) differ.",
+            (unsigned long long)first, (unsigned long long)last - 1,
+            (unsigned long long)first*BS, (unsigned long long)last*BS - 1 );
+}
+
+bool Verifier_finish( Verifier *v, uint8_t digest_expected[DS],
+                      char *buf, size_t size )
+{
+    buf[0] = '\0';
+    if (v->computed == NULL)
+    {
+        uint8_t digest_computed[DS];
+
+        MD5_Final(digest_computed, &v->md5_ctx);
+        if (memcmp(digest_expected, digest_computed, DS) != 0)
+        {
+            char expected_str[2*DS + 1],
+                 computed_str[2*DS + 1];
+
+            hexstring(expected_str, digest_expected, DS);
+            hexstring(computed_str, digest_computed, DS);
+
+            report( buf, size, "Output file verification failed!\n"
+                               "Original file hash:  %s (expected)\n"
+                               "New file hash:       %s (computed)",
+                               expected_str, computed_str );
+            return false;
+        }
+    }
+    else
+    {
+        ChunkDigests *e = v->expected, *c = v->computed;
+        uint64_t nblocks;
+        size_t i, j, n;
+
+        ChunkDigests_finish(c);
+        nblocks = (e->total_blocks > c->total_blocks) ? e->total_blocks
+                                                      : c->total_blocks;
+        n = (e->count > c->count) ? e->count : c->count;
+        i = ChunkDigests_mismatch(e, c, 0);
+        if (i < n || e->total_blocks != c->total_blocks)
+        {
+            report(buf, size, "Output file verification failed!");
+            if (e->total_blocks != c->total_blocks)
+            {
+                report( buf, size, "Output file has %llu blocks "
+                                   "(expected %llu).",
+                                   (unsigned long long)c->total_blocks,
+                                   (unsigned long long)e->total_blocks );
+            }
+            while (i < n)
+            {
+                j = i + 1;
+                while (j < n && ChunkDigests_mismatch(e, c, j) == j) ++j;
+                report_chunks(e, nblocks, i, j, buf, size);
+                i = ChunkDigests_mismatch(e, c, j);
+            }
+            ChunkDigests_destroy(c);
+            return false;
+        }
+        ChunkDigests_destroy(c);
+    }
+    return true;
+}
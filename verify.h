@@ -0,0 +1,36 @@
+#ifndef VERIFY_H_INCLUDED
+#define VERIFY_H_INCLUDED
+
+#include "format.h"
+
+/* Verifies the output of a patch operation. If the differences file contains
+   chunk digests (version 1.2) these are used, so that mismatches can be
+   reported per chunk. Otherwise, the digest of the entire output is used. */
+typedef struct Verifier
+{
+    ChunkDigests *expected;     /* expected chunk digests (or NULL) */
+    ChunkDigests *computed;     /* computed chunk digests (or NULL) */
+    MD5_CTX      md5_ctx;       /* digest of the entire output */
+} Verifier;
+
+/* Initializes a verifier. `expected' may be NULL, and is not freed. */
+void Verifier_init(Verifier *v, ChunkDigests *expected);
+
+/* Adds the next block of output data. */
+void Verifier_add(Verifier *v, const void *data);
+
+/* Adds the next `n' blocks of output data. */
+void Verifier_add_blocks(Verifier *v, const void *data, size_t n);
+
+/* Adds `nblocks' blocks of output data read from the start of output stream
+   `os'. Chunks are hashed on all available processors, when possible. */
+void Verifier_add_file(Verifier *v, OutputStream *os, uint64_t nblocks);
+
+/* Compares the computed digests with the expected values, and frees the
+   verifier's resources. Returns true if the output was verified successfully.
+   Otherwise, a report of the mismatches (one per line, without a final
+   newline) is stored in `buf', which has room for `size' bytes. */
+bool Verifier_finish( Verifier *v, uint8_t digest_expected[DS],
+                      char *buf, size_t size );
+
+#endif /* ndef VERIFY_H_INCLUDED */